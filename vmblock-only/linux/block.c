@@ -39,24 +39,58 @@
 
 typedef struct BlockInfo {
    DblLnkLst_Links links;
+   struct BlockInfo *hashNext;  /* next block in the same blockHash bucket */
+   uint32 hash;                 /* BlockHashName(filename) */
    os_atomic_t refcount;
    os_blocker_id_t blocker;
    os_completion_t completion;
+   os_rcu_head_t rcu;
    char filename[OS_PATH_MAX];
 } BlockInfo;
 
 
-/* XXX: Is it worth turning this into a hash table? */
+/*
+ * All blocks are on the blockedFiles list and, hashed by filename, in
+ * blockHash.  Both are modified under blockedFilesLock held for writing.
+ * Lookups walk the hash chains under RCU only and take a reference with
+ * os_atomic_inc_not_zero(), so BlockInfos are freed after a grace period.
+ */
+#define BLOCK_HASH_BITS 10
+#define BLOCK_HASH_SIZE (1 << BLOCK_HASH_BITS)
+
 static DblLnkLst_Links blockedFiles;
+static BlockInfo *blockHash[BLOCK_HASH_SIZE];
+static uint32 numBlocks;
 static os_rwlock_t blockedFilesLock;
 static os_kmem_cache_t *blockInfoCache = NULL;
 
+/*
+ * Lookup statistics, reported by BlockGetStats().  They are kept per CPU
+ * so that lookups do not write to shared cache lines, and only one lookup
+ * in BLOCK_STATS_TIME_RATE is timed.
+ */
+#define BLOCK_STATS_TIME_RATE 64
+
+typedef struct BlockCpuStats {
+   uint64 lookups;
+   uint64 hits;
+   uint64 probes;
+   uint64 timed;
+   uint64 totalNs;
+   uint64 maxNs;
+} BlockCpuStats;
+
+OS_DEFINE_PER_CPU(BlockCpuStats, blockStats);
+
 /* Utility functions */
 static Bool BlockExists(const char *filename);
 static BlockInfo *GetBlock(const char *filename, const os_blocker_id_t blocker);
 static BlockInfo *AllocBlock(os_kmem_cache_t *cache,
                              const char *filename, const os_blocker_id_t blocker);
 static void FreeBlock(os_kmem_cache_t *cache, BlockInfo *block);
+static uint32 BlockHashName(const char *filename);
+static void BlockHashInsert(BlockInfo *block);
+static void BlockHashRemove(BlockInfo *block);
 
 
 /*
@@ -89,6 +123,8 @@ BlockInit(void)
    }
 
    DblLnkLst_Init(&blockedFiles);
+   memset(blockHash, 0, sizeof blockHash);
+   numBlocks = 0;
    os_rwlock_init(&blockedFilesLock);
 
    return 0;
@@ -117,6 +153,8 @@ BlockCleanup(void)
    ASSERT(blockInfoCache);
    ASSERT(!DblLnkLst_IsLinked(&blockedFiles));
 
+   /* Wait for the RCU callbacks of FreeBlock(). */
+   os_rcu_barrier();
    os_rwlock_destroy(&blockedFilesLock);
    os_kmem_cache_destroy(blockInfoCache);
 }
@@ -174,6 +212,7 @@ BlockAddFileBlock(const char *filename,           // IN: name of file to block
    }
 
    DblLnkLst_LinkLast(&blockedFiles, &block->links);
+   BlockHashInsert(block);
 
    os_write_unlock(&blockedFilesLock);
 
@@ -218,6 +257,7 @@ BlockRemoveFileBlock(const char *filename,          // IN: block to remove
    }
 
    DblLnkLst_Unlink1(&block->links);
+   BlockHashRemove(block);
    os_write_unlock(&blockedFilesLock);
 
    /* Undo GetBlock's refcount increment first. */
@@ -271,6 +311,7 @@ BlockRemoveAllBlocks(const os_blocker_id_t blocker)  // IN: blocker to remove bl
       if (currBlock->blocker == blocker || blocker == OS_UNKNOWN_BLOCKER) {
 
          DblLnkLst_Unlink1(&currBlock->links);
+         BlockHashRemove(currBlock);
 
          /*
           * We count only entries removed from the -list-, regardless of whether
@@ -338,9 +379,7 @@ BlockWaitOnFile(const char *filename,   // IN: file to block on
     * blocking here.)
     */
    if (cookie == NULL) {
-      os_read_lock(&blockedFilesLock);
       block = GetBlock(filename, OS_UNKNOWN_BLOCKER);
-      os_read_unlock(&blockedFilesLock);
 
       if (!block) {
          /* This file is not blocked, just return */
@@ -403,15 +442,47 @@ BlockLookup(const char *filename,               // IN: pathname to test for
             const os_blocker_id_t blocker)      // IN: specific blocker to
                                                 //     search for
 {
-   BlockInfo *block;
+   return GetBlock(filename, blocker);
+}
 
-   os_read_lock(&blockedFilesLock);
 
-   block = GetBlock(filename, blocker);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BlockGetStats --
+ *
+ *      Reports the number of blocks and the block lookup statistics.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   os_read_unlock(&blockedFilesLock);
+void
+BlockGetStats(BlockStats *stats)        // OUT: current statistics
+{
+   int cpu;
 
-   return block;
+   ASSERT(stats);
+
+   memset(stats, 0, sizeof *stats);
+   os_for_each_cpu(cpu) {
+      const BlockCpuStats *cpuStats = &os_per_cpu(blockStats, cpu);
+
+      stats->lookups += cpuStats->lookups;
+      stats->hits += cpuStats->hits;
+      stats->probes += cpuStats->probes;
+      stats->timed += cpuStats->timed;
+      stats->totalNs += cpuStats->totalNs;
+      if (cpuStats->maxNs > stats->maxNs) {
+         stats->maxNs = cpuStats->maxNs;
+      }
+   }
+   stats->numBlocks = numBlocks;
 }
 
 
@@ -500,14 +571,14 @@ BlockExists(const char *filename)
  *    If blocker is NULL, it is ignored and any matching filename is returned.
  *    If a block is found, the refcount is incremented.
  *
- *    Note that this assumes the proper locking has been done on the data
- *    structure holding the blocked files.
+ *    The hash chains are walked under RCU, so no lock needs to be held.
+ *    A block whose last reference is being dropped is skipped.
  *
  * Results:
  *    A pointer to the corresponding BlockInfo if found, NULL otherwise.
  *
  * Side effects:
- *    None.
+ *    Updates the lookup statistics.
  *
  *----------------------------------------------------------------------------
  */
@@ -516,30 +587,144 @@ static BlockInfo *
 GetBlock(const char *filename,          // IN: file to find block for
          const os_blocker_id_t blocker) // IN: blocker associated with this block
 {
-   struct DblLnkLst_Links *curr;
+   BlockCpuStats *stats;
+   Bool timed;
+   uint64 start = 0;
+   uint32 hash = BlockHashName(filename);
+   uint32 probes = 0;
+   BlockInfo *found = NULL;
+   BlockInfo *currBlock;
+
+   stats = &os_get_cpu_var(blockStats);
+   timed = stats->lookups % BLOCK_STATS_TIME_RATE == 0;
+   if (timed) {
+      start = os_time_ns();
+   }
 
-   /*
-    * On FreeBSD we have a mechanism to assert (but not simply check)
-    * that a lock is held. Since semantic is different (panic that
-    * happens if assertion fails can not be suppressed) we are using
-    * different name.
-    */
-#ifdef os_assert_rwlock_held
-   os_assert_rwlock_held(&blockedFilesLock);
-#else
-   ASSERT(os_rwlock_held(&blockedFilesLock));
-#endif
+   os_rcu_read_lock();
+
+   for (currBlock = os_rcu_dereference(blockHash[hash & (BLOCK_HASH_SIZE - 1)]);
+        currBlock != NULL;
+        currBlock = os_rcu_dereference(currBlock->hashNext)) {
+      probes++;
+      if (currBlock->hash == hash &&
+          (blocker == OS_UNKNOWN_BLOCKER || currBlock->blocker == blocker) &&
+          strcmp(currBlock->filename, filename) == 0 &&
+          os_atomic_inc_not_zero(&currBlock->refcount)) {
+         found = currBlock;
+         break;
+      }
+   }
 
-   DblLnkLst_ForEach(curr, &blockedFiles) {
-      BlockInfo *currBlock = DblLnkLst_Container(curr, BlockInfo, links);
-      if ((blocker == OS_UNKNOWN_BLOCKER || currBlock->blocker == blocker) &&
-          strcmp(currBlock->filename, filename) == 0) {
-         os_atomic_inc(&currBlock->refcount);
-         return currBlock;
+   os_rcu_read_unlock();
+
+   stats->lookups++;
+   stats->probes += probes;
+   if (found) {
+      stats->hits++;
+   }
+   if (timed) {
+      uint64 elapsed = os_time_ns() - start;
+
+      stats->timed++;
+      stats->totalNs += elapsed;
+      if (elapsed > stats->maxNs) {
+         stats->maxNs = elapsed;
       }
    }
+   os_put_cpu_var(blockStats);
 
-   return NULL;
+   return found;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * BlockHashName --
+ *
+ *    Hashes a filename for blockHash (32 bit FNV-1a).
+ *
+ * Results:
+ *    The hash value.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint32
+BlockHashName(const char *filename)     // IN: file to hash
+{
+   const unsigned char *p = (const unsigned char *)filename;
+   uint32 hash = 2166136261U;
+
+   while (*p) {
+      hash ^= *p++;
+      hash *= 16777619U;
+   }
+
+   return hash;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * BlockHashInsert --
+ *
+ *    Adds a block to blockHash.  blockedFilesLock must be held for writing.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The block becomes visible to lookups.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+BlockHashInsert(BlockInfo *block)       // IN: block to add
+{
+   BlockInfo **bucket = &blockHash[block->hash & (BLOCK_HASH_SIZE - 1)];
+
+   block->hashNext = *bucket;
+   os_rcu_assign_pointer(*bucket, block);
+   numBlocks++;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * BlockHashRemove --
+ *
+ *    Removes a block from blockHash.  blockedFilesLock must be held for
+ *    writing.  Lookups already walking the chain may still find the block
+ *    until the end of the RCU grace period.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+BlockHashRemove(BlockInfo *block)       // IN: block to remove
+{
+   BlockInfo **prev = &blockHash[block->hash & (BLOCK_HASH_SIZE - 1)];
+
+   while (*prev != block) {
+      ASSERT(*prev);
+      prev = &(*prev)->hashNext;
+   }
+   os_rcu_assign_pointer(*prev, block->hashNext);
+   numBlocks--;
 }
 
 
@@ -581,6 +766,8 @@ AllocBlock(os_kmem_cache_t *cache,        // IN: cache to allocate from
    }
 
    DblLnkLst_Init(&block->links);
+   block->hashNext = NULL;
+   block->hash = BlockHashName(block->filename);
    os_atomic_set(&block->refcount, 1);
    os_completion_init(&block->completion);
    block->blocker = blocker;
@@ -589,12 +776,39 @@ AllocBlock(os_kmem_cache_t *cache,        // IN: cache to allocate from
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FreeBlockRcu --
+ *
+ *    RCU callback that frees a block structure once no lookup can be
+ *    looking at it anymore.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+FreeBlockRcu(os_rcu_head_t *head)       // IN: rcu member of the block
+{
+   BlockInfo *block = (BlockInfo *)((char *)head - offsetof(BlockInfo, rcu));
+
+   os_completion_destroy(&block->completion);
+   os_kmem_cache_free(blockInfoCache, block);
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
  * FreeBlock --
  *
- *    Frees the provided block structure.
+ *    Frees the provided block structure after an RCU grace period.
  *
  * Results:
  *    None.
@@ -609,9 +823,8 @@ static void
 FreeBlock(os_kmem_cache_t *cache,       // IN: cache block was allocated from
           BlockInfo *block)             // IN: block to free
 {
-   ASSERT(cache);
+   ASSERT(cache == blockInfoCache);
    ASSERT(block);
 
-   os_completion_destroy(&block->completion);
-   os_kmem_cache_free(cache, block);
+   os_call_rcu(&block->rcu, FreeBlockRcu);
 }
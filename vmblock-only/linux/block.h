@@ -29,6 +29,20 @@
 
 typedef struct BlockInfo * BlockHandle;
 
+/*
+ * Block lookup statistics, see BlockGetStats().
+ */
+
+typedef struct BlockStats {
+   uint64 lookups;      /* block lookups by filename */
+   uint64 hits;         /* lookups that found a block */
+   uint64 probes;       /* hash chain entries examined */
+   uint64 timed;        /* lookups sampled for timing */
+   uint64 totalNs;      /* time spent in sampled lookups */
+   uint64 maxNs;        /* longest sampled lookup */
+   uint32 numBlocks;    /* blocks currently in place */
+} BlockStats;
+
 /*
  * Global functions
  */
@@ -40,6 +54,7 @@ int BlockRemoveFileBlock(const char *filename, const os_blocker_id_t blocker);
 unsigned int BlockRemoveAllBlocks(const os_blocker_id_t blocker);
 int BlockWaitOnFile(const char *filename, BlockHandle cookie);
 BlockHandle BlockLookup(const char *filename, const os_blocker_id_t blocker);
+void BlockGetStats(BlockStats *stats);
 #ifdef VMX86_DEVEL
 void BlockListFileBlocks(void);
 #endif
@@ -43,6 +43,8 @@ static int CleanupProcDevice(void);
 ssize_t ControlFileOpWrite(struct file *filp, const char __user *buf,
                            size_t cmd, loff_t *ppos);
 static int ControlFileOpRelease(struct inode *inode, struct file *file);
+static int ControlStatsRead(char *page, char **start, off_t off,
+                            int count, int *eof, void *data);
 
 
 static struct proc_dir_entry *controlProcDirEntry;
@@ -219,6 +221,17 @@ SetupProcDevice(void)
    }
 
    controlProcEntry->proc_fops = &ControlFileOps;
+
+   /* Create /proc/fs/vmblock/stats; the module works fine without it. */
+   if (!create_proc_read_entry(VMBLOCK_CONTROL_STATSNAME,
+                               VMBLOCK_CONTROL_STATS_MODE,
+                               controlProcDirEntry,
+                               ControlStatsRead,
+                               NULL)) {
+      Warning("SetupProcDevice: could not create /proc/"
+              VMBLOCK_CONTROL_PROC_DIRNAME "/" VMBLOCK_CONTROL_STATSNAME "\n");
+   }
+
    return 0;
 }
 
@@ -243,6 +256,7 @@ static int
 CleanupProcDevice(void)
 {
    if (controlProcDirEntry) {
+      remove_proc_entry(VMBLOCK_CONTROL_STATSNAME, controlProcDirEntry);
       remove_proc_entry(VMBLOCK_CONTROL_MOUNTPOINT, controlProcDirEntry);
       remove_proc_entry(VMBLOCK_CONTROL_DEVNAME, controlProcDirEntry);
       remove_proc_entry(VMBLOCK_CONTROL_PROC_DIRNAME, NULL);
@@ -253,6 +267,57 @@ CleanupProcDevice(void)
 
 /* procfs file operations */
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ControlStatsRead --
+ *
+ *    read_proc implementation for the stats file.  Prints the number of
+ *    blocks and the block lookup statistics.
+ *
+ * Results:
+ *    Length of the output.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static int
+ControlStatsRead(char *page,   // OUT: buffer to write into
+                 char **start, // OUT: 0 if file < 4k
+                 off_t off,    // IN: offset of read into the file
+                 int count,    // IN: maximum number of bytes to read
+                 int *eof,     // OUT: TRUE if there is nothing more to read
+                 void *data)   // IN: unused
+{
+   BlockStats stats;
+   int len;
+
+   BlockGetStats(&stats);
+   len = sprintf(page,
+                 "blocks %u\n"
+                 "lookups %llu\n"
+                 "hits %llu\n"
+                 "probes %llu\n"
+                 "timed %llu\n"
+                 "totalNs %llu\n"
+                 "maxNs %llu\n",
+                 stats.numBlocks,
+                 (unsigned long long)stats.lookups,
+                 (unsigned long long)stats.hits,
+                 (unsigned long long)stats.probes,
+                 (unsigned long long)stats.timed,
+                 (unsigned long long)stats.totalNs,
+                 (unsigned long long)stats.maxNs);
+
+   *start = 0;
+   *eof = 1;
+   return len;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
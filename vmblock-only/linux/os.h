@@ -28,10 +28,16 @@
 #define __OS_H__
 
 #include "driver-config.h"
+#include "compat_version.h"
 #include <linux/completion.h>
 #include <linux/limits.h>
 #include "compat_slab.h"
 #include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16)
+#  include <linux/hrtimer.h>
+#endif
 #include <asm/atomic.h>
 #include <asm/errno.h>
 #include <asm/current.h>
@@ -40,6 +46,7 @@ typedef rwlock_t os_rwlock_t;
 typedef compat_kmem_cache os_kmem_cache_t;
 typedef struct completion os_completion_t;
 typedef atomic_t os_atomic_t;
+typedef struct rcu_head os_rcu_head_t;
 typedef struct file * os_blocker_id_t;
 
 #define OS_UNKNOWN_BLOCKER              NULL
@@ -99,5 +106,34 @@ typedef struct file * os_blocker_id_t;
 #define os_atomic_set(atomic, val)      atomic_set(atomic, val)
 #define os_atomic_inc(atomic)           atomic_inc(atomic)
 #define os_atomic_read(atomic)          atomic_read(atomic)
+#define os_atomic_inc_not_zero(atomic)  atomic_inc_not_zero(atomic)
+
+/*
+ * Per-CPU variables.  They are only updated from process context, so
+ * disabling preemption around an update is enough.
+ */
+#define OS_DEFINE_PER_CPU(type, name)   static DEFINE_PER_CPU(type, name)
+#define os_get_cpu_var(name)            get_cpu_var(name)
+#define os_put_cpu_var(name)            put_cpu_var(name)
+#define os_per_cpu(name, cpu)           per_cpu(name, cpu)
+#ifdef for_each_possible_cpu
+# define os_for_each_cpu(cpu)           for_each_possible_cpu(cpu)
+#else
+# define os_for_each_cpu(cpu)           for_each_cpu(cpu)
+#endif
+
+#define os_rcu_read_lock()              rcu_read_lock()
+#define os_rcu_read_unlock()            rcu_read_unlock()
+#define os_rcu_dereference(ptr)         rcu_dereference(ptr)
+#define os_rcu_assign_pointer(ptr, val) rcu_assign_pointer(ptr, val)
+#define os_call_rcu(head, func)         call_rcu(head, func)
+#define os_rcu_barrier()                rcu_barrier()
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16)
+# define os_time_ns()                   ((uint64)ktime_to_ns(ktime_get()))
+#else
+/* No ktime before hrtimers; jiffies resolution is all we get. */
+# define os_time_ns()                   ((uint64)jiffies * (1000000000 / HZ))
+#endif
 
 #endif /* __OS_H__ */
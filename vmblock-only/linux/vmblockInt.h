@@ -64,6 +64,8 @@ extern int LOGLEVEL_THRESHOLD;
 #endif /* __KERNEL__ */
 
 #define VMBLOCK_CONTROL_MODE       S_IRUSR | S_IFREG
+#define VMBLOCK_CONTROL_STATSNAME  "stats"
+#define VMBLOCK_CONTROL_STATS_MODE S_IRUGO | S_IFREG
 
 /*
  * Our modules may be compatible with kernels built for different processors.
@@ -70,6 +70,7 @@ struct VMCIDatagramProcess {
 
 struct VMCIContext {
    ListItem           listItem;         /* For global VMCI list. */
+   struct VMCIContext *hashNext;        /* Next in the cid hash bucket. */
    VMCIId             cid;
    Atomic_uint32      refCount;
    ListItem           *datagramQueue;   /* Head of per VM queue. */
@@ -85,12 +86,13 @@ struct VMCIContext {
    VMCIHandleArray    *queuePairArray;  /*
                                          * QueuePairs attached to.  The array of
                                          * handles for queue pairs is accessed
-                                         * from the code for QP API, and there
-                                         * it is protected by the QP lock.  It
-                                         * is also accessed from the context
-                                         * clean up path, which does not
-                                         * require a lock.  VMCILock is not
-                                         * used to protect the QP array field.
+                                         * from the code for QP API, which
+                                         * holds the QP lock of one handle
+                                         * only, so there it is protected by
+                                         * the context lock.  It is also
+                                         * accessed from the context clean up
+                                         * path, which does not require a
+                                         * lock.
                                          */
    VMCIHandleArray    *notifierArray;   /* Contexts current context is subscribing to. */
    VMCIHost           hostContext;
@@ -170,4 +172,92 @@ VMCIDenyInteraction(VMCIPrivilegeFlags partOne,  // IN
 #endif
 }
 
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIDatagramQueueDequeueBatch --
+ *
+ *     Moves datagrams from the head of a datagram queue to dgs, as long as
+ *     there are no more than maxDGs of them and they fit in bufSize bytes
+ *     packed back to back, each at an 8 byte aligned offset.  The queue
+ *     entries are moved to *doneList, to be freed with
+ *     VMCIDatagramQueueFreeEntries once the queue lock, which must be held
+ *     here, has been dropped.
+ *
+ *  Result:
+ *     Number of datagrams dequeued.  *bufUsed is set to the bytes used.
+ *
+ *  Side effects:
+ *     None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static INLINE uint32
+VMCIDatagramQueueDequeueBatch(ListItem **queue,    // IN/OUT:
+                              uint32 *pending,     // IN/OUT:
+                              size_t *queueSize,   // IN/OUT:
+                              size_t bufSize,      // IN:
+                              uint32 maxDGs,       // IN:
+                              VMCIDatagram **dgs,  // OUT:
+                              size_t *bufUsed,     // OUT:
+                              ListItem **doneList) // IN/OUT:
+{
+   size_t used = 0;
+   uint32 n = 0;
+
+   while (n < maxDGs && *pending > 0) {
+      ListItem *listItem = LIST_FIRST(*queue);
+      DatagramQueueEntry *dqEntry;
+
+      ASSERT(listItem);
+      dqEntry = LIST_CONTAINER(listItem, DatagramQueueEntry, listItem);
+      if (used + dqEntry->dgSize > bufSize) {
+         break;
+      }
+      LIST_DEL(listItem, queue);
+      LIST_QUEUE(listItem, doneList);
+      (*pending)--;
+      *queueSize -= dqEntry->dgSize;
+      dgs[n++] = dqEntry->dg;
+      used += VMCI_DG_SIZE_ALIGNED(dqEntry->dg);
+   }
+   *bufUsed = MIN(used, bufSize);
+
+   return n;
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIDatagramQueueFreeEntries --
+ *
+ *     Frees the queue entries collected by VMCIDatagramQueueDequeueBatch.
+ *     The datagrams themselves belong to the caller.
+ *
+ *  Result:
+ *     None.
+ *
+ *  Side effects:
+ *     None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static INLINE void
+VMCIDatagramQueueFreeEntries(ListItem *doneList) // IN:
+{
+   ListItem *curr;
+   ListItem *next;
+
+   LIST_SCAN_SAFE(curr, next, doneList) {
+      DatagramQueueEntry *dqEntry =
+         LIST_CONTAINER(curr, DatagramQueueEntry, listItem);
+
+      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
+   }
+}
+
 #endif /* _VMCI_COMMONINT_H_ */
@@ -62,16 +62,117 @@ static int VMCIContextFireNotification(VMCIId contextID,
                                        const char *domain);
 
 /*
- * List of current VMCI contexts.
+ * List of current VMCI contexts, also hashed by cid.  The hash chains are
+ * only changed with the lock held; with VMCI_HAS_RCU, lookups walk them
+ * without it.  lookups and probes count the lookups and the contexts
+ * looked at by them; every CPU doing a lookup would write them, so they
+ * are only kept in debug and stats builds.
  */
 
+#if defined(VMX86_DEBUG) || defined(VMX86_STATS)
+#define VMCI_CONTEXT_STATS
+#endif
+
+#define VMCI_CONTEXT_HASH_BITS 6
+#define VMCI_CONTEXT_HASH_SIZE (1 << VMCI_CONTEXT_HASH_BITS)
+#define VMCI_CONTEXT_HASH(_cid) \
+   (((uint32)(_cid) * 0x9e3779b1) >> (32 - VMCI_CONTEXT_HASH_BITS))
+
 static struct {
    ListItem *head;
+   VMCIContext *hash[VMCI_CONTEXT_HASH_SIZE];
    VMCILock lock;
    VMCILock firingLock;
+#ifdef VMCI_CONTEXT_STATS
+   Atomic_uint64 lookups;
+   Atomic_uint64 probes;
+#endif
 } contextList;
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextReadLock --
+ * VMCIContextReadUnlock --
+ *
+ *      Enter or leave a section looking up contexts by cid.  Takes the
+ *      context list lock only where there is no RCU.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VMCIContextReadLock(VMCILockFlags *flags) // OUT:
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_ReadLockRCU();
+#else
+   VMCI_GrabLock(&contextList.lock, flags);
+#endif
+}
+
+static INLINE void
+VMCIContextReadUnlock(VMCILockFlags flags) // IN:
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_ReadUnlockRCU();
+#else
+   VMCI_ReleaseLock(&contextList.lock, flags);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextLookup --
+ *
+ *      Finds the context with the given cid in the hash.  Must be called
+ *      with the context list lock held or within VMCIContextReadLock.
+ *
+ * Results:
+ *      The context, or NULL.  No reference is taken.
+ *
+ * Side effects:
+ *      Updates the lookup counters in debug and stats builds.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMCIContext *
+VMCIContextLookup(VMCIId cid)  // IN
+{
+   VMCIContext *context;
+#ifdef VMCI_CONTEXT_STATS
+   uint32 probes = 0;
+#endif
+
+   for (context = VMCI_DereferenceRCU(contextList.hash[VMCI_CONTEXT_HASH(cid)]);
+        context != NULL;
+        context = VMCI_DereferenceRCU(context->hashNext)) {
+#ifdef VMCI_CONTEXT_STATS
+      probes++;
+#endif
+      if (context->cid == cid) {
+         break;
+      }
+   }
+#ifdef VMCI_CONTEXT_STATS
+   Atomic_Inc64(&contextList.lookups);
+   Atomic_FetchAndAdd64(&contextList.probes, probes);
+#endif
+
+   return context;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -211,6 +312,11 @@ int
 VMCIContext_Init(void)
 {
    contextList.head = NULL;
+   memset(contextList.hash, 0, sizeof contextList.hash);
+#ifdef VMCI_CONTEXT_STATS
+   Atomic_Write64(&contextList.lookups, 0);
+   Atomic_Write64(&contextList.probes, 0);
+#endif
    VMCI_InitLock(&contextList.lock, "VMCIContextListLock",
 		 VMCI_LOCK_RANK_HIGHER);
    VMCI_InitLock(&contextList.firingLock, "VMCIContextFiringLock",
@@ -231,7 +337,7 @@ VMCIContext_Init(void)
  *      None.
  *
  * Side effects:
- *      None.
+ *      Logs the context lookup counters in debug and stats builds.
  *
  *----------------------------------------------------------------------
  */
@@ -239,6 +345,14 @@ VMCIContext_Init(void)
 void
 VMCIContext_Exit(void)
 {
+#ifdef VMCI_CONTEXT_STATS
+   uint64 lookups = Atomic_Read64(&contextList.lookups);
+
+   if (lookups != 0) {
+      VMCILOG((LGPFX"%"FMT64"u context lookups, %"FMT64"u probes.\n",
+               lookups, Atomic_Read64(&contextList.probes)));
+   }
+#endif
    VMCI_CleanupLock(&contextList.firingLock);
    VMCI_CleanupLock(&contextList.lock);
 }
@@ -328,6 +442,13 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    
    context->privFlags = privFlags;
 
+#ifndef VMX86_SERVER
+   context->notify = NULL;
+#  ifdef __linux__
+   context->notifyPage = NULL;
+#  endif
+#endif
+
    /* 
     * If we collide with an existing context we generate a new and use it 
     * instead. The VMX will determine if regeneration is okay. Since there
@@ -353,6 +474,8 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    context->cid = cid;
    
    LIST_QUEUE(&context->listItem, &contextList.head);
+   context->hashNext = contextList.hash[VMCI_CONTEXT_HASH(cid)];
+   VMCI_AssignPointerRCU(contextList.hash[VMCI_CONTEXT_HASH(cid)], context);
    VMCI_ReleaseLock(&contextList.lock, flags);
 
 #ifdef VMKERNEL
@@ -362,13 +485,6 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
    VMCIContext_SetDomainName(context, "");
 #endif
 
-#ifndef VMX86_SERVER
-   context->notify = NULL;
-#  ifdef __linux__
-   context->notifyPage = NULL;
-#  endif
-#endif
-
    *outContext = context;
    return VMCI_SUCCESS;
 
@@ -401,7 +517,7 @@ error:
  *      None.
  *
  * Side effects:
- *      None.
+ *      May wait for an RCU grace period.
  *
  *----------------------------------------------------------------------
  */
@@ -409,14 +525,29 @@ error:
 void
 VMCIContext_ReleaseContext(VMCIContext *context)   // IN
 {
+   VMCIContext **link;
    VMCILockFlags flags;
 
    /* Dequeue VMCI context. */
 
    VMCI_GrabLock(&contextList.lock, &flags);
    LIST_DEL(&context->listItem, &contextList.head);
+   link = &contextList.hash[VMCI_CONTEXT_HASH(context->cid)];
+   while (*link != context) {
+      ASSERT(*link);
+      link = &(*link)->hashNext;
+   }
+   *link = context->hashNext;
    VMCI_ReleaseLock(&contextList.lock, flags);
 
+#ifdef VMCI_HAS_RCU
+   /*
+    * Lookups that still found the context have taken their reference
+    * once the grace period is over.
+    */
+   VMCI_SynchronizeRCU();
+#endif
+
    VMCIContext_Release(context);
 }
 
@@ -519,7 +650,7 @@ VMCIContextFreeContext(VMCIContext *context)  // IN
       LIST_DEL(curr, &context->datagramQueue);
       ASSERT(dqEntry && dqEntry->dg);
       ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-      VMCI_FreeKernelMem(dqEntry->dg, dqEntry->dgSize);
+      VMCI_FreeDatagramMem(dqEntry->dg, dqEntry->dgSize);
       VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
    }
 
@@ -693,7 +824,8 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
  * VMCIContextExists --
  *
  *      Internal helper to check if a context with the specified context
- *      ID exists. Assumes the contextList.lock is held.
+ *      ID exists. Assumes the contextList.lock is held, or the caller
+ *      is within VMCIContextReadLock.
  *
  * Results:
  *      TRUE if a context exists with the given cid.
@@ -708,18 +840,7 @@ VMCIContext_EnqueueDatagram(VMCIId cid,        // IN: Target VM
 static Bool
 VMCIContextExists(VMCIId cid)    // IN
 {
-   VMCIContext *context;
-   ListItem *next;
-   Bool rv = FALSE;
-
-   LIST_SCAN(next, contextList.head) {
-      context = LIST_CONTAINER(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         rv = TRUE;
-         break;
-      }
-   }
-   return rv;
+   return VMCIContextLookup(cid) != NULL;
 }
 
 
@@ -746,9 +867,9 @@ VMCIContext_Exists(VMCIId cid)    // IN
    VMCILockFlags flags;
    Bool rv;
 
-   VMCI_GrabLock(&contextList.lock, &flags);
+   VMCIContextReadLock(&flags);
    rv = VMCIContextExists(cid);
-   VMCI_ReleaseLock(&contextList.lock, flags);
+   VMCIContextReadUnlock(flags);
    return rv;
 }
 
@@ -772,36 +893,28 @@ VMCIContext_Exists(VMCIId cid)    // IN
 VMCIContext *
 VMCIContext_Get(VMCIId cid)  // IN
 {
-   VMCIContext *context = NULL;  
-   ListItem *next;
+   VMCIContext *context;
    VMCILockFlags flags;
 
-   VMCI_GrabLock(&contextList.lock, &flags);
-   if (LIST_EMPTY(contextList.head)) {
-      goto out;
-   }
-
-   LIST_SCAN(next, contextList.head) {
-      context = LIST_CONTAINER(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         /*
-          * At this point, we are sure that the reference count is
-          * larger already than zero. When starting the destruction of
-          * a context, we always remove it from the context list
-          * before decreasing the reference count. As we found the
-          * context here, it hasn't been destroyed yet. This means
-          * that we are not about to increase the reference count of
-          * something that is in the process of being destroyed.
-          */
+   VMCIContextReadLock(&flags);
+   context = VMCIContextLookup(cid);
+   if (context != NULL) {
+      /*
+       * At this point, we are sure that the reference count is
+       * larger already than zero. When starting the destruction of
+       * a context, we always remove it from the context hash (and
+       * wait for the lookups in progress to finish) before
+       * decreasing the reference count. As we found the context
+       * here, it hasn't been destroyed yet. This means that we are
+       * not about to increase the reference count of something that
+       * is in the process of being destroyed.
+       */
 
-         Atomic_Inc(&context->refCount);
-         break;
-      }
+      Atomic_Inc(&context->refCount);
    }
+   VMCIContextReadUnlock(flags);
 
-out:
-   VMCI_ReleaseLock(&contextList.lock, flags);
-   return (context && context->cid == cid) ? context : NULL;
+   return context;
 }
 
 
@@ -935,6 +1048,93 @@ VMCIContext_DequeueDatagram(VMCIContext *context, // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_DequeueDatagrams --
+ *
+ *      Dequeues as many of the pending datagrams as fit, up to *numDGs
+ *      of them, in a buffer of *bufSize bytes where they are packed at 8
+ *      byte aligned offsets.  The context lock is taken once for the
+ *      whole batch.
+ *
+ * Results:
+ *      On success:  0 if no more pending datagrams, otherwise the size of
+ *                   the next pending datagram.  *numDGs and *bufSize are
+ *                   set to the number of datagrams returned in dgs and the
+ *                   bytes they take in the buffer.  The caller must free
+ *                   the datagrams.
+ *      On failure:  appropriate error code.  If even the first datagram
+ *                   doesn't fit, VMCI_ERROR_NO_MEM with its size in
+ *                   *bufSize.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCIContext_DequeueDatagrams(VMCIContext *context, // IN
+                             size_t *bufSize,      // IN/OUT:
+                             uint32 *numDGs,       // IN/OUT:
+                             VMCIDatagram **dgs)   // OUT:
+{
+   ListItem *doneList = NULL;
+   VMCILockFlags flags;
+   size_t used;
+   uint32 n;
+   int rv;
+
+   ASSERT(context && bufSize && numDGs && dgs);
+
+   VMCI_GrabLock(&context->lock, &flags);
+   if (context->pendingDatagrams == 0) {
+      VMCIHost_ClearCall(&context->hostContext);
+      VMCIContextClearNotify(context);
+      VMCI_ReleaseLock(&context->lock, flags);
+      VMCI_DEBUG_LOG((LGPFX"No datagrams pending.\n"));
+      return VMCI_ERROR_NO_MORE_DATAGRAMS;
+   }
+
+   n = VMCIDatagramQueueDequeueBatch(&context->datagramQueue,
+                                     &context->pendingDatagrams,
+                                     &context->datagramQueueSize,
+                                     *bufSize, *numDGs, dgs, &used,
+                                     &doneList);
+   if (n == 0) {
+      DatagramQueueEntry *dqEntry =
+         LIST_CONTAINER(LIST_FIRST(context->datagramQueue),
+                        DatagramQueueEntry, listItem);
+
+      *bufSize = dqEntry->dgSize;
+      VMCI_ReleaseLock(&context->lock, flags);
+      VMCILOG((LGPFX"Caller's buffer is too small. It must be at "
+               "least %"FMTSZ"d bytes.\n", *bufSize));
+      return VMCI_ERROR_NO_MEM;
+   }
+
+   if (context->pendingDatagrams == 0) {
+      VMCIHost_ClearCall(&context->hostContext);
+      VMCIContextClearNotify(context);
+      rv = VMCI_SUCCESS;
+   } else {
+      DatagramQueueEntry *nextEntry =
+         LIST_CONTAINER(LIST_FIRST(context->datagramQueue),
+                        DatagramQueueEntry, listItem);
+
+      rv = (int)nextEntry->dgSize;
+   }
+   VMCI_ReleaseLock(&context->lock, flags);
+
+   VMCIDatagramQueueFreeEntries(doneList);
+   *numDGs = n;
+   *bufSize = used;
+
+   return rv;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -982,15 +1182,16 @@ VMCIContext_GetId(VMCIContext *context) // IN:
 VMCIPrivilegeFlags
 VMCIContext_GetPrivFlagsInt(VMCIId contextID)  // IN
 {
-   VMCIPrivilegeFlags flags;
+   VMCIPrivilegeFlags flags = VMCI_LEAST_PRIVILEGE_FLAGS;
    VMCIContext *context;
+   VMCILockFlags lockFlags;
 
-   context = VMCIContext_Get(contextID);
-   if (!context) {
-      return VMCI_LEAST_PRIVILEGE_FLAGS;
+   VMCIContextReadLock(&lockFlags);
+   context = VMCIContextLookup(contextID);
+   if (context) {
+      flags = context->privFlags;
    }
-   flags = context->privFlags;
-   VMCIContext_Release(context);
+   VMCIContextReadUnlock(lockFlags);
    return flags;
 }
 
@@ -54,6 +54,8 @@ void VMCIContext_ReleaseContext(VMCIContext *context);
 int VMCIContext_EnqueueDatagram(VMCIId cid, VMCIDatagram *dg);
 int VMCIContext_DequeueDatagram(VMCIContext *context, size_t *maxSize, 
 				VMCIDatagram **dg);
+int VMCIContext_DequeueDatagrams(VMCIContext *context, size_t *bufSize,
+                                 uint32 *numDGs, VMCIDatagram **dgs);
 int VMCIContext_PendingDatagrams(VMCIId cid, uint32 *pending);
 VMCIContext *VMCIContext_Get(VMCIId cid);
 void VMCIContext_Release(VMCIContext *context);
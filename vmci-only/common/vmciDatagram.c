@@ -91,6 +91,8 @@ static void DatagramFreeCB(void *resource);
 static int DatagramReleaseCB(void *clientData);
 static DatagramWKMapping *DatagramGetWellKnownMap(VMCIId wellKnownID);
 static void DatagramReleaseWellKnownMap(DatagramWKMapping *wkMap);
+static int VMCIDatagramDispatchInt(VMCIId contextID, VMCIDatagram *dg,
+                                   Bool *consumed);
 				     
 #ifndef VMX86_SERVER
 static int DatagramProcessNotifyCB(void *clientData, VMCIDatagram *msg);
@@ -275,7 +277,7 @@ DatagramProcessNotifyCB(void *clientData,  // IN:
    dgmSize = VMCI_DG_SIZE(msg);
    ASSERT(dgmSize <= VMCI_MAX_DG_SIZE);
 
-   dgm = VMCI_AllocKernelMem(dgmSize, VMCI_MEMORY_NORMAL);
+   dgm = VMCI_AllocDatagramMem(dgmSize, VMCI_MEMORY_NORMAL);
    if (!dgm) {
       VMCILOG((LGPFX"Failed to allocate datagram of size %"FMTSZ"d bytes.\n",
                dgmSize));
@@ -287,7 +289,7 @@ DatagramProcessNotifyCB(void *clientData,  // IN:
    dqEntry = VMCI_AllocKernelMem(sizeof *dqEntry, VMCI_MEMORY_NONPAGED);
    if (dqEntry == NULL) {
       VMCILOG((LGPFX"Failed to allocate memory for process datagram.\n"));
-      VMCI_FreeKernelMem(dgm, dgmSize);
+      VMCI_FreeDatagramMem(dgm, dgmSize);
       return VMCI_ERROR_NO_MEM;
    }
    dqEntry->dg = dgm;
@@ -296,7 +298,7 @@ DatagramProcessNotifyCB(void *clientData,  // IN:
    VMCI_GrabLock(&dgmProc->lock, &flags);
    if (dgmProc->datagramQueueSize + dgmSize >= VMCI_MAX_DATAGRAM_QUEUE_SIZE) {
       VMCI_ReleaseLock(&dgmProc->lock, flags);
-      VMCI_FreeKernelMem(dgm, dgmSize);
+      VMCI_FreeDatagramMem(dgm, dgmSize);
       VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
       VMCILOGThrottled((LGPFX"Datagram process receive queue is full.\n"));
       return VMCI_ERROR_NO_RESOURCES;
@@ -427,7 +429,7 @@ VMCIDatagramProcess_Destroy(VMCIDatagramProcess *dgmProc) // IN:
       LIST_DEL(curr, &dgmProc->datagramQueue);
       ASSERT(dqEntry && dqEntry->dg);
       ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-      VMCI_FreeKernelMem(dqEntry->dg, dqEntry->dgSize);
+      VMCI_FreeDatagramMem(dqEntry->dg, dqEntry->dgSize);
       VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
    }
 
@@ -520,6 +522,92 @@ VMCIDatagramProcess_ReadCall(VMCIDatagramProcess *dgmProc, // IN:
 
    return VMCI_SUCCESS;
 }
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIDatagramProcess_ReadCalls --
+ *
+ *      Like VMCIDatagramProcess_ReadCall, but dequeues as many of the
+ *      pending datagrams as fit, up to *numDGs of them, in a buffer of
+ *      *bufSize bytes where they are packed at 8 byte aligned offsets.
+ *      Blocks only until the first datagram is available.
+ *
+ * Results:
+ *      0 on success, with *numDGs and *bufSize set to the number of
+ *      datagrams returned in dgs and the bytes they take in the buffer.
+ *      Appropriate error code otherwise.  If even the first datagram
+ *      doesn't fit, VMCI_ERROR_NO_MEM with its size in *bufSize.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCIDatagramProcess_ReadCalls(VMCIDatagramProcess *dgmProc, // IN:
+                              size_t *bufSize,              // IN/OUT:
+                              uint32 *numDGs,               // IN/OUT:
+                              VMCIDatagram **dgs)           // OUT:
+{
+   ListItem *doneList = NULL;
+   VMCILockFlags flags;
+   size_t used;
+   uint32 n;
+
+   ASSERT(dgmProc);
+   ASSERT(bufSize && numDGs && dgs);
+
+   VMCI_GrabLock(&dgmProc->lock, &flags);
+
+#if defined(SOLARIS) || defined(__APPLE__)
+   if (dgmProc->pendingDatagrams == 0) {
+      VMCIHost_ClearCall(&dgmProc->host);
+      VMCI_ReleaseLock(&dgmProc->lock, flags);
+      VMCILOG((LGPFX"No datagrams pending.\n"));
+      return VMCI_ERROR_NO_MORE_DATAGRAMS;
+   }
+#else
+   while (dgmProc->pendingDatagrams == 0) {
+      VMCIHost_ClearCall(&dgmProc->host);
+      if (!VMCIHost_WaitForCallLocked(&dgmProc->host, &dgmProc->lock,
+                                      &flags, FALSE)) {
+         VMCI_ReleaseLock(&dgmProc->lock, flags);
+         VMCILOG((LGPFX"Blocking read of datagram interrupted.\n"));
+         return VMCI_ERROR_NO_MORE_DATAGRAMS;
+      }
+   }
+#endif
+
+   n = VMCIDatagramQueueDequeueBatch(&dgmProc->datagramQueue,
+                                     &dgmProc->pendingDatagrams,
+                                     &dgmProc->datagramQueueSize,
+                                     *bufSize, *numDGs, dgs, &used,
+                                     &doneList);
+   if (n == 0) {
+      DatagramQueueEntry *dqEntry =
+         LIST_CONTAINER(LIST_FIRST(dgmProc->datagramQueue),
+                        DatagramQueueEntry, listItem);
+
+      *bufSize = dqEntry->dgSize;
+      VMCI_ReleaseLock(&dgmProc->lock, flags);
+      VMCILOG((LGPFX"Caller's buffer is too small. It must be at "
+               "least %"FMTSZ"d bytes.\n", *bufSize));
+      return VMCI_ERROR_NO_MEM;
+   }
+   if (dgmProc->pendingDatagrams == 0) {
+      VMCIHost_ClearCall(&dgmProc->host);
+   }
+   VMCI_ReleaseLock(&dgmProc->lock, flags);
+
+   VMCIDatagramQueueFreeEntries(doneList);
+   *numDGs = n;
+   *bufSize = used;
+
+   return VMCI_SUCCESS;
+}
 #endif // !VMX86_SERVER
 
 /*------------------------------ Init functions ----------------------------*/
@@ -913,6 +1001,70 @@ VMCIDatagram_GetPrivFlags(VMCIHandle handle,             // IN
 int 
 VMCIDatagram_Dispatch(VMCIId contextID,  // IN:
 		      VMCIDatagram *dg)  // IN:
+{
+   return VMCIDatagramDispatchInt(contextID, dg, NULL);
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIDatagram_DispatchOwned --
+ *
+ *     Like VMCIDatagram_Dispatch, but takes over dg, which must have been
+ *     allocated with VMCI_AllocDatagramMem(VMCI_DG_SIZE(dg)).  A datagram
+ *     for another VM context is queued as is instead of being copied.
+ *
+ *  Result:
+ *     Number of bytes sent on success, appropriate error code otherwise.
+ *     
+ *  Side effects:
+ *     dg is queued or freed, and must not be used by the caller any more.
+ *     
+ *------------------------------------------------------------------------------
+ */
+
+int 
+VMCIDatagram_DispatchOwned(VMCIId contextID,  // IN:
+                           VMCIDatagram *dg)  // IN:
+{
+   size_t dgSize;
+   Bool consumed = FALSE;
+   int retval;
+
+   ASSERT(dg);
+   dgSize = VMCI_DG_SIZE(dg);
+   retval = VMCIDatagramDispatchInt(contextID, dg, &consumed);
+   if (!consumed) {
+      VMCI_FreeDatagramMem(dg, dgSize);
+   }
+
+   return retval;
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIDatagramDispatchInt --
+ *
+ *     Does the work of VMCIDatagram_Dispatch.  If consumed is not NULL,
+ *     dg belongs to the dispatcher and a datagram for another VM context
+ *     is queued without a copy, in which case *consumed is set to TRUE.
+ *
+ *  Result:
+ *     Number of bytes sent on success, appropriate error code otherwise.
+ *     
+ *  Side effects:
+ *     None.
+ *     
+ *------------------------------------------------------------------------------
+ */
+
+static int 
+VMCIDatagramDispatchInt(VMCIId contextID,  // IN:
+                        VMCIDatagram *dg,  // IN:
+                        Bool *consumed)    // OUT: dg was queued, or NULL
 {
    int retval = 0;
    size_t dgSize;
@@ -1073,23 +1225,33 @@ VMCIDatagram_Dispatch(VMCIId contextID,  // IN:
 	 return VMCI_ERROR_NO_ACCESS;
       }
 
-      /* We make a copy to enqueue. */
+      if (consumed != NULL) {
+         /* The caller handed dg over, enqueue it as is. */
+         newDG = dg;
+      } else {
+         /* We make a copy to enqueue. */
 #ifdef _WIN32
-      newDG = VMCI_AllocKernelMem(dgSize, VMCI_MEMORY_NONPAGED);
+         newDG = VMCI_AllocDatagramMem(dgSize, VMCI_MEMORY_NONPAGED);
 #else // Linux, Mac OS, ESX cases below
-      newDG = VMCI_AllocKernelMem(dgSize, VMCI_MEMORY_NORMAL);
+         newDG = VMCI_AllocDatagramMem(dgSize, VMCI_MEMORY_NORMAL);
 #endif // _WIN32
 
-      if (newDG == NULL) {
-	 return VMCI_ERROR_NO_MEM;
+         if (newDG == NULL) {
+            return VMCI_ERROR_NO_MEM;
+         }
+         memcpy(newDG, dg, dgSize);
       }
-      memcpy(newDG, dg, dgSize);
       retval = 
 	 VMCIContext_EnqueueDatagram(dstContext, newDG);
       if (retval < VMCI_SUCCESS) {
-	 VMCI_FreeKernelMem(newDG, dgSize);
+         if (newDG != dg) {
+            VMCI_FreeDatagramMem(newDG, dgSize);
+         }
 	 return retval;
       }
+      if (consumed != NULL) {
+         *consumed = TRUE;
+      }
    }
    /* The datagram is freed when the context reads it. */
    VMCI_DEBUG_LOG((LGPFX"Sent datagram of size %u.\n", dgSize));
@@ -54,6 +54,7 @@ int VMCIDatagramCreateHndPriv(VMCIId resourceID, uint32 flags,
 			      VMCIHandle *outHandle);
 int VMCIDatagramDestroyHndInt(VMCIHandle handle);
 int VMCIDatagram_Dispatch(VMCIId contextID, VMCIDatagram *dg);
+int VMCIDatagram_DispatchOwned(VMCIId contextID, VMCIDatagram *dg);
 int VMCIDatagramSendInt(VMCIDatagram *msg);
 int VMCIDatagram_GetPrivFlags(VMCIHandle handle, VMCIPrivilegeFlags *privFlags);
 
@@ -70,6 +71,9 @@ int VMCIDatagramProcess_Create(VMCIDatagramProcess **outDgmProc,
 void VMCIDatagramProcess_Destroy(VMCIDatagramProcess *dgmProc);
 int VMCIDatagramProcess_ReadCall(VMCIDatagramProcess *dgmProc,
                                  size_t maxSize, VMCIDatagram **dg);
+int VMCIDatagramProcess_ReadCalls(VMCIDatagramProcess *dgmProc,
+                                  size_t *bufSize, uint32 *numDGs,
+                                  VMCIDatagram **dgs);
 #endif // !VMX86_SERVER
 
 #endif // _VMCI_DATAGRAM_H_
@@ -103,9 +103,22 @@ typedef VMCIMutex VMCIQPLock;
 # define VMCIQPLock_Release(_l)  VMCIMutex_Release(_l)
 #endif
 
-typedef struct QueuePairList {
+/*
+ * QueuePair entries are hashed by handle.  Each bucket has its own lock,
+ * which callers take through QueuePairList_Lock for the handle they work
+ * on, so operations on different queue pairs mostly don't serialize.
+ */
+
+#define QP_HASH_BITS 6
+#define QP_HASH_SIZE (1 << QP_HASH_BITS)
+
+typedef struct QueuePairBucket {
    ListItem  *head;
    VMCIQPLock lock;
+} QueuePairBucket;
+
+typedef struct QueuePairList {
+   QueuePairBucket buckets[QP_HASH_SIZE];
 } QueuePairList;
 
 static QueuePairList queuePairList;
@@ -120,11 +133,36 @@ static int QueuePairAllocHost(VMCIHandle handle, VMCIId peer,
 static QueuePairEntry *QueuePairList_FindEntry(VMCIHandle handle);
 static void QueuePairList_AddEntry(QueuePairEntry *entry);
 static void QueuePairList_RemoveEntry(QueuePairEntry *entry);
-static QueuePairEntry *QueuePairList_GetHead(void);
+static QueuePairEntry *QueuePairList_GetHead(QueuePairBucket *bucket);
 static int QueuePairNotifyPeer(Bool attach, VMCIHandle handle, VMCIId myId,
                                VMCIId peerId);
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * QueuePairList_Bucket --
+ *
+ *      Returns the hash bucket of the given handle.
+ *
+ * Results:
+ *      Pointer to bucket.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE QueuePairBucket *
+QueuePairList_Bucket(VMCIHandle handle) // IN:
+{
+   uint32 hash = (handle.context * 31 + handle.resource) * 0x9e3779b1;
+
+   return &queuePairList.buckets[hash >> (32 - QP_HASH_BITS)];
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -144,10 +182,19 @@ static int QueuePairNotifyPeer(Bool attach, VMCIHandle handle, VMCIId myId,
 static INLINE int
 QueuePairList_Init(void)
 {
-   int ret;
+   int ret = VMCI_SUCCESS;
+   int i;
 
    memset(&queuePairList, 0, sizeof queuePairList);
-   VMCIQPLock_Init(&queuePairList.lock, ret);
+   for (i = 0; i < QP_HASH_SIZE; i++) {
+      VMCIQPLock_Init(&queuePairList.buckets[i].lock, ret);
+      if (ret < VMCI_SUCCESS) {
+         while (i-- > 0) {
+            VMCIQPLock_Destroy(&queuePairList.buckets[i].lock);
+         }
+         break;
+      }
+   }
 
    return ret;
 }
@@ -158,7 +205,7 @@ QueuePairList_Init(void)
  *
  * QueuePairList_Exit --
  *
- *      Destroy the list's lock.
+ *      Destroy the list's locks.
  *
  * Results:
  *      None.
@@ -172,7 +219,11 @@ QueuePairList_Init(void)
 static INLINE void
 QueuePairList_Exit(void)
 {
-   VMCIQPLock_Destroy(&queuePairList.lock);
+   int i;
+
+   for (i = 0; i < QP_HASH_SIZE; i++) {
+      VMCIQPLock_Destroy(&queuePairList.buckets[i].lock);
+   }
    memset(&queuePairList, 0, sizeof queuePairList);
 }
 
@@ -182,7 +233,8 @@ QueuePairList_Exit(void)
  *
  * QueuePairList_Lock --
  *
- *      Acquires the lock protecting the QueuePair list.
+ *      Acquires the lock protecting the QueuePair list entries that hash
+ *      like the given handle.
  *
  * Results:
  *      None.
@@ -194,9 +246,9 @@ QueuePairList_Exit(void)
  */
 
 void
-QueuePairList_Lock(void)
+QueuePairList_Lock(VMCIHandle handle) // IN:
 {
-   VMCIQPLock_Acquire(&queuePairList.lock);
+   VMCIQPLock_Acquire(&QueuePairList_Bucket(handle)->lock);
 }
 
 
@@ -205,7 +257,7 @@ QueuePairList_Lock(void)
  *
  * QueuePairList_Unlock --
  *
- *      Releases the lock protecting the QueuePair list.
+ *      Releases the lock taken by QueuePairList_Lock for the handle.
  *
  * Results:
  *      None.
@@ -217,9 +269,9 @@ QueuePairList_Lock(void)
  */
 
 void
-QueuePairList_Unlock(void)
+QueuePairList_Unlock(VMCIHandle handle) // IN:
 {
-   VMCIQPLock_Release(&queuePairList.lock);
+   VMCIQPLock_Release(&QueuePairList_Bucket(handle)->lock);
 }
 
 
@@ -229,7 +281,7 @@ QueuePairList_Unlock(void)
  * QueuePairList_FindEntry --
  *
  *      Finds the entry in the list corresponding to a given handle. Assumes
- *      that the list is locked.
+ *      that the list is locked for the handle.
  *
  * Results:
  *      Pointer to entry.
@@ -246,7 +298,7 @@ QueuePairList_FindEntry(VMCIHandle handle) // IN:
    ListItem *next;
 
    ASSERT(!VMCI_HANDLE_INVALID(handle));
-   LIST_SCAN(next, queuePairList.head) {
+   LIST_SCAN(next, QueuePairList_Bucket(handle)->head) {
       QueuePairEntry *entry = LIST_CONTAINER(next, QueuePairEntry, listItem);
 
       if (VMCI_HANDLE_EQUAL(entry->handle, handle)) {
@@ -263,7 +315,8 @@ QueuePairList_FindEntry(VMCIHandle handle) // IN:
  *
  * QueuePairList_AddEntry --
  *
- *      Adds the given entry to the list. Assumes that the list is locked.
+ *      Adds the given entry to the list. Assumes that the list is locked
+ *      for the entry's handle.
  *
  * Results:
  *      None.
@@ -278,7 +331,7 @@ static void
 QueuePairList_AddEntry(QueuePairEntry *entry) // IN:
 {
    if (entry) {
-      LIST_QUEUE(&entry->listItem, &queuePairList.head);
+      LIST_QUEUE(&entry->listItem, &QueuePairList_Bucket(entry->handle)->head);
    }
 }
 
@@ -288,7 +341,8 @@ QueuePairList_AddEntry(QueuePairEntry *entry) // IN:
  *
  * QueuePairList_RemoveEntry --
  *
- *      Removes the given entry from the list. Assumes that the list is locked.
+ *      Removes the given entry from the list. Assumes that the list is
+ *      locked for the entry's handle.
  *
  * Results:
  *      None.
@@ -303,7 +357,7 @@ static void
 QueuePairList_RemoveEntry(QueuePairEntry *entry) // IN:
 {
    if (entry) {
-      LIST_DEL(&entry->listItem, &queuePairList.head);
+      LIST_DEL(&entry->listItem, &QueuePairList_Bucket(entry->handle)->head);
    }
 }
 
@@ -313,8 +367,8 @@ QueuePairList_RemoveEntry(QueuePairEntry *entry) // IN:
  *
  * QueuePairList_GetHead --
  *
- *      Returns the entry from the head of the list. Assumes that the list is
- *      locked.
+ *      Returns the entry from the head of the given bucket. Assumes that
+ *      the bucket is locked.
  *
  * Results:
  *      Pointer to entry.
@@ -326,9 +380,9 @@ QueuePairList_RemoveEntry(QueuePairEntry *entry) // IN:
  */
 
 static QueuePairEntry *
-QueuePairList_GetHead(void)
+QueuePairList_GetHead(QueuePairBucket *bucket) // IN:
 {
-   ListItem *first = LIST_FIRST(queuePairList.head);
+   ListItem *first = LIST_FIRST(bucket->head);
 
    if (first) {
       QueuePairEntry *entry = LIST_CONTAINER(first, QueuePairEntry, listItem);
@@ -339,6 +393,39 @@ QueuePairList_GetHead(void)
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * QueuePairContextHasHandle --
+ *
+ *      Checks whether the context is attached to the queue pair.  The
+ *      context's queue pair array is shared by all QueuePairList buckets,
+ *      so it is guarded by the context lock.
+ *
+ * Results:
+ *      TRUE if the handle is in the context's queue pair array.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+QueuePairContextHasHandle(VMCIContext *context, // IN:
+                          VMCIHandle handle)    // IN:
+{
+   VMCILockFlags flags;
+   Bool rv;
+
+   VMCI_GrabLock(&context->lock, &flags);
+   rv = VMCIHandleArray_HasEntry(context->queuePairArray, handle);
+   VMCI_ReleaseLock(&context->lock, flags);
+
+   return rv;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -428,15 +515,19 @@ void
 QueuePair_Exit(void)
 {
    QueuePairEntry *entry;
+   int i;
 
-   QueuePairList_Lock();
+   for (i = 0; i < QP_HASH_SIZE; i++) {
+      QueuePairBucket *bucket = &queuePairList.buckets[i];
 
-   while ((entry = QueuePairList_GetHead())) {
-      QueuePairList_RemoveEntry(entry);
-      VMCI_FreeKernelMem(entry, sizeof *entry);
+      VMCIQPLock_Acquire(&bucket->lock);
+      while ((entry = QueuePairList_GetHead(bucket))) {
+         QueuePairList_RemoveEntry(entry);
+         VMCI_FreeKernelMem(entry, sizeof *entry);
+      }
+      VMCIQPLock_Release(&bucket->lock);
    }
-   
-   QueuePairList_Unlock();
+
    QueuePairList_Exit();
 }
 
@@ -536,7 +627,7 @@ QueuePairAllocHost(VMCIHandle handle,             // IN:
    }
 #endif // VMKERNEL
 
-   if (VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (QueuePairContextHasHandle(context, handle)) {
       VMCILOG((LGPFX"Context %u already attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_ALREADY_EXISTS;
@@ -869,11 +960,15 @@ errorDealloc:
 
 out:
    if (result >= VMCI_SUCCESS) {
+      VMCILockFlags lockFlags;
+
       ASSERT(entry);
       if (ent != NULL) {
          *ent = entry;
       }
+      VMCI_GrabLock(&context->lock, &lockFlags);
       VMCIHandleArray_AppendEntry(&context->queuePairArray, handle);
+      VMCI_ReleaseLock(&context->lock, lockFlags);
    }
    return result;
 }
@@ -933,7 +1028,7 @@ QueuePair_SetPageStore(VMCIHandle handle,             // IN:
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   if (!VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (!QueuePairContextHasHandle(context, handle)) {
       VMCILOG((LGPFX"Context %u not attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_NOT_FOUND;
@@ -1138,7 +1233,7 @@ QueuePair_Detach(VMCIHandle  handle,   // IN:
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   if (!VMCIHandleArray_HasEntry(context->queuePairArray, handle)) {
+   if (!QueuePairContextHasHandle(context, handle)) {
       VMCILOG((LGPFX"Context %u not attached to queue pair 0x%x:0x%x.\n",
                contextId, handle.context, handle.resource));
       result = VMCI_ERROR_NOT_FOUND;
@@ -1302,7 +1397,11 @@ QueuePair_Detach(VMCIHandle  handle,   // IN:
 
 out:
    if (result >= VMCI_SUCCESS && detach) {
+      VMCILockFlags lockFlags;
+
+      VMCI_GrabLock(&context->lock, &lockFlags);
       VMCIHandleArray_RemoveEntry(context->queuePairArray, handle);
+      VMCI_ReleaseLock(&context->lock, lockFlags);
    }
    return result;
 }
@@ -1470,7 +1569,7 @@ VMCIQueuePair_AllocPriv(VMCIHandle *handle,           // IN/OUT
    ASSERT(context);
 
    entry = NULL;
-   QueuePairList_Lock();
+   QueuePairList_Lock(*handle);
    result = QueuePairAllocHost(*handle, peer,
                                flags, privFlags, produceSize,
                                consumeSize, NULL,
@@ -1492,7 +1591,7 @@ VMCIQueuePair_AllocPriv(VMCIHandle *handle,           // IN/OUT
       VMCILOG((LGPFX"QueuePairAllocHost() failed: %d.\n", result));
    }
 
-   QueuePairList_Unlock();
+   QueuePairList_Unlock(*handle);
    VMCIContext_Release(context);
    return result;
 }
@@ -1527,9 +1626,9 @@ VMCIQueuePair_Detach(VMCIHandle handle) // IN
 
    context = VMCIContext_Get(VMCI_HOST_CONTEXT_ID);
 
-   QueuePairList_Lock();
+   QueuePairList_Lock(handle);
    result = QueuePair_Detach(handle, context, TRUE);
-   QueuePairList_Unlock();
+   QueuePairList_Unlock(handle);
 
    VMCIContext_Release(context);
    return result;
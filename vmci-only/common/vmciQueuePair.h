@@ -70,8 +70,8 @@ typedef struct QueuePairPageStore {
 
 int QueuePair_Init(void);
 void QueuePair_Exit(void);
-void QueuePairList_Lock(void);
-void QueuePairList_Unlock(void);
+void QueuePairList_Lock(VMCIHandle handle);
+void QueuePairList_Unlock(VMCIHandle handle);
 int QueuePair_Alloc(VMCIHandle handle, VMCIId peer, uint32 flags,
                     VMCIPrivilegeFlags privFlags,
                     uint64 produceSize, uint64 consumeSize,
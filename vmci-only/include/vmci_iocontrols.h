@@ -241,6 +241,8 @@ enum IOCTLCmd_VMCI {
 
    IOCTLCMD(FIRST2),
    IOCTLCMD(SET_NOTIFY) = IOCTLCMD(FIRST2), /* 1995 on Linux. */
+   IOCTLCMD(DATAGRAM_SEND_BATCH),           /* 1996 on Linux. */
+   IOCTLCMD(DATAGRAM_RECEIVE_BATCH),        /* 1997 on Linux. */
    IOCTLCMD(LAST2),
 };
 
@@ -448,6 +450,26 @@ typedef struct VMCIDatagramSendRecvInfo {
    int32  result;
 } VMCIDatagramSendRecvInfo;
 
+/*
+ * Used to send or receive several datagrams with one ioctl.  The datagrams
+ * are packed in the buffer at addr, each starting at an 8 byte aligned
+ * offset (see VMCI_DG_SIZE_ALIGNED).  On input len is the size of the buffer
+ * and numDGs the maximum number of datagrams to transfer, of which at most
+ * VMCI_DATAGRAM_BATCH_MAX are transferred per call; on output they are the
+ * bytes and datagrams actually transferred.  For sends, result is the
+ * outcome of the first datagram that failed, if any.
+ */
+
+#define VMCI_DATAGRAM_BATCH_MAX 32
+
+typedef struct VMCIDatagramBatchInfo {
+   VA64   addr;
+   uint32 len;
+   uint32 numDGs;
+   int32  result;
+   uint32 _pad;
+} VMCIDatagramBatchInfo;
+
 /* Used to create datagram endpoints in guest or host userlevel. */
 typedef struct VMCIDatagramCreateInfo {
    VMCIId      resourceID;
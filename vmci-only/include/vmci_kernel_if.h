@@ -111,6 +111,27 @@
   typedef PPN *VMCIPpnList; /* List of PPNs in produce/consume queue. */
 #endif // VMKERNEL
 
+/*
+ * Read-copy-update for read-mostly lookup structures.  Where the host
+ * kernel has RCU, readers don't take any lock and writers wait for a
+ * grace period before dropping what they unlinked.  Elsewhere VMCI_HAS_RCU
+ * is not defined and readers must take the writers' lock.
+ */
+
+#if defined(linux) && !defined(VMKERNEL) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 12)
+#  include <linux/rcupdate.h>
+#  define VMCI_HAS_RCU
+#  define VMCI_ReadLockRCU()             rcu_read_lock()
+#  define VMCI_ReadUnlockRCU()           rcu_read_unlock()
+#  define VMCI_SynchronizeRCU()          synchronize_rcu()
+#  define VMCI_DereferenceRCU(_p)        rcu_dereference(_p)
+#  define VMCI_AssignPointerRCU(_p, _v)  rcu_assign_pointer(_p, _v)
+#else
+#  define VMCI_DereferenceRCU(_p)        (_p)
+#  define VMCI_AssignPointerRCU(_p, _v)  ((_p) = (_v))
+#endif
+
 /* Callback needed for correctly waiting on events. */
 typedef int (*VMCIEventReleaseCB)(void *clientData);
 
@@ -226,6 +247,20 @@ int VMCIHost_ContextToHostVmID(VMCIHost *hostContext, VMCIHostVmID *hostVmID);
 
 void *VMCI_AllocKernelMem(size_t size, int flags);
 void VMCI_FreeKernelMem(void *ptr, size_t size);
+/*
+ * Memory for datagrams queued to a reader, which may come from a pool.
+ * It must be freed with the size it was allocated with.
+ */
+#if defined(linux) && !defined(VMKERNEL)
+int VMCI_DatagramMemInit(void);
+void VMCI_DatagramMemExit(void);
+void *VMCI_AllocDatagramMem(size_t size, int flags);
+void VMCI_FreeDatagramMem(void *ptr, size_t size);
+#else
+#  define VMCI_AllocDatagramMem(_size, _flags) \
+      VMCI_AllocKernelMem(_size, _flags)
+#  define VMCI_FreeDatagramMem(_ptr, _size) VMCI_FreeKernelMem(_ptr, _size)
+#endif
 VMCIBuffer VMCI_AllocBuffer(size_t size, int flags);
 void *VMCI_MapBuffer(VMCIBuffer buf);
 void VMCI_ReleaseBuffer(void *ptr);
@@ -278,7 +278,7 @@ AddPointer(Atomic_uint64 *var, // IN:
    *
    * The version of the VMCIQueue data structure which is provided by
    * the VMCI kernel module is protected by the VMCI
-   * QueuePairList_Lock and the VMCI QueuePairList_FindEntry()
+   * QueuePairList_Lock of its handle and the VMCI QueuePairList_FindEntry()
    * function.  Therefore, host-side clients shouldn't be able to
    * access the structure after it's gone.  And, the memory the
    * queueHeaderPtr points to is torn down (and freed) after the entry
@@ -298,11 +298,15 @@ AddPointer(Atomic_uint64 *var, // IN:
        *
        * Also, the queue contents are managed by an array of struct
        * pages which are managed elsewhere.  So, this structure simply
-       * contains the address of that array of struct pages.
+       * contains the address of that array of struct pages.  If the
+       * queue could be mapped contiguously in the kernel, vaddr is the
+       * address of its contents and the pages need not be mapped one
+       * by one.
        */
       typedef struct VMCIQueue {
 	 VMCIQueueHeader *queueHeaderPtr;
 	 struct page **page;
+	 void *vaddr;
       } VMCIQueue;
 #  elif defined __APPLE__
       /*
@@ -254,8 +254,13 @@ init_module(void)
 
    DriverLog_Init("/dev/vmci");
 
+   if (VMCI_DatagramMemInit() < VMCI_SUCCESS) {
+      return -ENOMEM;
+   }
+
    /* Initialize VMCI core and APIs. */
    if (VMCI_Init() < VMCI_SUCCESS) {
+      VMCI_DatagramMemExit();
       return -ENOMEM;
    }
 
@@ -327,6 +332,7 @@ cleanup_module(void)
    unregister_ioctl32_handlers();
 
    VMCI_Cleanup();
+   VMCI_DatagramMemExit();
 
    /*
     * XXX smp race?
@@ -703,7 +709,7 @@ LinuxDriver_Ioctl(struct inode *inode,
 	 break;
       }
 
-      dg = VMCI_AllocKernelMem(sendInfo.len, VMCI_MEMORY_NORMAL);
+      dg = VMCI_AllocDatagramMem(sendInfo.len, VMCI_MEMORY_NORMAL);
       if (dg == NULL) {
          Log("VMCI: Cannot allocate memory to dispatch datagram.\n");
          retval = -ENOMEM;
@@ -713,11 +719,18 @@ LinuxDriver_Ioctl(struct inode *inode,
       retval = copy_from_user(dg, (char *)(VA)sendInfo.addr, sendInfo.len);
       if (retval != 0) {
          Log("VMCI: Error getting datagram: %d\n", retval);
-         VMCI_FreeKernelMem(dg, sendInfo.len);
+         VMCI_FreeDatagramMem(dg, sendInfo.len);
          retval = -EFAULT;
          break;
       }
 
+      if (VMCI_DG_SIZE(dg) > sendInfo.len) {
+         Warning("VMCI: datagram payload larger than buffer.\n");
+         VMCI_FreeDatagramMem(dg, sendInfo.len);
+         retval = -EINVAL;
+         break;
+      }
+
       VMCI_DEBUG_LOG(("VMCI: Datagram dst handle 0x%"FMT64"x, "
 	        "src handle 0x%"FMT64"x, payload size %"FMT64"u.\n",
                 dg->dstHandle, dg->srcHandle, dg->payloadSize));
@@ -731,8 +744,18 @@ LinuxDriver_Ioctl(struct inode *inode,
 	 cid = VMCI_HOST_CONTEXT_ID;
       }
       ASSERT(cid != VMCI_INVALID_ID);
-      sendInfo.result = VMCIDatagram_Dispatch(cid, dg);
-      VMCI_FreeKernelMem(dg, sendInfo.len);
+
+      /*
+       * In the common case the buffer holds exactly the datagram, and it
+       * is handed over to be queued to the destination without a copy.
+       */
+
+      if (VMCI_DG_SIZE(dg) == sendInfo.len) {
+         sendInfo.result = VMCIDatagram_DispatchOwned(cid, dg);
+      } else {
+         sendInfo.result = VMCIDatagram_Dispatch(cid, dg);
+         VMCI_FreeDatagramMem(dg, sendInfo.len);
+      }
       retval = copy_to_user((void *)ioarg, &sendInfo, sizeof sendInfo);
       break;
    }
@@ -771,7 +794,7 @@ LinuxDriver_Ioctl(struct inode *inode,
 	 ASSERT(dg);
 	 retval = copy_to_user((void *) ((uintptr_t) recvInfo.addr), dg,
 			       VMCI_DG_SIZE(dg));
-	 VMCI_FreeKernelMem(dg, VMCI_DG_SIZE(dg));
+	 VMCI_FreeDatagramMem(dg, VMCI_DG_SIZE(dg));
 	 if (retval != 0) {
 	    break;
 	 }
@@ -780,6 +803,170 @@ LinuxDriver_Ioctl(struct inode *inode,
       break;
    }
 
+   case IOCTL_VMCI_DATAGRAM_SEND_BATCH: {
+      VMCIDatagramBatchInfo batchInfo;
+      VMCIDatagram hdr;
+      VMCIId cid;
+      uint32 numDGs;
+      uint32 offset = 0;
+      uint32 numSent = 0;
+
+      if (vmciLinux->ctType != VMCIOBJ_DATAGRAM_PROCESS &&
+	  vmciLinux->ctType != VMCIOBJ_CONTEXT) {
+         Warning("VMCI: Ioctl %d only valid for context and process datagram "
+		 "handle.\n", iocmd);
+         retval = -EINVAL;
+         break;
+      }
+
+      retval = copy_from_user(&batchInfo, (void *) ioarg, sizeof batchInfo);
+      if (retval) {
+         Warning("VMCI: copy_from_user failed.\n");
+         retval = -EFAULT;
+         break;
+      }
+
+      if (vmciLinux->ctType == VMCIOBJ_CONTEXT) {
+	 ASSERT(vmciLinux->ct.context);
+	 cid = VMCIContext_GetId(vmciLinux->ct.context);
+      } else {
+	 /* XXX Will change to dynamic id when we make host context id random. */
+	 cid = VMCI_HOST_CONTEXT_ID;
+      }
+      ASSERT(cid != VMCI_INVALID_ID);
+
+      /*
+       * Each datagram is handed over to its destination without a copy.
+       * Stop at the first one that is malformed or fails to dispatch and
+       * report how far we got.
+       */
+
+      batchInfo.result = VMCI_SUCCESS;
+      numDGs = MIN(batchInfo.numDGs, VMCI_DATAGRAM_BATCH_MAX);
+      while (numSent < numDGs && offset < batchInfo.len) {
+         char *uaddr = (char *)(VA)batchInfo.addr + offset;
+         VMCIDatagram *dg;
+         size_t dgSize;
+         int result;
+
+         if (batchInfo.len - offset < sizeof hdr ||
+             copy_from_user(&hdr, uaddr, sizeof hdr) != 0 ||
+             hdr.payloadSize > VMCI_MAX_DG_PAYLOAD_SIZE ||
+             VMCI_DG_SIZE(&hdr) > batchInfo.len - offset) {
+            batchInfo.result = VMCI_ERROR_INVALID_ARGS;
+            break;
+         }
+
+         dgSize = VMCI_DG_SIZE(&hdr);
+         dg = VMCI_AllocDatagramMem(dgSize, VMCI_MEMORY_NORMAL);
+         if (dg == NULL) {
+            batchInfo.result = VMCI_ERROR_NO_MEM;
+            break;
+         }
+
+         /* The header is read again, so check it hasn't changed since. */
+         if (copy_from_user(dg, uaddr, dgSize) != 0 ||
+             VMCI_DG_SIZE(dg) != dgSize) {
+            VMCI_FreeDatagramMem(dg, dgSize);
+            batchInfo.result = VMCI_ERROR_INVALID_ARGS;
+            break;
+         }
+
+         result = VMCIDatagram_DispatchOwned(cid, dg);
+         if (result < VMCI_SUCCESS) {
+            batchInfo.result = result;
+            break;
+         }
+         numSent++;
+         offset += VMCI_DG_SIZE_ALIGNED(&hdr);
+      }
+
+      batchInfo.numDGs = numSent;
+      batchInfo.len = MIN(offset, batchInfo.len);
+      retval = copy_to_user((void *)ioarg, &batchInfo, sizeof batchInfo);
+      if (retval) {
+         retval = -EFAULT;
+      }
+      break;
+   }
+
+   case IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH: {
+      VMCIDatagramBatchInfo batchInfo;
+      VMCIDatagram *dgs[VMCI_DATAGRAM_BATCH_MAX];
+      size_t bufSize;
+      uint32 numDGs;
+      uint32 offset = 0;
+      uint32 i;
+
+      if (vmciLinux->ctType != VMCIOBJ_DATAGRAM_PROCESS &&
+	  vmciLinux->ctType != VMCIOBJ_CONTEXT) {
+         Warning("VMCI: Ioctl %d only valid for context and process datagram "
+		 "handle.\n", iocmd);
+         retval = -EINVAL;
+         break;
+      }
+
+      retval = copy_from_user(&batchInfo, (void *) ioarg, sizeof batchInfo);
+      if (retval) {
+         Warning("VMCI: copy_from_user failed.\n");
+         retval = -EFAULT;
+         break;
+      }
+
+      if (batchInfo.numDGs == 0) {
+         retval = -EINVAL;
+         break;
+      }
+
+      bufSize = batchInfo.len;
+      numDGs = MIN(batchInfo.numDGs, VMCI_DATAGRAM_BATCH_MAX);
+      if (vmciLinux->ctType == VMCIOBJ_CONTEXT) {
+	 ASSERT(vmciLinux->ct.context);
+	 batchInfo.result = VMCIContext_DequeueDatagrams(vmciLinux->ct.context,
+                                                         &bufSize, &numDGs,
+                                                         dgs);
+      } else {
+	 ASSERT(vmciLinux->ctType == VMCIOBJ_DATAGRAM_PROCESS);
+	 ASSERT(vmciLinux->ct.dgmProc);
+	 batchInfo.result =
+            VMCIDatagramProcess_ReadCalls(vmciLinux->ct.dgmProc, &bufSize,
+                                          &numDGs, dgs);
+      }
+      if (batchInfo.result < VMCI_SUCCESS) {
+         /* On VMCI_ERROR_NO_MEM, len tells the size needed. */
+         batchInfo.numDGs = 0;
+         batchInfo.len = batchInfo.result == VMCI_ERROR_NO_MEM ?
+                         (uint32)bufSize : 0;
+      } else {
+         /*
+          * The datagrams are off the queue at this point, so copy out all
+          * of them even if one copy faults; the whole ioctl fails then.
+          */
+
+         for (i = 0; i < numDGs; i++) {
+            size_t dgSize = VMCI_DG_SIZE(dgs[i]);
+
+            if (retval == 0 &&
+                copy_to_user((char *)(VA)batchInfo.addr + offset, dgs[i],
+                             dgSize) != 0) {
+               retval = -EFAULT;
+            }
+            offset += VMCI_DG_SIZE_ALIGNED(dgs[i]);
+            VMCI_FreeDatagramMem(dgs[i], dgSize);
+         }
+         if (retval != 0) {
+            break;
+         }
+         batchInfo.numDGs = numDGs;
+         batchInfo.len = (uint32)bufSize;
+      }
+      retval = copy_to_user((void *)ioarg, &batchInfo, sizeof batchInfo);
+      if (retval) {
+         retval = -EFAULT;
+      }
+      break;
+   }
+
    case IOCTL_VMCI_QUEUEPAIR_ALLOC: {
       VMCIQueuePairAllocInfo queuePairAllocInfo;
       VMCIQueuePairAllocInfo *info = (VMCIQueuePairAllocInfo *)ioarg;
@@ -800,7 +987,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       }
 
       cid = VMCIContext_GetId(vmciLinux->ct.context);
-      QueuePairList_Lock();
+      QueuePairList_Lock(queuePairAllocInfo.handle);
 
       {
 	 QueuePairPageStore pageStore = { TRUE,
@@ -832,7 +1019,7 @@ LinuxDriver_Ioctl(struct inode *inode,
          }
       }
 
-      QueuePairList_Unlock();
+      QueuePairList_Unlock(queuePairAllocInfo.handle);
       break;
    }
 
@@ -891,7 +1078,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       retval = copy_to_user(&info->result, &result, sizeof result);
       if (retval == 0) {
          cid = VMCIContext_GetId(vmciLinux->ct.context);
-         QueuePairList_Lock();
+         QueuePairList_Lock(pageFileInfo.handle);
 
          {
             QueuePairPageStore pageStore = { TRUE,
@@ -906,7 +1093,7 @@ LinuxDriver_Ioctl(struct inode *inode,
                                             &pageStore,
                                             vmciLinux->ct.context);
          }
-         QueuePairList_Unlock();
+         QueuePairList_Unlock(pageFileInfo.handle);
 
          if (result < VMCI_SUCCESS) {
             Log("VMCI: IOCTL_VMCI_QUEUEPAIR_SETPAGEFILE cid = %u result = %d.\n",
@@ -964,7 +1151,7 @@ LinuxDriver_Ioctl(struct inode *inode,
       }
 
       cid = VMCIContext_GetId(vmciLinux->ct.context);
-      QueuePairList_Lock();
+      QueuePairList_Lock(detachInfo.handle);
       result = QueuePair_Detach(detachInfo.handle, vmciLinux->ct.context,
                                 FALSE); /* Probe detach operation. */
       Log("VMCI: IOCTL_VMCI_QUEUEPAIR_DETACH cid = %u result = %d.\n",
@@ -990,7 +1177,7 @@ LinuxDriver_Ioctl(struct inode *inode,
          }
       }
 
-      QueuePairList_Unlock();
+      QueuePairList_Unlock(detachInfo.handle);
       break;
    }
 
@@ -471,6 +471,178 @@ VMCI_FreeKernelMem(void *ptr,   // IN:
 }
 
 
+/*
+ * Datagrams that get queued for a reader come from slab caches sized for
+ * the common datagram sizes, larger ones from kmalloc.  The cache is
+ * picked by size, so a datagram must be freed with the size it was
+ * allocated with.
+ */
+
+static const size_t vmciDgCacheSize[] = { 256, 1024, 4096 };
+static const char *vmciDgCacheName[] = { "vmci_dg_256", "vmci_dg_1024",
+                                         "vmci_dg_4096" };
+static compat_kmem_cache *vmciDgCache[ARRAYSIZE(vmciDgCacheSize)];
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIDatagramMemCache --
+ *
+ *      Returns the slab cache for datagrams of the given size.
+ *
+ * Results:
+ *      The cache, or NULL if the size is served by kmalloc.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE compat_kmem_cache *
+VMCIDatagramMemCache(size_t size) // IN:
+{
+   unsigned i;
+
+   for (i = 0; i < ARRAYSIZE(vmciDgCacheSize); i++) {
+      if (size <= vmciDgCacheSize[i]) {
+         return vmciDgCache[i];
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_DatagramMemInit --
+ *
+ *      Creates the datagram slab caches.
+ *
+ * Results:
+ *      VMCI_SUCCESS or VMCI_ERROR_NO_MEM.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCI_DatagramMemInit(void)
+{
+   unsigned i;
+
+   for (i = 0; i < ARRAYSIZE(vmciDgCacheSize); i++) {
+      vmciDgCache[i] = compat_kmem_cache_create(vmciDgCacheName[i],
+                                                vmciDgCacheSize[i],
+                                                0, 0, NULL);
+      if (vmciDgCache[i] == NULL) {
+         VMCI_DatagramMemExit();
+         return VMCI_ERROR_NO_MEM;
+      }
+   }
+
+   return VMCI_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_DatagramMemExit --
+ *
+ *      Destroys the datagram slab caches.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCI_DatagramMemExit(void)
+{
+   unsigned i;
+
+   for (i = 0; i < ARRAYSIZE(vmciDgCacheSize); i++) {
+      if (vmciDgCache[i] != NULL) {
+         kmem_cache_destroy(vmciDgCache[i]);
+         vmciDgCache[i] = NULL;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_AllocDatagramMem --
+ *
+ *      Allocate memory for a datagram of the given size.
+ *
+ * Results:
+ *      The address allocated or NULL on error.
+ *
+ * Side effects:
+ *      memory is malloced
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+VMCI_AllocDatagramMem(size_t size, // IN:
+                      int flags)   // IN:
+{
+   compat_kmem_cache *cache = VMCIDatagramMemCache(size);
+
+   if (cache == NULL) {
+      return VMCI_AllocKernelMem(size, flags);
+   }
+   if ((flags & VMCI_MEMORY_ATOMIC) != 0) {
+      return kmem_cache_alloc(cache, GFP_ATOMIC);
+   }
+
+   return kmem_cache_alloc(cache, GFP_KERNEL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_FreeDatagramMem --
+ *
+ *      Free memory allocated by VMCI_AllocDatagramMem.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCI_FreeDatagramMem(void *ptr,   // IN:
+                     size_t size) // IN: As passed to VMCI_AllocDatagramMem
+{
+   compat_kmem_cache *cache = VMCIDatagramMemCache(size);
+
+   if (cache == NULL) {
+      VMCI_FreeKernelMem(ptr, size);
+   } else if (ptr != NULL) {
+      kmem_cache_free(cache, ptr);
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1107,7 +1279,8 @@ VMCI_PopulatePPNList(uint8 *callBuf,       // OUT:
  *
  * __VMCIMemcpyToQueue --
  *
- *      Copies from a given buffer or iovector to a VMCI Queue.  Uses
+ *      Copies from a given buffer or iovector to a VMCI Queue.  If the queue
+ *      is mapped contiguously this is a single copy, otherwise uses
  *      kmap()/kunmap() to dynamically map/unmap required portions of the queue
  *      by traversing the offset -> page translation structure for the queue.
  *      Assumes that offset + size does not wrap around in the queue.
@@ -1130,6 +1303,18 @@ __VMCIMemcpyToQueue(VMCIQueue *queue,   // OUT:
 {
    size_t bytesCopied = 0;
 
+#ifndef VMX86_TOOLS
+   if (queue->vaddr != NULL) {
+      uint8 *va = (uint8 *)queue->vaddr + queueOffset;
+
+      if (isIovec) {
+         return memcpy_fromiovec(va, (struct iovec *)src, size);
+      }
+      memcpy(va, src, size);
+      return 0;
+   }
+#endif
+
    while (bytesCopied < size) {
       uint64 pageIndex = (queueOffset + bytesCopied) / PAGE_SIZE;
       size_t pageOffset = (queueOffset + bytesCopied) & (PAGE_SIZE - 1);
@@ -1171,7 +1356,8 @@ __VMCIMemcpyToQueue(VMCIQueue *queue,   // OUT:
  *
  * __VMCIMemcpyFromQueue --
  *
- *      Copies to a given buffer or iovector from a VMCI Queue.  Uses
+ *      Copies to a given buffer or iovector from a VMCI Queue.  If the queue
+ *      is mapped contiguously this is a single copy, otherwise uses
  *      kmap()/kunmap() to dynamically map/unmap required portions of the queue
  *      by traversing the offset -> page translation structure for the queue.
  *      Assumes that offset + size does not wrap around in the queue.
@@ -1194,6 +1380,18 @@ __VMCIMemcpyFromQueue(void *dest,             // OUT:
 {
    size_t bytesCopied = 0;
 
+#ifndef VMX86_TOOLS
+   if (queue->vaddr != NULL) {
+      const uint8 *va = (const uint8 *)queue->vaddr + queueOffset;
+
+      if (isIovec) {
+         return memcpy_toiovec((struct iovec *)dest, (uint8 *)va, size);
+      }
+      memcpy(dest, va, size);
+      return 0;
+   }
+#endif
+
    while (bytesCopied < size) {
       uint64 pageIndex = (queueOffset + bytesCopied) / PAGE_SIZE;
       size_t pageOffset = (queueOffset + bytesCopied) & (PAGE_SIZE - 1);
@@ -1395,6 +1593,75 @@ VMCIWellKnownID_AllowMap(VMCIId wellKnownID,           // IN:
 
 #ifndef VMX86_TOOLS
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMCIHostMapQueue --
+ *       Maps the pages of a queue, header page first, into one contiguous
+ *       kernel virtual range so that copies to and from the queue need
+ *       not map each page in turn.  If that fails, e.g. because vmalloc
+ *       space is short, only the header page is mapped and the contents
+ *       are mapped page by page as they are accessed.
+ *
+ * Results:
+ *       None.
+ *
+ * Side Effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VMCIHostMapQueue(struct page **pages, // IN
+                 uint64 numPages,     // IN: including the header page
+                 VMCIQueue *queue)    // OUT
+{
+   void *va = vmap(pages, (unsigned int)numPages, VM_MAP, PAGE_KERNEL);
+
+   if (va != NULL) {
+      queue->queueHeaderPtr = va;
+      queue->vaddr = (uint8 *)va + PAGE_SIZE;
+   } else {
+      Log("vmap of %"FMT64"u queue pages failed, mapping on demand.\n",
+          numPages);
+      queue->queueHeaderPtr = kmap(pages[0]);
+      queue->vaddr = NULL;
+   }
+   queue->page = &pages[1];
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMCIHostUnmapQueue --
+ *       Undoes VMCIHostMapQueue.
+ *
+ * Results:
+ *       None.
+ *
+ * Side Effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VMCIHostUnmapQueue(struct page **pages, // IN
+                   VMCIQueue *queue)    // IN/OUT
+{
+   if (queue->vaddr != NULL) {
+      vunmap(queue->queueHeaderPtr);
+      queue->vaddr = NULL;
+   } else {
+      kunmap(pages[0]);
+   }
+}
+#endif
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1478,10 +1745,10 @@ VMCIHost_GetUserMemory(PageStoreAttachInfo *attach,      // IN/OUT
    }
 
    if (err == VMCI_SUCCESS) {
-      produceQ->queueHeaderPtr = kmap(attach->producePages[0]);
-      produceQ->page = &attach->producePages[1];
-      consumeQ->queueHeaderPtr = kmap(attach->consumePages[0]);
-      consumeQ->page = &attach->consumePages[1];
+      VMCIHostMapQueue(attach->producePages, attach->numProducePages,
+                       produceQ);
+      VMCIHostMapQueue(attach->consumePages, attach->numConsumePages,
+                       consumeQ);
    }
 
 out:
@@ -1598,8 +1865,8 @@ VMCIHost_ReleaseUserMemory(PageStoreAttachInfo *attach,      // IN/OUT
    ASSERT(attach->producePages);
    ASSERT(attach->consumePages);
 
-   kunmap(attach->producePages[0]);
-   kunmap(attach->consumePages[0]);
+   VMCIHostUnmapQueue(attach->producePages, produceQ);
+   VMCIHostUnmapQueue(attach->consumePages, consumeQ);
 
    for (i = 0; i < attach->numProducePages; i++) {
       ASSERT(attach->producePages[i]);
@@ -65,9 +65,7 @@
 
 EXTERN int   HostIF_Init(VMDriver *vm);
 EXTERN MPN   HostIF_LookupUserMPN(VMDriver *vm, VA64 uAddr);
-#if defined(__linux__) && defined(VMX86_DEVEL) && defined(VM_X86_64)
 EXTERN MPN   HostIF_LookupLargeMPN(void *addr);
-#endif
 EXTERN void *HostIF_MapCrossPage(VMDriver *vm, VA64 uAddr);
 EXTERN void  HostIF_InitFP(VMDriver *vm);
 #if defined __APPLE__
@@ -118,8 +116,12 @@ EXTERN void HostIF_UnmapUserMem(struct page **page);
 #endif
 
 EXTERN MPN   HostIF_LockPage(VMDriver *vm, VA64 uAddr, Bool allowMultipleMPNsPerVA);
+EXTERN int   HostIF_LockPages(VMDriver *vm, VA64 uAddr, unsigned numPages,
+                              Bool allowMultipleMPNsPerVA, int32 *results);
 EXTERN int   HostIF_UnlockPage(VMDriver *vm, VA64 uAddr);
 EXTERN int   HostIF_UnlockPageByMPN(VMDriver *vm, MPN mpn, VA64 uAddr);
+EXTERN MPN   HostIF_LockLargePage(VMDriver *vm, VA64 uAddr);
+EXTERN int   HostIF_UnlockLargePage(VMDriver *vm, VA64 uAddr);
 EXTERN Bool  HostIF_IsLockedByMPN(VMDriver *vm, MPN mpn);
 EXTERN void  HostIF_FreeAllResources(VMDriver *vm);
 #if __linux__
@@ -151,7 +153,9 @@ EXTERN int   HostIF_SemaphoreWait(VMDriver *vm,
                                   Vcpuid vcpuid,
                                   uint32 *args);
 
-EXTERN int   HostIF_SemaphoreSignal(uint32 *args);
+EXTERN int   HostIF_SemaphoreSignal(VMDriver *vm, uint32 *args);
+EXTERN int   HostIF_SemaphoreRegister(VMDriver *vm, Vcpuid vcpuid,
+                                      int waitFD, int signalFD);
 
 EXTERN void  HostIF_SemaphoreForceWakeup(VMDriver *vm, Vcpuid vcpuid);
 EXTERN Bool  HostIF_IPI(VMDriver *vm, VCPUSet vcs, Bool all, Bool *didBroadcast);
@@ -195,6 +199,16 @@ HostIF_GetLockedPageList(VMDriver *vm, VA64 uAddr, unsigned int numPages);
 
 EXTERN int HostIF_ReadPage(MPN mpn, VA64 addr, Bool kernelBuffer);
 EXTERN int HostIF_WritePage(MPN mpn, VA64 addr, Bool kernelBuffer);
+
+EXTERN int HostIF_COWShare(VMDriver *vm, COWShareInfo *info,
+                           unsigned int *numNew);
+EXTERN MPN HostIF_COWGetZeroMPN(void);
+EXTERN int HostIF_COWIncZeroRef(VMDriver *vm, BPN bpn);
+EXTERN int HostIF_COWCopyPage(VMDriver *vm, BPN bpn, MPN mpn);
+EXTERN void HostIF_COWCheck(VMDriver *vm, COWCheckInfo *info);
+EXTERN void HostIF_COWUpdateHints(VMDriver *vm, COWHintInfo *info);
+EXTERN void HostIF_COWGetStats(VMMemCOWInfo *info);
+EXTERN void HostIF_COWCleanup(void);
 #if defined __APPLE__
 // There is no need for a fast clock lock on Mac OS.
 #define HostIF_FastClockLock(_callerID) do {} while (0)
@@ -204,6 +218,7 @@ EXTERN void HostIF_FastClockLock(int callerID);
 EXTERN void HostIF_FastClockUnlock(int callerID);
 #endif
 EXTERN int HostIF_SetFastClockRate(unsigned rate);
+EXTERN void HostIF_FastClockArm(uint32 pCPU, VmAbsoluteTS expiry);
 
 EXTERN MPN HostIF_AllocMachinePage(void);
 EXTERN void HostIF_FreeMachinePage(MPN mpn);
@@ -25,15 +25,16 @@
  * --
  *
  * Track memory using a 3-level directory, to keep allocations to one
- * page in size. The first level is inlined with the MemTrack struct
- * and a new page is allocated for each directory in the second level,
- * as needed. The third level packs in as many MemTrackEntry structs
- * on a single page as possible.
+ * page in size. The first level is a page directory hanging off the
+ * MemTrack struct: a root page of pointers to pages of directory
+ * pointers, which grows a page at a time and is never reallocated; a
+ * new page is allocated for each directory in the second level, as
+ * needed. The third level packs in as many MemTrackEntry structs on a
+ * single page as possible.
  *
  * Optionally use a 2-level directory on systems that prefer larger
- * contiguous allocations. In this case we allow the first level
- * allocation to be larger than 1 page (its size will depend on the
- * maximum number of tracked pages, currently set to 4GB).
+ * contiguous allocations. In this case the first level points
+ * directly at pages of entries.
  *
  *   MemTrack      MemTrackDir1        MemTrackDir2      MemTrackDir3
  *   (Handle)                           (Optional)
@@ -51,7 +52,7 @@
  * \----------/  \ | ...      |        | ...      |
  *                \| Dir[N]   |-----   | Dir[N+N] |           .
  *                 \----------/    |   \----------/           .
- *   MEMTRACK_DIR1_ENTRIES         |                          .
+ *   (page directory)              |                          .
  *                                 --->/----------\
  *                                     | ...      |
  *                                     |          |
@@ -63,14 +64,23 @@
  *                                                       | Entry[M] |
  *                                                       \----------/
  *
- * We also keep a simple chaining hash table of entries hashed on
- * the VPN, for quick lookup. A separate hash table hashed on the MPN
- * exists as well, but this is only used in debug builds.
+ * Entries are indexed by VPN in an open-addressing hash table with
+ * linear probing. Each slot holds the key next to the entry pointer,
+ * so a probe sequence touches only the table until it hits; the keys
+ * are run through a 64-bit mix first, since guest memory is mostly
+ * long runs of consecutive VPNs. The table is kept in pages found
+ * through a page directory like the first level above, and doubled
+ * once it is MEMTRACK_HT_LOAD_NUM / MEMTRACK_HT_LOAD_DEN full. The
+ * rehash into the doubled table is incremental: every later insertion
+ * moves a few slots of the old table, and lookups check the old table
+ * until it is drained, so no single insertion pays for the whole
+ * table. A second table keyed on the MPN exists as well, in debug
+ * builds and on Linux hosts (see memtrack.h).
  *
- * This tracker does not allow pages to be removed. If, in the future,
- * we have a use case for removing MPNs from the tracker, a simple
- * MemTrackEntry recycle scheme can be implemented at the cost of an
- * additional pointer per MemTrackEntry instance.
+ * This tracker does not allow pages to be removed, so the hash tables
+ * need no tombstones. If, in the future, we have a use case for
+ * removing MPNs from the tracker, a simple MemTrackEntry recycle
+ * scheme can be implemented.
  */
 
 #if defined(__linux__)
@@ -87,16 +97,11 @@
 #endif
 
 #include "vmware.h"
+#include "vm_basic_asm.h"
 #include "hostif.h"
 
 #include "memtrack.h"
 
-/*
- * Modify this value to increase the maximum number of tracked pages
- * per MemTrack instance.
- */
-#define MEMTRACK_MAX_TRACKED        MBYTES_2_PAGES(4096)
-
 /*
  * Linux uses a 3-level directory, because we want to keep allocations
  * to a single page.
@@ -111,13 +116,41 @@
 #else
 #define MEMTRACK_DIR2_ENTRIES       (1)
 #endif
-#define MEMTRACK_DIR1_ENTRIES       CEILING(MEMTRACK_MAX_TRACKED,        \
-                                            (MEMTRACK_DIR2_ENTRIES *     \
-                                             MEMTRACK_DIR3_ENTRIES))
 
-#define MEMTRACK_HT_SIZE            (16384)
-#define MEMTRACK_HT_ENTRIES         (PAGE_SIZE / sizeof (void *))
-#define MEMTRACK_HT_PAGES           (MEMTRACK_HT_SIZE / MEMTRACK_HT_ENTRIES)
+/*
+ * Page directories: a root page of pointers to leaf pages of pointers,
+ * indexed up to MEMTRACK_PD_MAX.
+ */
+#define MEMTRACK_PD_ENTRIES         (PAGE_SIZE / sizeof (void *))
+#define MEMTRACK_PD_MAX             (MEMTRACK_PD_ENTRIES * MEMTRACK_PD_ENTRIES)
+
+/*
+ * Hash table geometry. Tables start at MEMTRACK_HT_INIT_PAGES pages and
+ * are doubled when the load factor would exceed LOAD_NUM / LOAD_DEN.
+ * While the old table is drained, each insertion moves
+ * MEMTRACK_HT_MIGRATE_SLOTS of its slots; anything above 4/3 finishes
+ * the drain before the new table fills up.
+ */
+#define MEMTRACK_HT_INIT_PAGES      (4)
+#define MEMTRACK_HT_LOAD_NUM        (3)
+#define MEMTRACK_HT_LOAD_DEN        (4)
+#define MEMTRACK_HT_MIGRATE_SLOTS   (8)
+
+/*
+ * Lookup statistics cost a write per lookup and per probe, so they
+ * are only kept in stats builds.
+ */
+#if defined(VMX86_STATS)
+#define MEMTRACK_STATS
+#endif
+
+typedef struct MemTrackPDPage {
+   void             *ptr[MEMTRACK_PD_ENTRIES];
+} MemTrackPDPage;
+
+typedef struct MemTrackPD {
+   MemTrackPDPage   *root;          /* NULL until the first page is added. */
+} MemTrackPD;
 
 typedef struct MemTrackDir3 {
    MemTrackEntry     entries[MEMTRACK_DIR3_ENTRIES];
@@ -131,20 +164,34 @@ typedef struct MemTrackDir2 {
 typedef struct MemTrackDir3 MemTrackDir2;
 #endif
 
-typedef struct MemTrackDir1 {
-   MemTrackDir2     *dir[MEMTRACK_DIR1_ENTRIES];
-} MemTrackDir1;
+typedef MemTrackPD MemTrackDir1;
+
+typedef uint64 MemTrackHTKey;
+
+typedef struct MemTrackHTSlot {
+   MemTrackHTKey     key;
+   MemTrackEntry    *ent;           /* NULL if the slot is free. */
+} MemTrackHTSlot;
+
+#define MEMTRACK_HT_ENTRIES         (PAGE_SIZE / sizeof (MemTrackHTSlot))
 
 typedef struct MemTrackHTPage {
-   MemTrackEntry    *entries[MEMTRACK_HT_ENTRIES];
+   MemTrackHTSlot    slots[MEMTRACK_HT_ENTRIES];
 } MemTrackHTPage;
 
+typedef struct MemTrackHTTable {
+   unsigned          numPages;      /* Table pages, a power of 2; 0 if none. */
+   unsigned          mask;          /* Number of slots - 1. */
+   unsigned          numUsed;       /* Occupied slots. */
+   MemTrackPD        pages;
+} MemTrackHTTable;
+
 typedef struct MemTrackHT {
-   MemTrackHTPage   *pages[MEMTRACK_HT_PAGES];
+   MemTrackHTTable   cur;           /* Table insertions go to. */
+   MemTrackHTTable   old;           /* Table being drained into cur. */
+   unsigned          migrateIdx;    /* Next slot of old to move. */
 } MemTrackHT;
 
-typedef uint64 MemTrackHTKey;
-
 typedef struct MemTrack {
    unsigned          numPages;      /* Number of pages tracked. */
    MemTrackDir1      dir1;          /* First level directory. */
@@ -152,8 +199,99 @@ typedef struct MemTrack {
 #if defined(MEMTRACK_MPN_LOOKUP)
    MemTrackHT        mpnHashTable;  /* MPN to entry hashtable. */
 #endif
+#if defined(MEMTRACK_STATS)
+   uint64            lookups;       /* VPN lookups performed. */
+   uint64            probes;        /* Slots examined by those lookups. */
+#endif
 } MemTrack;
 
+static INLINE void *
+MemTrackAllocPage(void)
+{
+   void *ptr = HostIF_AllocPage();
+   if (ptr != NULL) {
+      memset(ptr, 0, PAGE_SIZE);
+   }
+   return ptr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MEMTRACK_PD_SLOT --
+ * MemTrackPDGet --
+ * MemTrackPDGrow --
+ * MemTrackPDFree --
+ *
+ *      Page directory accessors. MEMTRACK_PD_SLOT is the slot for idx,
+ *      which must have been made available with MemTrackPDGrow.
+ *      MemTrackPDGet returns NULL for slots that were never made
+ *      available. MemTrackPDFree frees the directory pages only, not
+ *      what the slots point to.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define MEMTRACK_PD_SLOT(_pd, _idx)                                    \
+   (((MemTrackPDPage *)(_pd)->root->ptr[(_idx) / MEMTRACK_PD_ENTRIES])  \
+       ->ptr[(_idx) % MEMTRACK_PD_ENTRIES])
+
+static INLINE void *
+MemTrackPDGet(const MemTrackPD *pd,  // IN
+              unsigned idx)          // IN
+{
+   MemTrackPDPage *leaf;
+
+   if (pd->root == NULL || idx >= MEMTRACK_PD_MAX) {
+      return NULL;
+   }
+   leaf = pd->root->ptr[idx / MEMTRACK_PD_ENTRIES];
+   return leaf == NULL ? NULL : leaf->ptr[idx % MEMTRACK_PD_ENTRIES];
+}
+
+static Bool
+MemTrackPDGrow(MemTrackPD *pd,  // IN/OUT
+               unsigned idx)    // IN
+{
+   unsigned leafIdx = idx / MEMTRACK_PD_ENTRIES;
+
+   if (idx >= MEMTRACK_PD_MAX) {
+      return FALSE;
+   }
+   if (pd->root == NULL) {
+      pd->root = MemTrackAllocPage();
+      if (pd->root == NULL) {
+         return FALSE;
+      }
+   }
+   if (pd->root->ptr[leafIdx] == NULL) {
+      pd->root->ptr[leafIdx] = MemTrackAllocPage();
+      if (pd->root->ptr[leafIdx] == NULL) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+static void
+MemTrackPDFree(MemTrackPD *pd)  // IN/OUT
+{
+   unsigned leafIdx;
+
+   if (pd->root == NULL) {
+      return;
+   }
+   for (leafIdx = 0; leafIdx < MEMTRACK_PD_ENTRIES; leafIdx++) {
+      if (pd->root->ptr[leafIdx] != NULL) {
+         HostIF_FreePage(pd->root->ptr[leafIdx]);
+      }
+   }
+   HostIF_FreePage(pd->root);
+   pd->root = NULL;
+}
+
+
 /*
  * The following functions and macros help allocate and access the
  * directory structure. This is convenient because the second level
@@ -167,88 +305,338 @@ typedef struct MemTrack {
       _p3   = _idx % MEMTRACK_DIR3_ENTRIES;                            \
    } while (0)
 
-#define MEMTRACK_GETDIR2(_dir1, _p1)     (_dir1->dir[_p1])
+#define MEMTRACK_GETDIR2(_dir1, _p1)     ((MemTrackDir2 *)MemTrackPDGet(_dir1, _p1))
 #define MEMTRACK_ALLOCDIR2(_dir1, _p1)   MemTrackAllocDir2(_dir1, _p1)
 #define MEMTRACK_FREEDIR2(_dir1)         HostIF_FreePage(_dir1)
 
 #if defined(MEMTRACK_3LEVEL)
-#define MEMTRACK_GETENTRY(_dir1, _p1, _p2, _p3) \
-                                         (&((_dir1->dir[_p1])->dir[_p2])->entries[_p3])
+#define MEMTRACK_GETENTRY(_dir1, _p1, _p2, _p3)                        \
+   (&((MemTrackDir2 *)MEMTRACK_PD_SLOT(_dir1, _p1))->dir[_p2]->entries[_p3])
 #define MEMTRACK_GETDIR3(_dir2, _p2)     (_dir2->dir[_p2])
 #define MEMTRACK_ALLOCDIR3(_dir2, _p2)   MemTrackAllocDir3(_dir2, _p2)
 #define MEMTRACK_FREEDIR3(_dir2)         HostIF_FreePage(_dir2)
 #else
-#define MEMTRACK_GETENTRY(_dir1, _p1, _p2, _p3) \
-                                         (&(_dir1->dir[_p1])->entries[_p3])
+#define MEMTRACK_GETENTRY(_dir1, _p1, _p2, _p3)                        \
+   (&((MemTrackDir2 *)MEMTRACK_PD_SLOT(_dir1, _p1))->entries[_p3])
 #define MEMTRACK_GETDIR3(_dir2, _p2)     (_dir2)
 #define MEMTRACK_ALLOCDIR3(_dir2, _p2)   (_dir2)
 #define MEMTRACK_FREEDIR3(_dir2)
 #endif
 
-static INLINE void *
-MemTrackAllocPage(void)
+#if defined(MEMTRACK_3LEVEL)
+static INLINE MemTrackDir3 *
+MemTrackAllocDir3(MemTrackDir2 *dir2,  // IN/OUT
+                  unsigned p2)         // IN
 {
-   void *ptr = HostIF_AllocPage();
-   if (ptr != NULL) {
-      memset(ptr, 0, PAGE_SIZE);
+   if (dir2->dir[p2] == NULL) {
+      dir2->dir[p2] = MemTrackAllocPage();
    }
-   return ptr;
+   return dir2->dir[p2];
+}
+#endif
+
+static INLINE MemTrackDir2 *
+MemTrackAllocDir2(MemTrackDir1 *dir1,  // IN/OUT
+                  unsigned p1)         // IN
+{
+   if (!MemTrackPDGrow(dir1, p1)) {
+      return NULL;
+   }
+   if (MEMTRACK_PD_SLOT(dir1, p1) == NULL) {
+      MEMTRACK_PD_SLOT(dir1, p1) = MemTrackAllocPage();
+   }
+   return MEMTRACK_PD_SLOT(dir1, p1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHash --
+ *
+ *      Mix all 64 bits of a VPN or MPN into the hash (the MurmurHash3
+ *      finalizer), so that runs of consecutive keys spread over the
+ *      whole table instead of clustering.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned
+MemTrackHash(MemTrackHTKey key)  // IN
+{
+   key ^= key >> 33;
+   key *= CONST64U(0xff51afd7ed558ccd);
+   key ^= key >> 33;
+   key *= CONST64U(0xc4ceb9fe1a85ec53);
+   key ^= key >> 33;
+
+   return (unsigned)key;
 }
 
-#define MEMTRACK_ALLOCDFN(_name, _itype, _otype)   \
-   static INLINE _otype *                          \
-   _name(_itype *arg, unsigned pos)                \
-   {                                               \
-      if (arg->dir[pos] == NULL) {                 \
-         arg->dir[pos] = MemTrackAllocPage();      \
-      }                                            \
-      return arg->dir[pos];                        \
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHTSlotAt --
+ * MemTrackHTPut --
+ * MemTrackHTFind --
+ *
+ *      Helper functions to access slots, and to insert and find entries
+ *      in one table of the VPN or MPN hash tables. Tables are always
+ *      allocated in page size chunks. The caller of MemTrackHTPut must
+ *      have reserved room with MemTrackHTReserve. MemTrackHTFind adds
+ *      the number of slots it examined to *probes.
+ *
+ *      Entries in the MPN table are hashed on the MPN they were added
+ *      with; the MPN may since have been cleared or replaced, so the
+ *      entry itself is checked as well.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE MemTrackHTSlot *
+MemTrackHTSlotAt(const MemTrackHTTable *table,  // IN
+                 unsigned idx)                  // IN
+{
+   MemTrackHTPage *page = MEMTRACK_PD_SLOT(&table->pages,
+                                           idx / MEMTRACK_HT_ENTRIES);
+
+   return &page->slots[idx % MEMTRACK_HT_ENTRIES];
+}
+
+static INLINE void
+MemTrackHTPut(MemTrackHTTable *table,  // IN
+              MemTrackEntry *ent,      // IN
+              MemTrackHTKey key)       // IN
+{
+   unsigned idx = MemTrackHash(key) & table->mask;
+   MemTrackHTSlot *slot = MemTrackHTSlotAt(table, idx);
+
+   while (slot->ent != NULL) {
+      idx = (idx + 1) & table->mask;
+      slot = MemTrackHTSlotAt(table, idx);
    }
+   slot->key = key;
+   slot->ent = ent;
+   table->numUsed++;
+}
 
-#if defined(MEMTRACK_3LEVEL)
-MEMTRACK_ALLOCDFN(MemTrackAllocDir3, MemTrackDir2, MemTrackDir3)
-#endif
-MEMTRACK_ALLOCDFN(MemTrackAllocDir2, MemTrackDir1, MemTrackDir2)
+static INLINE MemTrackEntry *
+MemTrackHTFind(const MemTrackHTTable *table,  // IN
+               MemTrackHTKey key,             // IN
+               Bool isMPN,                    // IN
+               unsigned *probes)              // IN/OUT
+{
+   unsigned idx = MemTrackHash(key) & table->mask;
+
+   for (;;) {
+      MemTrackHTSlot *slot = MemTrackHTSlotAt(table, idx);
+
+      (*probes)++;
+      if (slot->ent == NULL) {
+         return NULL;
+      }
+      if (slot->key == key && (!isMPN || slot->ent->mpn == key)) {
+         return slot->ent;
+      }
+      idx = (idx + 1) & table->mask;
+   }
+}
 
 
 /*
  *----------------------------------------------------------------------
  *
- * MemTrackHTLookup --
- * MemTrackHTInsert --
+ * MemTrackHTFree --
  *
- *      Helper functions to insert or lookup entries in the VPN or
- *      MPN hash tables. Hash tables are always allocated in page
- *      size chunks.
+ *      Free the pages of a hash table.
  *
  *----------------------------------------------------------------------
  */
 
-#define MEMTRACK_HASHKEY(_key, _hash, _page, _pos)  \
-   do {                                             \
-      _hash = _key % MEMTRACK_HT_SIZE;              \
-      _page = _hash / MEMTRACK_HT_ENTRIES;          \
-      _pos  = _hash % MEMTRACK_HT_ENTRIES;          \
-   } while(0)
+static void
+MemTrackHTFree(MemTrackHTTable *table)  // IN
+{
+   unsigned idx;
+
+   for (idx = 0; idx < table->numPages; idx++) {
+      void *page = MemTrackPDGet(&table->pages, idx);
 
-static INLINE MemTrackEntry **
-MemTrackHTLookup(MemTrackHT *ht,       // IN
-                 MemTrackHTKey key)    // IN
+      if (page != NULL) {
+         HostIF_FreePage(page);
+      }
+   }
+   MemTrackPDFree(&table->pages);
+   memset(table, 0, sizeof *table);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHTAlloc --
+ *
+ *      Allocate an empty hash table of numPages pages.
+ *
+ * Results:
+ *      TRUE on success, FALSE on allocation failure (table is left
+ *      empty).
+ *
+ * Side effects:
+ *      Memory allocation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+MemTrackHTAlloc(MemTrackHTTable *table,  // OUT
+                unsigned numPages)       // IN: a power of 2
 {
-   uint64 hash, page, pos;
-   MEMTRACK_HASHKEY(key, hash, page, pos);
-   return &ht->pages[page]->entries[pos];
+   unsigned idx;
+
+   ASSERT((numPages & (numPages - 1)) == 0);
+   ASSERT(numPages <= MEMTRACK_PD_MAX);
+
+   memset(table, 0, sizeof *table);
+   table->numPages = numPages;
+   table->mask = numPages * MEMTRACK_HT_ENTRIES - 1;
+
+   for (idx = 0; idx < numPages; idx++) {
+      if (!MemTrackPDGrow(&table->pages, idx)) {
+         MemTrackHTFree(table);
+         return FALSE;
+      }
+      MEMTRACK_PD_SLOT(&table->pages, idx) = MemTrackAllocPage();
+      if (MEMTRACK_PD_SLOT(&table->pages, idx) == NULL) {
+         MemTrackHTFree(table);
+         return FALSE;
+      }
+   }
+
+   return TRUE;
 }
 
-static INLINE void
-MemTrackHTInsert(MemTrackHT *ht,          // IN
-                 MemTrackEntry *ent,      // IN
-                 MemTrackEntry **chain,   // OUT
-                 MemTrackHTKey key)       // IN
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHTMigrate --
+ *
+ *      Move up to numSlots slots of the table being drained into the
+ *      current table, and free the drained table once it is empty.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May free memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemTrackHTMigrate(MemTrackHT *ht,     // IN/OUT
+                  unsigned numSlots)  // IN
+{
+   if (ht->old.numPages == 0) {
+      return;
+   }
+   while (numSlots > 0 && ht->migrateIdx <= ht->old.mask) {
+      MemTrackHTSlot *slot = MemTrackHTSlotAt(&ht->old, ht->migrateIdx);
+
+      if (slot->ent != NULL) {
+         MemTrackHTPut(&ht->cur, slot->ent, slot->key);
+      }
+      ht->migrateIdx++;
+      numSlots--;
+   }
+   if (ht->migrateIdx > ht->old.mask) {
+      MemTrackHTFree(&ht->old);
+      ht->migrateIdx = 0;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHTReserve --
+ *
+ *      Make room for one more entry. Moves a few slots of a table
+ *      being drained, and starts draining into a doubled table if that
+ *      insertion would push the current one over the maximum load
+ *      factor. If the table cannot grow, insertion may still proceed
+ *      as long as it leaves a free slot to terminate probe sequences.
+ *
+ * Results:
+ *      TRUE if an entry can be inserted, FALSE otherwise.
+ *
+ * Side effects:
+ *      Memory allocation, partial rehash.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+MemTrackHTReserve(MemTrackHT *ht)  // IN/OUT
+{
+   MemTrackHTTable newTable;
+   uint64 numSlots;
+
+   MemTrackHTMigrate(ht, MEMTRACK_HT_MIGRATE_SLOTS);
+
+   numSlots = (uint64)ht->cur.mask + 1;
+   if ((uint64)(ht->cur.numUsed + 1) * MEMTRACK_HT_LOAD_DEN <=
+       numSlots * MEMTRACK_HT_LOAD_NUM) {
+      return TRUE;
+   }
+
+   /* Not reached at the migration rate above, but never drain two. */
+   MemTrackHTMigrate(ht, ht->old.mask + 1);
+
+   if (ht->cur.numPages * 2 <= MEMTRACK_PD_MAX &&
+       MemTrackHTAlloc(&newTable, ht->cur.numPages * 2)) {
+      ht->old = ht->cur;
+      ht->cur = newTable;
+      ht->migrateIdx = 0;
+      MemTrackHTMigrate(ht, MEMTRACK_HT_MIGRATE_SLOTS);
+
+      return TRUE;
+   }
+
+   return ht->cur.numUsed + 1 < numSlots;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackHTLookup --
+ *
+ *      Find the entry for a key, in the current table first and then in
+ *      the table being drained, if any.
+ *
+ * Results:
+ *      A pointer to the element, or NULL if not there.
+ *
+ * Side effects:
+ *      Adds the number of slots examined to *probes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE MemTrackEntry *
+MemTrackHTLookup(const MemTrackHT *ht,  // IN
+                 MemTrackHTKey key,     // IN
+                 Bool isMPN,            // IN
+                 unsigned *probes)      // IN/OUT
 {
-   MemTrackEntry **head = MemTrackHTLookup(ht, key);
-   *chain = *head;
-   *head = ent;
+   MemTrackEntry *ent = MemTrackHTFind(&ht->cur, key, isMPN, probes);
+
+   if (ent == NULL && ht->old.numPages != 0) {
+      ent = MemTrackHTFind(&ht->old, key, isMPN, probes);
+   }
+   return ent;
 }
 
 
@@ -271,7 +659,6 @@ MemTrackHTInsert(MemTrackHT *ht,          // IN
 static void
 MemTrackCleanup(MemTrack *mt)    // IN
 {
-   unsigned idx;
    unsigned p1;
    MemTrackDir1 *dir1;
 
@@ -280,7 +667,7 @@ MemTrackCleanup(MemTrack *mt)    // IN
    }
    dir1 = &mt->dir1;
 
-   for (p1 = 0; p1 < MEMTRACK_DIR1_ENTRIES; p1++) {
+   for (p1 = 0; p1 < MEMTRACK_PD_MAX; p1++) {
       unsigned p2;
       MemTrackDir2 *dir2 = MEMTRACK_GETDIR2(dir1, p1);
       if (dir2 == NULL) {
@@ -295,17 +682,14 @@ MemTrackCleanup(MemTrack *mt)    // IN
       }
       MEMTRACK_FREEDIR2(dir2);
    }
+   MemTrackPDFree(dir1);
 
-   for (idx = 0; idx < MEMTRACK_HT_PAGES; idx++) {
-      if (mt->vpnHashTable.pages[idx] != NULL) {
-         HostIF_FreePage(mt->vpnHashTable.pages[idx]);
-      }
+   MemTrackHTFree(&mt->vpnHashTable.cur);
+   MemTrackHTFree(&mt->vpnHashTable.old);
 #if defined(MEMTRACK_MPN_LOOKUP)
-      if (mt->mpnHashTable.pages[idx] != NULL) {
-         HostIF_FreePage(mt->mpnHashTable.pages[idx]);
-      }
+   MemTrackHTFree(&mt->mpnHashTable.cur);
+   MemTrackHTFree(&mt->mpnHashTable.old);
 #endif
-   }
 
    HostIF_FreeKernelMem(mt);
 }
@@ -331,13 +715,13 @@ MemTrack *
 MemTrack_Init(void)
 {
    MemTrack *mt;
-   unsigned idx;
 
 #if defined(MEMTRACK_3LEVEL)
-   ASSERT_ON_COMPILE(sizeof *mt <= PAGE_SIZE);
    ASSERT_ON_COMPILE(sizeof (MemTrackDir2) == PAGE_SIZE);
 #endif
    ASSERT_ON_COMPILE(sizeof (MemTrackDir3) <= PAGE_SIZE);
+   ASSERT_ON_COMPILE(sizeof (MemTrackHTPage) <= PAGE_SIZE);
+   ASSERT_ON_COMPILE(sizeof (MemTrackPDPage) == PAGE_SIZE);
 
    mt = HostIF_AllocKernelMem(sizeof *mt, FALSE);
    if (mt == NULL) {
@@ -346,23 +730,20 @@ MemTrack_Init(void)
    }
    memset(mt, 0, sizeof *mt);
 
-   for (idx = 0; idx < MEMTRACK_HT_PAGES; idx++) {
-      MemTrackHTPage *htPage = MemTrackAllocPage();
-      if (htPage == NULL) {
-         Warning("MemTrack failed to allocate VPN hash table (%d).\n", idx);
-         goto error;
-      }
-      mt->vpnHashTable.pages[idx] = htPage;
+   if (!MemTrackPDGrow(&mt->dir1, 0)) {
+      Warning("MemTrack failed to allocate directory.\n");
+      goto error;
+   }
+
+   if (!MemTrackHTAlloc(&mt->vpnHashTable.cur, MEMTRACK_HT_INIT_PAGES)) {
+      Warning("MemTrack failed to allocate VPN hash table.\n");
+      goto error;
    }
 
 #if defined(MEMTRACK_MPN_LOOKUP)
-   for (idx = 0; idx < MEMTRACK_HT_PAGES; idx++) {
-      MemTrackHTPage *htPage = MemTrackAllocPage();
-      if (htPage == NULL) {
-         Warning("MemTrack failed to allocate MPN hash table (%d).\n", idx);
-         goto error;
-      }
-      mt->mpnHashTable.pages[idx] = htPage;
+   if (!MemTrackHTAlloc(&mt->mpnHashTable.cur, MEMTRACK_HT_INIT_PAGES)) {
+      Warning("MemTrack failed to allocate MPN hash table.\n");
+      goto error;
    }
 #endif
 
@@ -385,7 +766,7 @@ error:
  *      A pointer to the element, or NULL on error.
  *
  * Side effects:
- *      Memory allocation.
+ *      Memory allocation; the hash tables may be rehashed.
  *
  *----------------------------------------------------------------------
  */
@@ -403,9 +784,7 @@ MemTrack_Add(MemTrack *mt,    // IN
    MemTrackDir3 *dir3;
    MEMTRACK_IDX2DIR(idx, p1, p2, p3);
 
-   if (p1 >= MEMTRACK_DIR1_ENTRIES ||
-       p2 >= MEMTRACK_DIR2_ENTRIES ||
-       p3 >= MEMTRACK_DIR3_ENTRIES) {
+   if (idx + 1 == 0) {
       return NULL;
    }
 
@@ -419,13 +798,27 @@ MemTrack_Add(MemTrack *mt,    // IN
       return NULL;
    }
 
+   /*
+    * Reserve hash table room before touching anything, so that a
+    * failure leaves the tracker unchanged.
+    */
+
+   if (!MemTrackHTReserve(&mt->vpnHashTable)) {
+      return NULL;
+   }
+#if defined(MEMTRACK_MPN_LOOKUP)
+   if (!MemTrackHTReserve(&mt->mpnHashTable)) {
+      return NULL;
+   }
+#endif
+
    ent = MEMTRACK_GETENTRY(dir1, p1, p2, p3);
    ent->vpn = vpn;
    ent->mpn = mpn;
 
-   MemTrackHTInsert(&mt->vpnHashTable, ent, &ent->vpnChain, ent->vpn);
+   MemTrackHTPut(&mt->vpnHashTable.cur, ent, ent->vpn);
 #if defined(MEMTRACK_MPN_LOOKUP)
-   MemTrackHTInsert(&mt->mpnHashTable, ent, &ent->mpnChain, ent->mpn);
+   MemTrackHTPut(&mt->mpnHashTable.cur, ent, ent->mpn);
 #endif
 
    mt->numPages++;
@@ -444,7 +837,7 @@ MemTrack_Add(MemTrack *mt,    // IN
  *      A pointer to the element, or NULL if not there.
  *
  * Side effects:
- *      None.
+ *      Updates the probe statistics in stats builds.
  *
  *----------------------------------------------------------------------
  */
@@ -453,14 +846,15 @@ MemTrackEntry *
 MemTrack_LookupVPN(MemTrack *mt, // IN
                    VPN64 vpn)    // IN
 {
-   MemTrackEntry *next = *MemTrackHTLookup(&mt->vpnHashTable, vpn);
-   while (next != NULL) {
-      if (next->vpn == vpn) {
-         return next;
-      }
-      next = next->vpnChain;
-   }
-   return NULL;
+   unsigned probes = 0;
+   MemTrackEntry *ent = MemTrackHTLookup(&mt->vpnHashTable, vpn, FALSE,
+                                         &probes);
+
+#if defined(MEMTRACK_STATS)
+   mt->lookups++;
+   mt->probes += probes;
+#endif
+   return ent;
 }
 
 
@@ -484,16 +878,125 @@ MemTrackEntry *
 MemTrack_LookupMPN(MemTrack *mt, // IN
                    MPN mpn)      // IN
 {
-   MemTrackEntry *next = *MemTrackHTLookup(&mt->mpnHashTable, mpn);
-   while (next != NULL) {
-      if (next->mpn == mpn) {
-         return next;
+   unsigned probes = 0;
+
+   return MemTrackHTLookup(&mt->mpnHashTable, mpn, TRUE, &probes);
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackBenchmarkCb --
+ *
+ *      MemTrack_Cleanup callback for the benchmark: nothing to release.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemTrackBenchmarkCb(void *cData,          // IN: unused
+                    MemTrackEntry *ent)   // IN: unused
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrackBenchmarkPass --
+ *
+ *      Look up numPages consecutive VPNs from base and log the average
+ *      probe length (in hundredths) and lookup cost.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemTrackBenchmarkPass(MemTrack *mt,        // IN
+                      const char *name,    // IN
+                      VPN64 base,          // IN
+                      unsigned numPages,   // IN
+                      Bool expectHit)      // IN
+{
+   uint64 start;
+   uint64 elapsed;
+   uint32 avgProbes, elapsedUs, nsPerLookup, rem;
+   unsigned probes = 0;
+   unsigned found = 0;
+   unsigned idx;
+
+   /* Count probes here rather than rely on the stats-build counters. */
+   start = HostIF_ReadUptime();
+   for (idx = 0; idx < numPages; idx++) {
+      if (MemTrackHTLookup(&mt->vpnHashTable, base + idx, FALSE,
+                           &probes) != NULL) {
+         found++;
       }
-      next = next->mpnChain;
    }
-   return NULL;
+   elapsed = HostIF_ReadUptime() - start;
+
+   Div643232((uint64)probes * 100, numPages, &avgProbes, &rem);
+   Div643232(elapsed * 1000000, (uint32)HostIF_UptimeFrequency(),
+             &elapsedUs, &rem);
+   Div643232((uint64)elapsedUs * 1000, numPages, &nsPerLookup, &rem);
+
+   Log("MemTrack benchmark %s: %u/%u found, avg probe length %u.%02u, "
+       "%u us (%u ns/lookup)\n", name, found, expectHit ? numPages : 0,
+       avgProbes / 100, avgProbes % 100, elapsedUs, nsPerLookup);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemTrack_Benchmark --
+ *
+ *      Lookup microbenchmark. Builds a private tracker holding numPages
+ *      consecutive VPNs (the common layout of guest main memory), then
+ *      times one successful lookup of each and as many unsuccessful
+ *      lookups, logging the average probe length of each pass.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates and frees a tracker; logs results.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+MemTrack_Benchmark(unsigned numPages)  // IN
+{
+   const VPN64 base = CONST64U(0x7f0000000);
+   MemTrack *mt;
+   unsigned idx;
+
+   if (numPages == 0) {
+      return;
+   }
+
+   mt = MemTrack_Init();
+   if (mt == NULL) {
+      return;
+   }
+   for (idx = 0; idx < numPages; idx++) {
+      if (MemTrack_Add(mt, base + idx, idx + 1) == NULL) {
+         Warning("MemTrack benchmark: add failed after %u pages\n", idx);
+         MemTrack_Cleanup(mt, MemTrackBenchmarkCb, NULL);
+         return;
+      }
+   }
+   Log("MemTrack benchmark: %u pages, %u hash slots\n", mt->numPages,
+       mt->vpnHashTable.cur.mask + 1);
+
+   MemTrackBenchmarkPass(mt, "hit", base, numPages, TRUE);
+   MemTrackBenchmarkPass(mt, "miss", base + numPages, numPages, FALSE);
+
+   MemTrack_Cleanup(mt, MemTrackBenchmarkCb, NULL);
 }
-#endif
 
 
 /*
@@ -31,7 +31,12 @@
 #define INCLUDE_ALLOW_VMCORE
 #include "includeCheck.h"
 
-#if defined(VMX86_DEBUG)
+/*
+ * The MPN table backs debug checks and the page sharing ownership test
+ * on Linux hosts.
+ */
+
+#if defined(VMX86_DEBUG) || defined(__linux__)
 #define MEMTRACK_MPN_LOOKUP
 #endif
 
@@ -40,10 +45,6 @@ struct MemTrack;
 typedef struct MemTrackEntry {
    VPN64                   vpn;
    MPN                     mpn;
-   struct MemTrackEntry   *vpnChain;
-#if defined(MEMTRACK_MPN_LOOKUP)
-   struct MemTrackEntry   *mpnChain;
-#endif
 } MemTrackEntry;
 
 typedef void (MemTrackCleanupCb)(void *cData, MemTrackEntry *entry);
@@ -53,6 +54,7 @@ extern unsigned MemTrack_Cleanup(struct MemTrack *mt, MemTrackCleanupCb *cb,
                                  void *cbData);
 extern MemTrackEntry *MemTrack_Add(struct MemTrack *mt, VPN64 vpn, MPN mpn);
 extern MemTrackEntry *MemTrack_LookupVPN(struct MemTrack *mt, VPN64 vpn);
+extern void MemTrack_Benchmark(unsigned numPages);
 #if defined(MEMTRACK_MPN_LOOKUP)
 extern MemTrackEntry *MemTrack_LookupMPN(struct MemTrack *mt, MPN mpn);
 #endif
@@ -30,6 +30,10 @@
  *
  *    2-level phystracker is built on top of 3-level one by collapsing
  *    middle level.
+ *
+ *    L3 bitmaps are scanned a 64-bit word at a time.  A summary bitmap
+ *    with one bit per L3 table, set while the table tracks any page,
+ *    lets enumeration skip empty L2/L3 directories 64 tables at a time.
  */
 
 
@@ -38,6 +42,7 @@
 #   include "driver-config.h"
 
 #   include <linux/string.h> /* memset() in the kernel */
+#   include <linux/bitops.h> /* ffs() in the kernel */
 #else
 #   include <string.h>
 #endif
@@ -49,6 +54,7 @@
 
 #define BYTES_PER_ENTRY      (PAGE_SIZE)
 #define PHYSTRACK_L3_ENTRIES (8 * BYTES_PER_ENTRY) /* 128MB */
+#define PHYSTRACK_L3_WORDS   (BYTES_PER_ENTRY / sizeof (uint64))
 
 #if defined(WINNT_DDK)
 #if defined(VM_X86_64)
@@ -77,8 +83,14 @@
 #define PHYSTRACK_3LEVEL (1)
 #endif
 
+/*
+ * Total number of L3 tables, and the size of the summary bitmap.
+ */
+#define PHYSTRACK_L3_TABLES     (PHYSTRACK_L1_ENTRIES * PHYSTRACK_L2_ENTRIES)
+#define PHYSTRACK_SUMMARY_WORDS CEILING(PHYSTRACK_L3_TABLES, 64)
+
 typedef struct PhysTrackerL3 {
-   uint8 bits[BYTES_PER_ENTRY];
+   uint64 bits[PHYSTRACK_L3_WORDS];
 } PhysTrackerL3;
 
 #ifdef PHYSTRACK_3LEVEL
@@ -91,6 +103,7 @@ typedef struct PhysTrackerL3 PhysTrackerL2;
 
 typedef struct PhysTracker {
    int numVMs;
+   uint64 *summary;   /* Bit per L3 table, set if the table is non-empty. */
    PhysTrackerL2 *dir[PHYSTRACK_L1_ENTRIES];
 } PhysTracker;
 
@@ -109,14 +122,23 @@ PhysTracker *physTracker = NULL;
    } while (0)
 
 /*
- * Convert L3 index to offset and bitmask.  offs/bitmask must be l-values.
+ * Convert L3 index to word offset and bitmask.  offs/bitmask must be
+ * l-values.
  */
-#define PHYSTRACK_GETL3POS(p3, offs, bitmask) \
-   do {                          \
-      offs = (p3) / 8;           \
-      bitmask = 1 << ((p3) % 8); \
+#define PHYSTRACK_GETL3POS(p3, offs, bitmask)     \
+   do {                                           \
+      offs = (p3) / 64;                           \
+      bitmask = CONST64U(1) << ((p3) % 64);       \
    } while (0)
 
+/*
+ * Summary bitmap accessors; 'idx' is p1 * PHYSTRACK_L2_ENTRIES + p2.
+ */
+#define PHYSTRACK_SUMMARY_SET(tracker, idx) \
+   ((tracker)->summary[(idx) / 64] |= CONST64U(1) << ((idx) % 64))
+#define PHYSTRACK_SUMMARY_CLEAR(tracker, idx) \
+   ((tracker)->summary[(idx) / 64] &= ~(CONST64U(1) << ((idx) % 64)))
+
 /*
  * Helpers hiding middle level.
  */
@@ -130,6 +152,160 @@ PhysTracker *physTracker = NULL;
 #define PHYSTRACK_FREEL3(dir2, p2) do { } while (0)
 #endif
 
+typedef enum {
+   PHYSTRACK_OP_ADD,
+   PHYSTRACK_OP_REMOVE,
+   PHYSTRACK_OP_COUNT
+} PhysTrackOp;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackFirstSet --
+ *
+ *      Index of the least significant set bit of a non-zero word.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned int
+PhysTrackFirstSet(uint64 word)
+{
+   uint32 lo = (uint32)word;
+
+   ASSERT(word != 0);
+   if (lo != 0) {
+      return ffs(lo) - 1;
+   }
+   return 32 + ffs((uint32)(word >> 32)) - 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackPopCount --
+ *
+ *      Number of set bits in a word.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned int
+PhysTrackPopCount(uint64 word)
+{
+   word = word - ((word >> 1) & CONST64U(0x5555555555555555));
+   word = (word & CONST64U(0x3333333333333333)) +
+          ((word >> 2) & CONST64U(0x3333333333333333));
+   word = (word + (word >> 4)) & CONST64U(0x0f0f0f0f0f0f0f0f);
+   word += word >> 8;
+   word += word >> 16;
+   word += word >> 32;
+
+   return (unsigned int)(word & 0x7f);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackL3IsEmpty --
+ *
+ *      Tests whether an L3 table tracks no page.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+PhysTrackL3IsEmpty(const PhysTrackerL3 *dir3)
+{
+   unsigned int pos;
+
+   for (pos = 0; pos < PHYSTRACK_L3_WORDS; pos++) {
+      if (dir3->bits[pos]) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackL3Next --
+ *
+ *      Find the first tracked page at or after p3 in an L3 table.
+ *
+ * Results:
+ *      Its L3 index, or PHYSTRACK_L3_ENTRIES if there is none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned int
+PhysTrackL3Next(const PhysTrackerL3 *dir3,
+                unsigned int p3)
+{
+   unsigned int pos = p3 / 64;
+   uint64 word;
+
+   if (p3 >= PHYSTRACK_L3_ENTRIES) {
+      return PHYSTRACK_L3_ENTRIES;
+   }
+   word = dir3->bits[pos] & (~CONST64U(0) << (p3 % 64));
+   for (;;) {
+      if (word) {
+         return pos * 64 + PhysTrackFirstSet(word);
+      }
+      if (++pos == PHYSTRACK_L3_WORDS) {
+         return PHYSTRACK_L3_ENTRIES;
+      }
+      word = dir3->bits[pos];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackAllocL2 --
+ *
+ *      Allocate and hook L2 directory to the tracker if does not exist.
+ *      Or get existing one if it exists.
+ *
+ * Results:
+ *      L2 directory.
+ *
+ * Side effects:
+ *      Fatal on allocation failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE PhysTrackerL2 *
+PhysTrackAllocL2(PhysTracker *tracker,
+                 unsigned int p1)
+{
+   PhysTrackerL2 *dir2 = tracker->dir[p1];
+
+   if (!dir2) { 
+      // more efficient with page alloc
+      ASSERT_ON_COMPILE(sizeof *dir2 == PAGE_SIZE);
+      dir2 = HostIF_AllocPage();
+      if (!dir2) { 
+         PANIC();
+      }
+      memset(dir2, 0, sizeof *dir2);
+      tracker->dir[p1] = dir2;
+   }
+   return dir2;
+}
+
 
 #ifdef PHYSTRACK_3LEVEL
 /*
@@ -149,7 +325,7 @@ PhysTracker *physTracker = NULL;
  *----------------------------------------------------------------------
  */
 
-static INLINE_SINGLE_CALLER PhysTrackerL3 *
+static INLINE PhysTrackerL3 *
 PhysTrackAllocL3(PhysTrackerL2 *dir2,
                  unsigned int p2)
 {
@@ -195,6 +371,46 @@ PhysTrackFreeL3(PhysTrackerL2 *dir2,
 #endif
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackNew --
+ *
+ *      Allocate and zero a tracker and its summary bitmap.
+ *
+ * Results:
+ *      The tracker, or NULL on allocation failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static PhysTracker *
+PhysTrackNew(void)
+{
+   PhysTracker *tracker;
+
+   tracker = HostIF_AllocKernelMem(sizeof *tracker, FALSE);
+   if (!tracker) {
+      return NULL;
+   }
+   memset(tracker, 0, sizeof *tracker);
+
+   tracker->summary = HostIF_AllocKernelMem(PHYSTRACK_SUMMARY_WORDS *
+                                            sizeof *tracker->summary, FALSE);
+   if (!tracker->summary) {
+      HostIF_FreeKernelMem(tracker);
+      return NULL;
+   }
+   memset(tracker->summary, 0,
+          PHYSTRACK_SUMMARY_WORDS * sizeof *tracker->summary);
+
+   return tracker;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -219,9 +435,8 @@ PhysTrack_Alloc(void)
    PhysTracker *tracker;
 
    /* allocate a new phystracker */
-   tracker = HostIF_AllocKernelMem(sizeof *tracker, FALSE);
+   tracker = PhysTrackNew();
    if (tracker) {
-      memset(tracker, 0, sizeof *tracker);
       tracker->numVMs = 1;
    } else {
       Warning("PhysTrack_Alloc failed\n");
@@ -253,10 +468,7 @@ PhysTrack_Init(void)
 {
    /* allocate a new phystracker */
    if (physTracker == NULL) {
-      physTracker = HostIF_AllocKernelMem(sizeof *physTracker, FALSE);
-      if (physTracker) {
-         memset(physTracker, 0, sizeof *physTracker);
-      }
+      physTracker = PhysTrackNew();
    }
 
    /* increment use count */
@@ -299,6 +511,14 @@ PhysTrack_Cleanup(PhysTracker *tracker)
    /* deallocate phystracker if no more VMs */
    if (tracker->numVMs == 0) {
       unsigned int p1;
+      unsigned int pos;
+
+      for (pos = 0; pos < PHYSTRACK_SUMMARY_WORDS; pos++) {
+         if (tracker->summary[pos]) {
+            Warning("PhysTrack_Cleanup: pfns still locked\n");
+            PANIC();
+         }
+      }
 
       for (p1 = 0; p1 < PHYSTRACK_L1_ENTRIES; p1++) {
          PhysTrackerL2 *dir2 = tracker->dir[p1];
@@ -310,14 +530,7 @@ PhysTrack_Cleanup(PhysTracker *tracker)
                PhysTrackerL3 *dir3 = PHYSTRACK_GETL3(dir2, p2);
 
                if (dir3) {
-                  unsigned int pos;
-
-                  for (pos = 0; pos < BYTES_PER_ENTRY; pos++) {
-                     if (dir3->bits[pos]) {
-                        Warning("PhysTrack_Cleanup: pfns still locked\n");
-                        PANIC();
-                     }
-                  }
+                  ASSERT(PhysTrackL3IsEmpty(dir3));
                   PHYSTRACK_FREEL3(dir2, p2);
                }
             }
@@ -325,6 +538,7 @@ PhysTrack_Cleanup(PhysTracker *tracker)
             tracker->dir[p1] = NULL;
          }
       }
+      HostIF_FreeKernelMem(tracker->summary);
       HostIF_FreeKernelMem(tracker);
       if (tracker == physTracker) {
          physTracker = NULL;
@@ -358,7 +572,7 @@ PhysTrack_Add(PhysTracker *tracker,
    unsigned int p2;
    unsigned int p3;
    unsigned int pos;
-   unsigned int bit;
+   uint64 bit;
    PhysTrackerL2 *dir2;
    PhysTrackerL3 *dir3;
 
@@ -366,23 +580,14 @@ PhysTrack_Add(PhysTracker *tracker,
    PHYSTRACK_MPN2IDX(mpn, p1, p2, p3);
    ASSERT(p1 < PHYSTRACK_L1_ENTRIES);
 
-   dir2 = tracker->dir[p1];
-   if (!dir2) { 
-      // more efficient with page alloc
-      ASSERT_ON_COMPILE(sizeof *dir2 == PAGE_SIZE);
-      dir2 = HostIF_AllocPage();
-      if (!dir2) { 
-         PANIC();
-      }
-      memset(dir2, 0, sizeof *dir2);
-      tracker->dir[p1] = dir2;
-   }
+   dir2 = PhysTrackAllocL2(tracker, p1);
    dir3 = PHYSTRACK_ALLOCL3(dir2, p2);
    PHYSTRACK_GETL3POS(p3, pos, bit);
    if (dir3->bits[pos] & bit) {
       PANIC();
    }
    dir3->bits[pos] |= bit;
+   PHYSTRACK_SUMMARY_SET(tracker, p1 * PHYSTRACK_L2_ENTRIES + p2);
 }
 
 
@@ -411,7 +616,7 @@ PhysTrack_Remove(PhysTracker *tracker,
    unsigned int p2;
    unsigned int p3;
    unsigned int pos;
-   unsigned int bit;
+   uint64 bit;
    PhysTrackerL2 *dir2;
    PhysTrackerL3 *dir3;
 
@@ -432,6 +637,9 @@ PhysTrack_Remove(PhysTracker *tracker,
       PANIC();
    }
    dir3->bits[pos] &= ~bit;
+   if (dir3->bits[pos] == 0 && PhysTrackL3IsEmpty(dir3)) {
+      PHYSTRACK_SUMMARY_CLEAR(tracker, p1 * PHYSTRACK_L2_ENTRIES + p2);
+   }
 }
 
 
@@ -462,7 +670,7 @@ PhysTrack_Test(const PhysTracker *tracker,
    unsigned int p2;
    unsigned int p3;
    unsigned int pos;
-   unsigned int bit;
+   uint64 bit;
    PhysTrackerL2 *dir2;
    PhysTrackerL3 *dir3;
 
@@ -484,6 +692,218 @@ PhysTrack_Test(const PhysTracker *tracker,
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackL3Range --
+ *
+ *      Apply 'op' to numPages pages of an L3 table starting at p3,
+ *      one 64-bit word at a time.
+ *
+ * Results:
+ *      Number of pages added, removed or found tracked.
+ *
+ * Side effects:
+ *      Fatal if adding a tracked page or removing an untracked one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+PhysTrackL3Range(PhysTrackerL3 *dir3,
+                 unsigned int p3,
+                 unsigned int numPages,
+                 PhysTrackOp op)
+{
+   unsigned int count = 0;
+
+   while (numPages > 0) {
+      unsigned int pos = p3 / 64;
+      unsigned int shift = p3 % 64;
+      unsigned int bits = MIN(numPages, 64 - shift);
+      uint64 mask = (bits == 64 ? ~CONST64U(0) :
+                                  (CONST64U(1) << bits) - 1) << shift;
+
+      switch (op) {
+      case PHYSTRACK_OP_ADD:
+         if (dir3->bits[pos] & mask) {
+            PANIC();
+         }
+         dir3->bits[pos] |= mask;
+         count += bits;
+         break;
+      case PHYSTRACK_OP_REMOVE:
+         if ((dir3->bits[pos] & mask) != mask) {
+            PANIC();
+         }
+         dir3->bits[pos] &= ~mask;
+         count += bits;
+         break;
+      case PHYSTRACK_OP_COUNT:
+         count += PhysTrackPopCount(dir3->bits[pos] & mask);
+         break;
+      }
+      p3 += bits;
+      numPages -= bits;
+   }
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrackRange --
+ *
+ *      Apply 'op' to the MPN range [mpn, mpn + numPages), splitting it
+ *      at L3 table boundaries.
+ *
+ * Results:
+ *      Number of pages added, removed or found tracked.
+ *
+ * Side effects:
+ *      See PhysTrack_AddRange and PhysTrack_RemoveRange.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+PhysTrackRange(PhysTracker *tracker,
+               MPN mpn,
+               unsigned int numPages,
+               PhysTrackOp op)
+{
+   unsigned int count = 0;
+
+   ASSERT(tracker);
+   while (numPages > 0) {
+      unsigned int p1;
+      unsigned int p2;
+      unsigned int p3;
+      unsigned int chunk;
+      PhysTrackerL2 *dir2;
+      PhysTrackerL3 *dir3 = NULL;
+
+      PHYSTRACK_MPN2IDX(mpn, p1, p2, p3);
+      chunk = MIN(numPages, PHYSTRACK_L3_ENTRIES - p3);
+
+      if (p1 >= PHYSTRACK_L1_ENTRIES) {
+         if (op == PHYSTRACK_OP_COUNT) {
+            break;
+         }
+         PANIC();
+      }
+      if (op == PHYSTRACK_OP_ADD) {
+         dir2 = PhysTrackAllocL2(tracker, p1);
+         dir3 = PHYSTRACK_ALLOCL3(dir2, p2);
+      } else {
+         dir2 = tracker->dir[p1];
+         if (dir2) {
+            dir3 = PHYSTRACK_GETL3(dir2, p2);
+         }
+      }
+
+      if (dir3) {
+         count += PhysTrackL3Range(dir3, p3, chunk, op);
+         if (op == PHYSTRACK_OP_ADD) {
+            PHYSTRACK_SUMMARY_SET(tracker, p1 * PHYSTRACK_L2_ENTRIES + p2);
+         } else if (op == PHYSTRACK_OP_REMOVE && PhysTrackL3IsEmpty(dir3)) {
+            PHYSTRACK_SUMMARY_CLEAR(tracker, p1 * PHYSTRACK_L2_ENTRIES + p2);
+         }
+      } else if (op == PHYSTRACK_OP_REMOVE) {
+         PANIC();
+      }
+
+      mpn += chunk;
+      numPages -= chunk;
+   }
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrack_AddRange --
+ *
+ *      add numPages contiguous pages starting at mpn to the core map
+ *      tracking.
+ *
+ * Results:
+ *      
+ *      void
+ *
+ * Side effects:
+ *      Fatal if any of the pages is already tracked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PhysTrack_AddRange(PhysTracker *tracker,
+                   MPN mpn,
+                   unsigned int numPages)
+{
+   PhysTrackRange(tracker, mpn, numPages, PHYSTRACK_OP_ADD);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrack_RemoveRange --
+ *
+ *      remove numPages contiguous pages starting at mpn from the core
+ *      map tracking.
+ *
+ * Results:
+ *      
+ *      void
+ *
+ * Side effects:
+ *      Fatal if any of the pages is not tracked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PhysTrack_RemoveRange(PhysTracker *tracker,
+                      MPN mpn,
+                      unsigned int numPages)
+{
+   PhysTrackRange(tracker, mpn, numPages, PHYSTRACK_OP_REMOVE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PhysTrack_CountRange --
+ *
+ *      count tracked pages among numPages contiguous pages starting
+ *      at mpn.
+ *
+ * Results:
+ *      
+ *      Number of tracked pages in the range.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned int
+PhysTrack_CountRange(const PhysTracker *tracker,
+                     MPN mpn,
+                     unsigned int numPages)
+{
+   /* PHYSTRACK_OP_COUNT does not modify the tracker. */
+   return PhysTrackRange((PhysTracker *)tracker, mpn, numPages,
+                         PHYSTRACK_OP_COUNT);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -510,36 +930,45 @@ PhysTrack_GetNext(const PhysTracker *tracker,
    unsigned int p1;
    unsigned int p2;
    unsigned int p3;
+   unsigned int idx;
 
    mpn++; /* We want the next MPN. */
 
    PHYSTRACK_MPN2IDX(mpn, p1, p2, p3);
 
    ASSERT(tracker);
-   for (; p1 < PHYSTRACK_L1_ENTRIES; p1++) {
-      PhysTrackerL2 *dir2;
+   if (p1 >= PHYSTRACK_L1_ENTRIES) {
+      return INVALID_MPN;
+   }
 
-      dir2 = tracker->dir[p1];
-      if (dir2) {
-         for (; p2 < PHYSTRACK_L2_ENTRIES; p2++) {
-            PhysTrackerL3 *dir3;
+   /*
+    * Walk the summary bitmap to the next non-empty L3 table at or
+    * after the one holding mpn, then scan that table word by word.
+    */
 
-            dir3 = PHYSTRACK_GETL3(dir2, p2);
-            if (dir3) {
-               for (; p3 < PHYSTRACK_L3_ENTRIES; p3++) {
-                  unsigned int pos;
-                  unsigned int bit;
-
-                  PHYSTRACK_GETL3POS(p3, pos, bit);
-                  if (dir3->bits[pos] & bit) {
-                     return (p1 * PHYSTRACK_L2_ENTRIES + p2) * PHYSTRACK_L3_ENTRIES + p3;
-                  }
-               }
-            }
-            p3 = 0;
-         }
+   idx = p1 * PHYSTRACK_L2_ENTRIES + p2;
+   while (idx < PHYSTRACK_L3_TABLES) {
+      uint64 word = tracker->summary[idx / 64] & (~CONST64U(0) << (idx % 64));
+      unsigned int next;
+
+      if (!word) {
+         idx = (idx / 64 + 1) * 64;
+         p3 = 0;
+         continue;
+      }
+      next = (idx / 64) * 64 + PhysTrackFirstSet(word);
+      if (next != idx) {
+         idx = next;
+         p3 = 0;
+      }
+
+      p3 = PhysTrackL3Next(PHYSTRACK_GETL3(tracker->dir[idx / PHYSTRACK_L2_ENTRIES],
+                                           idx % PHYSTRACK_L2_ENTRIES), p3);
+      if (p3 < PHYSTRACK_L3_ENTRIES) {
+         return (MPN)idx * PHYSTRACK_L3_ENTRIES + p3;
       }
-      p2 = 0; p3 = 0;
+      idx++;
+      p3 = 0;
    }
    return INVALID_MPN;
 }
@@ -37,6 +37,10 @@ EXTERN struct PhysTracker *PhysTrack_Init(void);
 EXTERN void PhysTrack_Add(struct PhysTracker *, MPN );
 EXTERN void PhysTrack_Remove(struct PhysTracker *, MPN );
 EXTERN Bool PhysTrack_Test(const struct PhysTracker *, MPN );
+EXTERN void PhysTrack_AddRange(struct PhysTracker *, MPN, unsigned int);
+EXTERN void PhysTrack_RemoveRange(struct PhysTracker *, MPN, unsigned int);
+EXTERN unsigned int PhysTrack_CountRange(const struct PhysTracker *, MPN,
+                                         unsigned int);
 EXTERN MPN  PhysTrack_GetNext(const struct PhysTracker *, MPN );
 
 EXTERN void PhysTrack_Cleanup(struct PhysTracker *);
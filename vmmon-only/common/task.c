@@ -1905,6 +1905,7 @@ Task_Switch(VMDriver *vm,  // IN
 #endif
 
       vm->currentHostCpu[vcpuid] = pCPU;
+      Vmx86_MonitorPollEnter(vm, vcpuid, pCPU);
 
       /*
        * The 32-bit switchNMI handlers assume there is a data segment at what
@@ -2250,6 +2251,7 @@ Task_Switch(VMDriver *vm,  // IN
        */
       TaskLoadIDT64(&hostIDT64);
 
+      Vmx86_MonitorPollExit(vm->currentHostCpu[vcpuid]);
       vm->currentHostCpu[vcpuid] = INVALID_HOST_CPU;
       /*
        * If we got an NMI, do an INT 2 so the host will see it.  Theoretically,
@@ -129,6 +129,8 @@ typedef struct HVEnableData {
    Bool hvForce;       // IN: whether to force HV if possible
 } HVEnableData;
 
+static void Vmx86MonitorPollQuiesce(void);
+
 
 
 
@@ -781,6 +783,7 @@ Vmx86_ReleaseVM(VMDriver *vm)
    HostIF_GlobalLock(1);
    Vmx86DeleteVMFromList(vm);
    HostIF_GlobalUnlock(1);
+   Vmx86MonitorPollQuiesce();
    Vmx86FreeAllVMResources(vm);
 
    return 0;
@@ -1459,6 +1462,123 @@ Vmx86_SetHostClockRate(VMDriver *vm,  // IN: VM instance pointer
 }
 
 
+/*
+ * VCPUs currently in the monitor, one slot per host CPU.  Only these
+ * can need a MonitorPoll IPI, so the fast clock looks at them instead
+ * of every VCPU of every VM under the global lock.  A slot is written
+ * only by its own CPU, with interrupts disabled, from Task_Switch; vm
+ * is set last and cleared first so a reader that sees the same vm
+ * before and after reading vcpuid has a consistent pair.
+ * monitorPollScanSeq is odd while a scan is in progress and lets
+ * Vmx86_ReleaseVM wait for the one scan that may still look at the VM
+ * it is about to free; it also keeps scans from overlapping.
+ */
+
+typedef struct MonitorPollSlot {
+   VMDriver * volatile vm;
+   volatile Vcpuid     vcpuid;
+} MonitorPollSlot;
+
+static MonitorPollSlot monitorPollSlots[MAX_PROCESSORS];
+static Atomic_uint32 monitorPollInMonitor;  // VCPUs in the monitor
+static Atomic_uint32 monitorPollNumCPUs;    // highest slot used + 1
+static Atomic_uint32 monitorPollScanSeq;    // odd while scanning
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_MonitorPollEnter --
+ * Vmx86_MonitorPollExit --
+ *
+ *      Record that a VCPU enters or leaves the monitor on host CPU
+ *      pCPU.  Called from Task_Switch with interrupts disabled.
+ *      Entering with a MonitorPoll deadline pending arms the host's
+ *      per-CPU fast clock, if it has one.  A deadline set later, from
+ *      within the monitor, is caught by Vmx86_MonitorPollIPI.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Vmx86_MonitorPollEnter(VMDriver *vm,   // IN:
+                       Vcpuid vcpuid,  // IN:
+                       uint32 pCPU)    // IN:
+{
+   MonitorPollSlot *slot;
+   uint32 numCPUs;
+
+   if (pCPU >= MAX_PROCESSORS) {
+      return;
+   }
+   slot = &monitorPollSlots[pCPU];
+   slot->vcpuid = vcpuid;
+   COMPILER_MEM_BARRIER();
+   slot->vm = vm;
+   while ((numCPUs = Atomic_Read(&monitorPollNumCPUs)) <= pCPU &&
+          Atomic_ReadIfEqualWrite(&monitorPollNumCPUs, numCPUs,
+                                  pCPU + 1) != numCPUs) {
+   }
+   Atomic_Inc(&monitorPollInMonitor);
+
+   if (vcpuid < vm->numVCPUs && vm->crosspage[vcpuid] != NULL) {
+      VmAbsoluteTS expiry = vm->crosspage[vcpuid]->monitorPollExpiry;
+
+      if (expiry != 0) {
+         HostIF_FastClockArm(pCPU, expiry);
+      }
+   }
+}
+
+void
+Vmx86_MonitorPollExit(uint32 pCPU)  // IN:
+{
+   if (pCPU >= MAX_PROCESSORS) {
+      return;
+   }
+   monitorPollSlots[pCPU].vm = NULL;
+   Atomic_Dec(&monitorPollInMonitor);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86MonitorPollQuiesce --
+ *
+ *      Wait for the scan of Vmx86_MonitorPollIPI in progress, if any,
+ *      to finish.  Once no VCPU of a VM is in the monitor, later scans
+ *      cannot see the VM any more, so they are not waited for.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Vmx86MonitorPollQuiesce(void)
+{
+   uint32 seq = Atomic_Read(&monitorPollScanSeq);
+
+   if ((seq & 1) == 0) {
+      return;
+   }
+   while (Atomic_Read(&monitorPollScanSeq) == seq) {
+      PAUSE();
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1470,6 +1590,11 @@ Vmx86_SetHostClockRate(VMDriver *vm,  // IN: VM instance pointer
  *      Otherwise does not need to be called at all, as the normal
  *      timer interrupts will wake up MonitorPoll often enough.
  *
+ *      Only the VCPUs recorded by Vmx86_MonitorPollEnter are looked
+ *      at, without the global lock, and nothing at all when no VCPU
+ *      is in the monitor.  A call that finds another scan in progress
+ *      returns; that scan covers it.
+ *
  * Results:
  *      None.
  *
@@ -1482,39 +1607,55 @@ Vmx86_SetHostClockRate(VMDriver *vm,  // IN: VM instance pointer
 void
 Vmx86_MonitorPollIPI(void)
 {
-   VMDriver *vm;
    VmAbsoluteTS pNow, expiry;
-   Bool sentIPI;
-   /*
-    * Loop through all vms -- needs the global lock to protect vmDriverList.
-    */
-   HostIF_GlobalLock(21);
+   uint32 numCPUs;
+   uint32 pCPU;
+   uint32 seq;
+
+   if (Atomic_Read(&monitorPollInMonitor) == 0) {
+      return;
+   }
 
+   seq = Atomic_Read(&monitorPollScanSeq);
+   if ((seq & 1) != 0 ||
+       Atomic_ReadIfEqualWrite(&monitorPollScanSeq, seq, seq + 1) != seq) {
+      return;
+   }
    pNow = Vmx86_GetPseudoTSC();
-   
-   for (vm = vmDriverList; vm != NULL; vm = vm->nextDriver) {
+   numCPUs = Atomic_Read(&monitorPollNumCPUs);
+
+   for (pCPU = 0; pCPU < numCPUs; pCPU++) {
+      MonitorPollSlot *slot = &monitorPollSlots[pCPU];
+      VMDriver *vm = slot->vm;
+      VMCrossPage *crosspage;
       Vcpuid v;
-      VCPUSet expiredVCPUs = VCPUSet_Empty();
-      for (v = 0; v < vm->numVCPUs; v++) {
-         VMCrossPage *crosspage = vm->crosspage[v];
-         if (!crosspage) {
-            continue;  // VCPU is not initialized yet
-         }
-         expiry = crosspage->monitorPollExpiry;
-         if (expiry && COMPARE_TS(expiry, <=, pNow)) {
-            expiredVCPUs = VCPUSet_Include(expiredVCPUs, v);
-         }
+
+      if (vm == NULL) {
+         continue;
+      }
+      COMPILER_MEM_BARRIER();
+      v = slot->vcpuid;
+      COMPILER_MEM_BARRIER();
+      if (slot->vm != vm || v >= vm->numVCPUs) {
+         continue;  // VCPU left the monitor meanwhile
       }
-      if (!VCPUSet_IsEmpty(expiredVCPUs)) {
+      crosspage = vm->crosspage[v];
+      if (!crosspage) {
+         continue;
+      }
+      expiry = crosspage->monitorPollExpiry;
+      if (expiry && COMPARE_TS(expiry, <=, pNow)) {
          Bool didBroadcast = FALSE;
-         sentIPI = HostIF_IPI(vm, expiredVCPUs, TRUE, &didBroadcast);
+
+         HostIF_IPI(vm, VCPUSet_Include(VCPUSet_Empty(), v), TRUE,
+                    &didBroadcast);
          if (didBroadcast) {
-            // no point in doing a broadcast for more than one VM.
+            // no point in doing more than one broadcast.
             break;
          }
       }
    }
-   HostIF_GlobalUnlock(21);
+   Atomic_Inc(&monitorPollScanSeq);
 }
 
 
@@ -1846,6 +1987,247 @@ Vmx86_UnlockPageByMPN(VMDriver *vm, // IN: VMDriver
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_LockLargePage --
+ *
+ *      Lock a 2MB large page.  It is accounted as the small pages it
+ *      is made of.
+ *
+ * Results:
+ *      The first MPN of the large page, or a PAGE_LOCK_* error code.
+ *
+ * Side effects:
+ *      Number of global and per-VM locked pages increased.
+ *
+ *----------------------------------------------------------------------
+ */
+
+MPN
+Vmx86_LockLargePage(VMDriver *vm,  // IN: VMDriver
+                    VA64 uAddr)    // IN: VA of the large page to lock
+{
+   MPN mpn;
+
+   if (!Vmx86ReserveFreePages(vm, VM_PAE_LARGE_2_SMALL_PAGES)) {
+      return PAGE_LOCK_LIMIT_EXCEEDED;
+   }
+
+   HostIF_VMLock(vm, 21);
+   mpn = HostIF_LockLargePage(vm, uAddr);
+   HostIF_VMUnlock(vm, 21);
+
+   if (!PAGE_LOCK_SUCCESS(mpn)) {
+      Vmx86UnreserveFreePages(vm, VM_PAE_LARGE_2_SMALL_PAGES);
+   }
+
+   return mpn;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_UnlockLargePage --
+ *
+ *      Unlock a large page locked by Vmx86_LockLargePage.
+ *
+ * Results:
+ *      PAGE_UNLOCK_NO_ERROR or a PAGE_UNLOCK_* error code.
+ *
+ * Side effects:
+ *      Number of global and per-VM locked pages decreased.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_UnlockLargePage(VMDriver *vm,  // IN
+                      VA64 uAddr)    // IN
+{
+   int retval;
+
+   HostIF_VMLock(vm, 22);
+   retval = HostIF_UnlockLargePage(vm, uAddr);
+   HostIF_VMUnlock(vm, 22);
+
+   if (PAGE_LOCK_SUCCESS(retval)) {
+      Vmx86UnreserveFreePages(vm, VM_PAE_LARGE_2_SMALL_PAGES);
+   }
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_LockPages --
+ *
+ *      Lock a batch of user pages.  The locked memory for the whole
+ *      batch is reserved up front and the VM lock is taken once; the
+ *      reservation for pages that failed to lock is returned at the end.
+ *
+ * Results:
+ *      Number of pages locked, or PAGE_LOCK_LIMIT_EXCEEDED if the batch
+ *      does not fit within the locked page limits.  results[] receives
+ *      the MPN or PAGE_LOCK_* code of each page, in range order.
+ *
+ * Side effects:
+ *      Number of global and per-VM locked pages increased.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_LockPages(VMDriver *vm,                  // IN: VMDriver
+                const VMLockPageRange *ranges, // IN: runs of user pages
+                unsigned numRanges,            // IN:
+                unsigned numPages,             // IN: total pages in ranges
+                Bool allowMultipleMPNsPerVA,   // IN:
+                int32 *results)                // OUT: MPN or error per page
+{
+   unsigned i;
+   int numLocked = 0;
+
+   if (!Vmx86ReserveFreePages(vm, numPages)) {
+      return PAGE_LOCK_LIMIT_EXCEEDED;
+   }
+
+   HostIF_VMLock(vm, 25);
+   for (i = 0; i < numRanges; i++) {
+      numLocked += HostIF_LockPages(vm, ranges[i].addr, ranges[i].numPages,
+                                    allowMultipleMPNsPerVA, results);
+      results += ranges[i].numPages;
+   }
+   HostIF_VMUnlock(vm, 25);
+
+   if (numLocked < numPages) {
+      Vmx86UnreserveFreePages(vm, numPages - numLocked);
+   }
+
+   return numLocked;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_UnlockPages --
+ *
+ *      Unlock a batch of pages under a single acquisition of the VM
+ *      lock.  If byMPN, results[] holds the MPNs to unlock on input and
+ *      the ranges only supply the (optional) user VAs.
+ *
+ * Results:
+ *      Number of pages unlocked.  results[] receives the PAGE_UNLOCK_*
+ *      code of each page, in range order.
+ *
+ * Side effects:
+ *      Number of global and per-VM locked pages decreased.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_UnlockPages(VMDriver *vm,                  // IN: VMDriver
+                  const VMLockPageRange *ranges, // IN: runs of user pages
+                  unsigned numRanges,            // IN:
+                  unsigned numPages,             // IN: total pages in ranges
+                  Bool byMPN,                    // IN: results[] holds MPNs
+                  int32 *results)                // IN/OUT:
+{
+   unsigned i;
+   unsigned j;
+   int numUnlocked = 0;
+
+   HostIF_VMLock(vm, 26);
+   for (i = 0; i < numRanges; i++) {
+      for (j = 0; j < ranges[i].numPages; j++) {
+         VA64 uAddr = ranges[i].addr + (VA64)j * PAGE_SIZE;
+         int retval;
+
+         if (byMPN) {
+            retval = HostIF_UnlockPageByMPN(vm, (MPN)(uint32)*results, uAddr);
+         } else {
+            retval = HostIF_UnlockPage(vm, uAddr);
+         }
+         if (PAGE_LOCK_SUCCESS(retval)) {
+            numUnlocked++;
+         }
+         *results++ = retval;
+      }
+   }
+   HostIF_VMUnlock(vm, 26);
+
+   if (numUnlocked > 0) {
+      Vmx86UnreserveFreePages(vm, numUnlocked);
+   }
+
+   return numUnlocked;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_UndoLockPages --
+ *
+ *      Unlock the pages that a Vmx86_LockPages call with the same
+ *      arguments reported as locked in results[], for when the results
+ *      cannot be handed back to userlevel.  Pages that failed to lock,
+ *      possibly because they were locked before, are left alone.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Number of global and per-VM locked pages decreased.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Vmx86_UndoLockPages(VMDriver *vm,                  // IN: VMDriver
+                    const VMLockPageRange *ranges, // IN: runs of user pages
+                    unsigned numRanges,            // IN:
+                    unsigned numPages,             // IN: total pages in ranges
+                    Bool allowMultipleMPNsPerVA,   // IN:
+                    const int32 *results)          // IN: from Vmx86_LockPages
+{
+   unsigned i;
+   unsigned j;
+   int numUnlocked = 0;
+
+   HostIF_VMLock(vm, 27);
+   for (i = 0; i < numRanges; i++) {
+      for (j = 0; j < ranges[i].numPages; j++) {
+         VA64 uAddr = ranges[i].addr + (VA64)j * PAGE_SIZE;
+         int32 mpn = *results++;
+         int retval;
+
+         if (!PAGE_LOCK_SUCCESS(mpn)) {
+            continue;
+         }
+         if (allowMultipleMPNsPerVA) {
+            retval = HostIF_UnlockPageByMPN(vm, (MPN)(uint32)mpn, uAddr);
+         } else {
+            retval = HostIF_UnlockPage(vm, uAddr);
+         }
+         if (PAGE_LOCK_SUCCESS(retval)) {
+            numUnlocked++;
+         }
+      }
+   }
+   HostIF_VMUnlock(vm, 27);
+
+   ASSERT(numUnlocked <= numPages);
+   if (numUnlocked > 0) {
+      Vmx86UnreserveFreePages(vm, numUnlocked);
+   }
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1998,12 +2380,116 @@ Vmx86_GetLockedPageList(VMDriver *vm,          // IN: VM instance pointer
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_COWShare --
+ *
+ *      Share a batch of guest pages with identical pages of this or
+ *      other VMs.  See HostIF_COWShare.
+ *
+ * Results:
+ *      Number of pages shared, or negative error code.
+ *
+ * Side effects:
+ *      Updates the VM's count of shared pages.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_COWShare(VMDriver *vm,         // IN:
+               COWShareInfo *info)   // IN/OUT:
+{
+   unsigned int numNew;
+   int ret;
+
+   HostIF_VMLock(vm, 18);
+   ret = HostIF_COWShare(vm, info, &numNew);
+   if (ret >= 0) {
+      vm->memInfo.shared += numNew;
+   }
+   HostIF_VMUnlock(vm, 18);
+
+   return ret;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_COWIncZeroRef --
+ *
+ *      Back a guest page with the shared zero page.
+ *
+ * Results:
+ *      0 on success, negative error code on failure.
+ *
+ * Side effects:
+ *      Updates the VM's count of shared pages.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_COWIncZeroRef(VMDriver *vm,  // IN:
+                    BPN bpn)       // IN:
+{
+   int ret;
+
+   HostIF_VMLock(vm, 19);
+   ret = HostIF_COWIncZeroRef(vm, bpn);
+   if (ret > 0) {
+      vm->memInfo.shared++;
+      ret = 0;
+   }
+   HostIF_VMUnlock(vm, 19);
+
+   return ret;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vmx86_COWCopyPage --
+ *
+ *      Break sharing of a guest page by copying it to a private page.
+ *
+ * Results:
+ *      0 on success, negative error code on failure.
+ *
+ * Side effects:
+ *      Updates the VM's count of shared pages.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Vmx86_COWCopyPage(VMDriver *vm,  // IN:
+                  BPN bpn,       // IN:
+                  MPN mpn)       // IN: private destination page
+{
+   int ret;
+
+   HostIF_VMLock(vm, 20);
+   ret = HostIF_COWCopyPage(vm, bpn, mpn);
+   if (ret == 0) {
+      ASSERT(vm->memInfo.shared > 0);
+      vm->memInfo.shared--;
+   }
+   HostIF_VMUnlock(vm, 20);
+
+   return ret;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * Vmx86COWStats --
  *
- *       Fill structure with no data...
+ *       Fill structure with the global page sharing statistics.
  *
  * Results:
  *       None.
@@ -2017,19 +2503,7 @@ Vmx86_GetLockedPageList(VMDriver *vm,          // IN: VM instance pointer
 static void
 Vmx86COWStats(VMMemCOWInfo *info)
 {
-   int i;
-
-   for (i = 0; i < VMMEM_COW_HOT_PAGES; i++) {
-      info->hot[i].mpn = INVALID_MPN;
-      info->hot[i].ref = 0;
-      info->hot[i].key = 0;
-      info->hot[i].pageClass = PC_UNKNOWN;
-   }
-   info->numRef = 0;
-   info->numHints = 0;
-   info->uniqueMPNs = 0;
-   info->numBreaks = 0;
-   info->totalUniqueMPNs = 0;
+   HostIF_COWGetStats(info);
 }
 
 
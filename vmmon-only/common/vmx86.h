@@ -99,6 +99,18 @@ extern int Vmx86_SetHostClockRate(VMDriver *vm, int rate);
 extern MPN Vmx86_LockPage(VMDriver *vm, VA64 uAddr, Bool allowMultipleMPNsPerVA);
 extern int Vmx86_UnlockPage(VMDriver *vm, VA64 uAddr);
 extern int Vmx86_UnlockPageByMPN(VMDriver *vm, MPN mpn, VA64 uAddr);
+extern MPN Vmx86_LockLargePage(VMDriver *vm, VA64 uAddr);
+extern int Vmx86_UnlockLargePage(VMDriver *vm, VA64 uAddr);
+extern int Vmx86_LockPages(VMDriver *vm, const VMLockPageRange *ranges,
+                           unsigned numRanges, unsigned numPages,
+                           Bool allowMultipleMPNsPerVA, int32 *results);
+extern int Vmx86_UnlockPages(VMDriver *vm, const VMLockPageRange *ranges,
+                             unsigned numRanges, unsigned numPages,
+                             Bool byMPN, int32 *results);
+extern void Vmx86_UndoLockPages(VMDriver *vm, const VMLockPageRange *ranges,
+                                unsigned numRanges, unsigned numPages,
+                                Bool allowMultipleMPNsPerVA,
+                                const int32 *results);
 extern MPN Vmx86_GetRecycledPage(VMDriver *vm);
 extern int Vmx86_ReleaseAnonPage(VMDriver *vm, MPN mpn);
 extern int Vmx86_AllocLockedPages(VMDriver *vm, VA64 addr,
@@ -108,6 +120,9 @@ extern int Vmx86_FreeLockedPages(VMDriver *vm, VA64 addr,
 extern int Vmx86_GetLockedPageList(VMDriver *vm, VA64 uAddr,
 				   unsigned int numPages);
 extern Bool Vmx86_IsAnonPage(VMDriver *vm, const MPN32 mpn);
+extern int Vmx86_COWShare(VMDriver *vm, COWShareInfo *info);
+extern int Vmx86_COWIncZeroRef(VMDriver *vm, BPN bpn);
+extern int Vmx86_COWCopyPage(VMDriver *vm, BPN bpn, MPN mpn);
 
 extern int32 Vmx86_GetNumVMs(void);
 extern int32 Vmx86_GetTotalMemUsage(void);
@@ -133,6 +148,8 @@ extern Bool Vmx86_GetAllMSRs(MSRQuery *query);
 extern Bool Vmx86_BrokenCPUHelper(void);
 extern void Vmx86_CompleteUserCall(VMDriver *vm, Vcpuid vcpuid);
 extern void Vmx86_MonitorPollIPI(void);
+extern void Vmx86_MonitorPollEnter(VMDriver *vm, Vcpuid vcpuid, uint32 pCPU);
+extern void Vmx86_MonitorPollExit(uint32 pCPU);
 extern void Vmx86_InitIDList(void);
 extern VMDriver *Vmx86_LookupVMByUserID(int userID);
 extern Bool Vmx86_FastSuspResSetOtherFlag(VMDriver *vm, int otherVmUserId);
@@ -336,6 +336,11 @@ enum IOCTLCmd {
    IOCTLCMD(USING_SWAPBACKED_PAGEFILE),
    IOCTLCMD(USING_MLOCK),
    IOCTLCMD(SET_HOST_SWAP_SIZE),
+   IOCTLCMD(LOCK_PAGES),
+   IOCTLCMD(UNLOCK_PAGES),
+   IOCTLCMD(LOCK_LARGE_PAGE),
+   IOCTLCMD(UNLOCK_LARGE_PAGE),
+   IOCTLCMD(REGISTER_SEMAPHORE),
 #endif
 
    // Must be last.
@@ -679,6 +684,46 @@ typedef struct VMMUnlockPageByMPN {
    VA64      uAddr;	    /* IN: User VA of the page (optional). */
 } VMMUnlockPageByMPN;
 
+/*
+ * Batched LOCK_PAGES / UNLOCK_PAGES.  'ranges' is an array of numRanges
+ * runs of contiguous user pages; 'results' is an array of int32, one per
+ * page in range order, receiving the MPN or PAGE_LOCK_* / PAGE_UNLOCK_*
+ * code of that page.  With VMLOCKPAGES_BY_MPN, LOCK_PAGES behaves like
+ * LOCK_PAGE_NEW and UNLOCK_PAGES like UNLOCK_PAGE_BY_MPN; in the latter
+ * case 'results' also carries the MPNs to unlock on input.  The ioctl
+ * returns the number of pages successfully (un)locked.
+ */
+
+#define VMLOCKPAGES_BY_MPN      0x1
+#define VMLOCKPAGES_MAX_RANGES  1024
+#define VMLOCKPAGES_MAX_PAGES   4096
+
+typedef struct VMLockPageRange {
+   VA64      addr;      /* IN: User VA of the first page. */
+   uint32    numPages;  /* IN */
+   uint32    pad;
+} VMLockPageRange;
+
+typedef struct VMLockPages {
+   uint32    numRanges; /* IN */
+   uint32    flags;     /* IN: VMLOCKPAGES_* */
+   VA64      ranges;    /* IN: User VA of VMLockPageRange[numRanges]. */
+   VA64      results;   /* IN/OUT: User VA of int32[total pages]. */
+} VMLockPages;
+
+/*
+ * REGISTER_SEMAPHORE: the fds of a VCPU's halt semaphore, which must be
+ * eventfds.  Once registered, MODULECALL_SEMAWAIT/SEMASIGNAL on them
+ * are handled without file lookups until the VM is released.
+ */
+
+typedef struct VMSemaphoreRegister {
+   uint32    vcpuid;    /* IN */
+   int32     waitFD;    /* IN: fd the VCPU waits on. */
+   int32     signalFD;  /* IN: fd used to wake the VCPU. */
+   uint32    pad;
+} VMSemaphoreRegister;
+
 typedef struct VMMReadWritePage {
    MPN32        mpn; // IN
    uint32       pad;
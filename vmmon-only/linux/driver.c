@@ -158,6 +158,15 @@ static int LinuxDriverPM24Callback(struct pm_dev *dev, pm_request_t rqst, void *
 
 struct VMXLinuxState linuxState;
 
+/*
+ * If non-zero, run the MemTrack lookup benchmark over this many pages
+ * at module load and log the average probe lengths.
+ */
+static unsigned int memtrack_bench;
+module_param(memtrack_bench, uint, 0444);
+MODULE_PARM_DESC(memtrack_bench, "Pages for the MemTrack lookup benchmark "
+                 "run at load time (0 disables it).");
+
 
 /*
  *----------------------------------------------------------------------
@@ -505,6 +514,9 @@ init_module(void)
     * (2.6.10 kernels and LOWER; later kernels are GPL-only symbols.)
     */
    Vmx86_FixHVEnable(FALSE);
+
+   MemTrack_Benchmark(memtrack_bench);
+
 #ifdef DO_PM24
    LinuxDriverPMDev = pm_register(PM_UNKNOWN_DEV,
                                   PM_SYS_UNKNOWN,
@@ -559,6 +571,7 @@ cleanup_module(void)
    Log("Module %s: unloaded\n", linuxState.deviceName);
 
    compat_del_timer_sync(&linuxState.pollTimer);
+   kfree(linuxState.pollHeap);
    compat_del_timer_sync(&tscTimer);
 
    Task_Terminate();
@@ -568,7 +581,7 @@ cleanup_module(void)
    HostIF_FastClockUnlock(1);
 
    HostIF_CleanupUptime();
-
+   HostIF_COWCleanup();
 
    Vmx86_DestroyNUMAInfo();
 
@@ -579,6 +592,219 @@ cleanup_module(void)
 
 
 
+/*
+ * Fast poll deadlines.
+ *
+ * VMLinux instances waiting in LinuxDriverPoll for a fast clock tick
+ * are kept in a binary min-heap ordered by pollTime, so that each tick
+ * only looks at the instances that are due.  Every instance knows its
+ * slot (pollIndex, -1 when not queued) so that it can be removed in
+ * O(log n) when closed.  The heap has a slot reserved for each open
+ * instance, so queuing never needs to allocate.  All of this is
+ * protected by the poll list lock.
+ */
+
+static INLINE void
+LinuxDriverPollHeapSet(unsigned int i,  // IN: slot
+                       VMLinux *p)      // IN:
+{
+   linuxState.pollHeap[i] = p;
+   p->pollIndex = i;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LinuxDriverPollHeapUp --
+ * LinuxDriverPollHeapDown --
+ *
+ *      Restore the heap order by moving the entry at slot i towards the
+ *      root or towards the leaves.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LinuxDriverPollHeapUp(unsigned int i)  // IN:
+{
+   VMLinux *p = linuxState.pollHeap[i];
+
+   while (i > 0) {
+      unsigned int parent = (i - 1) / 2;
+
+      if (linuxState.pollHeap[parent]->pollTime <= p->pollTime) {
+         break;
+      }
+      LinuxDriverPollHeapSet(i, linuxState.pollHeap[parent]);
+      i = parent;
+   }
+   LinuxDriverPollHeapSet(i, p);
+}
+
+static void
+LinuxDriverPollHeapDown(unsigned int i)  // IN:
+{
+   VMLinux **heap = linuxState.pollHeap;
+   VMLinux *p = heap[i];
+
+   for (;;) {
+      unsigned int child = 2 * i + 1;
+
+      if (child >= linuxState.pollHeapSize) {
+         break;
+      }
+      if (child + 1 < linuxState.pollHeapSize &&
+          heap[child + 1]->pollTime < heap[child]->pollTime) {
+         child++;
+      }
+      if (p->pollTime <= heap[child]->pollTime) {
+         break;
+      }
+      LinuxDriverPollHeapSet(i, heap[child]);
+      i = child;
+   }
+   LinuxDriverPollHeapSet(i, p);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LinuxDriverPollHeapInsert --
+ *
+ *      Queue an instance for a wakeup at its pollTime.  Called with the
+ *      poll list lock held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LinuxDriverPollHeapInsert(VMLinux *p)  // IN:
+{
+   ASSERT(p->pollIndex < 0);
+   ASSERT(linuxState.pollHeapSize < linuxState.pollHeapMax);
+
+   linuxState.pollHeap[linuxState.pollHeapSize] = p;
+   LinuxDriverPollHeapUp(linuxState.pollHeapSize++);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LinuxDriverPollHeapRemove --
+ *
+ *      Dequeue an instance.  Called with the poll list lock held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+LinuxDriverPollHeapRemove(VMLinux *p)  // IN:
+{
+   unsigned int i = p->pollIndex;
+   VMLinux *last;
+
+   ASSERT(p->pollIndex >= 0 && linuxState.pollHeap[i] == p);
+
+   last = linuxState.pollHeap[--linuxState.pollHeapSize];
+   p->pollIndex = -1;
+   if (last != p) {
+      LinuxDriverPollHeapSet(i, last);
+      LinuxDriverPollHeapUp(i);
+      LinuxDriverPollHeapDown(last->pollIndex);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LinuxDriverPollHeapReserve --
+ *
+ *      Reserve a heap slot for a new instance, growing the heap if
+ *      needed.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+LinuxDriverPollHeapReserve(void)
+{
+#ifdef POLLSPINLOCK
+   unsigned long flags;
+
+   spin_lock_irqsave(&linuxState.pollListLock, flags);
+#else
+   HostIF_PollListLock(3);
+#endif
+   while (linuxState.pollHeapUsers == linuxState.pollHeapMax) {
+      unsigned int newMax = linuxState.pollHeapMax ?
+                            2 * linuxState.pollHeapMax : 16;
+      VMLinux **heap;
+
+#ifdef POLLSPINLOCK
+      spin_unlock_irqrestore(&linuxState.pollListLock, flags);
+#else
+      HostIF_PollListUnlock(3);
+#endif
+      heap = kmalloc(newMax * sizeof *heap, GFP_KERNEL);
+      if (heap == NULL) {
+         return -ENOMEM;
+      }
+#ifdef POLLSPINLOCK
+      spin_lock_irqsave(&linuxState.pollListLock, flags);
+#else
+      HostIF_PollListLock(3);
+#endif
+      if (linuxState.pollHeapMax < newMax) {
+         VMLinux **old = linuxState.pollHeap;
+
+         if (linuxState.pollHeapSize != 0) {
+            memcpy(heap, old, linuxState.pollHeapSize * sizeof *heap);
+         }
+         linuxState.pollHeap = heap;
+         linuxState.pollHeapMax = newMax;
+         heap = old;
+      }
+      kfree(heap);
+   }
+   linuxState.pollHeapUsers++;
+#ifdef POLLSPINLOCK
+   spin_unlock_irqrestore(&linuxState.pollListLock, flags);
+#else
+   HostIF_PollListUnlock(3);
+#endif
+
+   return 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -605,8 +831,14 @@ LinuxDriver_Open(struct inode *inode, // IN
    }
    memset(vmLinux, 0, sizeof *vmLinux);
 
+   if (LinuxDriverPollHeapReserve() != 0) {
+      kfree(vmLinux);
+      return -ENOMEM;
+   }
+
    sema_init(&vmLinux->lock4Gb, 1);
    init_waitqueue_head(&vmLinux->pollQueue);
+   vmLinux->pollIndex = -1;
 
    filp->private_data = vmLinux;
    LinuxDriverQueue(vmLinux);
@@ -764,11 +996,10 @@ LinuxDriver_Close(struct inode *inode, // IN
 #else
    HostIF_PollListLock(0);
 #endif
-   if (vmLinux->pollBack != NULL) {
-      if ((*vmLinux->pollBack = vmLinux->pollForw) != NULL) {
-	 vmLinux->pollForw->pollBack = vmLinux->pollBack;
-      }
+   if (vmLinux->pollIndex >= 0) {
+      LinuxDriverPollHeapRemove(vmLinux);
    }
+   linuxState.pollHeapUsers--;
 #ifdef POLLSPINLOCK
    spin_unlock_irqrestore(&linuxState.pollListLock, flags);
    }
@@ -784,10 +1015,13 @@ LinuxDriver_Close(struct inode *inode, // IN
 }
 
 
-#define POLLQUEUE_MAX_TASK 1000
-static DEFINE_SPINLOCK(pollQueueLock);
-static void *pollQueue[POLLQUEUE_MAX_TASK];
-static unsigned int pollQueueCount = 0;
+/*
+ * Instances polling without the fast clock wait for the next pollTimer
+ * tick.  Each tick bumps pollQueueGeneration, so an instance is still
+ * waiting as long as the generation it queued in is the current one.
+ */
+
+static atomic_t pollQueueGeneration = ATOMIC_INIT(0);
 
 
 /*
@@ -795,7 +1029,7 @@ static unsigned int pollQueueCount = 0;
  *
  * LinuxDriverQueuePoll --
  *
- *      Remember that current process waits for next timer event.
+ *      Remember that this instance waits for next timer event.
  *
  * Results:
  *      None.
@@ -807,23 +1041,10 @@ static unsigned int pollQueueCount = 0;
  */
 
 static INLINE_SINGLE_CALLER void
-LinuxDriverQueuePoll(void)
+LinuxDriverQueuePoll(VMLinux *vmLinux)  // IN:
 {
-   unsigned long flags;
-
-   spin_lock_irqsave(&pollQueueLock, flags);
-
-   /*
-    * Under normal circumstances every process should be listed
-    * only once in this array. If it becomes problem that process
-    * can be in the array twice, walk array! Maybe you can keep
-    * it sorted by 'current' value then, making IsPollQueued
-    * a bit faster...
-    */
-   if (pollQueueCount < POLLQUEUE_MAX_TASK) {
-      pollQueue[pollQueueCount++] = current;
-   }
-   spin_unlock_irqrestore(&pollQueueLock, flags);
+   vmLinux->pollGeneration = atomic_read(&pollQueueGeneration);
+   vmLinux->pollQueued = TRUE;
 }
 
 
@@ -846,21 +1067,10 @@ LinuxDriverQueuePoll(void)
  */
 
 static INLINE_SINGLE_CALLER int
-LinuxDriverIsPollQueued(void)
+LinuxDriverIsPollQueued(const VMLinux *vmLinux)  // IN:
 {
-   unsigned long flags;
-   unsigned int i;
-   int retval = 0;
-
-   spin_lock_irqsave(&pollQueueLock, flags);
-   for (i = 0; i < pollQueueCount; i++) {
-      if (current == pollQueue[i]) {
-         retval = 1;
-         break;
-      }
-   }
-   spin_unlock_irqrestore(&pollQueueLock, flags);
-   return retval;
+   return vmLinux->pollQueued &&
+          vmLinux->pollGeneration == (uint32)atomic_read(&pollQueueGeneration);
 }
 
 
@@ -883,11 +1093,7 @@ LinuxDriverIsPollQueued(void)
 static INLINE_SINGLE_CALLER void
 LinuxDriverFlushPollQueue(void)
 {
-   unsigned long flags;
-
-   spin_lock_irqsave(&pollQueueLock, flags);
-   pollQueueCount = 0;
-   spin_unlock_irqrestore(&pollQueueLock, flags);
+   atomic_inc(&pollQueueGeneration);
 }
 
 
@@ -910,11 +1116,9 @@ LinuxDriverFlushPollQueue(void)
 void
 LinuxDriverWakeUp(Bool selective)
 {
-   if (selective && linuxState.pollList != NULL) {
+   if (selective && linuxState.pollHeapSize != 0) {
       struct timeval tv;
       VmTimeType now;
-      VMLinux *p;
-      VMLinux *next;
 
       //compat_preempt_disable();
 #ifdef POLLSPINLOCK
@@ -925,16 +1129,12 @@ LinuxDriverWakeUp(Bool selective)
 #endif
       do_gettimeofday(&tv);
       now = tv.tv_sec * 1000000ULL + tv.tv_usec;
-      for (p = linuxState.pollList; p != NULL; p = next) {
-	 next = p->pollForw;
-	 if (p->pollTime <= now) {
-	    if ((*p->pollBack = next) != NULL) {
-	       next->pollBack = p->pollBack;
-	    }
-	    p->pollForw = NULL;
-	    p->pollBack = NULL;
-	    wake_up(&p->pollQueue);
-	 }
+      while (linuxState.pollHeapSize != 0 &&
+             linuxState.pollHeap[0]->pollTime <= now) {
+         VMLinux *p = linuxState.pollHeap[0];
+
+         LinuxDriverPollHeapRemove(p);
+         wake_up(&p->pollQueue);
       }
 #ifdef POLLSPINLOCK
       spin_unlock_irqrestore(&linuxState.pollListLock, flags);
@@ -1003,7 +1203,7 @@ LinuxDriverPoll(struct file *filp,
        */
 
       if (wait == NULL) {
-	 if (vmLinux->pollBack == NULL && !LinuxDriverIsPollQueued()) {
+	 if (vmLinux->pollIndex < 0 && !LinuxDriverIsPollQueued(vmLinux)) {
 	    mask = POLLIN;
 	 }
       } else {
@@ -1011,21 +1211,20 @@ LinuxDriverPoll(struct file *filp,
 	    struct timeval tv;
 	    do_gettimeofday(&tv);
 	    poll_wait(filp, &vmLinux->pollQueue, wait);
-	    vmLinux->pollTime = *vmLinux->pollTimeoutPtr +
-	                        tv.tv_sec * 1000000ULL + tv.tv_usec;
-	    if (vmLinux->pollBack == NULL) {
+	    {
 #ifdef POLLSPINLOCK
 	       unsigned long flags;
 	       spin_lock_irqsave(&linuxState.pollListLock, flags);
 #else
 	       HostIF_PollListLock(2);
 #endif
-	       if (vmLinux->pollBack == NULL) {
-		  if ((vmLinux->pollForw = linuxState.pollList) != NULL) {
-		     vmLinux->pollForw->pollBack = &vmLinux->pollForw;
-		  }
-		  linuxState.pollList = vmLinux;
-		  vmLinux->pollBack = &linuxState.pollList;
+	       vmLinux->pollTime = *vmLinux->pollTimeoutPtr +
+	                           tv.tv_sec * 1000000ULL + tv.tv_usec;
+	       if (vmLinux->pollIndex < 0) {
+		  LinuxDriverPollHeapInsert(vmLinux);
+	       } else {
+		  LinuxDriverPollHeapUp(vmLinux->pollIndex);
+		  LinuxDriverPollHeapDown(vmLinux->pollIndex);
 	       }
 #ifdef POLLSPINLOCK
 	       spin_unlock_irqrestore(&linuxState.pollListLock, flags);
@@ -1034,7 +1233,7 @@ LinuxDriverPoll(struct file *filp,
 #endif
 	    }
 	 } else {
-	    LinuxDriverQueuePoll();
+	    LinuxDriverQueuePoll(vmLinux);
 	    poll_wait(filp, &linuxState.pollQueue, wait);
 	    if (!timer_pending(&linuxState.pollTimer)) {
 	       /*
@@ -1827,6 +2026,29 @@ LinuxDriver_Ioctl(struct inode *inode,
       ASSERT(mpn == (MPN)retval);
    } break;
 
+   case IOCTL_VMX86_LOCK_LARGE_PAGE:
+   case IOCTL_VMX86_UNLOCK_LARGE_PAGE: {
+      VA64 uAddr;
+      MPN mpn;
+
+      if (vmLinux->vm == NULL) {
+	 retval = -EINVAL;
+	 break;
+      }
+      retval = HostIF_CopyFromUser(&uAddr, (void *)ioarg, sizeof uAddr);
+      if (retval) {
+         break;
+      }
+      if (iocmd == IOCTL_VMX86_LOCK_LARGE_PAGE) {
+         mpn = Vmx86_LockLargePage(vmLinux->vm, uAddr);
+      } else {
+         mpn = Vmx86_UnlockLargePage(vmLinux->vm, uAddr);
+      }
+      retval = (int)mpn;
+      // Make sure mpn is within 32 bits.
+      ASSERT(mpn == (MPN)retval);
+   } break;
+
    case IOCTL_VMX86_UNLOCK_PAGE_BY_MPN: {
       VMMUnlockPageByMPN args;
       MPN mpn;
@@ -1845,6 +2067,97 @@ LinuxDriver_Ioctl(struct inode *inode,
       ASSERT(mpn == (MPN)retval);
    } break;
 
+   case IOCTL_VMX86_LOCK_PAGES:
+   case IOCTL_VMX86_UNLOCK_PAGES: {
+      VMLockPages req;
+      VMLockPageRange *ranges;
+      int32 *results;
+      unsigned numPages = 0;
+      unsigned i;
+      Bool byMPN;
+
+      if (vmLinux->vm == NULL) {
+	 retval = -EINVAL;
+	 break;
+      }
+      retval = HostIF_CopyFromUser(&req, (void *)ioarg, sizeof req);
+      if (retval) {
+         break;
+      }
+      if (req.numRanges == 0 || req.numRanges > VMLOCKPAGES_MAX_RANGES) {
+         retval = -EINVAL;
+         break;
+      }
+      byMPN = (req.flags & VMLOCKPAGES_BY_MPN) != 0;
+
+      ranges = HostIF_AllocKernelMem(req.numRanges * sizeof *ranges, FALSE);
+      if (ranges == NULL) {
+         retval = -ENOMEM;
+         break;
+      }
+      retval = HostIF_CopyFromUser(ranges, VA64ToPtr(req.ranges),
+                                   req.numRanges * sizeof *ranges);
+      if (retval) {
+         HostIF_FreeKernelMem(ranges);
+         break;
+      }
+      for (i = 0; i < req.numRanges; i++) {
+         if (ranges[i].numPages > VMLOCKPAGES_MAX_PAGES - numPages) {
+            retval = -EINVAL;
+            break;
+         }
+         numPages += ranges[i].numPages;
+      }
+      if (retval || numPages == 0) {
+         HostIF_FreeKernelMem(ranges);
+         retval = retval ? retval : -EINVAL;
+         break;
+      }
+
+      results = HostIF_AllocKernelMem(numPages * sizeof *results, FALSE);
+      if (results == NULL) {
+         HostIF_FreeKernelMem(ranges);
+         retval = -ENOMEM;
+         break;
+      }
+      if (iocmd == IOCTL_VMX86_UNLOCK_PAGES && byMPN) {
+         retval = HostIF_CopyFromUser(results, VA64ToPtr(req.results),
+                                      numPages * sizeof *results);
+         if (retval) {
+            goto lockPagesDone;
+         }
+      }
+
+      if (iocmd == IOCTL_VMX86_LOCK_PAGES) {
+         retval = Vmx86_LockPages(vmLinux->vm, ranges, req.numRanges,
+                                  numPages, byMPN, results);
+         if (retval == PAGE_LOCK_LIMIT_EXCEEDED) {
+            goto lockPagesDone;
+         }
+      } else {
+         retval = Vmx86_UnlockPages(vmLinux->vm, ranges, req.numRanges,
+                                    numPages, byMPN, results);
+      }
+
+      /*
+       * One copy-out for the whole batch.
+       */
+
+      if (HostIF_CopyToUser(VA64ToPtr(req.results), results,
+                            numPages * sizeof *results)) {
+         /* Userlevel can't learn what it locked, so don't keep it. */
+         if (iocmd == IOCTL_VMX86_LOCK_PAGES) {
+            Vmx86_UndoLockPages(vmLinux->vm, ranges, req.numRanges,
+                                numPages, byMPN, results);
+         }
+         retval = -EFAULT;
+      }
+
+   lockPagesDone:
+      HostIF_FreeKernelMem(results);
+      HostIF_FreeKernelMem(ranges);
+   } break;
+
    case IOCTL_VMX86_LOOK_UP_MPN: {
       VA64 uAddr;
       MPN mpn;
@@ -1863,15 +2176,13 @@ LinuxDriver_Ioctl(struct inode *inode,
       ASSERT(mpn == (MPN)retval);
    } break;
 
-#if defined(__linux__) && defined(VMX86_DEVEL) && defined(VM_X86_64)
-  case IOCTL_VMX86_LOOK_UP_LARGE_MPN: {
+   case IOCTL_VMX86_LOOK_UP_LARGE_MPN: {
       void *addr = (void *)ioarg;
       MPN   mpn; 
       mpn = HostIF_LookupLargeMPN(addr);
       retval = (int)mpn;
       break;
    }
-#endif
 
    case IOCTL_VMX86_GET_NUM_VMS: {
       retval = Vmx86_GetNumVMs();
@@ -2288,6 +2599,22 @@ LinuxDriver_Ioctl(struct inode *inode,
       }
       break;
 
+   case IOCTL_VMX86_REGISTER_SEMAPHORE: {
+      VMSemaphoreRegister args;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      retval = HostIF_CopyFromUser(&args, (void *)ioarg, sizeof args);
+      if (retval) {
+         break;
+      }
+      retval = HostIF_SemaphoreRegister(vmLinux->vm, args.vcpuid,
+                                        args.waitFD, args.signalFD);
+      break;
+   }
+
    case IOCTL_VMX86_READ_PAGE:
       {
          VMMReadWritePage req;
@@ -2314,36 +2641,97 @@ LinuxDriver_Ioctl(struct inode *inode,
 
    case IOCTL_VMX86_COW_SHARE:
    {
-      retval = -ENOTTY;
+      COWShareInfo info;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      retval = HostIF_CopyFromUser(&info, (void *)ioarg, sizeof info);
+      if (retval) {
+         break;
+      }
+      retval = Vmx86_COWShare(vmLinux->vm, &info);
+      if (retval >= 0 &&
+          HostIF_CopyToUser((void *)ioarg, &info, sizeof info) != 0) {
+         retval = -EFAULT;
+      }
       break;
    }
 
    case IOCTL_VMX86_COW_INC_ZERO_REF:
    {
-      retval = -ENOTTY;
+      BPN bpn;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      retval = HostIF_CopyFromUser(&bpn, (void *)ioarg, sizeof bpn);
+      if (retval) {
+         break;
+      }
+      retval = Vmx86_COWIncZeroRef(vmLinux->vm, bpn);
       break;
    }
 
    case IOCTL_VMX86_COW_GET_ZERO_MPN:
    {
-      retval = -ENOTTY;
+      MPN mpn = HostIF_COWGetZeroMPN();
+
+      retval = mpn == INVALID_MPN ? -ENOMEM : mpn;
       break;
    }
+
    case IOCTL_VMX86_COW_CHECK:
    {
-      retval = -ENOTTY;
+      COWCheckInfo info;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      retval = HostIF_CopyFromUser(&info, (void *)ioarg, sizeof info);
+      if (retval) {
+         break;
+      }
+      if (info.numPages > PSHARE_MAX_COW_CHECK_PAGES) {
+         retval = -EINVAL;
+         break;
+      }
+      HostIF_COWCheck(vmLinux->vm, &info);
+      retval = HostIF_CopyToUser((void *)ioarg, &info, sizeof info);
       break;
    }
 
-  case IOCTL_VMX86_COW_UPDATE_HINT:
+   case IOCTL_VMX86_COW_UPDATE_HINT:
    {
-      retval = -ENOTTY;
+      COWHintInfo info;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      /* Only numHints updates are filled in; don't copy out stack. */
+      memset(&info, 0, sizeof info);
+      HostIF_COWUpdateHints(vmLinux->vm, &info);
+      retval = HostIF_CopyToUser((void *)ioarg, &info, sizeof info);
       break;
    }
 
    case IOCTL_VMX86_COW_COPY_PAGE:
    {
-      retval = -ENOTTY;
+      PShare_P2MUpdate update;
+
+      if (vmLinux->vm == NULL) {
+         retval = -EINVAL;
+         break;
+      }
+      retval = HostIF_CopyFromUser(&update, (void *)ioarg, sizeof update);
+      if (retval) {
+         break;
+      }
+      retval = Vmx86_COWCopyPage(vmLinux->vm, update.bpn, update.mpn);
       break;
    }
 
@@ -67,8 +67,9 @@ typedef struct VMLinux {
    volatile uint32 *pollTimeoutPtr;
    struct page *pollTimeoutPage;
    VmTimeType pollTime;
-   struct VMLinux *pollForw;
-   struct VMLinux **pollBack;
+   int pollIndex;            /* Slot in linuxState.pollHeap, -1 if none. */
+   uint32 pollGeneration;    /* See LinuxDriverQueuePoll(). */
+   Bool pollQueued;
 
 #ifdef CONFIG_IOMMU_API
    struct iommu_domain *iommuDomain;
@@ -103,7 +104,10 @@ typedef struct VMXLinuxState {
    struct timer_list pollTimer;
    wait_queue_head_t pollQueue;
 
-   struct VMLinux *pollList;
+   struct VMLinux **pollHeap;    /* Min-heap of waiters by pollTime. */
+   unsigned int pollHeapSize;    /* Waiters in the heap. */
+   unsigned int pollHeapMax;     /* Allocated slots. */
+   unsigned int pollHeapUsers;   /* Reserved slots (open instances). */
 #ifdef POLLSPINLOCK
    spinlock_t pollListLock;
 #endif
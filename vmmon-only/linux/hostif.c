@@ -67,6 +67,8 @@
 #include "modulecall.h"
 #include "memtrack.h"
 #include "phystrack.h"
+#include "hashFunc.h"
+#include "pageUtil.h"
 #include "cpuid.h"
 #include "cpuid_info.h"
 #include "hostif.h"
@@ -97,6 +99,27 @@ static DECLARE_TASKLET(timerTasklet, HostIFWakeupClockThread, 0);
 #      define close_rtc(filp, files) compat_filp_close(filp, files)
 #   endif
 
+/*
+ * Per-CPU fast clock: pinned hrtimers armed only on the CPUs that run a
+ * VCPU with a MonitorPoll deadline.  Needs HRTIMER_MODE_REL_PINNED.
+ */
+
+#if defined(VMMON_USE_HIGH_RES_TIMERS) && defined(CONFIG_SMP) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+#   include <linux/moduleparam.h>
+#   define VMMON_USE_PERCPU_FAST_CLOCK
+#endif
+
+/*
+ * In-kernel eventfd interface, for registered semaphores.
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
+#   include <linux/eventfd.h>
+#   include <linux/fdtable.h>
+#   define VMMON_USE_EVENTFD
+#endif
+
 #define UPTIME_FREQ CONST64(1000000)
 
 /*
@@ -321,9 +344,12 @@ static Mutex globalMutex;
  */
 static Mutex fastClockMutex;
 
-/* This mutex protects linuxState.pollList.  */
+/* This mutex protects linuxState.pollHeap.  */
 static Mutex pollListMutex;
 
+/* This mutex protects the page sharing state.  It ranks below vmMutex. */
+static Mutex cowMutex;
+
 /*
  *----------------------------------------------------------------------
  *
@@ -379,6 +405,7 @@ HostIF_InitGlobalLock(void)
    MutexInit(&globalMutex, "global");
    MutexInit(&fastClockMutex, "fastClock");
    MutexInit(&pollListMutex, "pollList");
+   MutexInit(&cowMutex, "cow");
 }
 
 
@@ -507,7 +534,7 @@ HostIF_FastClockUnlock(int callerID) // IN
  *
  * HostIF_PollListLock --
  *
- *      Grabs the linuxState.pollList lock.
+ *      Grabs the linuxState.pollHeap lock.
  *
  * Results:
  *      None
@@ -530,7 +557,7 @@ HostIF_PollListLock(int callerID) // IN
  *
  * HostIF_PollListUnlock --
  *
- *      Releases the linuxState.pollList lock.
+ *      Releases the linuxState.pollHeap lock.
  *
  * Results:
  *      None
@@ -857,6 +884,100 @@ HostIF_FreeMachinePage(MPN mpn)  // IN:
 }
 
 
+/*
+ * HostIF_AllocLockedPages tries to allocate AWE pages in chunks of up
+ * to 2MB (a large page worth of small pages), falling back to smaller
+ * orders when memory is fragmented.  Chunks are split so that their
+ * pages can be freed one by one.  MPNs destined for user space are
+ * gathered in a page-sized kernel buffer and copied out in one go.
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16)
+#define HOSTIF_AWE_MAX_ORDER (21 - PAGE_SHIFT)
+#else
+#define HOSTIF_AWE_MAX_ORDER 0
+#endif
+#define HOSTIF_MPNS_PER_PAGE (PAGE_SIZE / sizeof(MPN32))
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFAllocChunk --
+ *
+ *      Allocate 2^*order physically contiguous pages, or as many as
+ *      possible by halving the order.  Only an order 0 allocation is
+ *      allowed to retry hard and warn on failure.
+ *
+ * Results:
+ *      The first page of the chunk, and its order in *order, or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct page *
+HostIFAllocChunk(unsigned int *order)  // IN/OUT: wanted/obtained order
+{
+   unsigned int o;
+
+   for (o = *order; o > 0; o--) {
+      struct page *pg = alloc_pages(GFP_HIGHUSER | __GFP_NOWARN |
+                                    __GFP_NORETRY, o);
+
+      if (pg) {
+#if HOSTIF_AWE_MAX_ORDER > 0
+         split_page(pg, o);
+#endif
+         *order = o;
+         return pg;
+      }
+   }
+   *order = 0;
+
+   return alloc_page(GFP_HIGHUSER);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFTrackAWEPages --
+ *
+ *      Add a batch of newly allocated MPNs to the VM's AWE tracker, one
+ *      contiguous run at a time.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFTrackAWEPages(VMHost *vmh,         // IN:
+                    MPN32 const *mpns,   // IN:
+                    unsigned int n)      // IN:
+{
+   unsigned int i;
+   unsigned int j;
+
+   for (i = 0; i < n; i = j) {
+      for (j = i + 1; j < n && mpns[j] == mpns[j - 1] + 1; j++) {
+      }
+      if (PhysTrack_CountRange(vmh->AWEPages, mpns[i], j - i) != 0) {
+         Warning("%s: duplicate MPN in %#x-%#x\n", __FUNCTION__, mpns[i],
+                 mpns[j - 1]);
+      }
+      PhysTrack_AddRange(vmh->AWEPages, mpns[i], j - i);
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -883,35 +1004,74 @@ HostIF_AllocLockedPages(VMDriver *vm,	     // IN: VM instance pointer
 {
    MPN32 *pmpn = VA64ToPtr(addr);
    VMHost *vmh = vm->vmhost;
-   unsigned int cnt;
+   unsigned int maxOrder = HOSTIF_AWE_MAX_ORDER;
+   unsigned int cnt = 0;
+   MPN32 *buf;
    int err = 0;
 
    if (!vmh || !vmh->AWEPages) {
       return -EINVAL;
    }
-   for (cnt = 0; cnt < numPages; cnt++) {
-      struct page* pg;
-      MPN32 mpn;
-      
-      pg = alloc_page(GFP_HIGHUSER);
-      if (!pg) {
-         err = -ENOMEM;
-	 break;
+   if (kernelMPNBuffer) {
+      buf = pmpn;
+   } else {
+      buf = HostIF_AllocPage();
+      if (!buf) {
+         return -ENOMEM;
       }
-      mpn = page_to_pfn(pg);
-      ASSERT(mpn == (MPN32)mpn);
-      if (kernelMPNBuffer) {
-         *pmpn = mpn;
-      } else if (HostIF_CopyToUser(pmpn, &mpn, sizeof *pmpn) != 0) {
-	__free_page(pg);
-	err = -EFAULT;
-	break;
+   }
+
+   while (cnt < numPages && !err) {
+      unsigned int bufMax = numPages - cnt;
+      unsigned int n = 0;
+      unsigned int i;
+
+      if (!kernelMPNBuffer) {
+         bufMax = MIN(bufMax, HOSTIF_MPNS_PER_PAGE);
+      }
+      while (n < bufMax) {
+         unsigned int order = maxOrder;
+         unsigned int wanted;
+         struct page *pg;
+         MPN32 mpn;
+
+         while (order > 0 && (1U << order) > bufMax - n) {
+            order--;
+         }
+         wanted = order;
+         pg = HostIFAllocChunk(&order);
+         if (!pg) {
+            err = -ENOMEM;
+            break;
+         }
+         if (order < wanted) {
+            /* Don't keep asking for chunks the allocator just refused. */
+            maxOrder = order;
+         }
+         mpn = page_to_pfn(pg);
+         ASSERT(mpn == page_to_pfn(pg));
+         for (i = 0; i < (1U << order); i++) {
+            buf[n++] = mpn + i;
+         }
+      }
+
+      if (!kernelMPNBuffer && n > 0 &&
+          HostIF_CopyToUser(pmpn + cnt, buf, n * sizeof *buf) != 0) {
+         for (i = 0; i < n; i++) {
+            __free_page(pfn_to_page(buf[i]));
+         }
+         err = -EFAULT;
+         break;
       }
-      pmpn++;
-      if (PhysTrack_Test(vmh->AWEPages, mpn)) {
-	Warning("%s: duplicate MPN %#x\n", __FUNCTION__, mpn);
+      HostIFTrackAWEPages(vmh, buf, n);
+      cnt += n;
+      if (kernelMPNBuffer) {
+         buf += n;
       }
-      PhysTrack_Add(vmh->AWEPages, mpn);
+   }
+
+   if (!kernelMPNBuffer) {
+      HostIF_FreePage(buf);
    }
 
    return cnt ? cnt : err;
@@ -923,7 +1083,11 @@ HostIF_AllocLockedPages(VMDriver *vm,	     // IN: VM instance pointer
  *
  * HostIF_FreeLockedPages --
  *
- *      Free non-swappable memory.
+ *      Free non-swappable memory.  There is no limit on numPages: a
+ *      user buffer is read one page of MPNs at a time, and every MPN is
+ *      read only once.  Checked pages are moved from the VM's AWEPages
+ *      to a private tracker, which also catches MPNs listed twice, and
+ *      are only freed once the whole list has been checked.
  *
  * Results:
  *      On success: 0. All pages were unlocked.
@@ -943,52 +1107,87 @@ HostIF_FreeLockedPages(VMDriver *vm,	     // IN: VM instance pointer
 {
    MPN32 const *pmpn = VA64ToPtr(addr);
    VMHost *vmh = vm->vmhost;
+   PhysTracker *doomed;
+   MPN32 *buf = NULL;
+   unsigned int done;
    unsigned int cnt;
-   struct page *pg; 
-   MPN32 mpns[64];
+   unsigned int n;
+   MPN mpn;
+   int ret = 0;
       
    if (!vmh || !vmh->AWEPages) {
       return -EINVAL;
    }
-
+   doomed = PhysTrack_Alloc();
+   if (!doomed) {
+      return -ENOMEM;
+   }
    if (!kernelMPNBuffer) {
-      if (numPages > ARRAYSIZE(mpns)) {
-         return -EINVAL;
+      buf = HostIF_AllocPage();
+      if (!buf) {
+         PhysTrack_Cleanup(doomed);
+         return -ENOMEM;
       }
+   }
 
-      if (HostIF_CopyFromUser(mpns, pmpn, numPages * sizeof *pmpn)) {
-         printk(KERN_DEBUG "Cannot read from process address space at %p\n",
-                pmpn);
+   for (done = 0; done < numPages && ret == 0; done += n) {
+      MPN32 const *mpns = pmpn + done;
 
-         return -EINVAL;
+      n = numPages - done;
+      if (!kernelMPNBuffer) {
+         n = MIN(n, HOSTIF_MPNS_PER_PAGE);
+         if (HostIF_CopyFromUser(buf, mpns, n * sizeof *buf)) {
+            printk(KERN_DEBUG "Cannot read from process address space "
+                   "at %p\n", mpns);
+            ret = -EINVAL;
+            break;
+         }
+         mpns = buf;
       }
 
-      pmpn = mpns;
-   }
+      for (cnt = 0; cnt < n; cnt++) {
+         struct page *pg;
 
-   for (cnt = 0; cnt < numPages; cnt++) {
-      if (!PhysTrack_Test(vmh->AWEPages, pmpn[cnt])) {
-         printk(KERN_DEBUG "Attempted to free unallocated MPN %08X\n",
-                pmpn[cnt]);
+         if (!PhysTrack_Test(vmh->AWEPages, mpns[cnt])) {
+            printk(KERN_DEBUG "Attempted to free unallocated MPN %08X\n",
+                   mpns[cnt]);
+            ret = -EINVAL;
+            break;
+         }
 
-         return -EINVAL;
+         pg = pfn_to_page(mpns[cnt]);
+         if (page_count(pg) != 1) {
+            // should this case be considered a failure?
+            printk(KERN_DEBUG "Page %08X is still used by someone "
+                   "(use count %u, VM %p)\n", mpns[cnt],
+                   page_count(pg), vm);
+         }
+         PhysTrack_Remove(vmh->AWEPages, mpns[cnt]);
+         PhysTrack_Add(doomed, mpns[cnt]);
       }
+   }
+
+   /*
+    * Free the checked pages, or on failure give them back to AWEPages.
+    */
 
-      pg = pfn_to_page(pmpn[cnt]);
-      if (page_count(pg) != 1) {
-         // should this case be considered a failure?
-         printk(KERN_DEBUG "Page %08X is still used by someone "
-                "(use count %u, VM %p)\n", pmpn[cnt], page_count(pg), vm);
+   mpn = PhysTrack_Test(doomed, 0) ? 0 : PhysTrack_GetNext(doomed, 0);
+   while (mpn != INVALID_MPN) {
+      PhysTrack_Remove(doomed, mpn);
+      if (ret == 0) {
+         __free_page(pfn_to_page(mpn));
+      } else {
+         PhysTrack_Add(vmh->AWEPages, mpn);
       }
+      mpn = PhysTrack_GetNext(doomed, mpn);
    }
 
-   for (cnt = 0; cnt < numPages; cnt++) {     
-      pg = pfn_to_page(pmpn[cnt]);
-      PhysTrack_Remove(vmh->AWEPages, pmpn[cnt]);
-      __free_page(pg);
+   PhysTrack_Cleanup(doomed);
+   if (buf) {
+      HostIF_FreePage(buf);
    }
 
-   return 0;
+   return ret;
 }
 
 
@@ -1313,7 +1512,6 @@ HostIFGetUserPage(void *uvAddr,		// IN
 }
 
 
-#if defined(__linux__) && defined(VMX86_DEVEL) && defined(VM_X86_64)
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1322,7 +1520,8 @@ HostIFGetUserPage(void *uvAddr,		// IN
  *      Gets the first MPN of a hugetlb page. 
  *
  * Results:
- *      The MPN or PAGE_LOCK_FAILED on an error. 
+ *      The MPN or PAGE_LOCK_FAILED on an error, including when the page
+ *      is not aligned on a large page boundary.
  *
  * Side effects:
  *      None.
@@ -1343,9 +1542,12 @@ HostIF_LookupLargeMPN(void *uvAddr)  // IN: user VA of the page
    mpn = page_to_pfn(page);
    put_page(page);
 
+   if ((mpn & (VM_PAE_LARGE_2_SMALL_PAGES - 1)) != 0) {
+      return PAGE_LOCK_FAILED;
+   }
+
    return mpn;
 }
-#endif
 
 
 /*
@@ -1376,49 +1578,76 @@ HostIF_IsLockedByMPN(VMDriver *vm,  // IN:
 /*
  *-----------------------------------------------------------------------------
  *
- * HostIF_LockPage --
+ * HostIFGetUserPages --
  *
- *      Lockup the MPN of an pinned user-level address space 
+ *      Pin a run of pages of the current user-level address space with a
+ *      single walk of the address space.
  *
  * Results:
- *      The MPN or zero on an error. 
+ *      Number of pages pinned starting at uvAddr (may be short if a page
+ *      could not be faulted in), or a negative value on failure.
  *
  * Side effects:
- *      Adds the page to the MemTracker,
- *	if allowMultipleMPNsPerVA then the page is added 
- *      to the VM's PhysTracker.
+ *      A reference is taken on each returned page.
  *
  *-----------------------------------------------------------------------------
  */
 
-MPN
-HostIF_LockPage(VMDriver *vm,		     // IN: VMDriver
-                VA64 uAddr,		     // IN: user VA of the page
-		Bool allowMultipleMPNsPerVA) // IN: allow to lock many pages per VA
+static int
+HostIFGetUserPages(void *uvAddr,          // IN
+                   unsigned numPages,     // IN
+                   struct page **ppages)  // OUT
 {
-   void *uvAddr = VA64ToPtr(uAddr);
-   struct page *page;
-   MPN mpn;
-   VPN vpn;
-   MemTrackEntry *entryPtr = NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 19)
+   int retval;
 
-   vpn = PTR_2_VPN(uvAddr);
-   if (!allowMultipleMPNsPerVA) {
-      entryPtr = MemTrack_LookupVPN(vm->memtracker, vpn);
-      
-      /*
-       * Already tracked and locked
-       */
+   down_read(&current->mm->mmap_sem);
+   retval = get_user_pages(current, current->mm, (unsigned long)uvAddr,
+                           numPages, 0, 0, ppages, NULL);
+   up_read(&current->mm->mmap_sem);
 
-      if (entryPtr != NULL && entryPtr->mpn != 0) {
-	 return PAGE_LOCK_ALREADY_LOCKED;
+   return retval;
+#else
+   unsigned i;
+
+   for (i = 0; i < numPages; i++) {
+      if (HostIFGetUserPage((uint8 *)uvAddr + i * PAGE_SIZE, &ppages[i])) {
+         break;
       }
    }
 
-   if (HostIFGetUserPage(uvAddr, &page)) {
-      return PAGE_LOCK_FAILED;
-   }
-   mpn = page_to_pfn(page);
+   return i;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFTrackLockedPage --
+ *
+ *      Record a freshly pinned user page in the VM's trackers.  entryPtr
+ *      is the MemTracker entry for vpn, if any, and must not already have
+ *      an MPN.
+ *
+ * Results:
+ *      The MPN or a PAGE_LOCK_* error code.  On error the page reference
+ *      is dropped.
+ *
+ * Side effects:
+ *      See HostIF_LockPage.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static MPN
+HostIFTrackLockedPage(VMDriver *vm,                 // IN: VMDriver
+                      VPN vpn,                      // IN: user VPN of the page
+                      struct page *page,            // IN: pinned page
+                      Bool allowMultipleMPNsPerVA,  // IN:
+                      MemTrackEntry *entryPtr)      // IN: MemTracker entry or NULL
+{
+   MPN mpn = page_to_pfn(page);
 
    if (HOST_ISTRACKED_PFN(vm, mpn)) {
       Warning("%s vpn=%p mpn=%#x already tracked\n", __FUNCTION__,
@@ -1450,7 +1679,7 @@ HostIF_LockPage(VMDriver *vm,		     // IN: VMDriver
       if (entryPtr == NULL) {
 	 entryPtr = MemTrack_Add(vm->memtracker, vpn, mpn);
 	 if (entryPtr == NULL) {
-	    HOST_UNLOCK_PFN(vm, mpn);
+	    put_page(page);
 
 	    return PAGE_LOCK_MEMTRACKER_ERROR;
 	 }
@@ -1465,99 +1694,412 @@ HostIF_LockPage(VMDriver *vm,		     // IN: VMDriver
 
 
 /*
- *----------------------------------------------------------------------
+ *-----------------------------------------------------------------------------
  *
- * HostIF_UnlockPage --
+ * HostIF_LockPage --
  *
- *      Unlock an pinned user-level page.
+ *      Lockup the MPN of an pinned user-level address space 
  *
  * Results:
- *      0 if successful, otherwise non-zero
- *      
+ *      The MPN or zero on an error. 
+ *
  * Side effects:
- *     None
+ *      Adds the page to the MemTracker,
+ *	if allowMultipleMPNsPerVA then the page is added 
+ *      to the VM's PhysTracker.
  *
- *----------------------------------------------------------------------
+ *-----------------------------------------------------------------------------
  */
 
-int
-HostIF_UnlockPage(VMDriver *vm,  // IN:
-                  VA64 uAddr)    // IN:
+MPN
+HostIF_LockPage(VMDriver *vm,		     // IN: VMDriver
+                VA64 uAddr,		     // IN: user VA of the page
+		Bool allowMultipleMPNsPerVA) // IN: allow to lock many pages per VA
 {
-   void *addr = VA64ToPtr(uAddr);
+   void *uvAddr = VA64ToPtr(uAddr);
+   struct page *page;
    VPN vpn;
-   MemTrackEntry *e;
+   MemTrackEntry *entryPtr = NULL;
 
-   vpn = VA_2_VPN((VA)addr);
-   e = MemTrack_LookupVPN(vm->memtracker, vpn);
-    
-   if (e == NULL) {
-      return PAGE_UNLOCK_NOT_TRACKED;
-   }
-   if (e->mpn == 0) {
-      return PAGE_UNLOCK_NO_MPN;
+   vpn = PTR_2_VPN(uvAddr);
+   if (!allowMultipleMPNsPerVA) {
+      entryPtr = MemTrack_LookupVPN(vm->memtracker, vpn);
+      
+      /*
+       * Already tracked and locked
+       */
+
+      if (entryPtr != NULL && entryPtr->mpn != 0) {
+	 return PAGE_LOCK_ALREADY_LOCKED;
+      }
    }
 
-   HOST_UNLOCK_PFN(vm, e->mpn);
-   e->mpn = 0;
+   if (HostIFGetUserPage(uvAddr, &page)) {
+      return PAGE_LOCK_FAILED;
+   }
 
-   return PAGE_UNLOCK_NO_ERROR;
+   return HostIFTrackLockedPage(vm, vpn, page, allowMultipleMPNsPerVA,
+                                entryPtr);
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *-----------------------------------------------------------------------------
  *
- * HostIF_UnlockPageByMPN --
+ * HostIF_LockPages --
  *
- *      Unlock a locked user mode page. The page doesn't need to be mapped
- *      anywhere.
+ *      Batched HostIF_LockPage over numPages contiguous user pages.  The
+ *      pages are pinned a page-full of struct page pointers at a time, so
+ *      the address space is walked once per chunk instead of once per
+ *      page.
  *
  * Results:
- *      returns PAGE_UNLOCK_NO_ERROR, or PAGE_UNLOCK_xxx error code.
+ *      Number of pages locked.  results[i] receives the MPN or the
+ *      PAGE_LOCK_* error code of page i.
  *
  * Side effects:
- *     Removes the MPN from from VM's PhysTracker.
+ *      See HostIF_LockPage.
  *
- *----------------------------------------------------------------------
+ *-----------------------------------------------------------------------------
  */
 
 int
-HostIF_UnlockPageByMPN(VMDriver *vm, // IN: VMDriver
-                       MPN mpn,	     // IN: the MPN to unlock
-                       VA64 uAddr)   // IN: optional(debugging) VA for the MPN
+HostIF_LockPages(VMDriver *vm,                 // IN: VMDriver
+                 VA64 uAddr,                   // IN: user VA of the first page
+                 unsigned numPages,            // IN:
+                 Bool allowMultipleMPNsPerVA,  // IN:
+                 int32 *results)               // OUT: MPN or error per page
 {
-   if (!PhysTrack_Test(vm->vmhost->lockedPages, mpn)) {
-      return PAGE_UNLOCK_NO_MPN;
+   const unsigned maxChunk = PAGE_SIZE / sizeof(struct page *);
+   uint8 *uvAddr = VA64ToPtr(uAddr);
+   struct page **pages;
+   unsigned done = 0;
+   int numLocked = 0;
+
+   pages = HostIF_AllocPage();
+   if (pages == NULL) {
+      for (; done < numPages; done++) {
+         results[done] = PAGE_LOCK_FAILED;
+      }
+
+      return 0;
    }
 
-#ifdef VMX86_DEBUG
-   {
-      void *va = VA64ToPtr(uAddr);
-      MemTrackEntry *e;
-      
-      /*
-       * Verify for debugging that VA and MPN make sense.
-       * PgtblVa2MPN() can fail under high memory pressure.
-       */
+   while (done < numPages) {
+      unsigned chunk = MIN(numPages - done, maxChunk);
+      VPN vpn = PTR_2_VPN(uvAddr + done * PAGE_SIZE);
+      int got;
+      int i;
 
-      if (va != NULL) {
-         MPN lookupMpn = PgtblVa2MPN((VA)va);
+      got = HostIFGetUserPages(uvAddr + done * PAGE_SIZE, chunk, pages);
+      if (got < 0) {
+         got = 0;
+      }
 
-         if (lookupMpn != INVALID_MPN && mpn != lookupMpn) {
-            Warning("Page lookup fail %#x %#x %p\n", mpn, lookupMpn, va);
+      for (i = 0; i < got; i++) {
+         MemTrackEntry *entryPtr = NULL;
+         MPN mpn;
 
-            return PAGE_LOOKUP_INVALID_ADDR;
+         if (!allowMultipleMPNsPerVA) {
+            entryPtr = MemTrack_LookupVPN(vm->memtracker, vpn + i);
+            if (entryPtr != NULL && entryPtr->mpn != 0) {
+               put_page(pages[i]);
+               results[done + i] = PAGE_LOCK_ALREADY_LOCKED;
+               continue;
+            }
+         }
+         mpn = HostIFTrackLockedPage(vm, vpn + i, pages[i],
+                                     allowMultipleMPNsPerVA, entryPtr);
+         results[done + i] = (int32)mpn;
+         if (PAGE_LOCK_SUCCESS(mpn)) {
+            numLocked++;
          }
       }
+      done += got;
 
       /*
-       * Verify that this MPN was locked with 
-       * HostIF_LockPage(allowMultipleMPNsPerVA = TRUE).
-       * That means that this MPN should not be in the MemTracker.
+       * A short pin stops at a page that could not be faulted in; fail
+       * that page alone and carry on with the rest of the run.
        */
 
-      e = MemTrack_LookupMPN(vm->memtracker, mpn);
+      if (got < chunk) {
+         results[done++] = PAGE_LOCK_FAILED;
+      }
+   }
+
+   HostIF_FreePage(pages);
+
+   return numLocked;
+}
+
+
+/*
+ * Large pages are locked as a whole: one get_user_pages() call and one
+ * MemTracker entry per 2MB page, keyed by its first VPN with
+ * HOSTIF_LARGE_VPN_TAG set so that small page operations never find it.
+ * Its small pages are all recorded in the PhysTracker, which keeps small
+ * and large locks of the same memory mutually exclusive.
+ */
+
+#define HOSTIF_LARGE_VPN_TAG  (CONST64U(1) << 63)
+#define HOSTIF_LARGE_PAGES    VM_PAE_LARGE_2_SMALL_PAGES
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFUnlockLargeMPN --
+ *
+ *      Release the small pages of a locked large page.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Pages are removed from the PhysTracker and unpinned.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HostIFUnlockLargeMPN(VMDriver *vm,  // IN:
+                     MPN mpn)       // IN: first MPN of the large page
+{
+   unsigned int i;
+
+   PhysTrack_RemoveRange(vm->vmhost->physTracker, mpn, HOSTIF_LARGE_PAGES);
+   for (i = 0; i < HOSTIF_LARGE_PAGES; i++) {
+      put_page(pfn_to_page(mpn + i));
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIF_LockLargePage --
+ *
+ *      Lock a 2MB-aligned user range backed by a single large page
+ *      (hugetlbfs or transparent huge page).
+ *
+ * Results:
+ *      The first MPN of the large page, or a PAGE_LOCK_* error code.
+ *      PAGE_LOCK_FAILED means the range could not be pinned or is not
+ *      backed by one physically contiguous, aligned large page.
+ *
+ * Side effects:
+ *      Adds a large page entry to the MemTracker and the small pages to
+ *      the PhysTracker.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+MPN
+HostIF_LockLargePage(VMDriver *vm,  // IN: VMDriver
+                     VA64 uAddr)    // IN: user VA of the large page
+{
+   void *uvAddr = VA64ToPtr(uAddr);
+   VPN64 key = PTR_2_VPN(uvAddr) | HOSTIF_LARGE_VPN_TAG;
+   MemTrackEntry *entryPtr;
+   struct page **pages;
+   MPN mpn = PAGE_LOCK_FAILED;
+   int got;
+   int i;
+
+   if ((uAddr & VM_PAE_LARGE_PAGE_MASK) != 0) {
+      return PAGE_LOCK_FAILED;
+   }
+
+   entryPtr = MemTrack_LookupVPN(vm->memtracker, key);
+   if (entryPtr != NULL && entryPtr->mpn != 0) {
+      return PAGE_LOCK_ALREADY_LOCKED;
+   }
+
+   pages = HostIF_AllocKernelMem(HOSTIF_LARGE_PAGES * sizeof *pages, FALSE);
+   if (pages == NULL) {
+      return PAGE_LOCK_SYS_ERROR;
+   }
+
+   got = HostIFGetUserPages(uvAddr, HOSTIF_LARGE_PAGES, pages);
+   if (got < 0) {
+      got = 0;
+   }
+   if (got == HOSTIF_LARGE_PAGES &&
+       (page_to_pfn(pages[0]) & (HOSTIF_LARGE_PAGES - 1)) == 0) {
+      mpn = page_to_pfn(pages[0]);
+      for (i = 1; i < got; i++) {
+         if (page_to_pfn(pages[i]) != mpn + i) {
+            mpn = PAGE_LOCK_FAILED;
+            break;
+         }
+      }
+   }
+
+   if (PAGE_LOCK_SUCCESS(mpn)) {
+      struct PhysTracker *lockedPages = vm->vmhost->lockedPages;
+
+      if (PhysTrack_CountRange(vm->vmhost->physTracker, mpn,
+                               HOSTIF_LARGE_PAGES) != 0 ||
+          (lockedPages &&
+           PhysTrack_CountRange(lockedPages, mpn, HOSTIF_LARGE_PAGES) != 0)) {
+         Warning("%s va=%p mpn=%#x already tracked\n", __FUNCTION__,
+                 uvAddr, mpn);
+         mpn = PAGE_LOCK_PHYSTRACKER_ERROR;
+      } else if (entryPtr == NULL &&
+                 (entryPtr = MemTrack_Add(vm->memtracker, key, mpn)) == NULL) {
+         mpn = PAGE_LOCK_MEMTRACKER_ERROR;
+      }
+   }
+
+   if (PAGE_LOCK_SUCCESS(mpn)) {
+      entryPtr->mpn = mpn;
+      PhysTrack_AddRange(vm->vmhost->physTracker, mpn, HOSTIF_LARGE_PAGES);
+   } else {
+      for (i = 0; i < got; i++) {
+         put_page(pages[i]);
+      }
+   }
+   HostIF_FreeKernelMem(pages);
+
+   return mpn;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIF_UnlockLargePage --
+ *
+ *      Unlock a large page locked by HostIF_LockLargePage.
+ *
+ * Results:
+ *      PAGE_UNLOCK_NO_ERROR or a PAGE_UNLOCK_* error code.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+HostIF_UnlockLargePage(VMDriver *vm,  // IN:
+                       VA64 uAddr)    // IN: user VA of the large page
+{
+   VPN64 key = PTR_2_VPN(VA64ToPtr(uAddr)) | HOSTIF_LARGE_VPN_TAG;
+   MemTrackEntry *e;
+
+   if ((uAddr & VM_PAE_LARGE_PAGE_MASK) != 0) {
+      return PAGE_UNLOCK_NOT_TRACKED;
+   }
+   e = MemTrack_LookupVPN(vm->memtracker, key);
+   if (e == NULL) {
+      return PAGE_UNLOCK_NOT_TRACKED;
+   }
+   if (e->mpn == 0) {
+      return PAGE_UNLOCK_NO_MPN;
+   }
+
+   HostIFUnlockLargeMPN(vm, e->mpn);
+   e->mpn = 0;
+
+   return PAGE_UNLOCK_NO_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_UnlockPage --
+ *
+ *      Unlock an pinned user-level page.
+ *
+ * Results:
+ *      0 if successful, otherwise non-zero
+ *      
+ * Side effects:
+ *     None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HostIF_UnlockPage(VMDriver *vm,  // IN:
+                  VA64 uAddr)    // IN:
+{
+   void *addr = VA64ToPtr(uAddr);
+   VPN vpn;
+   MemTrackEntry *e;
+
+   vpn = VA_2_VPN((VA)addr);
+   e = MemTrack_LookupVPN(vm->memtracker, vpn);
+    
+   if (e == NULL) {
+      return PAGE_UNLOCK_NOT_TRACKED;
+   }
+   if (e->mpn == 0) {
+      return PAGE_UNLOCK_NO_MPN;
+   }
+
+   HOST_UNLOCK_PFN(vm, e->mpn);
+   e->mpn = 0;
+
+   return PAGE_UNLOCK_NO_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_UnlockPageByMPN --
+ *
+ *      Unlock a locked user mode page. The page doesn't need to be mapped
+ *      anywhere.
+ *
+ * Results:
+ *      returns PAGE_UNLOCK_NO_ERROR, or PAGE_UNLOCK_xxx error code.
+ *
+ * Side effects:
+ *     Removes the MPN from from VM's PhysTracker.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HostIF_UnlockPageByMPN(VMDriver *vm, // IN: VMDriver
+                       MPN mpn,	     // IN: the MPN to unlock
+                       VA64 uAddr)   // IN: optional(debugging) VA for the MPN
+{
+   if (!PhysTrack_Test(vm->vmhost->lockedPages, mpn)) {
+      return PAGE_UNLOCK_NO_MPN;
+   }
+
+#ifdef VMX86_DEBUG
+   {
+      void *va = VA64ToPtr(uAddr);
+      MemTrackEntry *e;
+      
+      /*
+       * Verify for debugging that VA and MPN make sense.
+       * PgtblVa2MPN() can fail under high memory pressure.
+       */
+
+      if (va != NULL) {
+         MPN lookupMpn = PgtblVa2MPN((VA)va);
+
+         if (lookupMpn != INVALID_MPN && mpn != lookupMpn) {
+            Warning("Page lookup fail %#x %#x %p\n", mpn, lookupMpn, va);
+
+            return PAGE_LOOKUP_INVALID_ADDR;
+         }
+      }
+
+      /*
+       * Verify that this MPN was locked with 
+       * HostIF_LockPage(allowMultipleMPNsPerVA = TRUE).
+       * That means that this MPN should not be in the MemTracker.
+       */
+
+      e = MemTrack_LookupMPN(vm->memtracker, mpn);
       if (e) {
 	 Warning("%s(): mpn=%#x va=%p was permanently locked with "
                  "vpn=0x%"FMT64"x\n", __FUNCTION__, mpn, va, e->vpn);
@@ -1579,7 +2121,16 @@ UnlockEntry(void *clientData,         // IN:
 {
    VMDriver *vm = (VMDriver *)clientData;
 
-   if (entryPtr->mpn) {
+   if (entryPtr->mpn && (entryPtr->vpn & HOSTIF_LARGE_VPN_TAG) != 0) {
+      if (PhysTrack_CountRange(vm->vmhost->physTracker, entryPtr->mpn,
+                               HOSTIF_LARGE_PAGES) == HOSTIF_LARGE_PAGES) {
+         HostIFUnlockLargeMPN(vm, entryPtr->mpn);
+      } else {
+         Warning("%s large vpn=0x%"FMT64"x mpn=%#x not owned\n", __FUNCTION__,
+                 entryPtr->vpn & ~HOSTIF_LARGE_VPN_TAG, entryPtr->mpn);
+      }
+      entryPtr->mpn = 0;
+   } else if (entryPtr->mpn) {
       if (HOST_ISTRACKED_PFN(vm, entryPtr->mpn)) {
          HOST_UNLOCK_PFN(vm,entryPtr->mpn);
       } else { 
@@ -1612,6 +2163,10 @@ HostIF_FreeAllResources(VMDriver *vm) // IN
 {
    unsigned int cnt;
 
+   if (vm->vmhost) {
+      HostIFSemaphoreCleanup(vm);
+      HostIFCOWCleanupVM(vm);
+   }
    HostIFHostMemCleanup(vm);
    if (vm->memtracker) {
       /*
@@ -2806,13 +3361,56 @@ HostIF_APIC_ID(void)
 /*
  *-----------------------------------------------------------------------------
  *
- * HostIF_SemaphoreWait --
+ * Registered semaphores --
  *
- *    Perform the semaphore wait (P) operation, possibly blocking.
+ *    A VCPU's halt semaphore can be registered once, when it is an
+ *    eventfd, with HostIF_SemaphoreRegister.  The driver then keeps
+ *    references to the files and eventfd_ctxs of both of its fds and a
+ *    permanent entry on the wait queue of the one the VCPU waits on, so
+ *    MODULECALL_SEMAWAIT and MODULECALL_SEMASIGNAL on those fds no
+ *    longer take file references, switch address limits or build poll
+ *    tables.  Anything else (pipes, unregistered fds) still takes the
+ *    generic path.
+ *
+ *    The fds may be closed and their numbers reused, so each use checks
+ *    that the fd still resolves to the registered file.  If not, the
+ *    registration is dropped by its VCPU's next wait and the call takes
+ *    the generic path; userlevel can then register again.  A dropped
+ *    registration is freed after an RCU grace period, as signals from
+ *    other VCPU threads look at it under rcu_read_lock only.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+typedef struct HostIFSema {
+   int                 waitFD;
+   int                 signalFD;
+#ifdef VMMON_USE_EVENTFD
+   struct file        *waitFile;
+   struct file        *signalFile;
+   struct eventfd_ctx *waitCtx;
+   struct eventfd_ctx *signalCtx;
+   Bool                stale;     // signalFD no longer signalFile
+   wait_queue_head_t  *wqh;       // waitCtx's wait queue
+   wait_queue_t        wait;      // our entry on it
+   poll_table          pt;
+#endif
+   VMDriver           *vm;
+   Vcpuid              vcpuid;
+} HostIFSema;
+
+
+#ifdef VMMON_USE_EVENTFD
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaWake --
+ *
+ *    Wait queue callback: the eventfd a VCPU waits on became readable,
+ *    so wake the VCPU thread if it is waiting.
  *
  * Result:
- *    1 (which equals MX_WAITNORMAL) if success, 
- *    negated error code otherwise.
+ *    0.
  *
  * Side-effects:
  *    None
@@ -2820,41 +3418,385 @@ HostIF_APIC_ID(void)
  *-----------------------------------------------------------------------------
  */
 
-int   
-HostIF_SemaphoreWait(VMDriver *vm,   // IN:
-                     Vcpuid vcpuid,  // IN:
-                     uint32 *args)   // IN:
+static int
+HostIFSemaWake(wait_queue_t *wait,  // IN:
+               unsigned mode,       // IN: unused
+               int sync,            // IN: unused
+               void *key)           // IN: poll mask
 {
-   struct file *file;
-   mm_segment_t old_fs;
-   int res;
-   int waitFD = args[0];
-   int timeoutms = args[2];
-   uint64 value;
+   HostIFSema *sema = container_of(wait, HostIFSema, wait);
+   struct task_struct *t;
 
-   file = vmware_fget(waitFD);
-   if (file == NULL) {
-      return MX_WAITERROR;
+   if (key && !((unsigned long)key & POLLIN)) {
+      return 0;
    }
-
-   old_fs = get_fs();
-   set_fs(get_ds());
-
-   {
-      compat_poll_wqueues table;
-      poll_table *wait;
-      unsigned int mask;
-      
-      compat_poll_initwait(wait, &table);
-      current->state = TASK_INTERRUPTIBLE;
-      mask = file->f_op->poll(file, wait);
-      if (!(mask & (POLLIN | POLLERR | POLLHUP))) {
-	 vm->vmhost->vcpuSemaTask[vcpuid] = current;
-	 schedule_timeout(timeoutms * HZ / 1000);  // convert to Hz
-	 vm->vmhost->vcpuSemaTask[vcpuid] = NULL;
-      }
-      current->state = TASK_RUNNING;
-      compat_poll_freewait(wait, &table);
+   t = sema->vm->vmhost->vcpuSemaTask[sema->vcpuid];
+   if (t) {
+      wake_up_process(t);
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaQueue --
+ *
+ *    poll_table callback used once at registration to put our entry on
+ *    the eventfd's wait queue.
+ *
+ * Result:
+ *    None.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HostIFSemaQueue(struct file *file,        // IN: unused
+                wait_queue_head_t *wqh,   // IN:
+                poll_table *pt)           // IN:
+{
+   HostIFSema *sema = container_of(pt, HostIFSema, pt);
+
+   sema->wqh = wqh;
+   add_wait_queue(wqh, &sema->wait);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaFDIs --
+ *
+ *    Check that fd still resolves to file in the current process,
+ *    without taking a reference.
+ *
+ * Result:
+ *    TRUE if it does, FALSE otherwise.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE Bool
+HostIFSemaFDIs(int fd,             // IN:
+               struct file *file)  // IN:
+{
+   Bool same;
+
+   if (current->files == NULL) {
+      return FALSE;
+   }
+   rcu_read_lock();
+   same = fcheck(fd) == file;
+   rcu_read_unlock();
+
+   return same;
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaFree --
+ *
+ *    Drop a registration.
+ *
+ * Result:
+ *    None.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HostIFSemaFree(HostIFSema *sema)  // IN:
+{
+#ifdef VMMON_USE_EVENTFD
+   if (sema->wqh) {
+      remove_wait_queue(sema->wqh, &sema->wait);
+   }
+   if (sema->waitCtx) {
+      eventfd_ctx_put(sema->waitCtx);
+   }
+   if (sema->signalCtx) {
+      eventfd_ctx_put(sema->signalCtx);
+   }
+   if (sema->waitFile) {
+      compat_fput(sema->waitFile);
+   }
+   if (sema->signalFile) {
+      compat_fput(sema->signalFile);
+   }
+#endif
+   HostIF_FreeKernelMem(sema);
+}
+
+
+#ifdef VMMON_USE_EVENTFD
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaDrop --
+ *
+ *    Drop the registration of a VCPU whose fds no longer resolve to
+ *    the registered files.  Called by the VCPU's own thread.
+ *
+ * Result:
+ *    None.
+ *
+ * Side-effects:
+ *    Waits for an RCU grace period.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HostIFSemaDrop(VMDriver *vm,    // IN:
+               Vcpuid vcpuid)   // IN:
+{
+   HostIFSema *sema;
+
+   HostIF_VMLock(vm, 24);
+   sema = vm->vmhost->vcpuSema[vcpuid];
+   vm->vmhost->vcpuSema[vcpuid] = NULL;
+   HostIF_VMUnlock(vm, 24);
+
+   if (sema != NULL) {
+      synchronize_rcu();
+      HostIFSemaFree(sema);
+   }
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIF_SemaphoreRegister --
+ *
+ *    Register the eventfds of a VCPU's halt semaphore.
+ *
+ * Result:
+ *    0 on success.
+ *    -EINVAL if vcpuid is out of range or an fd is not an eventfd.
+ *    -EBUSY if the VCPU already has a registration.
+ *    -ENOSYS if the host has no in-kernel eventfd interface.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+HostIF_SemaphoreRegister(VMDriver *vm,    // IN:
+                         Vcpuid vcpuid,   // IN:
+                         int waitFD,      // IN:
+                         int signalFD)    // IN:
+{
+#ifdef VMMON_USE_EVENTFD
+   VMHost *vmh = vm->vmhost;
+   HostIFSema *sema;
+   struct file *file;
+   int ret = 0;
+
+   if (vcpuid >= vm->numVCPUs || vcpuid >= MAX_INITBLOCK_CPUS) {
+      return -EINVAL;
+   }
+   if (vmh->vcpuSema[vcpuid] != NULL) {
+      return -EBUSY;
+   }
+
+   sema = HostIF_AllocKernelMem(sizeof *sema, FALSE);
+   if (sema == NULL) {
+      return -ENOMEM;
+   }
+   memset(sema, 0, sizeof *sema);
+   sema->vm = vm;
+   sema->vcpuid = vcpuid;
+   sema->waitFD = waitFD;
+   sema->signalFD = signalFD;
+
+   sema->signalFile = vmware_fget(signalFD);
+   if (sema->signalFile == NULL) {
+      ret = -EINVAL;
+      goto fail;
+   }
+   sema->signalCtx = eventfd_ctx_fileget(sema->signalFile);
+   if (IS_ERR(sema->signalCtx)) {
+      sema->signalCtx = NULL;
+      ret = -EINVAL;
+      goto fail;
+   }
+
+   file = vmware_fget(waitFD);
+   if (file == NULL) {
+      ret = -EINVAL;
+      goto fail;
+   }
+   sema->waitFile = file;
+   sema->waitCtx = eventfd_ctx_fileget(file);
+   if (IS_ERR(sema->waitCtx)) {
+      sema->waitCtx = NULL;
+      ret = -EINVAL;
+      goto fail;
+   }
+   init_waitqueue_func_entry(&sema->wait, HostIFSemaWake);
+   init_poll_funcptr(&sema->pt, HostIFSemaQueue);
+   file->f_op->poll(file, &sema->pt);
+   if (sema->wqh == NULL) {
+      ret = -EINVAL;
+      goto fail;
+   }
+
+   HostIF_VMLock(vm, 23);
+   if (vmh->vcpuSema[vcpuid] == NULL) {
+      rcu_assign_pointer(vmh->vcpuSema[vcpuid], sema);
+      sema = NULL;
+   } else {
+      ret = -EBUSY;
+   }
+   HostIF_VMUnlock(vm, 23);
+   if (sema == NULL) {
+      return 0;
+   }
+
+fail:
+   HostIFSemaFree(sema);
+
+   return ret;
+#else
+   return -ENOSYS;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIFSemaphoreCleanup --
+ *
+ *    Drop all semaphore registrations of a VM.
+ *
+ * Result:
+ *    None.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HostIFSemaphoreCleanup(VMDriver *vm)  // IN:
+{
+   unsigned int v;
+
+   for (v = 0; v < MAX_INITBLOCK_CPUS; v++) {
+      if (vm->vmhost->vcpuSema[v] != NULL) {
+         HostIFSemaFree(vm->vmhost->vcpuSema[v]);
+         vm->vmhost->vcpuSema[v] = NULL;
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HostIF_SemaphoreWait --
+ *
+ *    Perform the semaphore wait (P) operation, possibly blocking.
+ *
+ * Result:
+ *    1 (which equals MX_WAITNORMAL) if success, 
+ *    negated error code otherwise.
+ *
+ * Side-effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int   
+HostIF_SemaphoreWait(VMDriver *vm,   // IN:
+                     Vcpuid vcpuid,  // IN:
+                     uint32 *args)   // IN:
+{
+   struct file *file;
+   mm_segment_t old_fs;
+   int res;
+   int waitFD = args[0];
+   int timeoutms = args[2];
+   uint64 value;
+#ifdef VMMON_USE_EVENTFD
+   HostIFSema *sema = NULL;
+
+   if (vcpuid < MAX_INITBLOCK_CPUS) {
+      sema = vm->vmhost->vcpuSema[vcpuid];
+   }
+   if (sema != NULL &&
+       (sema->stale || (sema->waitFD == waitFD &&
+                        !HostIFSemaFDIs(waitFD, sema->waitFile)))) {
+      HostIFSemaDrop(vm, vcpuid);
+      sema = NULL;
+   }
+   if (sema != NULL && sema->waitFD == waitFD) {
+      __u64 cnt;
+
+      vm->vmhost->vcpuSemaTask[vcpuid] = current;
+      set_current_state(TASK_INTERRUPTIBLE);
+      res = eventfd_ctx_read(sema->waitCtx, 1, &cnt);
+      if (res == -EAGAIN) {
+         schedule_timeout(timeoutms * HZ / 1000);  // convert to Hz
+         res = eventfd_ctx_read(sema->waitCtx, 1, &cnt);
+         if (res == -EAGAIN && signal_pending(current)) {
+            res = -EINTR;
+         }
+      }
+      __set_current_state(TASK_RUNNING);
+      vm->vmhost->vcpuSemaTask[vcpuid] = NULL;
+      if (res == 0) {
+         res = MX_WAITNORMAL;
+      }
+      goto mapResult;
+   }
+#endif
+
+   file = vmware_fget(waitFD);
+   if (file == NULL) {
+      return MX_WAITERROR;
+   }
+
+   old_fs = get_fs();
+   set_fs(get_ds());
+
+   {
+      compat_poll_wqueues table;
+      poll_table *wait;
+      unsigned int mask;
+      
+      compat_poll_initwait(wait, &table);
+      current->state = TASK_INTERRUPTIBLE;
+      mask = file->f_op->poll(file, wait);
+      if (!(mask & (POLLIN | POLLERR | POLLHUP))) {
+	 vm->vmhost->vcpuSemaTask[vcpuid] = current;
+	 schedule_timeout(timeoutms * HZ / 1000);  // convert to Hz
+	 vm->vmhost->vcpuSemaTask[vcpuid] = NULL;
+      }
+      current->state = TASK_RUNNING;
+      compat_poll_freewait(wait, &table);
    }
 
    /*
@@ -2876,6 +3818,9 @@ HostIF_SemaphoreWait(VMDriver *vm,   // IN:
    set_fs(old_fs);
    compat_fput(file);
 
+#ifdef VMMON_USE_EVENTFD
+mapResult:
+#endif
    /*
     * Handle benign errors:
     * EAGAIN is MX_WAITTIMEDOUT.
@@ -2951,7 +3896,8 @@ HostIF_SemaphoreForceWakeup(VMDriver *vm,   // IN:
  */
 
 int
-HostIF_SemaphoreSignal(uint32 *args)  // IN:
+HostIF_SemaphoreSignal(VMDriver *vm,   // IN:
+                       uint32 *args)   // IN:
 {
    struct file *file;
    mm_segment_t old_fs;
@@ -2959,6 +3905,30 @@ HostIF_SemaphoreSignal(uint32 *args)  // IN:
    int signalFD = args[1];
    uint64 value = 1;  // make an eventfd happy should it be there
 
+#ifdef VMMON_USE_EVENTFD
+   {
+      Vcpuid v;
+
+      rcu_read_lock();
+      for (v = 0; v < vm->numVCPUs && v < MAX_INITBLOCK_CPUS; v++) {
+         HostIFSema *sema = rcu_dereference(vm->vmhost->vcpuSema[v]);
+
+         if (sema == NULL || sema->signalFD != signalFD) {
+            continue;
+         }
+         if (!HostIFSemaFDIs(signalFD, sema->signalFile)) {
+            sema->stale = TRUE;  // dropped by the VCPU's next wait
+            break;
+         }
+         eventfd_signal(sema->signalCtx, 1);
+         rcu_read_unlock();
+
+         return MX_WAITNORMAL;
+      }
+      rcu_read_unlock();
+   }
+#endif
+
    file = vmware_fget(signalFD);
    if (!file) {
       return MX_WAITERROR;
@@ -3477,32 +4447,965 @@ HostIF_WritePage(MPN mpn,	    // MPN of the page
 }
 
 
+/*
+ * Content-based page sharing (COW).
+ *
+ * Shared pages are driver-owned copies of guest pages, indexed in
+ * cowHash by the HashFunc_HashPage key of their contents, which never
+ * change once shared, and in cowMPNHash by their MPN, so that the frame
+ * of a shared MPN is found without hashing the page again.  A monitor sharing a guest page gets back the MPN
+ * of an identical shared page (found by key, then confirmed by a full
+ * compare) and maps it read-only in place of its private copy; a write
+ * to it breaks sharing through COW_COPY_PAGE.
+ *
+ * Pages that match nothing are only recorded as hints (key, VM, BPN),
+ * without copying them.  When a later page matches a hint it becomes
+ * shared, and the hinted BPN is queued for its VM to share again, which
+ * the VMX picks up with COW_UPDATE_HINT.
+ *
+ * Each VM's BPN -> shared MPN mapping lives in a MemTrack, so that its
+ * references can be dropped when it goes away.  All this state is
+ * protected by cowMutex, which ranks below the VM and global mutexes.
+ */
+
+#define COW_HASH_BUCKETS    (1 << 18)
+#define COW_HASH_PER_PAGE   (PAGE_SIZE / sizeof (void *))
+#define COW_HASH_PAGES      (COW_HASH_BUCKETS / COW_HASH_PER_PAGE)
+#define COW_MPN_BUCKETS     (1 << 14)
+#define COW_MPN_PAGES       (COW_MPN_BUCKETS / COW_HASH_PER_PAGE)
+#define COW_MAX_HINTS       (1 << 20)
+#define COW_HINT_QUEUE_MAX  (PAGE_SIZE / sizeof (BPN))
+
+typedef struct COWFrame {
+   struct COWFrame *next;     /* Bucket chain. */
+   struct COWFrame *mpnNext;  /* MPN bucket chain, shared pages only. */
+   uint64           key;      /* HashFunc_HashPage of the contents. */
+   MPN              mpn;      /* Shared page, or INVALID_MPN for a hint. */
+   uint32           ref;      /* BPNs mapping the shared page. */
+   VMDriver        *hintVM;   /* Hint only: owner of the hinted page... */
+   BPN              hintBPN;  /* ... and its guest page number. */
+} COWFrame;
+
+static COWFrame **cowHash[COW_HASH_PAGES];
+static COWFrame **cowMPNHash[COW_MPN_PAGES];
+static COWFrame *cowZero;
+static COWFrame *cowHot[VMMEM_COW_HOT_PAGES];
+static uint32 cowNumHints;
+static uint32 cowUniqueMPNs;
+static uint32 cowTotalUniqueMPNs;
+static uint32 cowNumBreaks;
+static uint32 cowNumRef;
+
+
 /*
  *----------------------------------------------------------------------
  *
- * HostIF_GetLockedPageList --
- *
- *      puts MPNs of pages that were allocated by HostIF_AllocLockedPages()
- *      into user mode buffer.
- *
- * Results:
- *	non-negative number of the MPNs in the buffer on success.
- *	negative error code on error (-EFAULT)
+ * HostIFCOWBucket --
  *
- * Side effects:
- *      none
+ *      Return the hash chain for a key.  The table must exist.
  *
  *----------------------------------------------------------------------
  */
 
-int 
-HostIF_GetLockedPageList(VMDriver* vm,          // IN: VM instance pointer
-			 VA64 uAddr,            // OUT: user mode buffer for MPNs
+static INLINE COWFrame **
+HostIFCOWBucket(uint64 key)  // IN:
+{
+   unsigned int idx = (unsigned int)key & (COW_HASH_BUCKETS - 1);
+
+   return &cowHash[idx / COW_HASH_PER_PAGE][idx % COW_HASH_PER_PAGE];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWMPNBucket --
+ *
+ *      Return the MPN hash chain for a shared MPN.  The table must
+ *      exist.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE COWFrame **
+HostIFCOWMPNBucket(MPN mpn)  // IN:
+{
+   unsigned int idx = (unsigned int)mpn & (COW_MPN_BUCKETS - 1);
+
+   return &cowMPNHash[idx / COW_HASH_PER_PAGE][idx % COW_HASH_PER_PAGE];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWNewFrame --
+ *
+ *      Allocate a frame and link it into the hash table.  If contents
+ *      is not NULL, a shared page holding a copy of it is allocated
+ *      too; otherwise the frame is a hint for (vm, bpn).
+ *
+ * Results:
+ *      The frame, or NULL on allocation failure.
+ *
+ * Side effects:
+ *      Updates the sharing statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static COWFrame *
+HostIFCOWNewFrame(uint64 key,            // IN:
+                  const void *contents,  // IN: page contents or NULL
+                  VMDriver *vm,          // IN: hint owner
+                  BPN bpn)               // IN: hinted page
+{
+   COWFrame **bucket = HostIFCOWBucket(key);
+   COWFrame *frame;
+
+   frame = HostIF_AllocKernelMem(sizeof *frame, FALSE);
+   if (frame == NULL) {
+      return NULL;
+   }
+   memset(frame, 0, sizeof *frame);
+   frame->key = key;
+   frame->mpn = INVALID_MPN;
+
+   if (contents != NULL) {
+      struct page *page;
+
+      frame->mpn = HostIF_AllocMachinePage();
+      if (frame->mpn == INVALID_MPN) {
+         HostIF_FreeKernelMem(frame);
+         return NULL;
+      }
+      page = pfn_to_page(frame->mpn);
+      memcpy(kmap(page), contents, PAGE_SIZE);
+      kunmap(page);
+      frame->mpnNext = *HostIFCOWMPNBucket(frame->mpn);
+      *HostIFCOWMPNBucket(frame->mpn) = frame;
+      cowUniqueMPNs++;
+      cowTotalUniqueMPNs++;
+   } else {
+      frame->hintVM = vm;
+      frame->hintBPN = bpn;
+      cowNumHints++;
+   }
+
+   frame->next = *bucket;
+   *bucket = frame;
+
+   return frame;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWFreeFrame --
+ *
+ *      Unlink a frame from the hash table and free it, along with its
+ *      shared page if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCOWFreeFrame(COWFrame *frame)  // IN:
+{
+   COWFrame **link;
+   unsigned int i;
+
+   for (link = HostIFCOWBucket(frame->key); *link != frame;
+        link = &(*link)->next) {
+      ASSERT(*link != NULL);
+   }
+   *link = frame->next;
+
+   for (i = 0; i < VMMEM_COW_HOT_PAGES; i++) {
+      if (cowHot[i] == frame) {
+         cowHot[i] = NULL;
+      }
+   }
+
+   if (frame->mpn != INVALID_MPN) {
+      for (link = HostIFCOWMPNBucket(frame->mpn); *link != frame;
+           link = &(*link)->mpnNext) {
+         ASSERT(*link != NULL);
+      }
+      *link = frame->mpnNext;
+      HostIF_FreeMachinePage(frame->mpn);
+      cowUniqueMPNs--;
+   } else {
+      cowNumHints--;
+   }
+   HostIF_FreeKernelMem(frame);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWFindShared --
+ *
+ *      Find the frame of a shared MPN.
+ *
+ * Results:
+ *      The frame, or NULL if mpn is not a shared page.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static COWFrame *
+HostIFCOWFindShared(MPN mpn)  // IN:
+{
+   COWFrame *frame;
+
+   if (cowZero == NULL || mpn == INVALID_MPN) {
+      return NULL;
+   }
+   for (frame = *HostIFCOWMPNBucket(mpn); frame != NULL;
+        frame = frame->mpnNext) {
+      if (frame->mpn == mpn) {
+         return frame;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWGet --
+ * HostIFCOWPut --
+ *
+ *      Take or drop a reference to a shared frame.  Taking one keeps
+ *      the hot page list current; dropping the last one frees the frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCOWGet(COWFrame *frame)  // IN:
+{
+   int victim = -1;
+   unsigned int i;
+
+   frame->ref++;
+   cowNumRef++;
+
+   for (i = 0; i < VMMEM_COW_HOT_PAGES; i++) {
+      if (cowHot[i] == frame) {
+         return;
+      }
+      if (victim < 0 ||
+          (cowHot[victim] != NULL &&
+           (cowHot[i] == NULL || cowHot[i]->ref < cowHot[victim]->ref))) {
+         victim = i;
+      }
+   }
+   if (cowHot[victim] == NULL || cowHot[victim]->ref < frame->ref) {
+      cowHot[victim] = frame;
+   }
+}
+
+static void
+HostIFCOWPut(COWFrame *frame)  // IN:
+{
+   ASSERT(frame->ref > 0);
+   frame->ref--;
+   cowNumRef--;
+   if (frame->ref == 0) {
+      HostIFCOWFreeFrame(frame);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWInit --
+ *
+ *      Allocate the hash table and the shared zero page on first use.
+ *      The zero page holds a reference of its own so it is never freed
+ *      before HostIF_COWCleanup.
+ *
+ * Results:
+ *      TRUE on success, FALSE on allocation failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HostIFCOWInit(void)
+{
+   uint8 *zeroes;
+   unsigned int i;
+
+   if (cowZero != NULL) {
+      return TRUE;
+   }
+
+   for (i = 0; i < COW_HASH_PAGES; i++) {
+      if (cowHash[i] == NULL) {
+         cowHash[i] = HostIF_AllocPage();
+         if (cowHash[i] == NULL) {
+            return FALSE;
+         }
+         memset(cowHash[i], 0, PAGE_SIZE);
+      }
+   }
+   for (i = 0; i < COW_MPN_PAGES; i++) {
+      if (cowMPNHash[i] == NULL) {
+         cowMPNHash[i] = HostIF_AllocPage();
+         if (cowMPNHash[i] == NULL) {
+            return FALSE;
+         }
+         memset(cowMPNHash[i], 0, PAGE_SIZE);
+      }
+   }
+
+   zeroes = HostIF_AllocPage();
+   if (zeroes == NULL) {
+      return FALSE;
+   }
+   memset(zeroes, 0, PAGE_SIZE);
+   cowZero = HostIFCOWNewFrame(HashFunc_HashPage(zeroes), zeroes, NULL, 0);
+   HostIF_FreePage(zeroes);
+   if (cowZero == NULL) {
+      return FALSE;
+   }
+   HostIFCOWGet(cowZero);
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWMap --
+ *
+ *      Record that bpn of vm is now backed by frame, on whose behalf
+ *      the caller has taken a reference.  A previous mapping of bpn is
+ *      released.
+ *
+ * Results:
+ *      1 if bpn was not shared before, 0 if it was, -1 on failure (the
+ *      caller keeps its reference).
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HostIFCOWMap(VMDriver *vm,      // IN:
+             BPN bpn,           // IN:
+             COWFrame *frame)   // IN:
+{
+   VMHost *vmh = vm->vmhost;
+   MemTrackEntry *entry;
+
+   if (vmh->cowTracker == NULL) {
+      vmh->cowTracker = MemTrack_Init();
+      if (vmh->cowTracker == NULL) {
+         return -1;
+      }
+   }
+
+   entry = MemTrack_LookupVPN(vmh->cowTracker, bpn);
+   if (entry == NULL) {
+      if (MemTrack_Add(vmh->cowTracker, bpn, frame->mpn) == NULL) {
+         return -1;
+      }
+      return 1;
+   }
+   if (entry->mpn == 0) {
+      entry->mpn = frame->mpn;
+      return 1;
+   }
+
+   {
+      COWFrame *old = HostIFCOWFindShared(entry->mpn);
+
+      entry->mpn = frame->mpn;
+      if (old != NULL) {
+         HostIFCOWPut(old);
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWQueueHint --
+ *
+ *      Queue a hinted BPN for its VM to share again.  The queue is
+ *      advisory: overflowing entries are dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCOWQueueHint(VMDriver *vm,  // IN:
+                   BPN bpn)       // IN:
+{
+   VMHost *vmh = vm->vmhost;
+
+   if (vmh->cowHints == NULL) {
+      vmh->cowHints = HostIF_AllocPage();
+      if (vmh->cowHints == NULL) {
+         return;
+      }
+   }
+   if (vmh->cowNumHints < COW_HINT_QUEUE_MAX) {
+      vmh->cowHints[vmh->cowNumHints++] = bpn;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWOwnsMPN --
+ *
+ *      Tests whether mpn is a page the VM locked, by VA (small or large
+ *      page) or by MPN, or allocated without a particular VA.  The
+ *      physTracker of pages locked by VA is shared by all VMs, so it
+ *      only filters: the VM's own memtracker must hold the page, or the
+ *      large page containing it.  Called with the VM lock held.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HostIFCOWOwnsMPN(VMDriver *vm,  // IN:
+                 MPN mpn)       // IN:
+{
+   VMHost *vmh = vm->vmhost;
+   MemTrackEntry *entry;
+
+   if (vmh == NULL) {
+      return FALSE;
+   }
+   if ((vmh->lockedPages && PhysTrack_Test(vmh->lockedPages, mpn)) ||
+       (vmh->AWEPages && PhysTrack_Test(vmh->AWEPages, mpn))) {
+      return TRUE;
+   }
+   if (vmh->physTracker == NULL || vm->memtracker == NULL ||
+       !HOST_ISTRACKED_PFN(vm, mpn)) {
+      return FALSE;
+   }
+   entry = MemTrack_LookupMPN(vm->memtracker, mpn);
+   if (entry != NULL && (entry->vpn & HOSTIF_LARGE_VPN_TAG) == 0) {
+      return TRUE;
+   }
+   entry = MemTrack_LookupMPN(vm->memtracker,
+                              mpn & ~(MPN)(HOSTIF_LARGE_PAGES - 1));
+
+   return entry != NULL && (entry->vpn & HOSTIF_LARGE_VPN_TAG) != 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWShare --
+ *
+ *      Try to share a batch of guest pages, described by the
+ *      BusMem_PageList the monitor put in info->pshareMPN.  For each
+ *      page the private MPN, which must belong to the VM, is hashed and
+ *      compared against shared pages with the same key.  On a match, or
+ *      on a match with a hint left by another page, the BPN is backed by
+ *      the shared page; otherwise a hint is recorded.  Called with the
+ *      VM lock held.
+ *
+ * Results:
+ *      Number of pages shared, or -EINVAL if the page list is bad.  For
+ *      each shared page stateList[i] is set and mpnList[i] is the shared
+ *      MPN; the other entries get INVALID_MPN.  *numNew is the number of
+ *      BPNs that were not shared before; info->shareFailure is set if
+ *      some page could not be processed for lack of memory.
+ *
+ * Side effects:
+ *      Shared pages may be allocated and hint updates queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HostIF_COWShare(VMDriver *vm,            // IN:
+                COWShareInfo *info,      // IN/OUT:
+                unsigned int *numNew)    // OUT:
+{
+   unsigned int numPages = info->numPages;
+   BusMem_PageList *list;
+   struct page *listPage;
+   unsigned int i;
+   int numShared = 0;
+
+   *numNew = 0;
+   info->shareFailure = FALSE;
+   if (numPages > BUSMEM_PAGELIST_MAX ||
+       !HostIFCOWOwnsMPN(vm, info->pshareMPN)) {
+      return -EINVAL;
+   }
+
+   MutexLock(&cowMutex, 1);
+   if (!HostIFCOWInit()) {
+      MutexUnlock(&cowMutex, 1);
+      info->shareFailure = TRUE;
+      return 0;
+   }
+   listPage = pfn_to_page(info->pshareMPN);
+   list = kmap(listPage);
+
+   for (i = 0; i < numPages; i++) {
+      BPN bpn = list->bpnList[i];
+      MPN mpn = list->mpnList[i];
+      COWFrame *frame = NULL;
+      COWFrame *hint = NULL;
+      Bool selfHint = FALSE;
+      struct page *page;
+      const void *va;
+      uint64 key;
+      COWFrame *f;
+      int mapped;
+
+      list->stateList[i] = FALSE;
+      list->mpnList[i] = INVALID_MPN;
+      if (!HostIFCOWOwnsMPN(vm, mpn)) {
+         continue;
+      }
+
+      page = pfn_to_page(mpn);
+      va = kmap(page);
+      key = HashFunc_HashPage((void *)va);
+
+      for (f = *HostIFCOWBucket(key); f != NULL; f = f->next) {
+         if (f->key != key) {
+            continue;
+         }
+         if (f->mpn != INVALID_MPN) {
+            struct page *spage = pfn_to_page(f->mpn);
+            Bool same = memcmp(kmap(spage), va, PAGE_SIZE) == 0;
+
+            kunmap(spage);
+            if (same) {
+               frame = f;
+               break;
+            }
+         } else if (f->hintVM == vm && f->hintBPN == bpn) {
+            selfHint = TRUE;
+         } else if (hint == NULL) {
+            hint = f;
+         }
+      }
+
+      if (frame == NULL && hint != NULL) {
+         frame = HostIFCOWNewFrame(key, va, NULL, 0);
+         if (frame != NULL) {
+            HostIFCOWQueueHint(hint->hintVM, hint->hintBPN);
+            HostIFCOWFreeFrame(hint);
+         } else {
+            info->shareFailure = TRUE;
+         }
+      } else if (frame == NULL && !selfHint && cowNumHints < COW_MAX_HINTS) {
+         if (HostIFCOWNewFrame(key, NULL, vm, bpn) == NULL) {
+            info->shareFailure = TRUE;
+         }
+      }
+      kunmap(page);
+
+      if (frame == NULL) {
+         continue;
+      }
+      HostIFCOWGet(frame);
+      mapped = HostIFCOWMap(vm, bpn, frame);
+      if (mapped < 0) {
+         HostIFCOWPut(frame);
+         info->shareFailure = TRUE;
+         continue;
+      }
+      *numNew += mapped;
+      list->stateList[i] = TRUE;
+      list->mpnList[i] = frame->mpn;
+      numShared++;
+   }
+
+   kunmap(listPage);
+   MutexUnlock(&cowMutex, 1);
+
+   return numShared;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWGetZeroMPN --
+ *
+ *      Return the MPN of the shared zero page.
+ *
+ * Results:
+ *      The MPN, or INVALID_MPN on allocation failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+MPN
+HostIF_COWGetZeroMPN(void)
+{
+   MPN mpn = INVALID_MPN;
+
+   MutexLock(&cowMutex, 2);
+   if (HostIFCOWInit()) {
+      mpn = cowZero->mpn;
+   }
+   MutexUnlock(&cowMutex, 2);
+
+   return mpn;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWIncZeroRef --
+ *
+ *      Record that bpn of vm is backed by the shared zero page.  Called
+ *      with the VM lock held.
+ *
+ * Results:
+ *      1 if bpn was not shared before, 0 if it was, negative error code
+ *      on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HostIF_COWIncZeroRef(VMDriver *vm,  // IN:
+                     BPN bpn)       // IN:
+{
+   int ret = -ENOMEM;
+
+   MutexLock(&cowMutex, 3);
+   if (HostIFCOWInit()) {
+      HostIFCOWGet(cowZero);
+      ret = HostIFCOWMap(vm, bpn, cowZero);
+      if (ret < 0) {
+         HostIFCOWPut(cowZero);
+         ret = -ENOMEM;
+      }
+   }
+   MutexUnlock(&cowMutex, 3);
+
+   return ret;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWCopyPage --
+ *
+ *      Break sharing of bpn: copy its shared page into mpn, a page the
+ *      VM owns, and drop the reference.  Called with the VM lock held.
+ *
+ * Results:
+ *      0 on success, -EINVAL if mpn does not belong to the VM or bpn is
+ *      not shared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HostIF_COWCopyPage(VMDriver *vm,  // IN:
+                   BPN bpn,       // IN:
+                   MPN mpn)       // IN: private destination page
+{
+   MemTrackEntry *entry = NULL;
+   COWFrame *frame = NULL;
+   struct page *src;
+   struct page *dst;
+
+   if (!HostIFCOWOwnsMPN(vm, mpn)) {
+      return -EINVAL;
+   }
+
+   MutexLock(&cowMutex, 4);
+   if (vm->vmhost->cowTracker != NULL) {
+      entry = MemTrack_LookupVPN(vm->vmhost->cowTracker, bpn);
+   }
+   if (entry != NULL) {
+      frame = HostIFCOWFindShared(entry->mpn);
+   }
+   if (frame == NULL) {
+      MutexUnlock(&cowMutex, 4);
+      return -EINVAL;
+   }
+
+   src = pfn_to_page(frame->mpn);
+   dst = pfn_to_page(mpn);
+   memcpy(kmap(dst), kmap(src), PAGE_SIZE);
+   kunmap(src);
+   kunmap(dst);
+
+   entry->mpn = 0;
+   HostIFCOWPut(frame);
+   cowNumBreaks++;
+   MutexUnlock(&cowMutex, 4);
+
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWCheck --
+ *
+ *      Cross-check the monitor's view of a set of pages against the
+ *      driver's: fill in hostMPN/hostCOW from the VM's mappings, keyOK
+ *      if a shared page still hashes to its key, and checkOK if both
+ *      sides agree.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HostIF_COWCheck(VMDriver *vm,          // IN:
+                COWCheckInfo *info)    // IN/OUT:
+{
+   unsigned int i;
+
+   MutexLock(&cowMutex, 5);
+   for (i = 0; i < info->numPages; i++) {
+      PShare_COWCheckInfo *check = &info->check[i];
+      MemTrackEntry *entry = NULL;
+
+      if (vm->vmhost->cowTracker != NULL) {
+         entry = MemTrack_LookupVPN(vm->vmhost->cowTracker, check->bpn);
+      }
+      check->hostCOW = entry != NULL && entry->mpn != 0;
+      check->hostMPN = check->hostCOW ? entry->mpn : INVALID_MPN;
+      check->keyOK = !check->hostCOW ||
+                     HostIFCOWFindShared(check->hostMPN) != NULL;
+      check->checkOK = check->keyOK &&
+                       check->vmmCOW == check->hostCOW &&
+                       (!check->hostCOW || check->vmmMPN == check->hostMPN);
+   }
+   MutexUnlock(&cowMutex, 5);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWUpdateHints --
+ *
+ *      Hand the VM a batch of its hinted BPNs that now have a match.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HostIF_COWUpdateHints(VMDriver *vm,         // IN:
+                      COWHintInfo *info)    // OUT:
+{
+   VMHost *vmh = vm->vmhost;
+   unsigned int n;
+   unsigned int i;
+
+   MutexLock(&cowMutex, 6);
+   n = MIN(vmh->cowNumHints, PSHARE_HINT_BATCH_PAGES_MAX);
+   for (i = 0; i < n; i++) {
+      info->updates[i].bpn = vmh->cowHints[i];
+   }
+   if (n > 0) {
+      vmh->cowNumHints -= n;
+      memmove(vmh->cowHints, vmh->cowHints + n,
+              vmh->cowNumHints * sizeof *vmh->cowHints);
+   }
+   info->numHints = n;
+   MutexUnlock(&cowMutex, 6);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWGetStats --
+ *
+ *      Fill in the global page sharing statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HostIF_COWGetStats(VMMemCOWInfo *info)  // OUT:
+{
+   unsigned int i;
+
+   MutexLock(&cowMutex, 7);
+   for (i = 0; i < VMMEM_COW_HOT_PAGES; i++) {
+      COWFrame *frame = cowHot[i];
+
+      info->hot[i].mpn = frame ? frame->mpn : INVALID_MPN;
+      info->hot[i].ref = frame ? frame->ref : 0;
+      info->hot[i].key = frame ? frame->key : 0;
+      info->hot[i].pageClass = frame != NULL && frame == cowZero ? PC_ZERO
+                                                                 : PC_UNKNOWN;
+   }
+   info->numRef = cowNumRef;
+   info->numHints = cowNumHints;
+   info->uniqueMPNs = cowUniqueMPNs;
+   info->numBreaks = cowNumBreaks;
+   info->totalUniqueMPNs = cowTotalUniqueMPNs;
+   MutexUnlock(&cowMutex, 7);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWUnmapEntry --
+ *
+ *      MemTrack_Cleanup callback dropping a VM's reference to a shared
+ *      page.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCOWUnmapEntry(void *cData,            // IN: unused
+                    MemTrackEntry *entry)   // IN:
+{
+   if (entry->mpn != 0) {
+      COWFrame *frame = HostIFCOWFindShared(entry->mpn);
+
+      if (frame != NULL) {
+         HostIFCOWPut(frame);
+      }
+      entry->mpn = 0;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCOWCleanupVM --
+ *
+ *      Drop all sharing state of a VM: its references to shared pages,
+ *      its hints and its queue of hint updates.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCOWCleanupVM(VMDriver *vm)  // IN:
+{
+   VMHost *vmh = vm->vmhost;
+
+   MutexLock(&cowMutex, 8);
+   if (vmh->cowTracker != NULL) {
+      MemTrack_Cleanup(vmh->cowTracker, HostIFCOWUnmapEntry, NULL);
+      vmh->cowTracker = NULL;
+   }
+   if (cowNumHints > 0) {
+      unsigned int i;
+
+      for (i = 0; i < COW_HASH_BUCKETS; i++) {
+         COWFrame *frame = cowHash[i / COW_HASH_PER_PAGE][i % COW_HASH_PER_PAGE];
+
+         while (frame != NULL) {
+            COWFrame *next = frame->next;
+
+            if (frame->mpn == INVALID_MPN && frame->hintVM == vm) {
+               HostIFCOWFreeFrame(frame);
+            }
+            frame = next;
+         }
+      }
+   }
+   if (vmh->cowHints != NULL) {
+      HostIF_FreePage(vmh->cowHints);
+      vmh->cowHints = NULL;
+      vmh->cowNumHints = 0;
+   }
+   MutexUnlock(&cowMutex, 8);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_COWCleanup --
+ *
+ *      Free the shared zero page and the hash table at module unload,
+ *      once every VM is gone.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HostIF_COWCleanup(void)
+{
+   unsigned int i;
+
+   MutexLock(&cowMutex, 9);
+   if (cowZero != NULL) {
+      HostIFCOWPut(cowZero);
+      cowZero = NULL;
+   }
+   ASSERT(cowUniqueMPNs == 0 && cowNumHints == 0);
+   for (i = 0; i < COW_HASH_PAGES; i++) {
+      if (cowHash[i] != NULL) {
+         HostIF_FreePage(cowHash[i]);
+         cowHash[i] = NULL;
+      }
+   }
+   for (i = 0; i < COW_MPN_PAGES; i++) {
+      if (cowMPNHash[i] != NULL) {
+         HostIF_FreePage(cowMPNHash[i]);
+         cowMPNHash[i] = NULL;
+      }
+   }
+   MutexUnlock(&cowMutex, 9);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_GetLockedPageList --
+ *
+ *      puts MPNs of pages that were allocated by HostIF_AllocLockedPages()
+ *      into user mode buffer.
+ *
+ * Results:
+ *	non-negative number of the MPNs in the buffer on success.
+ *	negative error code on error (-EFAULT)
+ *
+ * Side effects:
+ *      none
+ *
+ *----------------------------------------------------------------------
+ */
+
+int 
+HostIF_GetLockedPageList(VMDriver* vm,          // IN: VM instance pointer
+			 VA64 uAddr,            // OUT: user mode buffer for MPNs
 		         unsigned int numPages) // IN: size of the buffer in MPNs 
 {
    MPN32 *mpns = VA64ToPtr(uAddr);
+   MPN32 *buf;
    MPN mpn;
    unsigned count;
+   unsigned fill;
 
    struct PhysTracker* AWEPages;
 
@@ -3511,15 +5414,37 @@ HostIF_GetLockedPageList(VMDriver* vm,          // IN: VM instance pointer
    }
    AWEPages = vm->vmhost->AWEPages;
 
-   for (mpn = 0, count = 0;
+   /*
+    * Gather the MPNs a page at a time and copy each page out at once.
+    */
+
+   buf = HostIF_AllocPage();
+   if (buf == NULL) {
+      return -ENOMEM;
+   }
+
+   for (mpn = 0, count = 0, fill = 0;
 	(count < numPages) &&
         (INVALID_MPN != (mpn = PhysTrack_GetNext(AWEPages, mpn)));
         count++) {
 
-      if (HostIF_CopyToUser(&mpns[count], &mpn, sizeof *mpns) != 0) {
-	 return -EFAULT;
+      buf[fill++] = mpn;
+      if (fill == PAGE_SIZE / sizeof *buf) {
+         if (HostIF_CopyToUser(&mpns[count + 1 - fill], buf,
+                               fill * sizeof *buf) != 0) {
+            HostIF_FreePage(buf);
+	    return -EFAULT;
+         }
+         fill = 0;
       }
    }
+   if (fill > 0 &&
+       HostIF_CopyToUser(&mpns[count - fill], buf, fill * sizeof *buf) != 0) {
+      HostIF_FreePage(buf);
+      return -EFAULT;
+   }
+   HostIF_FreePage(buf);
+
    return count;
 }
 
@@ -3673,6 +5598,213 @@ HostIFScheduleHRTimeout(ktime_t *expires)  //IN:
 #endif //VMMON_USE_COMPAT_SCHEDULE_HRTIMEOUT
 
 
+#ifdef VMMON_USE_PERCPU_FAST_CLOCK
+/*
+ * Each host CPU gets its own pinned hrtimer.  Task_Switch arms it when
+ * the VCPU it enters the monitor with has a MonitorPoll deadline
+ * pending, for that deadline but at most one fast clock period away, so
+ * the deadline is met without waiting for the next fast clock tick.
+ * The timer interrupt is what forces the VCPU back to the host, so the
+ * callback itself has nothing to do, and the next switch into the
+ * monitor arms the timer again.  CPUs that are idle or run VCPUs
+ * without a deadline are never ticked by it.
+ *
+ * A deadline the VCPU sets from within the monitor is not seen by
+ * Task_Switch, so the fast clock thread keeps calling
+ * Vmx86_MonitorPollIPI to kick such VCPUs, and keeps running at the
+ * full rate for that and the userlevel poll wakeups.  The per-CPU
+ * timers therefore only sharpen deadlines known at entry, on top of the
+ * fast clock, and are off by default.
+ *
+ * Stopping clears 'on' under each clock's lock before cancelling its
+ * timer, and arming checks 'on' under the same lock, so a remote CPU
+ * cannot start a timer behind the cancel.
+ */
+
+typedef struct HostIFCPUClock {
+   struct hrtimer timer;
+   spinlock_t     lock;     // protects on, armed against stopping
+   Bool           on;
+   Bool           armed;
+} HostIFCPUClock;
+
+static HostIFCPUClock hostIFCPUClock[MAX_PROCESSORS];
+static Bool hostIFCPUClockInited;
+static volatile Bool hostIFCPUClockOn;
+static uint32 hostIFCPUClockPeriodNS;
+static uint32 hostIFCPUClockPeriodTicks;  // period in pseudo TSC ticks
+
+static int fastclock_percpu = 0;
+module_param(fastclock_percpu, int, 0444);
+MODULE_PARM_DESC(fastclock_percpu, "Also arm per-CPU hrtimers for monitor "
+                 "poll deadlines pending at monitor entry.");
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCPUClockFire --
+ *
+ *      Per-CPU fast clock timer callback.  The interrupt has already
+ *      done the job of getting the VCPU out of the monitor.
+ *
+ * Results:
+ *      Tell the kernel not to restart the timer.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static enum hrtimer_restart
+HostIFCPUClockFire(struct hrtimer *timer)  // IN:
+{
+   HostIFCPUClock *clk = container_of(timer, HostIFCPUClock, timer);
+
+   clk->armed = FALSE;
+
+   return HRTIMER_NORESTART;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIFCPUClockSetRate --
+ *
+ *      Start (rate != 0) or stop (rate == 0) the per-CPU fast clock,
+ *      or change its period.
+ *
+ * Locking:
+ *      The caller must hold the fast clock lock.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Stopping waits for running timer callbacks.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HostIFCPUClockSetRate(unsigned int rate)  // IN: Frequency in Hz.
+{
+   unsigned long flags;
+   unsigned i;
+
+   if (rate != 0) {
+      uint64 ticks;
+      uint32 rem;
+
+      if (!hostIFCPUClockInited) {
+         for (i = 0; i < MAX_PROCESSORS; i++) {
+            hrtimer_init(&hostIFCPUClock[i].timer, CLOCK_MONOTONIC,
+                         HRTIMER_MODE_REL);
+            hostIFCPUClock[i].timer.function = HostIFCPUClockFire;
+            spin_lock_init(&hostIFCPUClock[i].lock);
+         }
+         hostIFCPUClockInited = TRUE;
+      }
+      Div643264(Vmx86_GetPseudoTSCHz(), rate, &ticks, &rem);
+      hostIFCPUClockPeriodNS = NSEC_PER_SEC / rate;
+      hostIFCPUClockPeriodTicks = ticks > MAX_UINT32 ? 0 : (uint32)ticks;
+      for (i = 0; i < MAX_PROCESSORS; i++) {
+         HostIFCPUClock *clk = &hostIFCPUClock[i];
+
+         spin_lock_irqsave(&clk->lock, flags);
+         if (!clk->on) {
+            clk->armed = FALSE;
+            clk->on = TRUE;
+         }
+         spin_unlock_irqrestore(&clk->lock, flags);
+      }
+      hostIFCPUClockOn = TRUE;
+   } else if (hostIFCPUClockOn) {
+      hostIFCPUClockOn = FALSE;
+      for (i = 0; i < MAX_PROCESSORS; i++) {
+         HostIFCPUClock *clk = &hostIFCPUClock[i];
+
+         spin_lock_irqsave(&clk->lock, flags);
+         clk->on = FALSE;
+         spin_unlock_irqrestore(&clk->lock, flags);
+         hrtimer_cancel(&clk->timer);
+      }
+   }
+}
+#endif // VMMON_USE_PERCPU_FAST_CLOCK
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HostIF_FastClockArm --
+ *
+ *      Called by Task_Switch, with interrupts disabled, when a VCPU
+ *      whose MonitorPoll deadline is 'expiry' enters the monitor on
+ *      the current host CPU pCPU.  If the per-CPU fast clock is in use
+ *      and not already pending on this CPU, arm it to fire at the
+ *      deadline, but no later than one fast clock period from now.
+ *
+ *      An overdue deadline still gets 1/8 of a period, so that the VCPU
+ *      makes progress in the monitor before it is kicked out again.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May arm the timer of the current CPU.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HostIF_FastClockArm(uint32 pCPU,          // IN: current host CPU
+                    VmAbsoluteTS expiry)  // IN: MonitorPoll deadline
+{
+#ifdef VMMON_USE_PERCPU_FAST_CLOCK
+   HostIFCPUClock *clk;
+   uint64 ns;
+   uint32 ticks;
+
+   if (!hostIFCPUClockOn || pCPU >= MAX_PROCESSORS) {
+      return;
+   }
+   clk = &hostIFCPUClock[pCPU];
+   if (clk->armed) {
+      return;
+   }
+
+   spin_lock(&clk->lock);
+   if (!clk->on) {
+      spin_unlock(&clk->lock);
+      return;
+   }
+
+   ns = hostIFCPUClockPeriodNS;
+   ticks = hostIFCPUClockPeriodTicks;
+   if (ticks != 0) {
+      int64 delta = (int64)(expiry - Vmx86_GetPseudoTSC());
+      uint32 rem;
+
+      if (delta <= 0) {
+         ns /= 8;
+      } else if (delta < ticks) {
+         Div643264((uint64)delta * ns, ticks, &ns, &rem);
+         ns = MAX(ns, hostIFCPUClockPeriodNS / 8);
+      }
+   }
+
+   clk->armed = TRUE;
+   hrtimer_start_range_ns(&clk->timer, ns_to_ktime(ns),
+                          hostIFCPUClockPeriodNS / 100,
+                          HRTIMER_MODE_REL_PINNED);
+   spin_unlock(&clk->lock);
+#endif
+}
+
+
 #ifndef VMMON_USE_HIGH_RES_TIMERS
 /*
  *----------------------------------------------------------------------
@@ -3864,7 +5996,8 @@ HostIFFastClockThread(void *data)  // IN:
 #if defined(CONFIG_SMP)
       /*
        * IPI each VCPU thread that is in the monitor and is due to
-       * fire a MonitorPoll callback.
+       * fire a MonitorPoll callback.  The per-CPU timers only cover
+       * deadlines that were pending when the VCPU entered the monitor.
        */
       Vmx86_MonitorPollIPI();
 #endif
@@ -3912,7 +6045,8 @@ HostIFFastClockThread(void *data)  // IN:
  *      which timer interrupts will occur on CPUs other than 0, then
  *      also arrange to call Vmx86_MonitorPollIPI on every timer
  *      interrupt, in order to relay IPIs to any other CPUs that need
- *      them.
+ *      them.  With per-CPU hrtimers, CPUs that enter the monitor with a
+ *      deadline are also ticked directly (see HostIF_FastClockArm).
  *
  * Locking:
  *      The caller must hold the fast clock lock.
@@ -4001,7 +6135,15 @@ HostIF_SetFastClockRate(unsigned int rate) // IN: Frequency in Hz.
          }
          linuxState.fastClockThread = rtcTask;
       }
+#ifdef VMMON_USE_PERCPU_FAST_CLOCK
+      if (fastclock_percpu) {
+         HostIFCPUClockSetRate(rate);
+      }
+#endif
    } else {
+#ifdef VMMON_USE_PERCPU_FAST_CLOCK
+      HostIFCPUClockSetRate(0);
+#endif
       if (linuxState.fastClockThread) {
          force_sig(SIGKILL, linuxState.fastClockThread);
          compat_kthread_stop(linuxState.fastClockThread);
@@ -88,6 +88,7 @@ typedef struct VMHost {
    unsigned int       crosspagePagesCount;
    struct page        *crosspagePages[MAX_INITBLOCK_CPUS];
    struct task_struct *vcpuSemaTask[MAX_INITBLOCK_CPUS];
+   struct HostIFSema  *vcpuSema[MAX_INITBLOCK_CPUS];   // registered eventfds
    struct PhysTracker *physTracker;
    /*
     * Pages that were allocated/mapped by VMX and locked by the driver and
@@ -100,6 +101,11 @@ typedef struct VMHost {
     * as pages for "AWE" guest memory.
     */
    struct PhysTracker *AWEPages; 
+   /* Guest pages backed by shared (COW) pages: BPN -> shared MPN. */
+   struct MemTrack    *cowTracker;
+   /* Hinted BPNs that found a match, waiting for COW_UPDATE_HINT. */
+   BPN                *cowHints;
+   unsigned int       cowNumHints;
    /* Is VMDriver.hostAPIC mapped or is from __fix_to_virt(FIX_APIC_BASE)? */
    Bool               hostAPICIsMapped;
 
@@ -179,7 +179,7 @@ skipTaskSwitch:;
       }
 
       case MODULECALL_SEMASIGNAL: {
-         retval = HostIF_SemaphoreSignal(crosspage->args);
+         retval = HostIF_SemaphoreSignal(vm, crosspage->args);
 
          if (retval == MX_WAITINTERRUPTED) {
              crosspage->moduleCallInterrupted = TRUE;
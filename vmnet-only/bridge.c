@@ -586,6 +586,11 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
       return;
    }
 
+   if (VNetIsGSO(skb)) {
+      VNetReceiveSegmented(this, skb);
+      return;
+   }
+
    /*
     * skb might be freed by wireless code, so need to keep
     * a local copy of the MAC rather than a pointer to it.
@@ -1475,11 +1480,9 @@ VNetBridgeComputeHeaderPos(struct sk_buff *skb) // IN: buffer to examine
  *                no helper.
  * Oldest kernels: without any segmentation offload support.
  */
-#if defined(NETIF_F_GSO) || LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 18)
-#define VNetBridgeIsGSO(skb) skb_shinfo(skb)->gso_size
+#if defined(VNET_HAVE_GSO)
 #define VNetBridgeGSOSegment(skb) skb_gso_segment(skb, 0)
 #elif defined(NETIF_F_TSO)
-#define VNetBridgeIsGSO(skb) skb_shinfo(skb)->tso_size
 
 
 /*
@@ -1610,7 +1613,6 @@ VNetBridgeGSOSegment(struct sk_buff *skb)        // IN: packet to split
    return segs;
 }
 #else
-#define VNetBridgeIsGSO(skb) (0)
 #define VNetBridgeGSOSegment(skb) ERR_PTR(-ENOSYS)
 #endif
 
@@ -1664,6 +1666,49 @@ VNetBridgeSendLargePacket(struct sk_buff *skb,        // IN: packet to split
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetReceiveSegmented --
+ *
+ *      Split a GSO sk_buff into packets which fit on wire and hand each
+ *      one to the receive function of the jack. Used by receivers that
+ *      cannot take GSO packets when the bridge passes them through.
+ *
+ *	skb passed in is deallocated by function.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The packet is split into multiple packets.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetReceiveSegmented(VNetJack *jack,       // IN: receiving jack
+                     struct sk_buff *skb)  // IN: packet to split
+{
+   struct sk_buff *segs;
+
+   segs = VNetBridgeGSOSegment(skb);
+   dev_kfree_skb(skb);
+   if (IS_ERR(segs)) {
+      LOG(1, (KERN_DEBUG "%s: cannot segment packet: error %ld\n",
+              jack->name, PTR_ERR(segs)));
+      return;
+   }
+
+   while (segs) {
+      skb = segs;
+      segs = skb->next;
+      skb->next = NULL;
+      jack->rcv(jack, skb);
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1782,9 +1827,10 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
 	   bridge->name, (int) skb->len));
 
    /*
-    * If this is a large packet, chop chop chop (if supported)...
+    * If this is a large packet, chop chop chop (if supported), unless
+    * some port on a vnet takes it whole...
     */
-   if (VNetBridgeIsGSO(skb)) {
+   if (VNetIsGSO(skb) && atomic_read(&vnetGSOPorts) == 0) {
       VNetBridgeSendLargePacket(skb, bridge);
    } else {
       VNetSend(&bridge->port.jack, skb);
@@ -26,6 +26,7 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
 
 #include <linux/smp.h>
 
@@ -71,6 +72,7 @@ extern int VNetUserListener_Create(uint32 classMask, VNetJack *hubJack, VNetPort
  * Filter routine from filter.c
  */
 extern int VNetFilter_HandleUserCall(VNet_RuleHeader *ruleHeader, unsigned long ioarg);
+extern void VNetFilter_Init(void);
 extern void VNetFilter_Shutdown(void);
 #endif
 
@@ -95,7 +97,10 @@ const uint8 allMultiFilter[VNET_LADRF_LEN] = { 0xff, 0xff, 0xff, 0xff,
 const uint8 broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 /*
- * All jack->peer accesses are guarded by this lock.
+ * All jack->peer updates are guarded by this lock. The packet path
+ * (VNetSend) does not take it: peers are published with
+ * rcu_assign_pointer() and VNetDisconnect waits for a grace period
+ * before handing the old peer back to be freed.
  *
  * This lock is acquired for read from interrupt context:
  * use write_lock_irqsave() to gain write access.
@@ -126,7 +131,9 @@ compat_define_mutex(vnetMutex);
  */
 static const unsigned int ioctl32_cmds[] = {
 	SIOCGBRSTATUS, SIOCSPEER, SIOCSPEER2, SIOCSBIND, SIOCGETAPIVERSION2,
-        SIOCSFILTERRULES, SIOCSUSERLISTENER, SIOCSPEER3, 0,
+        SIOCSFILTERRULES, SIOCSUSERLISTENER, SIOCSPEER3, SIOCBATCHRECV,
+        SIOCBATCHSEND, SIOCSETRING, SIOCUNSETRING, SIOCRINGKICK,
+        SIOCSHUBLEARN, SIOCSETQUEUES, SIOCSQUEUELEN, SIOCSOFFLOAD, 0,
 };
 #endif
 
@@ -476,6 +483,10 @@ init_module(void)
       goto err_proto;
    }
 
+#ifdef CONFIG_NETFILTER
+   VNetFilter_Init();
+#endif
+
    /*
     * Initialize the file_operations structure. Because this code is always
     * compiled as a module, this is fine to do it here and not in a static
@@ -515,6 +526,9 @@ init_module(void)
 err_ioctl:
    unregister_chrdev(VNET_MAJOR_NUMBER, "vmnet");
 err_chrdev:
+#ifdef CONFIG_NETFILTER
+   VNetFilter_Shutdown();
+#endif
    VNetProtoUnregister();
 err_proto:
    VNetProc_Cleanup();
@@ -547,10 +561,12 @@ cleanup_module(void)
    unregister_ioctl32_handlers();
    unregister_chrdev(VNET_MAJOR_NUMBER, "vmnet");
    VNetProtoUnregister();
-   VNetProc_Cleanup();
 #ifdef CONFIG_NETFILTER
    VNetFilter_Shutdown();
 #endif
+   VNetProc_Cleanup();
+   /* Let pending call_rcu() callbacks run before the code goes away. */
+   rcu_barrier();
 }
 
 
@@ -815,6 +831,15 @@ VNetFileOpPoll(struct file *filp, // IN:
  *      SIOCSFILTERRULES - set host filter rules    - ioarg IN: VNet_Filter
  *      SIOCBRIDGE - (legacy see SIOCSPEER)
  *      SIOCSUSERLISTENER - set user listener - ioarg IN: VNet_SetUserListener
+ *      SIOCBATCHRECV - read many packets         - ioarg IN/OUT: VNet_Batch
+ *      SIOCBATCHSEND - write many packets        - ioarg IN/OUT: VNet_Batch
+ *      SIOCSETRING - map shared packet ring      - ioarg IN: VNet_Ring
+ *      SIOCUNSETRING - unmap shared packet ring  - no ioarg
+ *      SIOCRINGKICK - send pending ring frames   - no ioarg
+ *      SIOCSHUBLEARN - set hub MAC learning age  - ioarg IN: 4 bytes
+ *      SIOCSETQUEUES - set receive queues        - ioarg IN: VNet_Queues
+ *      SIOCSQUEUELEN - set receive queue limit   - ioarg IN: VNet_QueueLen
+ *      SIOCSOFFLOAD  - set receive offloads      - ioarg IN: uint32
  *
  *      Supported flags are (taken from if.h):
  *
@@ -1009,6 +1034,22 @@ VNetFileOpIoctl(struct inode   *inode, // IN:
       break;
 #endif
 
+   case SIOCSHUBLEARN:
+      {
+         uint32 ageSecs;
+
+         if (copy_from_user(&ageSecs, (void *)ioarg, sizeof ageSecs)) {
+            return -EFAULT;
+         }
+         if (!capable(CAP_NET_ADMIN)) {
+            return -EACCES;
+         }
+         compat_mutex_lock(&vnetStructureMutex);
+         retval = VNetHub_SetLearning(port->jack.peer, ageSecs);
+         compat_mutex_unlock(&vnetStructureMutex);
+         return retval;
+      }
+
    case SIOCGBRSTATUS:
       {
          uint32 flags;
@@ -1134,6 +1175,16 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
    if (filp && filp->f_dentry) {
       inode = filp->f_dentry->d_inode;
    }
+
+   /*
+    * Batched packet I/O is a data path operation just like read() and
+    * write(), so do not serialize it with the configuration ioctls.
+    */
+   if (iocmd == SIOCBATCHRECV || iocmd == SIOCBATCHSEND ||
+       iocmd == SIOCRINGKICK) {
+      return VNetFileOpIoctl(inode, filp, iocmd, ioarg);
+   }
+
    compat_mutex_lock(&vnetMutex);
    err = VNetFileOpIoctl(inode, filp, iocmd, ioarg);
    compat_mutex_unlock(&vnetMutex);
@@ -1434,8 +1485,8 @@ VNetConnect(VNetJack *jack1, // IN: jack
     */
 
    write_lock_irqsave(&vnetPeerLock, flags);
-   jack1->peer = jack2;
-   jack2->peer = jack1;
+   rcu_assign_pointer(jack1->peer, jack2);
+   rcu_assign_pointer(jack2->peer, jack1);
    write_unlock_irqrestore(&vnetPeerLock, flags);
 
    if (jack2->numPorts) {
@@ -1456,7 +1507,7 @@ VNetConnect(VNetJack *jack1, // IN: jack
  * VNetDisconnect --
  *
  *	Disconnect 2 jacks.
- *	vnetStructureMutex must be held.
+ *	vnetStructureMutex must be held. Might sleep.
  *
  * Results:
  *      Return the peer jack (returns NULL on error, or if no peer)
@@ -1479,10 +1530,13 @@ VNetDisconnect(VNetJack *jack) // IN: jack
       write_unlock_irqrestore(&vnetPeerLock, flags);
       return NULL;
    }
-   jack->peer = NULL;
-   peer->peer = NULL;
+   rcu_assign_pointer(jack->peer, NULL);
+   rcu_assign_pointer(peer->peer, NULL);
    write_unlock_irqrestore(&vnetPeerLock, flags);
 
+   /* Wait for VNetSend callers that may still be delivering to peer. */
+   synchronize_rcu();
+
    if (peer->numPorts) {
       VNetPortsChanged(jack);
    }
@@ -1597,13 +1651,16 @@ void
 VNetSend(const VNetJack *jack, // IN: jack
          struct sk_buff *skb)  // IN: packet
 {
-   read_lock(&vnetPeerLock);
-   if (jack && jack->peer && jack->peer->rcv) {
-      jack->peer->rcv(jack->peer, skb);
+   VNetJack *peer;
+
+   rcu_read_lock();
+   peer = jack ? rcu_dereference(jack->peer) : NULL;
+   if (peer && peer->rcv) {
+      peer->rcv(peer, skb);
    } else {
       dev_kfree_skb(skb);
    }
-   read_unlock(&vnetPeerLock);
+   rcu_read_unlock();
 }
 
 
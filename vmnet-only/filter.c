@@ -23,6 +23,10 @@
 #include <linux/if_ether.h>
 #include <linux/in.h>
 #include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
 #include "compat_skbuff.h"
 #include "compat_mutex.h"
 #include "compat_semaphore.h"
@@ -54,6 +58,41 @@
 #define VNET_FILTER_ACTION_FWD_MATCH   (1<<8 | 6)
 #define VNET_FILTER_ACTION_FWD_DEFAULT (1<<8 | 7)
 
+/*
+ * Per-CPU packet counters, indexed by the low byte of the action code.
+ * The netfilter hook only ever touches the counters of its own CPU; the
+ * proc entry adds them up.
+ */
+#define VNET_FILTER_NUM_ACTIONS        8
+
+typedef struct VNetFilterStats {
+   uint64 dropped[VNET_FILTER_NUM_ACTIONS];
+   uint64 forwarded[VNET_FILTER_NUM_ACTIONS];
+} VNetFilterStats;
+
+static DEFINE_PER_CPU(VNetFilterStats, filterStats);
+
+/*
+ * The hook runs from softirqs as well as from process context on local
+ * output, so an increment must not be torn by a softirq on the same CPU.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
+#define VNetFilterStatsInc(field, action) \
+   this_cpu_inc(filterStats.field[(action) & (VNET_FILTER_NUM_ACTIONS - 1)])
+#else
+#define VNetFilterStatsInc(field, action)                                 \
+   do {                                                                   \
+      unsigned long _flags;                                               \
+                                                                          \
+      local_irq_save(_flags);                                             \
+      __get_cpu_var(filterStats).field[(action) &                         \
+                                       (VNET_FILTER_NUM_ACTIONS - 1)]++;  \
+      local_irq_restore(_flags);                                          \
+   } while (0)
+#endif
+
+static VNetProcEntry *filterProcEntry = NULL;
+
 /* netfilter hooks for filtering. */
 static nf_hookfn VNetFilterHookFn;
 
@@ -76,17 +115,16 @@ static Bool installedFilterCallback = FALSE;
 /* rules to use for filtering */
 RuleSet *ruleSetHead = NULL;  /* linked list of all rules */
 int32 numRuleSets = 0;        /* number of rule sets in ruleSetHead's linked list */
-RuleSet *activeRule = NULL;   /* actual rule set for filter callback to use */
+RuleSet *activeRule = NULL;   /* actual rule set for filter callback to use,
+                                 RCU protected */
 
-/* locks to protect against concurrent accesses. */
-static compat_define_mutex(filterIoctlMutex); /* serialize ioctl()s from user space. */
 /*
- * user/netfilter hook concurrency lock.
- * This spinlock doesn't scale well if/when in the future the netfilter
- * callbacks can be concurrently executing on multiple threads on multiple
- * CPUs, so we should revisit locking for allowing for that in the future.
+ * Serialize ioctl()s from user space, and with them all changes to the
+ * rule sets. The netfilter hook takes no lock: it reads activeRule and
+ * the compiled rule index under RCU, and each change publishes a new
+ * rule set or index with a single pointer store.
  */
-DEFINE_SPINLOCK(activeRuleLock);
+static compat_define_mutex(filterIoctlMutex);
 
 /*
  * Logging.
@@ -123,7 +161,7 @@ static int AddIPv4Rule(uint32 id, VNet_AddIPv4Rule *rule,
  *      void
  *
  * Side effects:
- *      Might store information regarding the packet.
+ *      Counts the packet. Might log information regarding the packet.
  *
  *----------------------------------------------------------------------
  */
@@ -134,7 +172,11 @@ DropPacket(uint16 action,  // IN: reason code
            void *data,     // IN: packet data
            uint32 length)  // IN: packet length
 {
-   LogPacket(action, header, data, length, TRUE);
+   VNetFilterStatsInc(dropped, action);
+
+   if (unlikely(logLevel >= VNET_FILTER_LOGLEVEL_VERBOSE)) {
+      LogPacket(action, header, data, length, TRUE);
+   }
 }
 
 
@@ -150,7 +192,7 @@ DropPacket(uint16 action,  // IN: reason code
  *      void
  *
  * Side effects:
- *      Might store information regarding the packet.
+ *      Counts the packet. Might log information regarding the packet.
  *
  *----------------------------------------------------------------------
  */
@@ -161,12 +203,533 @@ ForwardPacket(uint16 action,  // IN: reason code
               void *data,     // IN: packet data
               uint32 length)  // IN: packet length
 {
+   VNetFilterStatsInc(forwarded, action);
+
 #ifdef DBG
-   LogPacket(action, header, data, length, FALSE);
+   if (unlikely(logLevel >= VNET_FILTER_LOGLEVEL_VERBOSE)) {
+      LogPacket(action, header, data, length, FALSE);
+   }
 #endif
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterProcRead --
+ *
+ *      Callback for read operation on the filter entry in vnets proc fs.
+ *      Prints the packet counters, summed over all CPUs, by reason.
+ *
+ * Results:
+ *      Length of read operation.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterProcRead(char    *page,   // IN/OUT: buffer to write into
+                   char   **start,  // OUT: 0 if file < 4k, else offset into page
+                   off_t    off,    // IN: offset of read into the file
+                   int      count,  // IN: maximum number of bytes to read
+                   int     *eof,    // OUT: TRUE if there is nothing more to read
+                   void    *data)   // IN: client data - not used
+{
+   VNetFilterStats total;
+   RuleSet *ruleSet;
+   int len = 0;
+   int cpu;
+   int i;
+
+   memset(&total, 0, sizeof total);
+   for_each_possible_cpu(cpu) {
+      const VNetFilterStats *st = &per_cpu(filterStats, cpu);
+
+      for (i = 0; i < VNET_FILTER_NUM_ACTIONS; i++) {
+         total.dropped[i] += st->dropped[i];
+         total.forwarded[i] += st->forwarded[i];
+      }
+   }
+
+   rcu_read_lock();
+   ruleSet = rcu_dereference(activeRule);
+   len += sprintf(page+len, "active %u ", ruleSet ? ruleSet->id : 0);
+   rcu_read_unlock();
+
+   len += sprintf(page+len, "dropped short %llu match %llu default %llu "
+                  "forwarded loopback %llu match %llu default %llu\n",
+                  (unsigned long long)total.dropped[VNET_FILTER_ACTION_DRP_SHORT],
+                  (unsigned long long)total.dropped[VNET_FILTER_ACTION_DRP_MATCH],
+                  (unsigned long long)total.dropped[VNET_FILTER_ACTION_DRP_DEFAULT],
+                  (unsigned long long)total.forwarded[VNET_FILTER_ACTION_FWD_LOOP & 0xff],
+                  (unsigned long long)total.forwarded[VNET_FILTER_ACTION_FWD_MATCH & 0xff],
+                  (unsigned long long)total.forwarded[VNET_FILTER_ACTION_FWD_DEFAULT & 0xff]);
+
+   *start = 0;
+   *eof   = 1;
+   return len;
+}
+
+
+#define DEBUG_HOST_FILTER 0
+
+#if DEBUG_HOST_FILTER
+#define HostFilterPrint(a) printk a
+#else
+#define HostFilterPrint(a)
+#endif
+
+/*
+ * Compiled rule sets.
+ *
+ * Rules are evaluated in order and the first match wins. To avoid
+ * walking the rule list for every packet, each rule set is compiled into
+ * a RuleIndex: for every property of a packet (direction, protocol,
+ * local port, remote address) the index holds the set of rules that
+ * property can match, as a bit mask with bit i standing for the i-th
+ * rule. ANDing the masks leaves the candidate rules, the lowest of which
+ * is the first match unless its port ranges rule it out.
+ *
+ * Remote addresses are hashed by (address & mask, mask), so a lookup
+ * costs one probe per distinct mask in the rule set. Local ports are
+ * bucketed by their high byte, and the exact ranges are only checked
+ * for candidates.
+ *
+ * An index is never modified once published: any change to the rule set
+ * builds a new index, swaps it in with rcu_assign_pointer and frees the
+ * old one after a grace period. The netfilter hook reads it under
+ * rcu_read_lock() only.
+ */
+
+typedef uint64 RuleMask;
+
+#if MAX_RULES_PER_SET > 64
+#error "RuleMask has to have a bit for every rule of a rule set"
+#endif
+
+#define RULE_ADDR_HASH_BITS   8
+#define RULE_ADDR_HASH_SIZE   (1 << RULE_ADDR_HASH_BITS)
+#define RULE_PORT_BUCKETS     256   /* local port >> 8 */
+
+typedef struct RuleAddrEntry {
+   struct RuleAddrEntry *next;   /* hash chain */
+   uint32 ipv4Addr;              /* address & mask */
+   uint32 maskIdx;               /* index into RuleIndex.masks */
+   RuleMask rules;               /* rules containing this address/mask */
+} RuleAddrEntry;
+
+typedef struct RuleIndex {
+   struct rcu_head rcu;
+   uint16 action;                /* default action of the rule set */
+   uint32 numRules;
+   Rule **rules;                 /* rules, in order */
+   RuleMask dirRules[2];         /* [0] inbound, [1] outbound */
+   RuleMask anyProto;            /* rules for any protocol */
+   RuleMask protoRules[256];
+   RuleMask anyPort;             /* rules not checking ports */
+   RuleMask portRules[RULE_PORT_BUCKETS];
+   RuleMask anyAddr;             /* rules for any address */
+   uint32 numMasks;
+   uint32 *masks;                /* distinct address masks */
+   RuleAddrEntry *entries;       /* storage for the hash chains */
+   RuleAddrEntry *addrHash[RULE_ADDR_HASH_SIZE];
+} RuleIndex;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleIndexHash --
+ *
+ *      Hash a masked remote address and its mask index.
+ *
+ * Results:
+ *      Bucket of RuleIndex.addrHash.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE uint32
+RuleIndexHash(uint32 ipv4Addr, // IN: address & mask
+              uint32 maskIdx)  // IN: index of the mask
+{
+   return jhash_2words(ipv4Addr, maskIdx, 0) & (RULE_ADDR_HASH_SIZE - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleMaskFirst --
+ *
+ *      Find the lowest set bit of a non-zero rule mask.
+ *
+ * Results:
+ *      Bit number.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE uint32
+RuleMaskFirst(RuleMask mask) // IN: non-zero mask
+{
+   if ((uint32)mask != 0) {
+      return ffs((uint32)mask) - 1;
+   }
+   return 32 + ffs((uint32)(mask >> 32)) - 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleChecksPorts --
+ *
+ *      Tell if a rule restricts TCP or UDP ports.
+ *
+ * Results:
+ *      TRUE if the port list of the rule has to be checked.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+RuleChecksPorts(const Rule *rule) // IN
+{
+   return (rule->proto == IPPROTO_TCP || rule->proto == IPPROTO_UDP) &&
+          rule->portListLen > 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleMatchPorts --
+ *
+ *      Check the ports of a TCP or UDP packet against the port ranges of
+ *      a rule.
+ *
+ * Results:
+ *      TRUE if some port range matches both ports.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+RuleMatchPorts(const Rule *rule,  // IN
+               uint16 localPort,  // IN
+               uint16 remotePort) // IN
+{
+   uint32 i;
+
+   for (i = 0; i < rule->portListLen; ++i) {
+      const RulePort *portRule = rule->portList + i;
+
+      /*
+       * It's presumed that if portRule->localPortLow == ~0 then
+       * portRule->localPortHigh == ~0.  Similiar story for the
+       * remote ports.
+       */
+      if (((localPort >= portRule->localPortLow &&
+            localPort <= portRule->localPortHigh) ||
+           portRule->localPortLow == ~0) &&
+          ((remotePort >= portRule->remotePortLow &&
+            remotePort <= portRule->remotePortHigh) ||
+           portRule->remotePortLow == ~0)) {
+         HostFilterPrint(("PacketFilter: matched rule's "
+                          "port element %u\n", i));
+         return TRUE;
+      }
+   }
+   HostFilterPrint(("PacketFilter: rule didn't match port "
+                    "(local %u remote %u)\n", localPort, remotePort));
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RuleIndexLookupAddr --
+ *
+ *      Find the rules with an address list entry matching a remote
+ *      address.
+ *
+ * Results:
+ *      Mask of the matching rules.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static RuleMask
+RuleIndexLookupAddr(const RuleIndex *index, // IN
+                    uint32 remoteAddr)      // IN
+{
+   RuleMask rules = index->anyAddr;
+   uint32 m;
+
+   for (m = 0; m < index->numMasks; m++) {
+      uint32 addr = remoteAddr & index->masks[m];
+      const RuleAddrEntry *entry;
+
+      for (entry = index->addrHash[RuleIndexHash(addr, m)];
+           entry != NULL;
+           entry = entry->next) {
+         if (entry->ipv4Addr == addr && entry->maskIdx == m) {
+            rules |= entry->rules;
+            break;
+         }
+      }
+   }
+   return rules;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeRuleIndex --
+ *
+ *      Free a rule index that no packet can be looking at anymore.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeRuleIndex(RuleIndex *index) // IN
+{
+   if (index == NULL) {
+      return;
+   }
+   kfree(index->rules);
+   kfree(index->masks);
+   kfree(index->entries);
+   kfree(index);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeRuleIndexRcu --
+ *
+ *      RCU callback freeing a replaced rule index.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeRuleIndexRcu(struct rcu_head *head) // IN
+{
+   FreeRuleIndex(container_of(head, RuleIndex, rcu));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileRuleSet --
+ *
+ *      Build the lookup index of a rule set from its rule list.
+ *
+ * Results:
+ *      The new index, NULL if out of memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static RuleIndex *
+CompileRuleSet(const RuleSet *ruleSet) // IN
+{
+   RuleIndex *index;
+   Rule *rule;
+   uint32 numAddrs = 0;
+   uint32 numEntries = 0;
+   uint32 r;
+
+   for (rule = ruleSet->list; rule != NULL; rule = rule->next) {
+      numAddrs += rule->addressListLen;
+   }
+
+   index = kmalloc(sizeof *index, GFP_USER);
+   if (index == NULL) {
+      return NULL;
+   }
+   memset(index, 0, sizeof *index);
+   index->action = ruleSet->action;
+   index->numRules = ruleSet->numRules;
+
+   if (ruleSet->numRules > 0) {
+      index->rules = kmalloc(ruleSet->numRules * sizeof *index->rules,
+                             GFP_USER);
+      if (index->rules == NULL) {
+         goto nomem;
+      }
+   }
+   if (numAddrs > 0) {
+      index->masks = kmalloc(numAddrs * sizeof *index->masks, GFP_USER);
+      index->entries = kmalloc(numAddrs * sizeof *index->entries, GFP_USER);
+      if (index->masks == NULL || index->entries == NULL) {
+         goto nomem;
+      }
+   }
+
+   for (rule = ruleSet->list, r = 0; rule != NULL; rule = rule->next, r++) {
+      RuleMask bit = (RuleMask)1 << r;
+      uint32 i;
+
+      index->rules[r] = rule;
+
+      if (rule->direction != VNET_FILTER_DIRECTION_OUT) {
+         index->dirRules[0] |= bit;
+      }
+      if (rule->direction != VNET_FILTER_DIRECTION_IN) {
+         index->dirRules[1] |= bit;
+      }
+
+      if (rule->proto == 0xffff) {
+         index->anyProto |= bit;
+      } else {
+         index->protoRules[rule->proto & 0xff] |= bit;
+      }
+
+      if (RuleChecksPorts(rule)) {
+         for (i = 0; i < rule->portListLen; i++) {
+            const RulePort *port = rule->portList + i;
+            uint32 b;
+
+            if (port->localPortLow == ~0) {
+               for (b = 0; b < RULE_PORT_BUCKETS; b++) {
+                  index->portRules[b] |= bit;
+               }
+               break;
+            }
+            for (b = port->localPortLow >> 8; b <= port->localPortHigh >> 8;
+                 b++) {
+               index->portRules[b] |= bit;
+            }
+         }
+      } else {
+         index->anyPort |= bit;
+      }
+
+      if (rule->addressListLen == 0) {
+         index->anyAddr |= bit;
+      }
+      for (i = 0; i < rule->addressListLen; i++) {
+         uint32 mask = rule->addressList[i].ipv4Mask;
+         uint32 addr = rule->addressList[i].ipv4Addr & mask;
+         RuleAddrEntry *entry;
+         uint32 m;
+         uint32 h;
+
+         for (m = 0; m < index->numMasks && index->masks[m] != mask; m++) {
+         }
+         if (m == index->numMasks) {
+            index->masks[index->numMasks++] = mask;
+         }
+
+         h = RuleIndexHash(addr, m);
+         for (entry = index->addrHash[h]; entry != NULL; entry = entry->next) {
+            if (entry->ipv4Addr == addr && entry->maskIdx == m) {
+               break;
+            }
+         }
+         if (entry == NULL) {
+            entry = &index->entries[numEntries++];
+            entry->ipv4Addr = addr;
+            entry->maskIdx = m;
+            entry->rules = 0;
+            entry->next = index->addrHash[h];
+            index->addrHash[h] = entry;
+         }
+         entry->rules |= bit;
+      }
+   }
+
+   LOG(2, (KERN_INFO "vnet filter compiled ruleset %u: %u rules, "
+           "%u addresses, %u masks\n", ruleSet->id, index->numRules,
+           numEntries, index->numMasks));
+   return index;
+
+nomem:
+   FreeRuleIndex(index);
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PublishRuleSet --
+ *
+ *      Recompile a rule set after a change and make the packet filter
+ *      use the new index. Must be called with filterIoctlMutex held.
+ *
+ * Results:
+ *      0 on success, -ENOMEM if the index could not be built, in which
+ *      case the old index stays in use.
+ *
+ * Side effects:
+ *      The old index is freed after an RCU grace period.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PublishRuleSet(RuleSet *ruleSet) // IN
+{
+   RuleIndex *newIndex;
+   RuleIndex *oldIndex;
+
+   newIndex = CompileRuleSet(ruleSet);
+   if (newIndex == NULL) {
+      LOG(2, (KERN_INFO "vnet filter mem alloc failed for rule index\n"));
+      return -ENOMEM;
+   }
+
+   oldIndex = ruleSet->index;
+   rcu_assign_pointer(ruleSet->index, newIndex);
+   if (oldIndex != NULL) {
+      call_rcu(&oldIndex->rcu, FreeRuleIndexRcu);
+   }
+   return 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -188,14 +751,6 @@ ForwardPacket(uint16 action,  // IN: reason code
  *----------------------------------------------------------------------
  */
 
-#define DEBUG_HOST_FILTER 0
-
-#if DEBUG_HOST_FILTER
-#define HostFilterPrint(a) printk a
-#else
-#define HostFilterPrint(a)
-#endif
-
 static unsigned int
 VNetFilterHookFn(unsigned int hooknum,                 // IN:
 #ifdef VMW_NFHOOK_USES_SKB
@@ -218,11 +773,11 @@ VNetFilterHookFn(unsigned int hooknum,                 // IN:
    uint8 *packetHeader;
    int packetLength;
    RuleSet *currRuleSet;
+   RuleIndex *index;
+   RuleMask candidates;
    Bool blockByDefault;
    Bool transmit; /* TRUE if transmitting, FALSE is receiving */
-   Rule *currRule;
    unsigned int verdict = NF_ACCEPT;
-   unsigned long flags;
 
 
    /* Early checks to see  we should even care. */
@@ -230,18 +785,20 @@ VNetFilterHookFn(unsigned int hooknum,                 // IN:
       return verdict;
    }
 
-   spin_lock_irqsave(&activeRuleLock, flags);
-
-   currRuleSet = activeRule;
-   // ASSERT(currRuleSet);
+   rcu_read_lock();
 
    /*
-    * Function uses a local copy of ruleSetHead so that we're
-    * not adversely affected by any rule changes that might occur
-    * while this function is running.
+    * The rule set and its index stay valid until rcu_read_unlock(), no
+    * matter what rule changes occur while this function is running.
     */
 
-   blockByDefault = currRuleSet->action == VNET_FILTER_RULE_BLOCK;
+   currRuleSet = rcu_dereference(activeRule);
+   if (currRuleSet == NULL) {
+      goto out_unlock;
+   }
+   index = rcu_dereference(currRuleSet->index);
+
+   blockByDefault = index->action == VNET_FILTER_RULE_BLOCK;
 
 
    /* When the host transmits, hooknum is VMW_NF_INET_POST_ROUTING. */
@@ -339,126 +896,45 @@ VNetFilterHookFn(unsigned int hooknum,                 // IN:
       remotePort = 0;
    }
 
-   currRule = currRuleSet->list;
-
-   /* traverse all the rules in the rule set */
-   while (currRule != NULL) {
-      uint32 i;
-      Bool matchedAddress;
-
-      /* if direction doesn't match rule, then skip */
-      if ((currRule->direction == VNET_FILTER_DIRECTION_IN && transmit) ||
-          (currRule->direction == VNET_FILTER_DIRECTION_OUT && !transmit)) {
-         HostFilterPrint(("PacketFilter: didn't match direction\n"));
-         /* wrong direction */
-         goto skipRule;
-      }
-
-      /*
-       * Check if the packet's address matches the rule.  If the list is empty
-       * then this means we don't care about address and it's considered a match.
-       */
-
-      matchedAddress = (currRule->addressListLen == 0); /* empty list means don't care */
-      for (i = 0; i < currRule->addressListLen; ++i) {
-         if ((remoteAddr & currRule->addressList[i].ipv4Mask) ==
-             currRule->addressList[i].ipv4Addr) {
-            matchedAddress = TRUE;
-            HostFilterPrint(("PacketFilter: rule matched ip addr %u: "
-                             "0x%08x == 0x%08x\n", i, remoteAddr,
-                             currRule->addressList[i].ipv4Addr));
-            break;
-         } else {
-            HostFilterPrint(("PacketFilter: rule not match ip addr %u: "
-                             "0x%08x != 0x%08x\n", i, remoteAddr,
-                             currRule->addressList[i].ipv4Addr));
-         }
-      }
-      if (!matchedAddress) {
-         HostFilterPrint(("PacketFilter: rule didn't match ip addr 0x%08x\n",
-                          remoteAddr));
-         /* ip addr doesn't match */
-         goto skipRule;
-      }
-
-      /*
-       * Check the protocol. ~0 (0xffff) means we don't care about the
-       * protocol and it's considered a match.
-       */
-
-      if (currRule->proto != 0xffff && currRule->proto != ip->protocol) {
-         HostFilterPrint(("PacketFilter: didn't match protocol: %u != %u\n",
-                          ip->protocol, currRule->proto));
-         /* protocol doesn't match */
-         goto skipRule;
-      }
-
-      /*
-       * If the protocol is TCP or UDP then check the port list.  If the list is empty
-       * then this means we don't care about ports and it's considered a match.
-       */
-
-      if (currRule->proto == IPPROTO_TCP || currRule->proto == IPPROTO_UDP) {
+   /*
+    * Narrow down the rules to those matching the packet's direction,
+    * protocol, local port bucket and remote address. The lowest one
+    * left is the first match, unless its port ranges say otherwise.
+    */
 
-         /* An empty list means the rule don't care about port numbers*/
-         Bool matchedPort = (currRule->portListLen == 0);
+   candidates = index->dirRules[transmit] &
+                (index->anyProto | index->protoRules[ip->protocol]);
+   if (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) {
+      candidates &= index->anyPort | index->portRules[localPort >> 8];
+   }
+   if (candidates != 0) {
+      candidates &= RuleIndexLookupAddr(index, remoteAddr);
+   }
 
-         for (i = 0; i < currRule->portListLen; ++i) {
-            RulePort *portRule = currRule->portList + i;
-            Bool matchedLocal, matchedRemote; /* improves readability */
+   while (candidates != 0) {
+      uint32 r = RuleMaskFirst(candidates);
+      Rule *currRule = index->rules[r];
 
-            /*
-             * It's presumed that if portRule->localPortLow == ~0 then
-             * portRule->localPortHigh == ~0.  Similiar story for the
-             * remote ports.
-             */
-            matchedLocal = (localPort >= portRule->localPortLow &&
-                            localPort <= portRule->localPortHigh) ||
-                           portRule->localPortLow == ~0;
-            matchedRemote = (remotePort >= portRule->remotePortLow &&
-                             remotePort <= portRule->remotePortHigh) ||
-                            portRule->remotePortLow == ~0;
-
-            if (matchedLocal && matchedRemote) {
-               HostFilterPrint(("PacketFilter: matched rule's "
-                                "port element %u\n", i));
-               matchedPort = TRUE;
-               break;
-            }
-            HostFilterPrint(("PacketFilter: didn't match rule's "
-                             "port element %u\n", i));
-            HostFilterPrint(("-- local  %4u not in range [%4u, %4u] or \n",
-                             localPort, portRule->localPortLow,
-                             portRule->localPortHigh));
-            HostFilterPrint(("-- remote %4u not in range [%4u, %4u]\n",
-                             remotePort, portRule->remotePortLow,
-                             portRule->remotePortHigh));
-         }
-         if (!matchedPort) {
-            HostFilterPrint(("PacketFilter: rule didn't match port "
-                             "(local %u remote %u)\n", localPort, remotePort));
-            /* port doesn't match */
-            goto skipRule;
-         }
+      if (RuleChecksPorts(currRule) &&
+          !RuleMatchPorts(currRule, localPort, remotePort)) {
+         candidates &= ~((RuleMask)1 << r);
+         continue;
       }
 
       /* rule matches so follow orders */
 
       if (currRule->action == VNET_FILTER_RULE_ALLOW) {
-         HostFilterPrint(("PacketFilter: found match, forwarding\n"));
+         HostFilterPrint(("PacketFilter: found match %u, forwarding\n", r));
          ForwardPacket(VNET_FILTER_ACTION_FWD_MATCH,
                        packetHeader, packet, packetLength);
          goto out_unlock;
       } else {
-         HostFilterPrint(("PacketFilter: found match, dropping\n"));
+         HostFilterPrint(("PacketFilter: found match %u, dropping\n", r));
          verdict = NF_DROP;
          DropPacket(VNET_FILTER_ACTION_DRP_MATCH,
                     packetHeader, packet, packetLength);
          goto out_unlock;
       }
-
-skipRule:
-      currRule = currRule->next;
    }
 
    /* Forward or drop packet based on the default rule */
@@ -478,7 +954,7 @@ skipRule:
                     packetHeader, packet, packetLength);
    }
 out_unlock:
-   spin_unlock_irqrestore(&activeRuleLock, flags);
+   rcu_read_unlock();
    return verdict;
 }
 
@@ -672,6 +1148,10 @@ CreateRuleSet(uint32 id,            // IN: requested ID for new rule set
    newRuleSet->list = NULL;
    newRuleSet->numRules = 0;
    newRuleSet->tail = &newRuleSet->list;
+   if (PublishRuleSet(newRuleSet) != 0) {
+      kfree(newRuleSet);
+      return -ENOMEM;
+   }
 
    /* add new rule set to head of linked list */
    numRuleSets++;
@@ -732,7 +1212,7 @@ DeleteRule(Rule *rule)          // IN: Rule to delete.
  *      Returns 0 on success, errno on failure.
  *
  * Side effects:
- *      None.
+ *      Might sleep.
  *
  *----------------------------------------------------------------------
  */
@@ -762,6 +1242,14 @@ DeleteRuleSet(uint32 id) // IN: ID of new rule set to delete
    /* remove item from linked list */
    *prev = curr->next;
 
+   /*
+    * The filter may still be looking at the rules if the set was active
+    * until just now.
+    */
+   synchronize_rcu();
+   FreeRuleIndex(curr->index);
+   curr->index = NULL;
+
    /* free rules in rule set */
    currRule = curr->list;
    curr->list = NULL; /* help mitigate any bugs or races */
@@ -779,6 +1267,40 @@ DeleteRuleSet(uint32 id) // IN: ID of new rule set to delete
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetDefaultAction --
+ *
+ *      Change the default action of a rule set and publish it to the
+ *      packet filter.
+ *
+ * Results:
+ *      Returns 0 on success, errno on failure, in which case the
+ *      default action is unchanged.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SetDefaultAction(RuleSet *ruleSet, // IN: rule set to change
+                 uint32 action)    // IN: new default action
+{
+   uint16 oldAction = ruleSet->action;
+   int retval;
+
+   ruleSet->action = (uint16)action;
+   retval = PublishRuleSet(ruleSet);
+   if (retval != 0) {
+      ruleSet->action = oldAction;
+   }
+   return retval;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -811,7 +1333,6 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
 {
    RuleSet *curr;
    int retval;
-   unsigned long flags;
 
    // ASSERT(!enable || !disable); /* at most one can be set */
 
@@ -830,26 +1351,23 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
       if (action != VNET_FILTER_RULE_NO_CHANGE) {
          LOG(2, (KERN_INFO "vnet filter changing default action "
                  "of active rule set: %u (id %u)\n", action, id));
-         curr->action = (uint16)action;
+         retval = SetDefaultAction(curr, action);
+         if (retval != 0) {
+            return retval;
+         }
       }
 
       /* enable new rule */
       curr->enabled = TRUE;
 
-      /* Grab activeRule spinlock. */
-      spin_lock_irqsave(&activeRuleLock, flags);
-
       LOG(2, (KERN_INFO "changing active rule from "
               "%p (%u) to %p (%u)\n", activeRule,
               activeRule ? activeRule->id : 0,
               curr, curr->id));
 
-      /* make rule active */
+      /* make rule active: packets see either the old or the new set */
       oldActive = activeRule;
-      activeRule = curr;
-
-      /* Safe to release activeRule spinlock now. */
-      spin_unlock_irqrestore(&activeRuleLock, flags);
+      rcu_assign_pointer(activeRule, curr);
 
       /*
        * Mark old rule as not enabled, except if it's the same
@@ -896,31 +1414,27 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
       RemoveHostFilterCallback();
 
       // ASSERT(activeRule == curr);
-      /* Grab activeRule spinlock. */
-      spin_lock_irqsave(&activeRuleLock, flags);
-      activeRule = NULL;
-      /* Safe to release activeRule spinlock now. */
-      spin_unlock_irqrestore(&activeRuleLock, flags);
+      rcu_assign_pointer(activeRule, NULL);
       curr->enabled = FALSE;
       if (action != VNET_FILTER_RULE_NO_CHANGE) {
          LOG(2, (KERN_INFO "vnet filter changing default action: "
                  "%u (id %u)\n", action, id));
-         curr->action = (uint16)action;
+         retval = SetDefaultAction(curr, action);
+      } else {
+         retval = 0;
       }
-      retval = 0;
 
    } else { /* !enable && !disable */
 
       if (action == VNET_FILTER_RULE_NO_CHANGE) {
          // 6) no activate change (and default not changed)
          LOG(2, (KERN_INFO "vnet filter got nothing to change\n"));
-         retval = 0;
+         return 0;
       }
 
       // 7) no activate change (but default action changed)
-      curr->action = (uint16)action;
+      retval = SetDefaultAction(curr, action);
       LOG(2, (KERN_INFO "vnet filter changed action: %u\n", action));
-      retval = 0;
    }
 
    return retval;
@@ -941,7 +1455,7 @@ ChangeRuleSet(uint32 id,     // IN: requested ID of rule set
  *      Returns 0 on success, errno on failure.
  *
  * Side effects:
- *      None.
+ *      Recompiles the rule set.
  *
  *----------------------------------------------------------------------
  */
@@ -954,6 +1468,7 @@ AddIPv4Rule(uint32 id,                       // IN: requested ID of rule set
 {
    Rule *newRule;
    RuleSet *curr;
+   Rule **oldTail;
 
    // ASSERT(rule && addressList && portList);
 
@@ -1047,10 +1562,19 @@ AddIPv4Rule(uint32 id,                       // IN: requested ID of rule set
 
    /* add rule to rule set */
    newRule->next = NULL;
+   oldTail = curr->tail;
    *(curr->tail) = newRule;
    curr->tail = &(newRule->next);
    ++curr->numRules;
 
+   if (PublishRuleSet(curr) != 0) {
+      --curr->numRules;
+      curr->tail = oldTail;
+      *oldTail = NULL;
+      DeleteRule(newRule);
+      return -ENOMEM;
+   }
+
    LOG(2, (KERN_INFO "Added rule %p to set %p, count now %u\n",
            newRule, curr, curr->numRules));
 
@@ -1445,6 +1969,35 @@ out_unlock:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilter_Init --
+ *
+ *      Function is called when the driver is being loaded. It creates
+ *      the filter entry in vnets proc fs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetFilter_Init(void)
+{
+   if (VNetProc_MakeEntry("filter", S_IFREG, &filterProcEntry) == 0) {
+      filterProcEntry->read_proc = VNetFilterProcRead;
+      filterProcEntry->data = NULL;
+   } else {
+      filterProcEntry = NULL;
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1468,6 +2021,11 @@ VNetFilter_Shutdown(void)
 {
    LOG(2, (KERN_INFO "shutting down vnet filter\n"));
 
+   if (filterProcEntry != NULL) {
+      VNetProc_RemoveEntry(filterProcEntry);
+      filterProcEntry = NULL;
+   }
+
    RemoveHostFilterCallback();
 
    if (activeRule != NULL) {
@@ -25,6 +25,8 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
 
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
@@ -45,10 +47,53 @@
 #define HUB_TYPE_VNET         0x1
 #define HUB_TYPE_PVN          0x2
 
+/*
+ * MAC learning table. Open addressing with a short linear probe; when
+ * the probe window is full the oldest entry in it is evicted.
+ */
+
+#define HUB_MAC_TABLE_BITS    10
+#define HUB_MAC_TABLE_SIZE    (1 << HUB_MAC_TABLE_BITS)
+#define HUB_MAC_TABLE_PROBE   8
+#define HUB_MAC_NO_JACK       (-1)
+
+typedef struct VNetHubMacEntry {
+   uint8         mac[ETH_ALEN];
+   int16         jack;                     // jack index or HUB_MAC_NO_JACK
+   unsigned long lastSeen;                 // jiffies
+} VNetHubMacEntry;
+
+typedef struct VNetHubMacTable {
+   unsigned long   ageJiffies;             // entries older than this expire
+   VNetHubMacEntry entry[HUB_MAC_TABLE_SIZE];
+} VNetHubMacTable;
+
 typedef struct VNetHubStats {
    unsigned      tx;
+   unsigned      unicast;                  // sent to a learned jack only
+   unsigned      flooded;                  // sent to all jacks
 } VNetHubStats;
 
+/*
+ * Statistics are kept per CPU so that CPUs forwarding through the same
+ * hub do not bounce a shared cache line; readers sum them up.
+ */
+
+typedef struct VNetHubCpuStats {
+   VNetHubStats  jack[NUM_JACKS_PER_HUB];
+} VNetHubCpuStats;
+
+/*
+ * The set of allocated jacks, published with RCU so that the packet
+ * path walks only the jacks in use and never takes a lock.
+ */
+
+typedef struct VNetHubJackSet {
+   struct rcu_head rcu;
+   int           count;
+   VNetJack     *jack[NUM_JACKS_PER_HUB];
+} VNetHubJackSet;
+
 typedef struct VNetHub {
    uint32        hubType;                  // HUB_TYPE_xxx
    union {
@@ -57,17 +102,22 @@ typedef struct VNetHub {
    } id;
    Bool		 used[NUM_JACKS_PER_HUB];  // tracks which jacks in use
    VNetJack      jack[NUM_JACKS_PER_HUB];  // jacks for the hub
-   VNetHubStats  stats[NUM_JACKS_PER_HUB]; // stats for the jacks
+   VNetHubCpuStats *stats;                 // per CPU stats for the jacks
+   VNetHubJackSet *jackSet;                // RCU: allocated jacks
+   VNetHubJackSet allJacks;                // fallback set, never freed
    int           totalPorts;               // num devices reachable from hub
    int           myGeneration;             // used for cycle detection
    struct VNetHub *next;                   // next hub in linked list
    VNetEvent_Mechanism *eventMechanism;    // event notification mechanism
+   spinlock_t    macLock;                  // serializes macTable writers
+   VNetHubMacTable *macTable;              // RCU: NULL unless learning
 } VNetHub;
 
 static VNetJack *VNetHubAlloc(Bool allocPvn, int hubNum,
 			      uint8 id[VNET_PVN_ID_LEN]);
 static void VNetHubFree(VNetJack *this);
 static void VNetHubReceive(VNetJack *this, struct sk_buff *skb);
+static void VNetHubForgetJack(VNetHub *hub, int jackIndex);
 static Bool VNetHubCycleDetect(VNetJack *this, int generation);
 static void VNetHubPortsChanged(VNetJack *this);
 static int  VNetHubIsBridged(VNetJack *this);
@@ -83,6 +133,156 @@ static VNetHub *vnetHub = NULL;
 
 static DEFINE_SPINLOCK(vnetHubLock);
 
+/*
+ * Serializes publication of the hub jack sets. Taken after the hub
+ * state changed, so the last publisher always sees the latest state.
+ */
+
+compat_define_mutex(vnetHubSetMutex);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubStatsInc --
+ *
+ *      Count an event in this CPU's statistics for a jack.  Frames are
+ *      forwarded both from process context and from softirqs, so the
+ *      increment must not be torn by a softirq on the same CPU.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
+#define VNetHubStatsInc(hub, jackIndex, field) \
+   this_cpu_inc((hub)->stats->jack[jackIndex].field)
+#else
+#define VNetHubStatsInc(hub, jackIndex, field)                          \
+   do {                                                                 \
+      unsigned long _flags;                                             \
+                                                                        \
+      local_irq_save(_flags);                                           \
+      per_cpu_ptr((hub)->stats,                                         \
+                  smp_processor_id())->jack[jackIndex].field++;         \
+      local_irq_restore(_flags);                                        \
+   } while (0)
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubStatsSum --
+ *
+ *      Add up the statistics of a jack over all CPUs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubStatsSum(VNetHub *hub,        // IN:
+                int jackIndex,       // IN:
+                VNetHubStats *total) // OUT:
+{
+   int cpu;
+
+   memset(total, 0, sizeof *total);
+   for_each_possible_cpu(cpu) {
+      const VNetHubStats *st = &per_cpu_ptr(hub->stats, cpu)->jack[jackIndex];
+
+      total->tx += st->tx;
+      total->unicast += st->unicast;
+      total->flooded += st->flooded;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFreeJackSet --
+ *
+ *      RCU callback freeing a retired jack set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubFreeJackSet(struct rcu_head *head) // IN:
+{
+   kfree(container_of(head, VNetHubJackSet, rcu));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubPublishJacks --
+ *
+ *      Rebuild the set of allocated jacks of a hub and publish it to
+ *      the packet path.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Might sleep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubPublishJacks(VNetHub *hub) // IN:
+{
+   VNetHubJackSet *set;
+   VNetHubJackSet *old;
+   int i;
+
+   set = kmalloc(sizeof *set, GFP_KERNEL);
+
+   compat_mutex_lock(&vnetHubSetMutex);
+   if (set) {
+      set->count = 0;
+      for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
+         if (hub->used[i]) {
+            set->jack[set->count++] = &hub->jack[i];
+         }
+      }
+   } else {
+      /*
+       * Out of memory: fall back to walking every jack, the packet path
+       * checks whether a jack is allocated anyway.
+       */
+      LOG(0, (KERN_NOTICE "/dev/vmnet: no memory for hub jack set\n"));
+      set = &hub->allJacks;
+   }
+   old = hub->jackSet;
+   rcu_assign_pointer(hub->jackSet, set);
+   compat_mutex_unlock(&vnetHubSetMutex);
+
+   if (old && old != &hub->allJacks && old != set) {
+      call_rcu(&old->rcu, VNetHubFreeJackSet);
+   }
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -285,6 +485,12 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
          return NULL;
       }
+      hub->stats = alloc_percpu(VNetHubCpuStats);
+      if (hub->stats == NULL) {
+         LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
+         kfree(hub);
+         return NULL;
+      }
       for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
          jack = &hub->jack[i];
 
@@ -311,9 +517,8 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          jack->portsChanged = VNetHubPortsChanged;
          jack->isBridged = VNetHubIsBridged;
 
-         memset(&hub->stats[i], 0, sizeof hub->stats[i]);
-
 	 hub->used[i] = FALSE;
+	 hub->allJacks.jack[i] = jack;
       }
 
       if (allocPvn) {
@@ -327,11 +532,16 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
       hub->next = NULL;
       hub->totalPorts = 0;
       hub->myGeneration = 0;
+      spin_lock_init(&hub->macLock);
+      hub->macTable = NULL;
+      hub->jackSet = NULL;
+      hub->allJacks.count = NUM_JACKS_PER_HUB;
 
       /* create event mechanism */
       retval = VNetEvent_CreateMechanism(&hub->eventMechanism);
       if (retval != 0) {
          LOG(1, (KERN_DEBUG "can't create event mechanism (%d)\n", retval));
+         free_percpu(hub->stats);
          kfree(hub);
          return NULL;
       }
@@ -343,6 +553,8 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
 	  * and use already present hub.
 	  */
 
+	 VNetEvent_DestroyMechanism(hub->eventMechanism);
+	 free_percpu(hub->stats);
 	 kfree(hub);
 	 hub = allocPvn ? VNetHubFindHubByID(id) : VNetHubFindHubByNum(hubNum);
       } else {
@@ -381,6 +593,21 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          jack->peer = NULL;
          jack->private = hub;
 
+         /*
+          * Start from zero: a previous user of the slot may have left
+          * counts behind.
+          */
+         {
+            int cpu;
+
+            for_each_possible_cpu(cpu) {
+               memset(&per_cpu_ptr(hub->stats, cpu)->jack[i], 0,
+                      sizeof (VNetHubStats));
+            }
+         }
+
+         VNetHubPublishJacks(hub);
+
          return jack;
       }
    }
@@ -425,6 +652,7 @@ VNetHubFree(VNetJack *this)
    }
 
    this->private = NULL;
+   VNetHubForgetJack(hub, this->index);
 
    spin_lock_irqsave(&vnetHubLock, flags);
 
@@ -433,6 +661,7 @@ VNetHubFree(VNetJack *this)
    for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
       if (hub->used[i]) {
 	 spin_unlock_irqrestore(&vnetHubLock, flags);
+	 VNetHubPublishJacks(hub);
 	 return;
       }
    }
@@ -447,6 +676,12 @@ VNetHubFree(VNetJack *this)
    }
    hub->eventMechanism = NULL;
 
+   /* No jack is connected any more, so there are no RCU readers. */
+   kfree(hub->macTable);
+   if (hub->jackSet != &hub->allJacks) {
+      kfree(hub->jackSet);
+   }
+   free_percpu(hub->stats);
    kfree(hub);
 }
 
@@ -513,12 +748,332 @@ VNetHub_CreateListener(VNetJack *jack,         // IN: a jack to a hub
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubMacHash --
+ *
+ *      Hash an ethernet address into the MAC learning table.
+ *
+ * Results:
+ *      Index of the first slot to probe.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned
+VNetHubMacHash(const uint8 *mac) // IN:
+{
+   uint32 h;
+
+   /* The low bytes carry the entropy, the OUI is usually shared. */
+   h = (mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5]) ^
+       (mac[0] << 8 | mac[1]);
+   h *= 0x9E3779B1;   // golden ratio multiplicative hash
+   return h >> (32 - HUB_MAC_TABLE_BITS);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubMacLookup --
+ *
+ *      Find the jack behind which a unicast address was last seen.
+ *      Caller must be in an RCU read side critical section. Entries
+ *      are rewritten in place by VNetHubMacSetEntry, so the jack is
+ *      read before and after the address to detect a concurrent
+ *      rewrite.
+ *
+ * Results:
+ *      Jack index, or HUB_MAC_NO_JACK if unknown or expired.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE int
+VNetHubMacLookup(const VNetHubMacTable *table, // IN:
+                 const uint8 *mac)             // IN:
+{
+   unsigned h = VNetHubMacHash(mac);
+   int i;
+
+   for (i = 0; i < HUB_MAC_TABLE_PROBE; i++) {
+      const VNetHubMacEntry *e =
+         &table->entry[(h + i) & (HUB_MAC_TABLE_SIZE - 1)];
+      int jack = ACCESS_ONCE(e->jack);
+
+      if (jack == HUB_MAC_NO_JACK) {
+         continue;
+      }
+      smp_rmb();
+      if (MAC_EQ(e->mac, mac)) {
+         smp_rmb();
+         if (ACCESS_ONCE(e->jack) != jack ||
+             time_after(jiffies, e->lastSeen + table->ageJiffies)) {
+            return HUB_MAC_NO_JACK;
+         }
+         return jack;
+      }
+   }
+   return HUB_MAC_NO_JACK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubMacSetEntry --
+ *
+ *      Rewrite a MAC table entry so that lockless readers never match
+ *      a half written address. Caller must hold hub->macLock.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VNetHubMacSetEntry(VNetHubMacEntry *e, // IN/OUT:
+                   const uint8 *mac,   // IN:
+                   int jackIndex)      // IN:
+{
+   e->jack = HUB_MAC_NO_JACK;
+   smp_wmb();
+   memcpy(e->mac, mac, ETH_ALEN);
+   e->lastSeen = jiffies;
+   smp_wmb();
+   e->jack = jackIndex;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubMacLearn --
+ *
+ *      Remember that a source address lives behind the given jack.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May evict the oldest entry of the probe window.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubMacLearn(VNetHub *hub,      // IN:
+                const uint8 *mac,  // IN: source address
+                int jackIndex)     // IN: jack it was received on
+{
+   VNetHubMacTable *table;
+   VNetHubMacEntry *e;
+   VNetHubMacEntry *victim = NULL;
+   unsigned long flags;
+   unsigned h;
+   int i;
+
+   if (mac[0] & 1) {
+      return;   /* never learn group addresses */
+   }
+   h = VNetHubMacHash(mac);
+
+   /*
+    * Common case: the address is known on this jack, so only refresh
+    * the timestamp. A racy store to lastSeen is harmless.
+    */
+   rcu_read_lock();
+   table = rcu_dereference(hub->macTable);
+   if (table) {
+      for (i = 0; i < HUB_MAC_TABLE_PROBE; i++) {
+         e = &table->entry[(h + i) & (HUB_MAC_TABLE_SIZE - 1)];
+         if (ACCESS_ONCE(e->jack) == jackIndex && MAC_EQ(e->mac, mac)) {
+            if (e->lastSeen != jiffies) {
+               e->lastSeen = jiffies;
+            }
+            rcu_read_unlock();
+            return;
+         }
+      }
+   }
+   rcu_read_unlock();
+
+   spin_lock_irqsave(&hub->macLock, flags);
+   table = hub->macTable;
+   if (!table) {
+      goto out;
+   }
+   for (i = 0; i < HUB_MAC_TABLE_PROBE; i++) {
+      e = &table->entry[(h + i) & (HUB_MAC_TABLE_SIZE - 1)];
+      if (e->jack != HUB_MAC_NO_JACK && MAC_EQ(e->mac, mac)) {
+         victim = e;
+         break;
+      }
+      if (e->jack == HUB_MAC_NO_JACK) {
+         if (!victim || victim->jack != HUB_MAC_NO_JACK) {
+            victim = e;
+         }
+      } else if (!victim || (victim->jack != HUB_MAC_NO_JACK &&
+                             time_before(e->lastSeen, victim->lastSeen))) {
+         victim = e;
+      }
+   }
+   VNetHubMacSetEntry(victim, mac, jackIndex);
+
+ out:
+   spin_unlock_irqrestore(&hub->macLock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubForgetJack --
+ *
+ *      Drop every learned address that points at the given jack, or all
+ *      of them if jackIndex is HUB_MAC_NO_JACK.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubForgetJack(VNetHub *hub,  // IN:
+                  int jackIndex) // IN:
+{
+   unsigned long flags;
+   int i;
+
+   spin_lock_irqsave(&hub->macLock, flags);
+   if (hub->macTable) {
+      for (i = 0; i < HUB_MAC_TABLE_SIZE; i++) {
+         VNetHubMacEntry *e = &hub->macTable->entry[i];
+
+         if (jackIndex == HUB_MAC_NO_JACK || e->jack == jackIndex) {
+            e->jack = HUB_MAC_NO_JACK;
+         }
+      }
+   }
+   spin_unlock_irqrestore(&hub->macLock, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHub_SetLearning --
+ *
+ *      Turn MAC learning on or off for the hub the jack is plugged into.
+ *      With learning on, unicast frames to a known address go only to
+ *      the jack the address was last seen on; broadcast, multicast and
+ *      unknown destinations are still flooded. Note that promiscuous
+ *      listeners only see flooded traffic on a learning hub.
+ *	vnetStructureMutex must be held.
+ *
+ * Results:
+ *      0 on success, -EINVAL if jack is not a hub jack, -ENOMEM.
+ *
+ * Side effects:
+ *      Might sleep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetHub_SetLearning(VNetJack *jack,  // IN: a jack to a hub
+                    uint32 ageSecs)  // IN: entry lifetime, 0 to disable
+{
+   VNetHub *hub;
+   VNetHubMacTable *table = NULL;
+   VNetHubMacTable *old;
+   unsigned long flags;
+   int i;
+
+   if (jack == NULL || jack->rcv != VNetHubReceive || jack->private == NULL) {
+      return -EINVAL;
+   }
+   hub = (VNetHub*)jack->private;
+
+   if (ageSecs) {
+      table = kmalloc(sizeof *table, GFP_KERNEL);
+      if (!table) {
+         return -ENOMEM;
+      }
+      table->ageJiffies = MIN(ageSecs, 3600) * HZ;
+      for (i = 0; i < HUB_MAC_TABLE_SIZE; i++) {
+         table->entry[i].jack = HUB_MAC_NO_JACK;
+      }
+   }
+
+   spin_lock_irqsave(&hub->macLock, flags);
+   old = hub->macTable;
+   rcu_assign_pointer(hub->macTable, table);
+   spin_unlock_irqrestore(&hub->macLock, flags);
+
+   if (old) {
+      synchronize_rcu();
+      kfree(old);
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubCanSendTo --
+ *
+ *      Check whether a jack of the hub can take a packet right now.
+ *      Caller must be in an RCU read side critical section.
+ *
+ * Results:
+ *      TRUE if the jack is allocated, connected and has a receiver.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetHubCanSendTo(const VNetJack *jack) // IN:
+{
+   const VNetJack *peer;
+
+   if (!jack->private) {     /* not allocated */
+      return FALSE;
+   }
+   peer = rcu_dereference(jack->peer);
+   return peer &&            /* connected */
+          peer->rcv != NULL; /* and has a receiver */
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * VNetHubReceive --
  *
  *      This jack is receiving a packet. Take appropriate action.
+ *      Runs without locks: the set of jacks and the MAC table are
+ *      published with RCU, statistics are per CPU.
  *
  * Results:
  *      None.
@@ -534,18 +1089,45 @@ VNetHubReceive(VNetJack       *this, // IN:
                struct sk_buff *skb)  // IN:
 {
    VNetHub *hub = (VNetHub*)this->private;
+   const VNetHubJackSet *set;
+   const VNetHubMacTable *table;
    VNetJack *jack;
    struct sk_buff *clone;
    int i;
 
-   hub->stats[this->index].tx++;
+   rcu_read_lock();
 
-   for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
-      jack = &hub->jack[i];
-      if (jack->private &&   /* allocated */
-          jack->peer &&      /* and connected */
-          jack->peer->rcv && /* and has a receiver */
-          (jack != this)) {  /* and not a loop */
+   VNetHubStatsInc(hub, this->index, tx);
+
+   table = rcu_dereference(hub->macTable);
+   if (table) {
+      const uint8 *dest = SKB_2_DESTMAC(skb);
+
+      VNetHubMacLearn(hub, SKB_2_SRCMAC(skb), this->index);
+
+      if (!(dest[0] & 1)) {
+         i = VNetHubMacLookup(table, dest);
+         if (i == this->index) {
+            /* Destination is on the segment the frame came from. */
+            rcu_read_unlock();
+            dev_kfree_skb(skb);
+            return;
+         }
+         if (i != HUB_MAC_NO_JACK && VNetHubCanSendTo(&hub->jack[i])) {
+            VNetHubStatsInc(hub, this->index, unicast);
+            VNetSend(&hub->jack[i], skb);
+            rcu_read_unlock();
+            return;
+         }
+      }
+      VNetHubStatsInc(hub, this->index, flooded);
+   }
+
+   set = rcu_dereference(hub->jackSet);
+   for (i = 0; set && i < set->count; i++) {
+      jack = set->jack[i];
+      if (jack != this &&    /* not a loop */
+          VNetHubCanSendTo(jack)) {
          clone = skb_clone(skb, GFP_ATOMIC);
          if (clone) {
             VNetSend(jack, clone);
@@ -553,6 +1135,7 @@ VNetHubReceive(VNetJack       *this, // IN:
       }
    }
 
+   rcu_read_unlock();
    dev_kfree_skb(skb);
 }
 
@@ -625,6 +1208,9 @@ VNetHubPortsChanged(VNetJack *this)
    int num, new;
    int i;
 
+   /* The topology changed, addresses may have moved. */
+   VNetHubForgetJack(hub, HUB_MAC_NO_JACK);
+
    hub->totalPorts = 0;
 
    for (i=0; i<NUM_JACKS_PER_HUB; i++) {
@@ -718,6 +1304,7 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
 {
    VNetJack *jack = (VNetJack*)data;
    VNetHub *hub;
+   VNetHubStats stats;
    int len = 0;
 
    if (!jack || !jack->private) {
@@ -727,7 +1314,13 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
 
    len += VNetPrintJack(jack, page+len);
 
-   len += sprintf(page+len, "tx %u ", hub->stats[jack->index].tx);
+   VNetHubStatsSum(hub, jack->index, &stats);
+   len += sprintf(page+len, "tx %u ", stats.tx);
+
+   if (hub->macTable) {
+      len += sprintf(page+len, "unicast %u flooded %u ",
+                     stats.unicast, stats.flooded);
+   }
 
    len += sprintf(page+len, "\n");
 
@@ -396,6 +396,11 @@ VNetNetIfReceive(VNetJack        *this, // IN: jack
       goto drop_packet;
    }
 
+   if (VNetIsGSO(skb)) {
+      VNetReceiveSegmented(this, skb);
+      return;
+   }
+
    if (!VNetPacketMatch(dest,
                         netIf->dev->dev_addr,
                         allMultiFilter, 
@@ -25,6 +25,11 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/jhash.h>
 
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
@@ -61,25 +66,84 @@ typedef struct VNetUserIFStats {
    unsigned    droppedMismatch;
    unsigned    droppedOverflow;
    unsigned    droppedLargePacket;
+   unsigned    highWater;      // longest receive queue seen
 } VNetUserIFStats;
 
-typedef struct VNetUserIF {
-   VNetPort               port;
+/*
+ * Receive queue length limit. In adaptive mode the limit doubles on
+ * every overflow drop, up to maxLen, and halves back towards baseLen
+ * after a quiet interval in which the queues stayed short.
+ */
+
+#define VNET_QLEN_SHRINK_INTERVAL  HZ
+
+typedef struct VNetUserIFQueueLimit {
+   unsigned               len;         // current limit
+   unsigned               baseLen;     // configured limit
+   unsigned               maxLen;      // adaptive ceiling
+   Bool                   adaptive;
+   Bool                   overflowed;  // overflow during this interval
+   unsigned               windowHigh;  // longest queue during this interval
+   unsigned long          windowStart; // jiffies
+} VNetUserIFQueueLimit;
+
+typedef struct VNetUserIFRing {
+   VNet_RingHeader       *hdr;         // shared header, kernel mapping
+   char                  *rxSlots;     // first receive slot
+   char                  *txSlots;     // first transmit slot
+   uint32                 slotSize;
+   uint32                 numRxSlots;
+   uint32                 numTxSlots;
+   uint32                 rxProd;      // private copies of the indices
+   uint32                 txCons;      //   userlevel cannot corrupt
+   struct page          **pages;
+   unsigned               numPages;
+} VNetUserIFRing;
+
+/*
+ * A receive queue. Multiqueue ports steer packets to queues by flow
+ * hash; every queue has its own poll and act bits so that several VMX
+ * threads can each service one of them.
+ */
+
+typedef struct VNetUserIFQueue {
    struct sk_buff_head    packetQueue;
-   uint32*                pollPtr;
-   Atomic_uint32*         actPtr;
    uint32                 pollMask;
    uint32                 actMask;
+} VNetUserIFQueue;
+
+typedef struct VNetUserIF {
+   VNetPort               port;
+   VNetUserIFQueue        queue[VNET_MAX_QUEUES];
+   unsigned               numQueues;
+   VNetUserIFQueueLimit   qlen;
+   uint32                 offload;     // VNET_OFFLOAD_xxx
+   Atomic_uint32*         pollPtr;     // shared by all queues
+   Atomic_uint32*         actPtr;
    uint32*                recvClusterCount;
    wait_queue_head_t      waitQueue;
    struct page*           actPage;
    struct page*           pollPage;
    struct page*           recvClusterPage;
+   VNetUserIFRing*        ring;
+   spinlock_t             ringLock;    // protects ring against receive
+   compat_mutex_t         ringTxMutex; // serializes kicks and ring changes
    VNetUserIFStats        stats;
 } VNetUserIF;
 
 static void VNetUserIfUnsetupNotify(VNetUserIF *userIf);
 static int  VNetUserIfSetupNotify(VNetUserIF *userIf, VNet_Notify *vn);
+static int  VNetUserIfSendFrame(VNetUserIF *userIf, const char *buf,
+                                size_t count);
+static void VNetUserIfUnsetupRing(VNetUserIF *userIf);
+static void VNetUserIfDrain(VNetUserIF *userIf);
+
+/*
+ * Userif ports which negotiated VNET_OFFLOAD_GSO, across all vnets.
+ * The bridge passes GSO packets through unsplit while this is nonzero.
+ */
+
+atomic_t vnetGSOPorts = ATOMIC_INIT(0);
 
 /*
  *-----------------------------------------------------------------------------
@@ -254,7 +318,7 @@ VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
    }
 
    if ((retval = VNetUserIfMapUint32Ptr((VA)vn->pollPtr, &userIf->pollPage, 
-                                       &userIf->pollPtr)) < 0) {
+                                       (uint32 **)&userIf->pollPtr)) < 0) {
       return retval;
    }
    
@@ -271,8 +335,8 @@ VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
       return retval;
    }
 
-   userIf->pollMask = vn->pollMask;
-   userIf->actMask = vn->actMask;
+   userIf->queue[0].pollMask = vn->pollMask;
+   userIf->queue[0].actMask = vn->actMask;
    return 0;
 }
 
@@ -296,6 +360,8 @@ VNetUserIfSetupNotify(VNetUserIF *userIf, // IN
 static void
 VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
 {
+   unsigned i;
+
    if (userIf->pollPage) {
       kunmap(userIf->pollPage);
       put_page(userIf->pollPage);
@@ -320,18 +386,20 @@ VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
    userIf->actPage = NULL;
    userIf->recvClusterCount = NULL;
    userIf->recvClusterPage = NULL;
-   userIf->pollMask = 0;
-   userIf->actMask = 0;
+   for (i = 0; i < VNET_MAX_QUEUES; i++) {
+      userIf->queue[i].pollMask = 0;
+      userIf->queue[i].actMask = 0;
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfFree --
- *
- *      Free the user interface port.
+ * VNetUserIfFreeRing --
  *
+ *      Destroys the kernel mapping of a packet ring and unlocks its pages.
+ * 
  * Results: 
  *      None.
  *
@@ -342,103 +410,207 @@ VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
  */
 
 static void
-VNetUserIfFree(VNetJack *this) // IN
+VNetUserIfFreeRing(VNetUserIFRing *ring) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)this;
-   struct sk_buff *skb;
+   unsigned i;
 
-   for (;;) {
-      skb = skb_dequeue(&userIf->packetQueue);
-      if (skb == NULL) {
-	 break;
+   vunmap(ring->hdr);
+   for (i = 0; i < ring->numPages; i++) {
+      set_page_dirty_lock(ring->pages[i]);
+      put_page(ring->pages[i]);
+   }
+   kfree(ring->pages);
+   kfree(ring);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfSetupRing --
+ *
+ *    Lock in core the user area described by vr and map it contiguously
+ *    into the kernel, so that packets can be exchanged through it
+ *    without read() and write().
+ * 
+ * Results: 
+ *    0 on success
+ *    < 0 on failure: the actual value determines the type of failure
+ *
+ * Side effects:
+ *    Field ring is filled in VNetUserIf structure.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetupRing(VNetUserIF *userIf, // IN
+                    VNet_Ring *vr)      // IN
+{
+   VNetUserIFRing *ring;
+   unsigned long flags;
+   int retval;
+
+   if (vr->numRxSlots == 0 || vr->numRxSlots > VNET_RING_MAX_SLOTS ||
+       (vr->numRxSlots & (vr->numRxSlots - 1)) != 0 ||
+       vr->numTxSlots == 0 || vr->numTxSlots > VNET_RING_MAX_SLOTS ||
+       (vr->numTxSlots & (vr->numTxSlots - 1)) != 0 ||
+       vr->slotSize <= sizeof (VNet_BatchFrame) + sizeof (struct ethhdr) ||
+       vr->slotSize % VNET_BATCH_ALIGN != 0 ||
+       (vr->addr & (PAGE_SIZE - 1)) != 0 ||
+       vr->len < VNET_RING_SIZE(vr) || vr->len > VNET_RING_MAX_LEN ||
+       VNetUserIfInvalidPointer((VA)vr->addr, vr->len)) {
+      return -EINVAL;
+   }
+
+   ring = kmalloc(sizeof *ring, GFP_USER);
+   if (!ring) {
+      return -ENOMEM;
+   }
+   ring->numPages = (vr->len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+   ring->pages = kmalloc(ring->numPages * sizeof *ring->pages, GFP_USER);
+   if (!ring->pages) {
+      kfree(ring);
+      return -ENOMEM;
+   }
+
+   down_read(&current->mm->mmap_sem);
+   retval = get_user_pages(current, current->mm, (VA)vr->addr,
+                           ring->numPages, 1, 0, ring->pages, NULL);
+   up_read(&current->mm->mmap_sem);
+   if (retval != ring->numPages) {
+      while (retval > 0) {
+         put_page(ring->pages[--retval]);
       }
-      dev_kfree_skb(skb);
+      kfree(ring->pages);
+      kfree(ring);
+      return -EAGAIN;
    }
-   
-   if (userIf->pollPtr) {
-      VNetUserIfUnsetupNotify(userIf);
+
+   ring->hdr = vmap(ring->pages, ring->numPages, VM_MAP, PAGE_KERNEL);
+   if (!ring->hdr) {
+      unsigned i;
+
+      for (i = 0; i < ring->numPages; i++) {
+         put_page(ring->pages[i]);
+      }
+      kfree(ring->pages);
+      kfree(ring);
+      return -ENOMEM;
    }
 
-   if (this->procEntry) {
-      VNetProc_RemoveEntry(this->procEntry);
+   ring->slotSize = vr->slotSize;
+   ring->numRxSlots = vr->numRxSlots;
+   ring->numTxSlots = vr->numTxSlots;
+   ring->rxSlots = (char *)ring->hdr + VNET_RING_HDR_SIZE;
+   ring->txSlots = ring->rxSlots + ring->numRxSlots * ring->slotSize;
+   ring->rxProd = ring->hdr->rxProd = ring->hdr->rxCons = 0;
+   ring->txCons = ring->hdr->txProd = ring->hdr->txCons = 0;
+
+   compat_mutex_lock(&userIf->ringTxMutex);
+   spin_lock_irqsave(&userIf->ringLock, flags);
+   retval = 0;
+   if (userIf->ring) {
+      retval = -EBUSY;
+   } else {
+      userIf->ring = ring;
    }
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+   compat_mutex_unlock(&userIf->ringTxMutex);
 
-   kfree(userIf);
+   if (retval) {
+      LOG(0, (KERN_DEBUG "vmnet: Packet ring already active\n"));
+      VNetUserIfFreeRing(ring);
+   }
+   return retval;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfUnsetupRing --
+ *
+ *      Detaches the packet ring, if any, from the port and frees it.
+ * 
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      Field ring in VNetUserIf structure is cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfUnsetupRing(VNetUserIF *userIf) // IN
+{
+   VNetUserIFRing *ring;
+   unsigned long flags;
+
+   compat_mutex_lock(&userIf->ringTxMutex);
+   spin_lock_irqsave(&userIf->ringLock, flags);
+   ring = userIf->ring;
+   userIf->ring = NULL;
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+   compat_mutex_unlock(&userIf->ringTxMutex);
+
+   if (ring) {
+      VNetUserIfFreeRing(ring);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfReceive --
+ * VNetUserIfFree --
  *
- *      This jack is receiving a packet. Take appropriate action.
+ *      Free the user interface port.
  *
  * Results: 
  *      None.
  *
  * Side effects:
- *      Frees skb.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-VNetUserIfReceive(VNetJack       *this, // IN
-                  struct sk_buff *skb)  // IN
+VNetUserIfFree(VNetJack *this) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)this->private;
-   uint8 *dest = SKB_2_DESTMAC(skb);
-   
-   if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
-      goto drop_packet;
-   }
-   
-   if (!VNetPacketMatch(dest,
-                        userIf->port.paddr,
-                        userIf->port.ladrf,
-                        userIf->port.flags)) {
-      userIf->stats.droppedMismatch++;
-      goto drop_packet;
-   }
-   
-   if (skb_queue_len(&userIf->packetQueue) >= VNET_MAX_QLEN) {
-      userIf->stats.droppedOverflow++;
-      goto drop_packet;
-   }
+   VNetUserIF *userIf = (VNetUserIF*)this;
+
+   VNetUserIfDrain(userIf);
    
-   if (skb->len > ETHER_MAX_QUEUED_PACKET) {
-      userIf->stats.droppedLargePacket++;
-      goto drop_packet;
+   if (userIf->pollPtr) {
+      VNetUserIfUnsetupNotify(userIf);
    }
 
-   userIf->stats.queued++;
+   VNetUserIfUnsetupRing(userIf);
 
-   skb_queue_tail(&userIf->packetQueue, skb);
-   if (userIf->pollPtr) {
-      *userIf->pollPtr |= userIf->pollMask;
-      if (skb_queue_len(&userIf->packetQueue) >= (*userIf->recvClusterCount)) {
-         Atomic_Or(userIf->actPtr, userIf->actMask);
-      }
+   if (userIf->offload & VNET_OFFLOAD_GSO) {
+      atomic_dec(&vnetGSOPorts);
    }
-   wake_up(&userIf->waitQueue);
-   return;
-   
- drop_packet:
-   dev_kfree_skb(skb);
+
+   if (this->procEntry) {
+      VNetProc_RemoveEntry(this->procEntry);
+   }
+
+   kfree(userIf);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfProcRead --
+ * VNetUserIfFlowHash --
  *
- *      Callback for read operation on this userif entry in vnets proc fs.
+ *      Compute a flow hash for steering a packet to a receive queue.
+ *      IPv4 packets hash on addresses, protocol and, for unfragmented
+ *      TCP and UDP, ports; everything else hashes on the MAC addresses.
  *
  * Results: 
- *      Length of read operation.
+ *      The hash.
  *
  * Side effects:
  *      None.
@@ -446,170 +618,1261 @@ VNetUserIfReceive(VNetJack       *this, // IN
  *----------------------------------------------------------------------
  */
 
-static int
-VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
-                   char   **start, // OUT: 0 if file < 4k, else offset into
-                                   //      page
-                   off_t    off,   // IN: offset of read into the file
-                   int      count, // IN: maximum number of bytes to read
-                   int     *eof,   // OUT: TRUE if there is nothing more to
-                                   //      read
-                   void    *data)  // IN: client data - not used
+static uint32
+VNetUserIfFlowHash(const struct sk_buff *skb) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)data; 
-   int len = 0;
-   
-   if (!userIf) {
-      return len;
+   const struct ethhdr *eth = (const struct ethhdr *)skb->data;
+   const struct iphdr *iph;
+   struct iphdr ipBuf;
+   uint32 ports = 0;
+
+   if (eth->h_proto == htons(ETH_P_IP)) {
+      iph = skb_header_pointer(skb, ETH_HLEN, sizeof ipBuf, &ipBuf);
+      if (iph && iph->ihl >= 5) {
+         if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+             !(iph->frag_off & htons(IP_MF | IP_OFFSET))) {
+            const uint32 *p;
+            uint32 portBuf;
+
+            p = skb_header_pointer(skb, ETH_HLEN + iph->ihl * 4,
+                                   sizeof portBuf, &portBuf);
+            if (p) {
+               ports = *p;
+            }
+         }
+         return jhash_3words(iph->saddr ^ iph->daddr, ports, iph->protocol, 0);
+      }
    }
-   
-   len += VNetPrintPort(&userIf->port, page+len);
-   
-   len += sprintf(page+len, "read %u written %u queued %u ",
-                  userIf->stats.read,
-                  userIf->stats.written,
-                  userIf->stats.queued);
-   
-   len += sprintf(page+len, 
-		  "dropped.down %u dropped.mismatch %u "
-		  "dropped.overflow %u dropped.largePacket %u",
-                  userIf->stats.droppedDown,
-                  userIf->stats.droppedMismatch,
-                  userIf->stats.droppedOverflow,
-		  userIf->stats.droppedLargePacket);
 
-   len += sprintf(page+len, "\n");
-   
-   *start = 0;
-   *eof   = 1;
-   return len;
+   return jhash_3words(*(const uint32 *)(eth->h_dest + 2) ^
+                       *(const uint32 *)(eth->h_source + 2),
+                       eth->h_dest[0] << 8 | eth->h_dest[1],
+                       eth->h_source[0] << 8 | eth->h_source[1], 0);
 }
 
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 4)
 /*
  *----------------------------------------------------------------------
  *
- * VNetCopyDatagram --
+ * VNetUserIfDrain --
  *
- *      Copy part of datagram to userspace.
+ *      Drop every queued packet of every receive queue.
  *
  * Results: 
- *	zero    on success,
- *	-EFAULT if buffer is an invalid area
+ *      None.
  *
  * Side effects:
- *      Data copied to the buffer.
+ *      Clears the poll bits of all queues.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-VNetCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
-		 char *buf,			// OUT: where to copy data
-		 int len)			// IN: length
+static void
+VNetUserIfDrain(VNetUserIF *userIf) // IN
 {
-   struct iovec iov = {
-      .iov_base = buf,
-      .iov_len  = len,
-   };
-   return skb_copy_datagram_iovec(skb, 0, &iov, len);
+   struct sk_buff *skb;
+   unsigned i;
+
+   for (i = 0; i < VNET_MAX_QUEUES; i++) {
+      while ((skb = skb_dequeue(&userIf->queue[i].packetQueue)) != NULL) {
+         dev_kfree_skb(skb);
+      }
+      if (userIf->pollPtr) {
+         /* Clear the pending bit as no packets are pending at this point. */
+         Atomic_And(userIf->pollPtr, ~userIf->queue[i].pollMask);
+      }
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetCsumCopyDatagram --
- *
- *      Copy part of datagram to userspace doing checksum at same time.
+ * VNetUserIfRingReceive --
  *
- *	Do not mark this function INLINE, it is recursive! With all gcc's 
- *	released up to now (<= gcc-3.3.1) inlining this function just
- *	consumes 120 more bytes of code and goes completely mad on
- *	register allocation, storing almost everything in the memory.
+ *      Copy a received packet straight into the next free slot of the
+ *      RX ring, if the port has one.
  *
  * Results: 
- *	folded checksum (non-negative value) on success,
- *	-EINVAL if offset is too big,
- *	-EFAULT if buffer is an invalid area
+ *      TRUE if the port has a ring and the packet was consumed (copied
+ *      or dropped), FALSE if the packet should go to the packet queue.
  *
  * Side effects:
- *      Data copied to the buffer.
+ *      Frees skb when returning TRUE.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
-		     unsigned int offset,	// IN: how many bytes skip
-		     char *buf)			// OUT: where to copy data
+static Bool
+VNetUserIfRingReceive(VNetUserIF     *userIf, // IN
+                      struct sk_buff *skb)    // IN
 {
-   unsigned int csum;
-   int err = 0;
-   int len = skb_headlen(skb) - offset;
-   char *curr = buf;
-   const skb_frag_t *frag;
+   VNetUserIFRing *ring;
+   VNet_BatchFrame *frame;
+   unsigned long flags;
+   uint32 pending;
 
-   /* 
-    * Something bad happened. We skip only up to skb->nh.raw, and skb->nh.raw
-    * must be in the header, otherwise we are in the big troubles.
+   if (!userIf->ring) {
+      return FALSE;
+   }
+
+   /*
+    * The ring has no room for the checksum offload metadata, so resolve
+    * partial checksums before the packet lands in guest visible memory.
     */
-   if (len < 0) {
-      return -EINVAL;
+   if (skb->ip_summed == VM_TX_CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+      dev_kfree_skb_any(skb);
+      return TRUE;
    }
 
-   csum = csum_and_copy_to_user(skb->data + offset, curr, len, 0, &err);
-   if (err) {
-      return err;
+   spin_lock_irqsave(&userIf->ringLock, flags);
+   ring = userIf->ring;
+   if (!ring) {
+      spin_unlock_irqrestore(&userIf->ringLock, flags);
+      return FALSE;
    }
-   curr += len;
 
-   for (frag = skb_shinfo(skb)->frags;
-	frag != skb_shinfo(skb)->frags + skb_shinfo(skb)->nr_frags;
-	frag++) {
-      if (frag->size > 0) {
-	 unsigned int tmpCsum;
-	 const void *vaddr;
+   pending = ring->rxProd - ACCESS_ONCE(ring->hdr->rxCons);
+   if (pending >= ring->numRxSlots) {
+      userIf->stats.droppedOverflow++;
+      goto unlock;
+   }
+   if (skb->len > ring->slotSize - sizeof *frame) {
+      userIf->stats.droppedLargePacket++;
+      goto unlock;
+   }
 
-	 vaddr = kmap(frag->page.p);
-	 tmpCsum = csum_and_copy_to_user(vaddr + frag->page_offset,
-					 curr, frag->size, 0, &err);
-	 kunmap(frag->page.p);
-	 if (err) {
-	    return err;
-	 }
-	 csum = csum_block_add(csum, tmpCsum, curr - buf);
-	 curr += frag->size;
-      }
+   frame = (VNet_BatchFrame *)(ring->rxSlots +
+                               (ring->rxProd & (ring->numRxSlots - 1)) *
+                               ring->slotSize);
+   if (skb_copy_bits(skb, 0, frame + 1, skb->len)) {
+      userIf->stats.droppedLargePacket++;
+      goto unlock;
+   }
+   frame->len = skb->len;
+   frame->reserved = 0;
+
+   /* Publish the frame contents before the producer index. */
+   smp_wmb();
+   ring->hdr->rxProd = ++ring->rxProd;
+   userIf->stats.queued++;
+
+   if (userIf->pollPtr) {
+      Atomic_Or(userIf->pollPtr, userIf->queue[0].pollMask);
+      if (pending + 1 >= *userIf->recvClusterCount) {
+         Atomic_Or(userIf->actPtr, userIf->queue[0].actMask);
+      }
+   }
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+
+   wake_up(&userIf->waitQueue);
+   dev_kfree_skb_any(skb);
+   return TRUE;
+
+ unlock:
+   spin_unlock_irqrestore(&userIf->ringLock, flags);
+   dev_kfree_skb_any(skb);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfQueueDecay --
+ *
+ *      Shrink a grown adaptive queue limit once a shrink interval has
+ *      passed without overflows and with the queues mostly empty. Called
+ *      from the receive path and from the read and poll paths, so that a
+ *      port which stopped receiving gives back its grown limit too. A
+ *      port idle for several intervals halves its limit once for each of
+ *      them.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      May change limit->len.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfQueueDecay(VNetUserIFQueueLimit *limit)   // IN/OUT
+{
+   unsigned long intervals;
+   unsigned len;
+
+   if (!limit->adaptive ||
+       !time_after(jiffies, limit->windowStart + VNET_QLEN_SHRINK_INTERVAL)) {
+      return;
+   }
+
+   intervals = (jiffies - limit->windowStart) / VNET_QLEN_SHRINK_INTERVAL;
+   len = limit->len;
+   if (!limit->overflowed) {
+      while (intervals-- > 0 && len > limit->baseLen &&
+             limit->windowHigh < len / 4) {
+         len = MAX(len / 2, limit->baseLen);
+      }
+   }
+   limit->len = len;
+   limit->overflowed = FALSE;
+   limit->windowHigh = 0;
+   limit->windowStart = jiffies;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfQueueFull --
+ *
+ *      Check a receive queue against the port's length limit, keeping
+ *      track of the high watermark and adapting the limit if the port
+ *      is in adaptive mode. Concurrent callers may race on the limit
+ *      bookkeeping, which only ever costs a slightly late adjustment.
+ *
+ * Results: 
+ *      TRUE if the packet must be dropped for overflow.
+ *
+ * Side effects:
+ *      May change userIf->qlen.len.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetUserIfQueueFull(VNetUserIF *userIf,   // IN
+                    VNetUserIFQueue *q)   // IN
+{
+   VNetUserIFQueueLimit *limit = &userIf->qlen;
+   unsigned len = skb_queue_len(&q->packetQueue);
+
+   if (len + 1 > userIf->stats.highWater) {
+      userIf->stats.highWater = len + 1;
+   }
+
+   if (limit->adaptive) {
+      if (len + 1 > limit->windowHigh) {
+         limit->windowHigh = len + 1;
+      }
+      if (len >= limit->len && limit->len < limit->maxLen) {
+         limit->len = MIN(limit->len * 2, limit->maxLen);
+         limit->overflowed = TRUE;
+      } else {
+         VNetUserIfQueueDecay(limit);
+      }
+   }
+
+   return len >= limit->len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSetQueueLen --
+ *
+ *      Handle SIOCSQUEUELEN: set the receive queue length limit of the
+ *      port and whether it adapts to overflows.
+ *
+ * Results: 
+ *      0 on success, -EINVAL on bad arguments.
+ *
+ * Side effects:
+ *      Resets the high watermark.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetQueueLen(VNetUserIF *userIf,   // IN
+                      VNet_QueueLen *vql)   // IN
+{
+   VNetUserIFQueueLimit *limit = &userIf->qlen;
+   Bool adaptive = (vql->flags & VNET_QUEUELEN_ADAPTIVE) != 0;
+
+   if (vql->version != VNET_QUEUELEN_VERSION ||
+       (vql->flags & ~VNET_QUEUELEN_ADAPTIVE) != 0 ||
+       vql->len == 0 || vql->len > VNET_QUEUELEN_MAX ||
+       (adaptive && (vql->maxLen < vql->len ||
+                     vql->maxLen > VNET_QUEUELEN_MAX))) {
+      return -EINVAL;
+   }
+
+   limit->baseLen = vql->len;
+   limit->maxLen = adaptive ? vql->maxLen : vql->len;
+   limit->adaptive = adaptive;
+   limit->overflowed = FALSE;
+   limit->windowHigh = 0;
+   limit->windowStart = jiffies;
+   limit->len = vql->len;
+   userIf->stats.highWater = 0;
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCanPassGSO --
+ *
+ *      Check whether a GSO packet is of a kind the offload header can
+ *      describe: plain TCPv4, TCPv6 or UDP, possibly with ECN. Anything
+ *      else (tunnels, GRE, SCTP, ...) must be segmented in software.
+ *
+ * Results: 
+ *      TRUE if the packet can be passed to userlevel unsplit.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef VNET_HAVE_GSO
+static INLINE Bool
+VNetUserIfCanPassGSO(const struct sk_buff *skb) // IN
+{
+   unsigned int type = skb_shinfo(skb)->gso_type;
+   unsigned int proto = type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | SKB_GSO_UDP);
+
+   if (proto != SKB_GSO_TCPV4 && proto != SKB_GSO_TCPV6 &&
+       proto != SKB_GSO_UDP) {
+      return FALSE;
+   }
+   if ((type & SKB_GSO_TCP_ECN) && proto == SKB_GSO_UDP) {
+      return FALSE;
+   }
+   return (type & ~(proto | SKB_GSO_TCP_ECN | SKB_GSO_DODGY)) == 0;
+}
+#else
+#define VNetUserIfCanPassGSO(skb) (FALSE)
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfReceive --
+ *
+ *      This jack is receiving a packet. Take appropriate action.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      Frees skb.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfReceive(VNetJack       *this, // IN
+                  struct sk_buff *skb)  // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)this->private;
+   uint8 *dest = SKB_2_DESTMAC(skb);
+   VNetUserIFQueue *q;
+   unsigned numQueues;
+   
+   if (!UP_AND_RUNNING(userIf->port.flags)) {
+      userIf->stats.droppedDown++;
+      goto drop_packet;
+   }
+   
+   if (!VNetPacketMatch(dest,
+                        userIf->port.paddr,
+                        userIf->port.ladrf,
+                        userIf->port.flags)) {
+      userIf->stats.droppedMismatch++;
+      goto drop_packet;
+   }
+
+   /*
+    * Split packets the bridge passed through for some other port.
+    */
+   if (VNetIsGSO(skb) &&
+       (!(userIf->offload & VNET_OFFLOAD_GSO) || userIf->ring ||
+        !VNetUserIfCanPassGSO(skb))) {
+      VNetReceiveSegmented(this, skb);
+      return;
+   }
+   
+   if (VNetUserIfRingReceive(userIf, skb)) {
+      return;
+   }
+
+   numQueues = userIf->numQueues;
+   q = &userIf->queue[numQueues > 1 ? VNetUserIfFlowHash(skb) % numQueues : 0];
+
+   if (VNetUserIfQueueFull(userIf, q)) {
+      userIf->stats.droppedOverflow++;
+      goto drop_packet;
+   }
+   
+   if (skb->len > ((userIf->offload & VNET_OFFLOAD_GSO) ?
+                   VNET_OFFLOAD_MAX_FRAME : ETHER_MAX_QUEUED_PACKET)) {
+      userIf->stats.droppedLargePacket++;
+      goto drop_packet;
+   }
+
+   userIf->stats.queued++;
+
+   skb_queue_tail(&q->packetQueue, skb);
+   if (userIf->pollPtr) {
+      Atomic_Or(userIf->pollPtr, q->pollMask);
+      if (skb_queue_len(&q->packetQueue) >= (*userIf->recvClusterCount)) {
+         Atomic_Or(userIf->actPtr, q->actMask);
+      }
+   }
+   wake_up(&userIf->waitQueue);
+   return;
+   
+ drop_packet:
+   dev_kfree_skb(skb);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfProcRead --
+ *
+ *      Callback for read operation on this userif entry in vnets proc fs.
+ *
+ * Results: 
+ *      Length of read operation.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
+                   char   **start, // OUT: 0 if file < 4k, else offset into
+                                   //      page
+                   off_t    off,   // IN: offset of read into the file
+                   int      count, // IN: maximum number of bytes to read
+                   int     *eof,   // OUT: TRUE if there is nothing more to
+                                   //      read
+                   void    *data)  // IN: client data - not used
+{
+   VNetUserIF *userIf = (VNetUserIF*)data; 
+   int len = 0;
+   
+   if (!userIf) {
+      return len;
+   }
+   
+   len += VNetPrintPort(&userIf->port, page+len);
+   
+   len += sprintf(page+len, "read %u written %u queued %u ",
+                  userIf->stats.read,
+                  userIf->stats.written,
+                  userIf->stats.queued);
+   
+   len += sprintf(page+len, 
+		  "dropped.down %u dropped.mismatch %u "
+		  "dropped.overflow %u dropped.largePacket %u",
+                  userIf->stats.droppedDown,
+                  userIf->stats.droppedMismatch,
+                  userIf->stats.droppedOverflow,
+		  userIf->stats.droppedLargePacket);
+
+   len += sprintf(page+len, " qlen.limit %u qlen.max %u qlen.highWater %u%s",
+                  userIf->qlen.len,
+                  userIf->qlen.maxLen,
+                  userIf->stats.highWater,
+                  userIf->qlen.adaptive ? " qlen.adaptive" : "");
+
+   len += sprintf(page+len, "\n");
+   
+   *start = 0;
+   *eof   = 1;
+   return len;
+}
+
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 4)
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCopyDatagram --
+ *
+ *      Copy part of datagram to userspace.
+ *
+ * Results: 
+ *	zero    on success,
+ *	-EFAULT if buffer is an invalid area
+ *
+ * Side effects:
+ *      Data copied to the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
+		 char *buf,			// OUT: where to copy data
+		 int len)			// IN: length
+{
+   struct iovec iov = {
+      .iov_base = buf,
+      .iov_len  = len,
+   };
+   return skb_copy_datagram_iovec(skb, 0, &iov, len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCsumCopyDatagram --
+ *
+ *      Copy part of datagram to userspace doing checksum at same time.
+ *
+ *	Do not mark this function INLINE, it is recursive! With all gcc's 
+ *	released up to now (<= gcc-3.3.1) inlining this function just
+ *	consumes 120 more bytes of code and goes completely mad on
+ *	register allocation, storing almost everything in the memory.
+ *
+ * Results: 
+ *	folded checksum (non-negative value) on success,
+ *	-EINVAL if offset is too big,
+ *	-EFAULT if buffer is an invalid area
+ *
+ * Side effects:
+ *      Data copied to the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
+		     unsigned int offset,	// IN: how many bytes skip
+		     char *buf)			// OUT: where to copy data
+{
+   unsigned int csum;
+   int err = 0;
+   int len = skb_headlen(skb) - offset;
+   char *curr = buf;
+   const skb_frag_t *frag;
+
+   /* 
+    * Something bad happened. We skip only up to skb->nh.raw, and skb->nh.raw
+    * must be in the header, otherwise we are in the big troubles.
+    */
+   if (len < 0) {
+      return -EINVAL;
+   }
+
+   csum = csum_and_copy_to_user(skb->data + offset, curr, len, 0, &err);
+   if (err) {
+      return err;
+   }
+   curr += len;
+
+   for (frag = skb_shinfo(skb)->frags;
+	frag != skb_shinfo(skb)->frags + skb_shinfo(skb)->nr_frags;
+	frag++) {
+      if (frag->size > 0) {
+	 unsigned int tmpCsum;
+	 const void *vaddr;
+
+	 vaddr = kmap(frag->page.p);
+	 tmpCsum = csum_and_copy_to_user(vaddr + frag->page_offset,
+					 curr, frag->size, 0, &err);
+	 kunmap(frag->page.p);
+	 if (err) {
+	    return err;
+	 }
+	 csum = csum_block_add(csum, tmpCsum, curr - buf);
+	 curr += frag->size;
+      }
    }
 
    for (skb = skb_shinfo(skb)->frag_list; skb != NULL; skb = skb->next) {
       int tmpCsum;
 
-      tmpCsum = VNetCsumCopyDatagram(skb, 0, curr);
-      if (tmpCsum < 0) {
-	 return tmpCsum;
+      tmpCsum = VNetCsumCopyDatagram(skb, 0, curr);
+      if (tmpCsum < 0) {
+	 return tmpCsum;
+      }
+      /* Folded checksum must be inverted before we can use it */
+      csum = csum_block_add(csum, tmpCsum ^ 0xFFFF, curr - buf);
+      curr += skb->len;
+   }
+   return csum_fold(csum);
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCopyDatagramToUser --
+ *
+ *      Copy complete datagram to the user space. Fill correct checksum
+ *	into the copied datagram if nobody did it yet.
+ *
+ * Results: 
+ *      On success byte count, on failure -EFAULT.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE int
+VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
+		       char *buf,			// OUT
+		       size_t count)			// IN
+{
+   if (count > skb->len) {
+      count = skb->len;
+   }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 4, 4)
+   if (copy_to_user(buf, skb->data, count)) {
+      return -EFAULT;
+   }
+#else
+   /*
+    * If truncation occurs, we do not bother with checksumming - caller cannot
+    * verify checksum anyway in such case, and copy without checksum is
+    * faster.
+    */
+   if (skb->pkt_type == PACKET_OUTGOING && 	/* Packet must be outgoing */
+       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL &&	/* Without checksum */
+       compat_skb_network_header_len(skb) &&    /* We must know where header is */
+       skb->len == count) {			/* No truncation may occur */
+      size_t skl;
+      int csum;
+      u_int16_t csum16;
+     
+      skl = compat_skb_csum_start(skb);
+      if (VNetCopyDatagram(skb, buf, skl)) {
+	 return -EFAULT;
+      }
+      csum = VNetCsumCopyDatagram(skb, skl, buf + skl);
+      if (csum < 0) {
+	 return csum;
+      }
+      csum16 = csum;
+      if (copy_to_user(buf + skl + compat_skb_csum_offset(skb),
+                       &csum16, sizeof csum16)) {
+	 return -EFAULT;
+      }
+   } else {
+      if (VNetCopyDatagram(skb, buf, count)) {
+	 return -EFAULT;
+      }
+   }
+#endif
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFrameLen --
+ *
+ *      Number of bytes a packet takes when returned to userlevel: the
+ *      packet itself plus the offload header, if the port uses one.
+ *
+ * Results: 
+ *      The length.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE size_t
+VNetUserIfFrameLen(const VNetUserIF *userIf,  // IN
+                   const struct sk_buff *skb) // IN
+{
+   if (userIf->offload & VNET_OFFLOAD_GSO) {
+      return sizeof (VNet_OffloadHdr) + skb->len;
+   }
+   return skb->len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFillOffloadHdr --
+ *
+ *      Describe the checksum and segmentation offload state of a packet
+ *      for userlevel.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef VNET_HAVE_GSO
+static void
+VNetUserIfFillOffloadHdr(const struct sk_buff *skb, // IN
+                         VNet_OffloadHdr *hdr)      // OUT
+{
+   memset(hdr, 0, sizeof *hdr);
+
+   if (skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      hdr->flags = VNET_OFFLOAD_F_NEEDS_CSUM;
+      hdr->csumStart = compat_skb_csum_start(skb);
+      hdr->csumOffset = compat_skb_csum_offset(skb);
+   }
+
+   if (VNetIsGSO(skb)) {
+      unsigned int type = skb_shinfo(skb)->gso_type;
+      Bool tcp = TRUE;
+
+      ASSERT(VNetUserIfCanPassGSO(skb));
+      if (type & SKB_GSO_TCPV4) {
+         hdr->gsoType = VNET_OFFLOAD_GSO_TCPV4;
+      } else if (type & SKB_GSO_TCPV6) {
+         hdr->gsoType = VNET_OFFLOAD_GSO_TCPV6;
+      } else if (type & SKB_GSO_UDP) {
+         hdr->gsoType = VNET_OFFLOAD_GSO_UDP;
+         tcp = FALSE;
+      }
+      if (type & SKB_GSO_TCP_ECN) {
+         hdr->gsoType |= VNET_OFFLOAD_GSO_ECN;
+      }
+      hdr->gsoSize = skb_shinfo(skb)->gso_size;
+      hdr->hdrLen = compat_skb_transport_offset(skb) +
+                    (tcp ? compat_skb_tcp_header(skb)->doff * 4 :
+                           sizeof (struct udphdr));
+   }
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCopyToUser --
+ *
+ *      Copy a packet to userlevel in the format the port negotiated.
+ *      Ports with VNET_OFFLOAD_GSO get the offload header followed by
+ *      the packet as is; others get the packet with its checksum
+ *      filled in.
+ *
+ * Results: 
+ *      On success byte count, on failure -EFAULT.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfCopyToUser(const VNetUserIF *userIf,  // IN
+                     const struct sk_buff *skb, // IN
+                     char *buf,                 // OUT
+                     size_t count)              // IN
+{
+#ifdef VNET_HAVE_GSO
+   VNet_OffloadHdr hdr;
+
+   if (!(userIf->offload & VNET_OFFLOAD_GSO)) {
+      return VNetCopyDatagramToUser(skb, buf, count);
+   }
+
+   if (count < sizeof hdr) {
+      return -EMSGSIZE;
+   }
+   VNetUserIfFillOffloadHdr(skb, &hdr);
+   if (copy_to_user(buf, &hdr, sizeof hdr)) {
+      return -EFAULT;
+   }
+
+   count = MIN(count - sizeof hdr, skb->len);
+   if (VNetCopyDatagram(skb, buf + sizeof hdr, count)) {
+      return -EFAULT;
+   }
+   return sizeof hdr + count;
+#else
+   return VNetCopyDatagramToUser(skb, buf, count);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfPendingQueue --
+ *
+ *      Pick the queue read() and poll() look at: the first non-empty one.
+ *
+ * Results: 
+ *      A queue with pending packets, or queue 0 if all are empty.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE VNetUserIFQueue *
+VNetUserIfPendingQueue(VNetUserIF *userIf) // IN
+{
+   unsigned i;
+
+   for (i = 0; i < userIf->numQueues; i++) {
+      if (!skb_queue_empty(&userIf->queue[i].packetQueue)) {
+         return &userIf->queue[i];
+      }
+   }
+   return &userIf->queue[0];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfDequeue --
+ *
+ *      Dequeue the next pending packet of a queue and keep the queue's
+ *      poll bit in sync with its state.
+ *
+ * Results: 
+ *      The dequeued skb, or NULL if the queue is empty.
+ *
+ * Side effects:
+ *      Clears the poll bit when the queue becomes empty. May shrink an
+ *      adaptive queue limit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE struct sk_buff *
+VNetUserIfDequeue(VNetUserIF *userIf,   // IN
+                  VNetUserIFQueue *q)   // IN
+{
+   struct sk_buff *skb;
+
+   skb = skb_dequeue(&q->packetQueue);
+
+   VNetUserIfQueueDecay(&userIf->qlen);
+
+   if (userIf->pollPtr) {
+      if (skb_queue_empty(&q->packetQueue)) {
+         Atomic_And(userIf->pollPtr, ~q->pollMask);
+      }
+#if 0
+      /*
+       * Disable this for now since the monitor likes to assert that
+       * actions are present and thus can't cope with them disappearing
+       * out from under it.  See bug 47760.  -Jeremy. 22 July 2004
+       */
+
+      if (skb_queue_len(&q->packetQueue) < (*userIf->recvClusterCount) &&
+          (Atomic_Read(userIf->actPtr) & q->actMask) != 0) {
+         Atomic_And(userIf->actPtr, ~q->actMask);
+      }
+#endif
+   }
+
+   return skb;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRequeue --
+ *
+ *      Puts a packet taken with VNetUserIfDequeue back at the head of its
+ *      receive queue.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      Sets the queue's poll bit again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfRequeue(VNetUserIF *userIf,   // IN
+                  VNetUserIFQueue *q,   // IN
+                  struct sk_buff *skb)  // IN
+{
+   skb_queue_head(&q->packetQueue, skb);
+   if (userIf->pollPtr) {
+      Atomic_Or(userIf->pollPtr, q->pollMask);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRead --
+ *
+ *      The virtual network's read file operation. Reads the next pending
+ *      packet for this network connection.
+ *
+ * Results: 
+ *      On success the len of the packet received,
+ *      else if no packet waiting and nonblocking 0,
+ *      else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int 
+VNetUserIfRead(VNetPort    *port, // IN
+               struct file *filp, // IN
+               char        *buf,  // OUT
+               size_t      count) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+   VNetUserIFQueue *q;
+   struct sk_buff *skb;
+   int ret;
+   DECLARE_WAITQUEUE(wait, current);
+
+   add_wait_queue(&userIf->waitQueue, &wait);
+   for (;;) {
+      set_current_state(TASK_INTERRUPTIBLE);
+      q = VNetUserIfPendingQueue(userIf);
+      skb = skb_peek(&q->packetQueue);
+      if (skb && (VNetUserIfFrameLen(userIf, skb) > count)) {
+         skb = NULL;
+         ret = -EMSGSIZE;
+         break;
+      }
+      ret = -EAGAIN;
+      skb = VNetUserIfDequeue(userIf, q);
+
+      if (skb != NULL || filp->f_flags & O_NONBLOCK) {
+         break;
+      }
+      ret = -EINTR;
+      if (signal_pending(current)) {
+         break;
+      }
+      schedule();
+   }
+   __set_current_state(TASK_RUNNING);
+   remove_wait_queue(&userIf->waitQueue, &wait);
+   if (! skb) {
+      return ret;
+   }
+
+   userIf->stats.read++;
+
+   count = VNetUserIfCopyToUser(userIf, skb, buf, count);
+   dev_kfree_skb(skb);
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfWrite --
+ *
+ *      The virtual network's write file operation. Send the raw packet
+ *      to the network.
+ *
+ * Results: 
+ *      On success the count of bytes written else errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int 
+VNetUserIfWrite(VNetPort    *port, // IN
+                struct file *filp, // IN
+                const char  *buf,  // IN
+                size_t      count) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+
+   return VNetUserIfSendFrame(userIf, buf, count);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSendFrame --
+ *
+ *      Copy one raw frame from user space and send it to the network.
+ *
+ * Results: 
+ *      On success the count of bytes written else errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSendFrame(VNetUserIF *userIf, // IN
+                    const char *buf,    // IN: user buffer
+                    size_t      count)  // IN
+{
+   struct sk_buff *skb;
+
+   /*
+    * Check size
+    */
+   
+   if (count < sizeof (struct ethhdr) || 
+       count > ETHER_MAX_QUEUED_PACKET) {
+      return -EINVAL;
+   }
+
+   /*
+    * Required to enforce the downWhenAddrMismatch policy in the MAC
+    * layer. --hpreg
+    */
+   if (!UP_AND_RUNNING(userIf->port.flags)) {
+      userIf->stats.droppedDown++;
+      return count;
+   }
+
+   /*
+    * Allocate an sk_buff.
+    */
+   
+   skb = dev_alloc_skb(count + 7);
+   if (skb == NULL) {
+      // XXX obey O_NONBLOCK?
+      return -ENOBUFS;
+   }
+   
+   skb_reserve(skb, 2);
+   
+   /*
+    * Copy the data and send it.
+    */
+   
+   userIf->stats.written++;
+   if (copy_from_user(skb_put(skb, count), buf, count)) {
+      dev_kfree_skb(skb);
+      return -EFAULT;
+   }
+   
+   VNetSend(&userIf->port.jack, skb);
+
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRingKick --
+ *
+ *      Send every frame userlevel has produced into the TX ring.
+ *
+ * Results: 
+ *      Number of frames consumed from the ring, or -EINVAL if the port
+ *      has no ring.
+ *
+ * Side effects:
+ *      Malformed frames are skipped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRingKick(VNetUserIF *userIf) // IN
+{
+   VNetUserIFRing *ring;
+   uint32 txProd;
+   int frames = 0;
+
+   compat_mutex_lock(&userIf->ringTxMutex);
+   ring = userIf->ring;
+   if (!ring) {
+      compat_mutex_unlock(&userIf->ringTxMutex);
+      return -EINVAL;
+   }
+
+   txProd = ACCESS_ONCE(ring->hdr->txProd);
+   /* Read the producer index before the frames it covers. */
+   smp_rmb();
+
+   /* Never process more than one ring's worth, whatever txProd says. */
+   while (ring->txCons != txProd && frames < ring->numTxSlots) {
+      VNet_BatchFrame *frame;
+      struct sk_buff *skb;
+      uint32 len;
+
+      frame = (VNet_BatchFrame *)(ring->txSlots +
+                                  (ring->txCons & (ring->numTxSlots - 1)) *
+                                  ring->slotSize);
+      ring->txCons++;
+      frames++;
+
+      /* The user can rewrite len at any time; check the copy we use. */
+      len = ACCESS_ONCE(frame->len);
+      if (len < sizeof (struct ethhdr) || len > ETHER_MAX_QUEUED_PACKET ||
+          len > ring->slotSize - sizeof *frame) {
+         continue;
+      }
+      if (!UP_AND_RUNNING(userIf->port.flags)) {
+         userIf->stats.droppedDown++;
+         continue;
+      }
+
+      skb = dev_alloc_skb(len + 7);
+      if (skb == NULL) {
+         ring->txCons--;
+         frames--;
+         break;
+      }
+      skb_reserve(skb, 2);
+      memcpy(skb_put(skb, len), frame + 1, len);
+
+      userIf->stats.written++;
+      VNetSend(&userIf->port.jack, skb);
+   }
+
+   /* Hand the slots back only once we are done reading them. */
+   smp_mb();
+   ring->hdr->txCons = ring->txCons;
+   compat_mutex_unlock(&userIf->ringTxMutex);
+
+   return frames;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBatchRecv --
+ *
+ *      Drain up to batch->maxFrames pending packets of receive queue
+ *      batch->queue into the framed user buffer described by batch.
+ *      Different threads may drain different queues. Never blocks: the
+ *      caller is expected to use poll() or the pollPtr/actPtr
+ *      notification to learn when packets are pending.
+ *
+ * Results: 
+ *      0 on success, with batch->numFrames and batch->bytes filled in,
+ *      -EAGAIN if no packet is pending,
+ *      -EMSGSIZE if the first pending packet does not fit in the buffer,
+ *      else -errno if the very first packet could not be copied.
+ *
+ * Side effects:
+ *      Packets are dequeued. A packet that faults on copy after at
+ *      least one packet was returned is dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfBatchRecv(VNetUserIF *userIf, // IN
+                    VNet_Batch *batch)  // IN/OUT
+{
+   char *buf = (char *)(VA)batch->buf;
+   VNetUserIFQueue *q;
+   uint32 used = 0;
+   uint32 frames = 0;
+
+   if (batch->queue >= userIf->numQueues) {
+      return -EINVAL;
+   }
+   q = &userIf->queue[batch->queue];
+
+   while (frames < batch->maxFrames) {
+      struct sk_buff *skb;
+      VNet_BatchFrame hdr;
+      size_t frameLen;
+      int len;
+
+      /*
+       * Size the frame only once it is off the queue: a peeked skb may
+       * be taken or freed by a concurrent reader or purge.
+       */
+
+      skb = VNetUserIfDequeue(userIf, q);
+      if (skb == NULL) {
+         break;
+      }
+      frameLen = VNetUserIfFrameLen(userIf, skb);
+      if (VNET_BATCH_FRAME_SIZE(frameLen) > batch->bufLen - used) {
+         VNetUserIfRequeue(userIf, q, skb);
+         if (frames == 0) {
+            return -EMSGSIZE;
+         }
+         break;
+      }
+
+      len = VNetUserIfCopyToUser(userIf, skb, buf + used + sizeof hdr,
+                                 frameLen);
+      dev_kfree_skb(skb);
+      if (len < 0) {
+         if (frames == 0) {
+            return len;
+         }
+         break;
       }
-      /* Folded checksum must be inverted before we can use it */
-      csum = csum_block_add(csum, tmpCsum ^ 0xFFFF, curr - buf);
-      curr += skb->len;
+
+      hdr.len = len;
+      hdr.reserved = 0;
+      if (copy_to_user(buf + used, &hdr, sizeof hdr)) {
+         if (frames == 0) {
+            return -EFAULT;
+         }
+         break;
+      }
+
+      userIf->stats.read++;
+      used += VNET_BATCH_FRAME_SIZE(len);
+      frames++;
    }
-   return csum_fold(csum);
+
+   if (frames == 0) {
+      return -EAGAIN;
+   }
+
+   batch->numFrames = frames;
+   batch->bytes = used;
+   return 0;
 }
-#endif
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetCopyDatagramToUser --
+ * VNetUserIfBatchSend --
  *
- *      Copy complete datagram to the user space. Fill correct checksum
- *	into the copied datagram if nobody did it yet.
+ *      Send up to batch->maxFrames frames from the framed user buffer
+ *      described by batch.
  *
  * Results: 
- *      On success byte count, on failure -EFAULT.
+ *      0 on success, with batch->numFrames and batch->bytes filled in.
+ *      -errno if the very first frame is malformed or faults; a later
+ *      failure stops the batch and reports the frames sent so far.
  *
  * Side effects:
  *      None.
@@ -617,67 +1880,57 @@ VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
  *----------------------------------------------------------------------
  */
 
-static INLINE_SINGLE_CALLER int
-VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
-		       char *buf,			// OUT
-		       size_t count)			// IN
+static int
+VNetUserIfBatchSend(VNetUserIF *userIf, // IN
+                    VNet_Batch *batch)  // IN/OUT
 {
-   if (count > skb->len) {
-      count = skb->len;
-   }
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 4, 4)
-   if (copy_to_user(buf, skb->data, count)) {
-      return -EFAULT;
-   }
-#else
-   /*
-    * If truncation occurs, we do not bother with checksumming - caller cannot
-    * verify checksum anyway in such case, and copy without checksum is
-    * faster.
-    */
-   if (skb->pkt_type == PACKET_OUTGOING && 	/* Packet must be outgoing */
-       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL &&	/* Without checksum */
-       compat_skb_network_header_len(skb) &&    /* We must know where header is */
-       skb->len == count) {			/* No truncation may occur */
-      size_t skl;
-      int csum;
-      u_int16_t csum16;
-     
-      skl = compat_skb_csum_start(skb);
-      if (VNetCopyDatagram(skb, buf, skl)) {
-	 return -EFAULT;
-      }
-      csum = VNetCsumCopyDatagram(skb, skl, buf + skl);
-      if (csum < 0) {
-	 return csum;
+   const char *buf = (const char *)(VA)batch->buf;
+   uint32 used = 0;
+   uint32 frames = 0;
+   int retval = 0;
+
+   while (frames < batch->maxFrames &&
+          batch->bufLen - used >= sizeof (VNet_BatchFrame)) {
+      VNet_BatchFrame hdr;
+
+      if (copy_from_user(&hdr, buf + used, sizeof hdr)) {
+         retval = -EFAULT;
+         break;
       }
-      csum16 = csum;
-      if (copy_to_user(buf + skl + compat_skb_csum_offset(skb),
-                       &csum16, sizeof csum16)) {
-	 return -EFAULT;
+      if (hdr.reserved != 0 ||
+          hdr.len > batch->bufLen - used - sizeof hdr) {
+         retval = -EINVAL;
+         break;
       }
-   } else {
-      if (VNetCopyDatagram(skb, buf, count)) {
-	 return -EFAULT;
+
+      retval = VNetUserIfSendFrame(userIf, buf + used + sizeof hdr, hdr.len);
+      if (retval < 0) {
+         break;
       }
+
+      used += MIN(VNET_BATCH_FRAME_SIZE(hdr.len), batch->bufLen - used);
+      frames++;
    }
-#endif
-   return count;
+
+   if (frames == 0 && retval < 0) {
+      return retval;
+   }
+
+   batch->numFrames = frames;
+   batch->bytes = used;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfRead --
+ * VNetUserIfBatch --
  *
- *      The virtual network's read file operation. Reads the next pending
- *      packet for this network connection.
+ *      Handle SIOCBATCHRECV and SIOCBATCHSEND.
  *
  * Results: 
- *      On success the len of the packet received,
- *      else if no packet waiting and nonblocking 0,
- *      else -errno.
+ *      0 on success, -errno on failure.
  *
  * Side effects:
  *      None.
@@ -685,80 +1938,54 @@ VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
  *----------------------------------------------------------------------
  */
 
-static int 
-VNetUserIfRead(VNetPort    *port, // IN
-               struct file *filp, // IN
-               char        *buf,  // OUT
-               size_t      count) // IN
+static int
+VNetUserIfBatch(VNetUserIF    *userIf, // IN
+                unsigned int   iocmd,  // IN
+                unsigned long  ioarg)  // IN/OUT: VNet_Batch
 {
-   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
-   struct sk_buff *skb;
-   int ret;
-   DECLARE_WAITQUEUE(wait, current);
-
-   add_wait_queue(&userIf->waitQueue, &wait);
-   for (;;) {
-      set_current_state(TASK_INTERRUPTIBLE);
-      skb = skb_peek(&userIf->packetQueue);
-      if (skb && (skb->len > count)) {
-         skb = NULL;
-         ret = -EMSGSIZE;
-         break;
-      }
-      ret = -EAGAIN;
-      skb = skb_dequeue(&userIf->packetQueue);
-
-      if (userIf->pollPtr) {
-         if (skb_queue_empty(&userIf->packetQueue)) {
-            *userIf->pollPtr &= ~userIf->pollMask;
-         }
-#if 0
-         /*
-          * Disable this for now since the monitor likes to assert that
-          * actions are present and thus can't cope with them disappearing
-          * out from under it.  See bug 47760.  -Jeremy. 22 July 2004
-          */
-
-         if (skb_queue_len(&userIf->packetQueue) < (*userIf->recvClusterCount) &&
-             (Atomic_Read(userIf->actPtr) & userIf->actMask) != 0) {
-            Atomic_And(userIf->actPtr, ~userIf->actMask);
-         }
-#endif
-      }
+   VNet_Batch batch;
+   int retval;
 
-      if (skb != NULL || filp->f_flags & O_NONBLOCK) {
-         break;
-      }
-      ret = -EINTR;
-      if (signal_pending(current)) {
-         break;
-      }
-      schedule();
+   if (copy_from_user(&batch, (void *)ioarg, sizeof batch)) {
+      return -EFAULT;
    }
-   __set_current_state(TASK_RUNNING);
-   remove_wait_queue(&userIf->waitQueue, &wait);
-   if (! skb) {
-      return ret;
+   if (batch.version != VNET_BATCH_VERSION) {
+      return -EINVAL;
+   }
+   if (VNetUserIfInvalidPointer((VA)batch.buf, batch.bufLen)) {
+      return -EFAULT;
    }
 
-   userIf->stats.read++;
+   batch.numFrames = 0;
+   batch.bytes = 0;
+   if (iocmd == SIOCBATCHRECV) {
+      retval = VNetUserIfBatchRecv(userIf, &batch);
+   } else {
+      retval = VNetUserIfBatchSend(userIf, &batch);
+   }
+   if (retval < 0) {
+      return retval;
+   }
 
-   count = VNetCopyDatagramToUser(skb, buf, count);
-   dev_kfree_skb(skb);
-   return count;
+   if (copy_to_user((void *)ioarg, &batch, sizeof batch)) {
+      return -EFAULT;
+   }
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfWrite --
+ * VNetUserIfSetQueues --
  *
- *      The virtual network's write file operation. Send the raw packet
- *      to the network.
+ *      Set the number of receive queues of the port and the poll/act
+ *      bits of each of them. Queue 0 keeps the bits given with
+ *      SIOCSETNOTIFY2 unless vq overrides them. The port must be down,
+ *      so that no packet is queued while the steering changes.
  *
  * Results: 
- *      On success the count of bytes written else errno.
+ *      0 on success, -errno on failure.
  *
  * Side effects:
  *      None.
@@ -766,58 +1993,81 @@ VNetUserIfRead(VNetPort    *port, // IN
  *----------------------------------------------------------------------
  */
 
-static int 
-VNetUserIfWrite(VNetPort    *port, // IN
-                struct file *filp, // IN
-                const char  *buf,  // IN
-                size_t      count) // IN
+static int
+VNetUserIfSetQueues(VNetUserIF *userIf, // IN
+                    VNet_Queues *vq)    // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
-   struct sk_buff *skb;
+   unsigned i;
 
-   /*
-    * Check size
-    */
-   
-   if (count < sizeof (struct ethhdr) || 
-       count > ETHER_MAX_QUEUED_PACKET) {
+   if (vq->version != VNET_QUEUES_VERSION ||
+       vq->numQueues == 0 || vq->numQueues > VNET_MAX_QUEUES) {
       return -EINVAL;
    }
+   if (UP_AND_RUNNING(userIf->port.flags)) {
+      return -EBUSY;
+   }
 
-   /*
-    * Required to enforce the downWhenAddrMismatch policy in the MAC
-    * layer. --hpreg
-    */
-   if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
-      return count;
+   VNetUserIfDrain(userIf);
+   for (i = 0; i < vq->numQueues; i++) {
+      if (i == 0 && vq->pollMask[0] == 0 && vq->actMask[0] == 0) {
+         continue;
+      }
+      userIf->queue[i].pollMask = vq->pollMask[i];
+      userIf->queue[i].actMask = vq->actMask[i];
+   }
+   for (; i < VNET_MAX_QUEUES; i++) {
+      userIf->queue[i].pollMask = 0;
+      userIf->queue[i].actMask = 0;
    }
+   userIf->numQueues = vq->numQueues;
+   return 0;
+}
 
-   /*
-    * Allocate an sk_buff.
-    */
-   
-   skb = dev_alloc_skb(count + 7);
-   if (skb == NULL) {
-      // XXX obey O_NONBLOCK?
-      return -ENOBUFS;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSetOffload --
+ *
+ *      Handle SIOCSOFFLOAD: choose the receive offloads of the port.
+ *      The port must be down so that no queued packet changes format.
+ *
+ * Results: 
+ *      0 on success, -EINVAL for unknown flags, -EOPNOTSUPP if the
+ *      kernel has no GSO, -EBUSY if the port is up.
+ *
+ * Side effects:
+ *      Adjusts the number of GSO capable ports seen by the bridge.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetOffload(VNetUserIF *userIf, // IN
+                     uint32 offload)     // IN
+{
+   if ((offload & ~VNET_OFFLOAD_GSO) != 0) {
+      return -EINVAL;
    }
-   
-   skb_reserve(skb, 2);
-   
-   /*
-    * Copy the data and send it.
-    */
-   
-   userIf->stats.written++;
-   if (copy_from_user(skb_put(skb, count), buf, count)) {
-      dev_kfree_skb(skb);
-      return -EFAULT;
+#ifndef VNET_HAVE_GSO
+   if (offload & VNET_OFFLOAD_GSO) {
+      return -EOPNOTSUPP;
+   }
+#endif
+   if (UP_AND_RUNNING(userIf->port.flags)) {
+      return -EBUSY;
    }
-   
-   VNetSend(&userIf->port.jack, skb);
 
-   return count;
+   VNetUserIfDrain(userIf);
+   if ((offload ^ userIf->offload) & VNET_OFFLOAD_GSO) {
+      if (offload & VNET_OFFLOAD_GSO) {
+         atomic_inc(&vnetGSOPorts);
+      } else {
+         atomic_dec(&vnetGSOPorts);
+      }
+   }
+   userIf->offload = offload;
+   return 0;
 }
 
 
@@ -882,6 +2132,63 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
       break;
    }
 #endif // VMX86_SERVER
+   case SIOCBATCHRECV:
+   case SIOCBATCHSEND:
+      return VNetUserIfBatch(userIf, iocmd, ioarg);
+
+   case SIOCSETRING:
+   {
+      VNet_Ring vr;
+
+      if (copy_from_user(&vr, (void *)ioarg, sizeof vr)) {
+         return -EFAULT;
+      }
+      if (vr.version != VNET_RING_VERSION) {
+         return -EINVAL;
+      }
+      return VNetUserIfSetupRing(userIf, &vr);
+   }
+
+   case SIOCUNSETRING:
+      if (!userIf->ring) {
+         return -EINVAL;
+      }
+      VNetUserIfUnsetupRing(userIf);
+      break;
+
+   case SIOCRINGKICK:
+      return VNetUserIfRingKick(userIf);
+
+   case SIOCSQUEUELEN:
+   {
+      VNet_QueueLen vql;
+
+      if (copy_from_user(&vql, (void *)ioarg, sizeof vql)) {
+         return -EFAULT;
+      }
+      return VNetUserIfSetQueueLen(userIf, &vql);
+   }
+
+   case SIOCSOFFLOAD:
+   {
+      uint32 offload;
+
+      if (copy_from_user(&offload, (void *)ioarg, sizeof offload)) {
+         return -EFAULT;
+      }
+      return VNetUserIfSetOffload(userIf, offload);
+   }
+
+   case SIOCSETQUEUES:
+   {
+      VNet_Queues vq;
+
+      if (copy_from_user(&vq, (void *)ioarg, sizeof vq)) {
+         return -EFAULT;
+      }
+      return VNetUserIfSetQueues(userIf, &vq);
+   }
+
    case SIOCUNSETNOTIFY:
       if (!userIf->pollPtr) {
 	 /* This should always happen on ESX. */
@@ -897,16 +2204,7 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
        */
       
       if (!UP_AND_RUNNING(userIf->port.flags)) {
-         struct sk_buff *skb;
-         
-         while ((skb = skb_dequeue(&userIf->packetQueue)) != NULL) {
-            dev_kfree_skb(skb);
-         }
-         
-         if (userIf->pollPtr) {
-            /* Clear the pending bit as no packets are pending at this point. */
-            *userIf->pollPtr &= ~userIf->pollMask;
-         }
+         VNetUserIfDrain(userIf);
       }
       break;
 
@@ -944,9 +2242,22 @@ VNetUserIfPoll(VNetPort     *port, // IN
    VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
    
    poll_wait(filp, &userIf->waitQueue, wait);
-   if (!skb_queue_empty(&userIf->packetQueue)) {
+   VNetUserIfQueueDecay(&userIf->qlen);
+   if (!skb_queue_empty(&VNetUserIfPendingQueue(userIf)->packetQueue)) {
       return POLLIN;
    }
+   if (userIf->ring) {
+      unsigned long flags;
+      unsigned int mask = 0;
+
+      spin_lock_irqsave(&userIf->ringLock, flags);
+      if (userIf->ring &&
+          userIf->ring->rxProd != ACCESS_ONCE(userIf->ring->hdr->rxCons)) {
+         mask = POLLIN;
+      }
+      spin_unlock_irqrestore(&userIf->ringLock, flags);
+      return mask;
+   }
 
    return 0;
 }
@@ -975,6 +2286,7 @@ VNetUserIf_Create(VNetPort **ret) // OUT
 {
    VNetUserIF *userIf;
    static unsigned id = 0;
+   unsigned i;
    int retval;
    
    userIf = kmalloc(sizeof *userIf, GFP_USER);
@@ -1006,7 +2318,21 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->pollPage = NULL;
    userIf->actPage = NULL;
    userIf->recvClusterPage = NULL;
-   userIf->pollMask = userIf->actMask = 0;
+   for (i = 0; i < VNET_MAX_QUEUES; i++) {
+      skb_queue_head_init(&userIf->queue[i].packetQueue);
+      userIf->queue[i].pollMask = userIf->queue[i].actMask = 0;
+   }
+   userIf->numQueues = 1;
+   userIf->qlen.len = VNET_MAX_QLEN;
+   userIf->qlen.baseLen = VNET_MAX_QLEN;
+   userIf->qlen.maxLen = VNET_MAX_QLEN;
+   userIf->qlen.adaptive = FALSE;
+   userIf->qlen.overflowed = FALSE;
+   userIf->qlen.windowHigh = 0;
+   userIf->qlen.windowStart = jiffies;
+   userIf->ring = NULL;
+   spin_lock_init(&userIf->ringLock);
+   compat_mutex_init(&userIf->ringTxMutex);
 
    /*
     * Make proc entry for this jack.
@@ -1042,7 +2368,6 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->port.fileOpIoctl = VNetUserIfIoctl;
    userIf->port.fileOpPoll = VNetUserIfPoll;
    
-   skb_queue_head_init(&(userIf->packetQueue));
    init_waitqueue_head(&userIf->waitQueue);
 
    memset(&userIf->stats, 0, sizeof userIf->stats);
@@ -77,6 +77,18 @@ typedef struct VNet_Bind {
 #define SIOCSUSERLISTENER   _IOW(0x99, 0xE2, VNet_SetUserListener)
 #endif
 
+#if defined __linux__
+#define SIOCBATCHRECV      _IOWR(0x99, 0xE5, VNet_Batch)
+#define SIOCBATCHSEND      _IOWR(0x99, 0xE6, VNet_Batch)
+#define SIOCSETRING        _IOW(0x99, 0xE7, VNet_Ring)
+#define SIOCUNSETRING      _IO(0x99, 0xE8)
+#define SIOCRINGKICK       _IO(0x99, 0xE9)
+#define SIOCSHUBLEARN      _IOW(0x99, 0xEA, uint32)
+#define SIOCSETQUEUES      _IOW(0x99, 0xEB, VNet_Queues)
+#define SIOCSQUEUELEN      _IOW(0x99, 0xEC, VNet_QueueLen)
+#define SIOCSOFFLOAD       _IOW(0x99, 0xED, uint32)
+#endif
+
 #if defined __linux__
 #define VNET_BRFLAG_FORCE_SMAC    0x00000001
 
@@ -159,7 +171,7 @@ typedef struct VNet_Read {
  */
 
 #ifdef linux
-#define VNET_API_VERSION		(3 << 16 | 0)
+#define VNET_API_VERSION		(3 << 16 | 1)
 #elif defined __APPLE__
 #define VNET_API_VERSION                (6 << 16 | 0)
 #else
@@ -186,6 +198,140 @@ typedef struct VNet_Notify {
    uint32           pollMask;
 } VNet_Notify;
 
+/*
+ * Batched packet I/O (SIOCBATCHRECV/SIOCBATCHSEND).
+ *
+ * The user buffer holds a sequence of frames, each one a VNet_BatchFrame
+ * header immediately followed by len bytes of ethernet frame, padded so
+ * that the next header starts on a VNET_BATCH_ALIGN boundary.
+ */
+
+#define VNET_BATCH_VERSION           1
+#define VNET_BATCH_ALIGN             8
+#define VNET_BATCH_FRAME_SIZE(len)   ROUNDUP(sizeof (VNet_BatchFrame) + (len), \
+                                             VNET_BATCH_ALIGN)
+
+typedef struct VNet_Batch {
+   uint32           version;        /* VNET_BATCH_VERSION */
+   uint32           maxFrames;      /* IN: max number of frames to move */
+   VA64             buf;            /* IN: user VA of the framed buffer */
+   uint32           bufLen;         /* IN: size of the buffer in bytes */
+   uint32           numFrames;      /* OUT: number of frames moved */
+   uint32           bytes;          /* OUT: bytes of the buffer consumed */
+   uint32           queue;          /* IN: receive queue (SIOCBATCHRECV) */
+} VNet_Batch;
+
+typedef struct VNet_BatchFrame {
+   uint32           len;            /* Length of the frame that follows */
+   uint32           reserved;       /* Must be zero */
+} VNet_BatchFrame;
+
+/*
+ * Shared memory packet ring (SIOCSETRING).
+ *
+ * Userlevel hands the driver a page aligned area laid out as a
+ * VNet_RingHeader, padded to VNET_RING_HDR_SIZE, followed by numRxSlots
+ * receive slots and then numTxSlots transmit slots. Each slot is
+ * slotSize bytes: a VNet_BatchFrame header followed by the frame.
+ *
+ * Indices are free running; the slot for index i is i & (numSlots - 1).
+ * The driver produces into the RX ring and consumes from the TX ring;
+ * userlevel does the opposite. The driver sets the poll bit (and the
+ * act bit once recvClusterCount frames are pending) when it produces;
+ * userlevel clears the poll bit when it finds the RX ring empty.
+ * Transmit slots are picked up by SIOCRINGKICK, which sends everything
+ * up to txProd in one call.
+ */
+
+#define VNET_RING_VERSION            1
+#define VNET_RING_HDR_SIZE           64
+#define VNET_RING_MAX_SLOTS          4096
+#define VNET_RING_MAX_LEN            (16 * 1024 * 1024)
+#define VNET_RING_SIZE(r)            (VNET_RING_HDR_SIZE + \
+                                      ((r)->numRxSlots + (r)->numTxSlots) * \
+                                      (uint64)(r)->slotSize)
+
+typedef struct VNet_Ring {
+   uint32           version;        /* VNET_RING_VERSION */
+   uint32           slotSize;       /* Bytes per slot, VNET_BATCH_ALIGNed */
+   uint32           numRxSlots;     /* Power of two */
+   uint32           numTxSlots;     /* Power of two */
+   VA64             addr;           /* Page aligned user VA of the area */
+   uint64           len;            /* At least VNET_RING_SIZE() */
+} VNet_Ring;
+
+typedef struct VNet_RingHeader {
+   volatile uint32  rxProd;         /* Written by the driver */
+   volatile uint32  rxCons;         /* Written by userlevel */
+   volatile uint32  txProd;         /* Written by userlevel */
+   volatile uint32  txCons;         /* Written by the driver */
+} VNet_RingHeader;
+
+/*
+ * Multiqueue receive (SIOCSETQUEUES). Packets are steered to a queue
+ * by flow hash; each queue sets its own bits in the SIOCSETNOTIFY2
+ * poll and act words and is drained with SIOCBATCHRECV.
+ */
+
+#define VNET_QUEUES_VERSION          1
+#define VNET_MAX_QUEUES              8
+
+typedef struct VNet_Queues {
+   uint32           version;        /* VNET_QUEUES_VERSION */
+   uint32           numQueues;      /* 1 .. VNET_MAX_QUEUES */
+   uint32           pollMask[VNET_MAX_QUEUES];
+   uint32           actMask[VNET_MAX_QUEUES];
+} VNet_Queues;
+
+/*
+ * Receive queue length limit (SIOCSQUEUELEN). The limit applies to each
+ * receive queue of the port. With VNET_QUEUELEN_ADAPTIVE the driver
+ * grows the limit up to maxLen when packets are dropped for overflow
+ * and shrinks it back to len when the queues stay short.
+ */
+
+#define VNET_QUEUELEN_VERSION        1
+#define VNET_QUEUELEN_MAX            4096
+#define VNET_QUEUELEN_ADAPTIVE       0x01
+
+typedef struct VNet_QueueLen {
+   uint32           version;        /* VNET_QUEUELEN_VERSION */
+   uint32           flags;          /* VNET_QUEUELEN_xxx */
+   uint32           len;            /* Limit, 1 .. VNET_QUEUELEN_MAX */
+   uint32           maxLen;         /* Adaptive ceiling, len .. MAX */
+} VNet_QueueLen;
+
+/*
+ * Receive offloads (SIOCSOFFLOAD). A port that sets VNET_OFFLOAD_GSO
+ * receives TCP/UDP super-frames up to VNET_OFFLOAD_MAX_FRAME bytes as
+ * the host stack built them, without checksums filled in. Every frame
+ * returned by read() and SIOCBATCHRECV is then prefixed with a
+ * VNet_OffloadHdr. Its 10 byte layout and encoding are those of the
+ * virtio-net header (struct virtio_net_hdr) so that userlevel can hand
+ * it to a paravirtual NIC as is. Shared memory rings keep receiving
+ * segmented, checksummed frames.
+ */
+
+#define VNET_OFFLOAD_GSO             0x01
+#define VNET_OFFLOAD_MAX_FRAME       (64 * 1024 + 64)
+
+#define VNET_OFFLOAD_F_NEEDS_CSUM    0x01
+
+#define VNET_OFFLOAD_GSO_NONE        0
+#define VNET_OFFLOAD_GSO_TCPV4       1
+#define VNET_OFFLOAD_GSO_UDP         3
+#define VNET_OFFLOAD_GSO_TCPV6       4
+#define VNET_OFFLOAD_GSO_ECN         0x80
+
+typedef struct VNet_OffloadHdr {
+   uint8            flags;          /* VNET_OFFLOAD_F_xxx */
+   uint8            gsoType;        /* VNET_OFFLOAD_GSO_xxx */
+   uint16           hdrLen;         /* Bytes of headers in each segment */
+   uint16           gsoSize;        /* Payload bytes per segment */
+   uint16           csumStart;      /* Checksum from here to the end, */
+   uint16           csumOffset;     /*   stored at csumStart + this */
+} VNet_OffloadHdr;
+
 #define VNET_SETMACADDRF_UNIQUE      0x01
 /*
  * The latest 802.3 standard sort of says that the length field ought to
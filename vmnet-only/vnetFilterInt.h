@@ -70,6 +70,7 @@ typedef struct RuleSet {
    struct Rule *list;	 /* first rule in rule set */
    struct Rule **tail;	 /* used to quickly add element to end of list */
    uint32 numRules;	 /* number of rules in 'list' */
+   struct RuleIndex *index; /* 'list' compiled for lookup, RCU protected */
 } RuleSet;
 
 #endif // _VNETFILTERINT_H_
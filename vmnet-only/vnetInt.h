@@ -81,7 +81,7 @@
 
 /* We support upto 32 adapters with LSP + DHCP + NAT + netif + sniffer */
 #define NUM_JACKS_PER_HUB      68 
-#define VNET_MAX_QLEN          128
+#define VNET_MAX_QLEN          128    // default, see SIOCSQUEUELEN
 
 #define VNET_NUM_IPBASED_MACS  64
 #define VNET_MAX_JACK_NAME_LEN 16
@@ -94,6 +94,25 @@
 #define VNET_NAME_LEN          16
 #endif
 
+/*
+ * Segmentation offload.
+ *
+ * The bridge passes GSO packets to the vnet unsplit only while at least
+ * one userif port has negotiated VNET_OFFLOAD_GSO (vnetGSOPorts > 0).
+ * Receivers that cannot take them split them with VNetReceiveSegmented.
+ */
+
+#if defined(NETIF_F_GSO) || LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 18)
+#define VNET_HAVE_GSO
+#define VNetIsGSO(skb) skb_shinfo(skb)->gso_size
+#elif defined(NETIF_F_TSO)
+#define VNetIsGSO(skb) skb_shinfo(skb)->tso_size
+#else
+#define VNetIsGSO(skb) (0)
+#endif
+
+extern atomic_t vnetGSOPorts;
+
 /*
  * Data structures
  */
@@ -162,6 +181,9 @@ VNetJack *VNetHub_AllocPvn(uint8 id[VNET_PVN_ID_LEN]);
 int VNetHub_CreateSender(VNetJack *jack, VNetEvent_Sender **s);
 int VNetHub_CreateListener(VNetJack *jack, VNetEvent_Handler h, void* data,
                            uint32 classMask, VNetEvent_Listener **l);
+int VNetHub_SetLearning(VNetJack *jack, uint32 ageSecs);
+
+void VNetReceiveSegmented(VNetJack *jack, struct sk_buff *skb);
 
 int VNetConnect(VNetJack *jack1, VNetJack *jack2);
 